@@ -1,40 +1,52 @@
-#include "proxy.h"
+#include "DCProxy.h"
 #include "log.h"
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <CFNetwork/CFNetwork.h>
-
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
 
 // https://github.com/CollinStuart/CFSocketExample/blob/master/Socket/AppDelegate.mm
 // https://developer.apple.com/library/content/samplecode/MiniSOAP/Listings/HTTPServer_m.html#//apple_ref/doc/uid/DTS40009323-HTTPServer_m-DontLinkElementID_4
 // https://github.com/robbiehanson/CocoaAsyncSocket/blob/d0adf58ca694e733c75a8a157635e3deb66c061e/Source/GCD/GCDAsyncSocket.m
 // lsof -n -i | grep -e LISTEN
 
-void myCFTimerCallback(CFRunLoopTimerRef timer, void *info) {
-    // log_debug("CALLBACK: %s\n", (char*)info);
+static DCEventLoopBackend __backendNamed(const char *name) {
+    if (strcmp(name, "epoll") == 0) return kDCEventLoopBackendEpoll;
+    if (strcmp(name, "kqueue") == 0) return kDCEventLoopBackendKqueue;
+    if (strcmp(name, "io_uring") == 0) return kDCEventLoopBackendIOUring;
+    if (strcmp(name, "default") != 0)
+        log_warn("Unknown event loop backend '%s', using the default\n", name);
+    return kDCEventLoopBackendDefault;
 }
 
 int main(int argc, const char * argv[]) {
-
-    char *myText = "Hello dear!";
-
-    CFRunLoopTimerContext context = {0, myText, NULL, NULL, NULL};
-    CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
-                                                   CFAbsoluteTimeGetCurrent() + 10,
-                                                   60.0,
-                                                   0,
-                                                   0,
-                                                   &myCFTimerCallback, &context);
-
-    CFRunLoopRef runLoop = CFRunLoopGetCurrent();
-    CFRunLoopAddTimer(runLoop, timer, kCFRunLoopCommonModes);
-    log_set_level(LOG_TRACE);
-    proxy_start(1080);
-    CFRunLoopRun();
+    unsigned int port = argc > 1 ? (unsigned int) atoi(argv[1]) : 1080;
+    unsigned int nbrWorkers = argc > 2 ? (unsigned int) atoi(argv[2]) : 0;
+    DCEventLoopBackend backend = argc > 3 ? __backendNamed(argv[3]) : kDCEventLoopBackendDefault;
+
+    // SIGINT and SIGTERM are taken here, blocked before the workers start so
+    // they inherit it. Stopping returns from main, and exit handlers (those
+    // writing PGO profiles among them) get to run.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    DCProxyRef proxy = DCProxyCreate(port);
+    DCProxySetWorkerCount(proxy, nbrWorkers);
+    DCProxySetEventLoopBackend(proxy, backend);
+    if (!DCProxyRunServer(proxy, false)) {
+        DCProxyRelease(proxy);
+        return 1;
+    }
+
+    int received = 0;
+    sigwait(&signals, &received);
+    log_info("Stopping on signal %d\n", received);
+    DCProxyRelease(proxy);
 
     return 0;
 }
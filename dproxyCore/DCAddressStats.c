@@ -0,0 +1,114 @@
+#include "DCAddressStats.h"
+#include "DCResolver.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#define TRACE(p) log_trace("stats=%p\n", p)
+
+#define kDCAddressStatsSlots     256
+// Failures older than this are forgotten
+#define kDCAddressStatsForgetMs  (60 * 1000)
+
+typedef struct __DCAddressStatsKey {
+    uint8_t address[16];
+    uint16_t port;
+    uint8_t family;
+} __DCAddressStatsKey;
+
+typedef struct __DCAddressStatsEntry {
+    __DCAddressStatsKey key;
+    unsigned int failures;
+    unsigned long long lastFailure;
+} __DCAddressStatsEntry;
+
+struct __DCAddressStats {
+    __DCAddressStatsEntry entries[kDCAddressStatsSlots];
+};
+
+DCAddressStatsRef DCAddressStatsCreate(void) {
+    struct __DCAddressStats *stats = (struct __DCAddressStats *) calloc(1, sizeof(struct __DCAddressStats));
+    TRACE(stats);
+    return stats;
+}
+
+void DCAddressStatsRelease(DCAddressStatsRef stats) {
+    TRACE(stats);
+    free(stats);
+}
+
+static void __DCAddressStatsMakeKey(const struct sockaddr_storage *address, __DCAddressStatsKey *key) {
+    memset(key, 0, sizeof(__DCAddressStatsKey));
+    key->family = (uint8_t) address->ss_family;
+    if (address->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) address;
+        memcpy(key->address, &(in6->sin6_addr), 16);
+        key->port = in6->sin6_port;
+    } else {
+        const struct sockaddr_in *in4 = (const struct sockaddr_in *) address;
+        memcpy(key->address, &(in4->sin_addr), 4);
+        key->port = in4->sin_port;
+    }
+}
+
+// FNV-1a, the slot an address and port always go to
+static __DCAddressStatsEntry* __DCAddressStatsSlot(DCAddressStatsRef stats, const __DCAddressStatsKey *key) {
+    const uint8_t *bytes = (const uint8_t *) key;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(__DCAddressStatsKey); i++)
+        hash = (hash ^ bytes[i]) * 16777619u;
+    return &(stats->entries[hash % kDCAddressStatsSlots]);
+}
+
+void DCAddressStatsRecordSuccess(DCAddressStatsRef stats, const struct sockaddr_storage *address) {
+    __DCAddressStatsKey key;
+    __DCAddressStatsMakeKey(address, &key);
+    __DCAddressStatsEntry *entry = __DCAddressStatsSlot(stats, &key);
+    if (memcmp(&(entry->key), &key, sizeof(key)) == 0)
+        entry->failures = 0;
+}
+
+void DCAddressStatsRecordFailure(DCAddressStatsRef stats, const struct sockaddr_storage *address, unsigned long long now) {
+    __DCAddressStatsKey key;
+    __DCAddressStatsMakeKey(address, &key);
+    __DCAddressStatsEntry *entry = __DCAddressStatsSlot(stats, &key);
+    if (memcmp(&(entry->key), &key, sizeof(key)) != 0 || now - entry->lastFailure > kDCAddressStatsForgetMs) {
+        entry->key = key;
+        entry->failures = 0;
+    }
+    entry->failures++;
+    entry->lastFailure = now;
+}
+
+unsigned int DCAddressStatsGetFailures(DCAddressStatsRef stats, const struct sockaddr_storage *address, unsigned long long now) {
+    __DCAddressStatsKey key;
+    __DCAddressStatsMakeKey(address, &key);
+    __DCAddressStatsEntry *entry = __DCAddressStatsSlot(stats, &key);
+    if (memcmp(&(entry->key), &key, sizeof(key)) != 0 || now - entry->lastFailure > kDCAddressStatsForgetMs)
+        return 0;
+    return entry->failures;
+}
+
+void DCAddressStatsSort(DCAddressStatsRef stats, struct sockaddr_storage *addresses, unsigned int nbrAddresses, unsigned long long now) {
+    unsigned int failures[kDCResolverMaxAddresses];
+    if (nbrAddresses > kDCResolverMaxAddresses)
+        nbrAddresses = kDCResolverMaxAddresses;
+    for (unsigned int i = 0; i < nbrAddresses; i++)
+        failures[i] = DCAddressStatsGetFailures(stats, &addresses[i], now);
+
+    // Insertion sort, there are only ever a few
+    for (unsigned int i = 1; i < nbrAddresses; i++) {
+        struct sockaddr_storage address = addresses[i];
+        unsigned int addressFailures = failures[i];
+        unsigned int j = i;
+        for (; j > 0 && failures[j - 1] > addressFailures; j--) {
+            addresses[j] = addresses[j - 1];
+            failures[j] = failures[j - 1];
+        }
+        addresses[j] = address;
+        failures[j] = addressFailures;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef DCAddressStats_h
+#define DCAddressStats_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+typedef struct __DCAddressStats*         DCAddressStatsRef;
+
+/*
+ * How connects to upstream addresses went lately, so that the next connect
+ * to a host with several addresses tries the ones that work first. Only the
+ * failures in a row since the last success are kept, per address and port,
+ * in a fixed table where an address may push out another that hashes to
+ * the same slot. Forgetting is harmless, it costs a slower connect at most,
+ * and failures are forgotten anyway a while after the last one, so an
+ * address that came back gets tried again. `now` is in milliseconds, see
+ * `DCEventLoopGetTime`.
+ *
+ * Belongs to one worker and isn't thread safe.
+ */
+DCAddressStatsRef DCAddressStatsCreate(void);
+void DCAddressStatsRelease(DCAddressStatsRef stats);
+
+void DCAddressStatsRecordSuccess(DCAddressStatsRef stats, const struct sockaddr_storage *address);
+void DCAddressStatsRecordFailure(DCAddressStatsRef stats, const struct sockaddr_storage *address, unsigned long long now);
+unsigned int DCAddressStatsGetFailures(DCAddressStatsRef stats, const struct sockaddr_storage *address, unsigned long long now);
+
+// Those with fewer failures first, otherwise the order stays as it is
+void DCAddressStatsSort(DCAddressStatsRef stats, struct sockaddr_storage *addresses, unsigned int nbrAddresses, unsigned long long now);
+
+#endif /* DCAddressStats_h */
@@ -0,0 +1,135 @@
+#include "DCBufferPool.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE(p) log_trace("bufferPool=%p\n", p)
+
+typedef struct __DCBufferPoolFreeBuffer {
+    struct __DCBufferPoolFreeBuffer *next;
+} __DCBufferPoolFreeBuffer;
+
+typedef struct __DCBufferPoolClass {
+    __DCBufferPoolFreeBuffer *freeList;
+    size_t cachedBytes;
+} __DCBufferPoolClass;
+
+struct __DCBufferPool {
+    __DCBufferPoolClass classes[kDCBufferPoolNbrClasses];
+    size_t maxCachedBytesPerClass;
+    DCBufferPoolStats stats;
+};
+
+static __thread DCBufferPoolRef __DCCurrentBufferPool = NULL;
+
+// MARK: - Helpers
+
+// Index of the smallest class holding `size` bytes, -1 when it's too large
+static inline int __DCBufferPoolClassIndex(size_t size) {
+    if (size > kDCBufferPoolMaxSize)
+        return -1;
+    if (size <= kDCBufferPoolMinSize)
+        return 0;
+    return (int) (sizeof(unsigned long) * 8 - __builtin_clzl((unsigned long) (size - 1))) - 6;
+}
+
+static inline size_t __DCBufferPoolClassSize(int idx) {
+    return (size_t) kDCBufferPoolMinSize << idx;
+}
+
+size_t DCBufferPoolGoodSize(size_t size) {
+    int idx = __DCBufferPoolClassIndex(size);
+    return idx < 0 ? size : __DCBufferPoolClassSize(idx);
+}
+
+// MARK: - Lifecycle
+
+DCBufferPoolRef DCBufferPoolCreate(size_t maxCachedBytesPerClass) {
+    struct __DCBufferPool *pool = (struct __DCBufferPool *) calloc(1, sizeof(struct __DCBufferPool));
+    TRACE(pool);
+    pool->maxCachedBytesPerClass = maxCachedBytesPerClass;
+    return pool;
+}
+
+void DCBufferPoolRelease(DCBufferPoolRef pool) {
+    TRACE(pool);
+    for (int i = 0; i < kDCBufferPoolNbrClasses; i++) {
+        while (pool->classes[i].freeList) {
+            __DCBufferPoolFreeBuffer *buffer = pool->classes[i].freeList;
+            pool->classes[i].freeList = buffer->next;
+            free(buffer);
+        }
+    }
+    if (__DCCurrentBufferPool == pool)
+        __DCCurrentBufferPool = NULL;
+    free(pool);
+}
+
+DCBufferPoolRef DCBufferPoolGetCurrent(void) {
+    return __DCCurrentBufferPool;
+}
+
+void DCBufferPoolSetCurrent(DCBufferPoolRef pool) {
+    __DCCurrentBufferPool = pool;
+}
+
+// MARK: - Buffers
+
+void* DCBufferPoolAlloc(DCBufferPoolRef pool, size_t size, size_t *capacity) {
+    int idx = __DCBufferPoolClassIndex(size);
+    size_t allocSize = idx < 0 ? size : __DCBufferPoolClassSize(idx);
+    if (capacity)
+        *capacity = allocSize;
+
+#if !defined(DC_DISABLE_POOLING)
+    if (pool && idx >= 0 && pool->classes[idx].freeList) {
+        __DCBufferPoolClass *class = &(pool->classes[idx]);
+        __DCBufferPoolFreeBuffer *buffer = class->freeList;
+        class->freeList = buffer->next;
+        class->cachedBytes -= allocSize;
+        pool->stats.hits++;
+        pool->stats.cachedBytes -= allocSize;
+        pool->stats.usedBytes += allocSize;
+        return buffer;
+    }
+#endif
+
+    void *buffer = malloc(allocSize);
+    if (pool && buffer) {
+        pool->stats.misses++;
+        pool->stats.usedBytes += allocSize;
+    }
+    return buffer;
+}
+
+void DCBufferPoolFree(DCBufferPoolRef pool, void *buffer, size_t capacity) {
+    if (!buffer)
+        return;
+    if (!pool) {
+        free(buffer);
+        return;
+    }
+
+    int idx = __DCBufferPoolClassIndex(capacity);
+    size_t allocSize = idx < 0 ? capacity : __DCBufferPoolClassSize(idx);
+    pool->stats.usedBytes -= allocSize;
+
+#if !defined(DC_DISABLE_POOLING)
+    if (idx >= 0 && pool->classes[idx].cachedBytes + allocSize <= pool->maxCachedBytesPerClass) {
+        __DCBufferPoolClass *class = &(pool->classes[idx]);
+        __DCBufferPoolFreeBuffer *freeBuffer = (__DCBufferPoolFreeBuffer *) buffer;
+        freeBuffer->next = class->freeList;
+        class->freeList = freeBuffer;
+        class->cachedBytes += allocSize;
+        pool->stats.cachedBytes += allocSize;
+        return;
+    }
+#endif
+
+    free(buffer);
+}
+
+void DCBufferPoolGetStats(DCBufferPoolRef pool, DCBufferPoolStats *stats) {
+    *stats = pool->stats;
+}
@@ -0,0 +1,51 @@
+#ifndef DCBufferPool_h
+#define DCBufferPool_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct __DCBufferPool*         DCBufferPoolRef;
+
+// Power of two size classes from the smallest to the largest, anything
+// bigger isn't pooled.
+#define kDCBufferPoolMinSize      64
+#define kDCBufferPoolMaxSize      (64 * 1024)
+#define kDCBufferPoolNbrClasses   11
+
+// Free buffers each class keeps for reuse, beyond that they're freed
+#define kDCBufferPoolDefaultMaxCachedBytes (4 * 1024 * 1024)
+
+typedef struct DCBufferPoolStats {
+    unsigned long long hits;    // Served from a free list
+    unsigned long long misses;  // Went to malloc
+    size_t cachedBytes;         // Free and kept for reuse
+    size_t usedBytes;           // Handed out right now
+} DCBufferPoolStats;
+
+/*
+ * Variable sized allocations (messages, outgoing segments, read buffers)
+ * rounded up to a size class and recycled per class. A pool belongs to one
+ * worker and isn't thread safe; the worker makes its pool current on its
+ * thread so code without a handle on the worker can find it.
+ *
+ * Every function accepts a NULL pool and then just mallocs and frees, which
+ * is also what `DC_DISABLE_POOLING` builds do.
+ */
+DCBufferPoolRef DCBufferPoolCreate(size_t maxCachedBytesPerClass);
+void DCBufferPoolRelease(DCBufferPoolRef pool);
+
+DCBufferPoolRef DCBufferPoolGetCurrent(void);
+void DCBufferPoolSetCurrent(DCBufferPoolRef pool);
+
+// At least `size` bytes, not zeroed. `capacity`, when given, gets what was
+// really handed out and is what must be passed back to `DCBufferPoolFree`.
+void* DCBufferPoolAlloc(DCBufferPoolRef pool, size_t size, size_t *capacity);
+void DCBufferPoolFree(DCBufferPoolRef pool, void *buffer, size_t capacity);
+
+// The capacity a request for `size` bytes gets
+size_t DCBufferPoolGoodSize(size_t size);
+
+void DCBufferPoolGetStats(DCBufferPoolRef pool, DCBufferPoolStats *stats);
+
+#endif /* DCBufferPool_h */
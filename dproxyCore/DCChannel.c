@@ -1,73 +1,613 @@
 #include "DCChannel.h"
+#include "DCBufferPool.h"
 #include "DCConnection.h"
+#include "DCConnectionPool.h"
+#include "DCEventLoop.h"
+#include "DCSlab.h"
+#include "DCWorker.h"
 #include "log.h"
 
-#include <CFNetwork/CFNetwork.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #define TRACE(p) log_trace("channel=%p\n", p)
 
+// Requests forwarded ahead of their responses before the client is paused,
+// it's resumed when one is answered. Below what a connection can have in
+// flight, `kDCConnectionMaxPendingRequests`.
+#define kDCChannelMaxPipelinedRequests 16
+
+// What a channel lets pile up for either side before it stops reading from
+// the other: the side that's ahead waits until the slow one is down to the
+// low mark. Each side may hold one read buffer on top.
+#define kDCChannelHighWatermark (256 * 1024)
+#define kDCChannelLowWatermark  (64 * 1024)
+
+/*
+ * Every request is routed on its own target, so one client connection may
+ * talk to several upstreams at once. Responses must still reach the client
+ * in request order: only the upstream owing the oldest response reads, the
+ * others are paused until it's their turn.
+ */
+typedef struct __DCChannelUpstream {
+    DCChannelRef channel;
+    DCConnectionRef connection;
+
+    SInt32 port;
+    char *host;   // Both stored right behind the upstream,
+    char *scheme; // it's one allocation of `allocationSize` bytes
+    size_t allocationSize;
+
+    // Requests forwarded on `connection` that haven't been fully answered yet
+    unsigned int pendingResponses;
+    // Its throttle count when it joined, pooled connections come with one
+    unsigned int throttlesAtAttach;
+    // The response to the oldest of them has begun reaching the client
+    bool responding;
+
+    struct __DCChannelUpstream *next;
+} __DCChannelUpstream;
+
 struct __DCChannel {
+    // Where the channel and everything it allocates goes back to, NULL
+    // when it was created outside of a worker.
+    DCSlabRef slab;
+    DCBufferPoolRef buffers;
+
+    // Where the channel is released from once its client is closed, see
+    // `__DCChannelFinish`, and the worker's list of open channels it's in
+    DCEventLoopRef loop;
+    DCWorkerRef worker;
+    struct __DCChannel *prev;
+    struct __DCChannel *next;
+    bool closed;
+
     DCConnectionRef client;
-    DCConnectionRef server;
+    __DCChannelUpstream *upstreams;
 
-    SInt32 port;
-    CFHostRef host;
-    CFHostClientContext dnsContext;
+    // The upstream of every forwarded request, oldest first
+    __DCChannelUpstream **responseOrder;
+    unsigned int responseOrderHead;
+    unsigned int responseOrderCount;
+    unsigned int responseOrderCapacity;
+    size_t responseOrderSize;
+    bool resumeScheduled;
+    // The client is paused since `kDCChannelMaxPipelinedRequests` are in flight
+    bool clientThrottled;
+
+    // Set once the channel is a raw byte relay, after a CONNECT or a 101
+    // response. Each side's FIN is passed on once the other side has
+    // everything, the channel closes when both directions are done.
+    __DCChannelUpstream *tunnel;
+    bool tunnelEstablished;
+    bool clientEOF;
+    bool upstreamEOF;
+    unsigned int tunnelShutdowns;
+
+    // Throttles of upstreams that have been detached, and of the client
+    // for having too many requests in flight
+    unsigned int upstreamThrottles;
+    unsigned int pipelineThrottles;
 };
 
+static const char kDCChannelConnectionEstablished[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+static const char kDCChannelBadRequest[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char kDCChannelBadGateway[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char kDCChannelGatewayTimeout[] = "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
 DCChannelRef DCChannelCreate() {
-    struct __DCChannel *channel = (struct __DCChannel *) calloc(1, sizeof(struct __DCChannel));
+    DCWorkerRef worker = DCWorkerGetCurrent();
+    DCSlabRef slab = worker ? DCWorkerGetChannelSlab(worker) : NULL;
+    struct __DCChannel *channel = (struct __DCChannel *) (slab ? DCSlabAlloc(slab) : calloc(1, sizeof(struct __DCChannel)));
     TRACE(channel);
+    channel->slab = slab;
+    channel->buffers = DCBufferPoolGetCurrent();
+    channel->loop = DCEventLoopGetCurrent();
+    if (worker) {
+        DCChannelRef *list = DCWorkerGetChannelList(worker);
+        channel->worker = worker;
+        channel->next = *list;
+        if (channel->next)
+            channel->next->prev = channel;
+        *list = channel;
+        DCWorkerChannelOpened(worker);
+    }
     return channel;
 }
 
-static void __DCChannelSetupServer(DCChannelRef channel, CFHTTPMessageRef message) {
-    CFURLRef serverURL = CFHTTPMessageCopyRequestURL(message);
-    CFStringRef serverHostname = CFURLCopyHostName(serverURL);
-    CFStringRef scheme = CFURLCopyScheme(serverURL);
+size_t DCChannelGetInstanceSize(void) {
+    return sizeof(struct __DCChannel);
+}
+
+static void __DCChannelServerConnectionCallback(DCConnectionRef connection, DCConnectionCallbackEvents type, CFDataRef address, const void *data, void *info);
 
-    CFHostRef host = CFHostCreateWithName(kCFAllocatorDefault, serverHostname);
-    SInt32 port_nbr = CFURLGetPortNumber(serverURL);
+static DCConnectionPoolRef __DCChannelConnectionPool(void) {
+    DCWorkerRef worker = DCWorkerGetCurrent();
+    return worker ? DCWorkerGetConnectionPool(worker) : NULL;
+}
 
-    channel->host = host;
-    channel->port = port_nbr;
+// MARK: - Response order
 
-    if (channel->port == -1) {
-        channel->port = CFStringCompare(scheme, CFSTR("http"), kCFCompareCaseInsensitive) == kCFCompareEqualTo ? 80 : 433;
+static __DCChannelUpstream* __DCChannelHeadUpstream(DCChannelRef channel) {
+    if (channel->responseOrderCount == 0)
+        return NULL;
+    return channel->responseOrder[channel->responseOrderHead];
+}
+
+static void __DCChannelPushResponseOrder(DCChannelRef channel, __DCChannelUpstream *upstream) {
+    if (channel->responseOrderCount == channel->responseOrderCapacity) {
+        unsigned int capacity = channel->responseOrderCapacity ? channel->responseOrderCapacity * 2 : 8;
+        size_t size;
+        __DCChannelUpstream **order = (__DCChannelUpstream **) DCBufferPoolAlloc(channel->buffers, capacity * sizeof(__DCChannelUpstream *), &size);
+        for (unsigned int i = 0; i < channel->responseOrderCount; i++)
+            order[i] = channel->responseOrder[(channel->responseOrderHead + i) % channel->responseOrderCapacity];
+        DCBufferPoolFree(channel->buffers, channel->responseOrder, channel->responseOrderSize);
+        channel->responseOrder = order;
+        channel->responseOrderSize = size;
+        channel->responseOrderHead = 0;
+        channel->responseOrderCapacity = capacity;
     }
+    unsigned int tail = (channel->responseOrderHead + channel->responseOrderCount) % channel->responseOrderCapacity;
+    channel->responseOrder[tail] = upstream;
+    channel->responseOrderCount++;
+    DCConnectionSetAwaitingResponses(channel->client, true);
+}
 
-    if (scheme) CFRelease(scheme);
-    if (serverHostname) CFRelease(serverHostname);
-    if (serverURL) CFRelease(serverURL);
+static void __DCChannelPopResponseOrder(DCChannelRef channel) {
+    channel->responseOrderHead = (channel->responseOrderHead + 1) % channel->responseOrderCapacity;
+    channel->responseOrderCount--;
+    // The client's keep-alive timeout starts once it's owed nothing
+    if (channel->responseOrderCount == 0)
+        DCConnectionSetAwaitingResponses(channel->client, false);
+}
+
+static void __DCChannelResumeReads(DCEventLoopRef loop, void *info) {
+    DCChannelRef channel = (DCChannelRef) info;
+    channel->resumeScheduled = false;
+    if (channel->closed)
+        return;
 
-    DCConnectionSetupWithHost(channel->server, host, channel->port);
+    __DCChannelUpstream *head = __DCChannelHeadUpstream(channel);
+    if (head && DCConnectionGetNativeHandle(head->connection) != -1)
+        DCConnectionResumeReading(head->connection);
+
+    if (channel->clientThrottled && channel->responseOrderCount < kDCChannelMaxPipelinedRequests) {
+        channel->clientThrottled = false;
+        if (channel->client && DCConnectionGetNativeHandle(channel->client) != -1)
+            DCConnectionResumeReading(channel->client);
+    }
 }
 
-static void __DCChannelLogHTTP(DCConnectionRef connection, CFHTTPMessageRef next) {
-    char *type = DCConnectionGetType(connection) == kDCConnectionTypeServer ? "SERVER" : "CLIENT";
-    DCChannelRef channel = DCConnectionGetChannel(connection);
-    CFSocketNativeHandle fd = DCConnectionGetNativeHandle(connection);
+// The oldest outstanding response now decides who may read, and a throttled
+// client may send more. Resuming is deferred since we're usually inside the
+// callback of another upstream.
+static void __DCChannelPromoteHead(DCChannelRef channel) {
+    if (channel->closed)
+        return;
+    __DCChannelUpstream *head = __DCChannelHeadUpstream(channel);
+    if (head)
+        DCConnectionSetRelayPeer(head->connection, channel->client);
+    else if (!channel->clientThrottled)
+        return;
+
+    DCEventLoopRef loop = DCEventLoopGetCurrent();
+    if (loop && !channel->resumeScheduled) {
+        channel->resumeScheduled = true;
+        DCEventLoopDefer(loop, __DCChannelResumeReads, channel);
+    }
+}
+
+// MARK: - Upstreams
+
+static __DCChannelUpstream* __DCChannelCreateUpstream(DCChannelRef channel, const char *scheme, const char *host, SInt32 port) {
+    size_t schemeSize = strlen(scheme) + 1;
+    size_t hostSize = strlen(host) + 1;
+    size_t size;
+    __DCChannelUpstream *upstream = (__DCChannelUpstream *) DCBufferPoolAlloc(channel->buffers, sizeof(__DCChannelUpstream) + schemeSize + hostSize, &size);
+    memset(upstream, 0, sizeof(__DCChannelUpstream));
+    upstream->channel = channel;
+    upstream->port = port;
+    upstream->scheme = (char *) (upstream + 1);
+    memcpy(upstream->scheme, scheme, schemeSize);
+    upstream->host = upstream->scheme + schemeSize;
+    memcpy(upstream->host, host, hostSize);
+    upstream->allocationSize = size;
+    return upstream;
+}
+
+static void __DCChannelFreeUpstream(DCChannelRef channel, __DCChannelUpstream *upstream) {
+    DCBufferPoolFree(channel->buffers, upstream, upstream->allocationSize);
+}
+
+static void __DCChannelReleaseConnection(DCEventLoopRef loop, void *info) {
+    DCConnectionRelease((DCConnectionRef) info);
+}
+
+// A closed upstream is released after the current batch, we may be inside
+// one of its callbacks
+static void __DCChannelReleaseUpstreamLater(DCChannelRef channel, DCConnectionRef server) {
+    if (channel->loop)
+        DCEventLoopDefer(channel->loop, __DCChannelReleaseConnection, server);
+    else
+        DCConnectionRelease(server);
+}
+
+
+static void __DCChannelAttachUpstream(DCChannelRef channel, __DCChannelUpstream *upstream) {
+    DCConnectionRef server = upstream->connection;
+    DCConnectionSetChannel(server, channel);
+
+    // Bodies are relayed straight between the two sides as they arrive
+    DCConnectionSetStreamsBody(server, true);
+    DCConnectionSetWatermarks(server, kDCChannelHighWatermark, kDCChannelLowWatermark);
+    upstream->throttlesAtAttach = DCConnectionGetThrottleCount(server);
+
+    DCConnectionContext context;
+    context.info = upstream;
+    DCConnectionSetClient(server,
+                          kDCConnectionCallbackTypeAvailable |
+                          kDCConnectionCallbackTypeIncomingMessage |
+                          kDCConnectionCallbackTypeCompleted |
+                          kDCConnectionCallbackTypeConnectionEOF |
+                          kDCConnectionCallbackTypeFailed |
+                          kDCConnectionCallbackTypeFlushed,
+                          __DCChannelServerConnectionCallback,
+                          &context);
+
+    upstream->next = channel->upstreams;
+    channel->upstreams = upstream;
+}
+
+// Hands the upstream back to the pool when it can be reused, closes it otherwise
+static void __DCChannelDetachUpstream(DCChannelRef channel, __DCChannelUpstream *upstream, bool reuse) {
+    DCConnectionRef server = upstream->connection;
+    channel->upstreamThrottles += DCConnectionGetThrottleCount(server) - upstream->throttlesAtAttach;
 
-    if (log_get_level() <= LOG_DEBUG && (CFHTTPMessageIsRequest(next))){
-        CFStringRef method = CFHTTPMessageCopyRequestMethod(next);
-        CFURLRef reqUrl = CFHTTPMessageCopyRequestURL(next);
-        CFStringRef url = CFURLGetString(reqUrl);
+    for (__DCChannelUpstream **it = &(channel->upstreams); *it; it = &((*it)->next)) {
+        if (*it == upstream) {
+            *it = upstream->next;
+            break;
+        }
+    }
 
-        char buff[BUFSIZ];
-        memset(buff, 0, BUFSIZ);
-        CFStringGetCString(method, buff, BUFSIZ, kCFStringEncodingUTF8);
+    if (channel->tunnel == upstream)
+        channel->tunnel = NULL;
 
-        char buff2[BUFSIZ];
-        memset(buff2, 0, BUFSIZ);
-        CFStringGetCString(url, buff2, BUFSIZ, kCFStringEncodingUTF8);
+    DCConnectionSetRelayPeer(server, NULL);
+    if (channel->client && DCConnectionGetRelayPeer(channel->client) == server)
+        DCConnectionSetRelayPeer(channel->client, NULL);
 
-        log_debug("%s (fd: %d) (%p) | request => %s %s\n", type, fd, channel, buff, buff2);
+    DCConnectionPoolRef pool = __DCChannelConnectionPool();
+    reuse = reuse && upstream->pendingResponses == 0 && DCConnectionIsKeepAlive(server);
+    if (!reuse || !pool || !DCConnectionPoolCheckin(pool, server, upstream->scheme, upstream->host, upstream->port)) {
+        DCConnectionSetClient(server, kDCConnectionCallbackTypeNone, NULL, &(DCConnectionContext){ NULL });
+        DCConnectionClose(server);
+        __DCChannelReleaseUpstreamLater(channel, server);
     }
 
-    if (log_get_level() <= LOG_DEBUG && (!CFHTTPMessageIsRequest(next))){
-        CFIndex responseCode = CFHTTPMessageGetResponseStatusCode(next);
-        log_debug("%s (fd: %d) (%p) | response => %d\n", type, fd, channel, responseCode);
+    __DCChannelFreeUpstream(channel, upstream);
+}
+
+static void __DCChannelDetachAllUpstreams(DCChannelRef channel, bool reuse) {
+    channel->responseOrderCount = 0;
+    while (channel->upstreams)
+        __DCChannelDetachUpstream(channel, channel->upstreams, reuse);
+}
+
+static void __DCChannelReleaseLater(DCEventLoopRef loop, void *info) {
+    DCChannelRelease((DCChannelRef) info);
+}
+
+// The client is closed, whoever closed it, so there's nobody left to answer.
+// We're inside a callback of one of our connections: the channel and its
+// client are released after the current batch. Without a loop that's up
+// to whoever created the channel.
+static void __DCChannelFinish(DCChannelRef channel) {
+    if (channel->closed)
+        return;
+    TRACE(channel);
+    channel->closed = true;
+    __DCChannelDetachAllUpstreams(channel, false);
+    if (channel->loop)
+        DCEventLoopDefer(channel->loop, __DCChannelReleaseLater, channel);
+}
+
+static void __DCChannelClose(DCChannelRef channel, bool reuse) {
+    TRACE(channel);
+    __DCChannelDetachAllUpstreams(channel, reuse);
+
+    DCChannelStats stats;
+    DCChannelGetStats(channel, &stats);
+    if (stats.clientThrottles || stats.upstreamThrottles || stats.pipelineThrottles)
+        log_debug("channel=%p, throttled client => %u, upstreams => %u, pipeline => %u\n", channel,
+                  stats.clientThrottles, stats.upstreamThrottles, stats.pipelineThrottles);
+
+    DCConnectionClose(channel->client);
+}
+
+// Answers the oldest request that's owed a response with `response`, and
+// closes the client once it's written, whatever else was in flight
+static void __DCChannelAnswerAndClose(DCChannelRef channel, const char *response, size_t length) {
+    TRACE(channel);
+    __DCChannelDetachAllUpstreams(channel, false);
+    DCConnectionAddOutgoingBytes(channel->client, (const UInt8 *) response, (CFIndex) length);
+    DCConnectionCloseWhenFlushed(channel->client);
+}
+
+// 504 when `server` gave up waiting, 502 for anything else going wrong
+static void __DCChannelAnswerUpstreamFailure(DCChannelRef channel, DCConnectionRef server) {
+    if (server && DCConnectionHasTimedOut(server))
+        __DCChannelAnswerAndClose(channel, kDCChannelGatewayTimeout, sizeof(kDCChannelGatewayTimeout) - 1);
+    else
+        __DCChannelAnswerAndClose(channel, kDCChannelBadGateway, sizeof(kDCChannelBadGateway) - 1);
+}
+
+static __DCChannelUpstream* __DCChannelFindUpstream(DCChannelRef channel, const char *scheme, const char *host, SInt32 port) {
+    for (__DCChannelUpstream *upstream = channel->upstreams; upstream; upstream = upstream->next) {
+        if (upstream->port == port && strcmp(upstream->host, host) == 0 && strcmp(upstream->scheme, scheme) == 0)
+            return upstream;
+    }
+    return NULL;
+}
+
+static __DCChannelUpstream* __DCChannelOpenUpstream(DCChannelRef channel, const char *scheme, const char *host, SInt32 port) {
+    __DCChannelUpstream *upstream = __DCChannelCreateUpstream(channel, scheme, host, port);
+
+    DCConnectionPoolRef pool = __DCChannelConnectionPool();
+    upstream->connection = pool ? DCConnectionPoolCheckout(pool, scheme, host, port) : NULL;
+    if (upstream->connection) {
+        log_trace("channel=%p, reusing pooled connection=%p for %s:%d\n", channel, upstream->connection, host, port);
+        __DCChannelAttachUpstream(channel, upstream);
+        return upstream;
+    }
+
+    // Not attached yet, a synchronous failure has nobody to tell. Failing
+    // once the host is resolved is reported like any other upstream failure.
+    upstream->connection = DCConnectionCreate(channel);
+    DCConnectionSetTalksTo(upstream->connection, kDCConnectionTypeServer);
+    DCConnectionSetupWithHost(upstream->connection, host, port);
+
+    if (DCConnectionHasFailed(upstream->connection)) {
+        log_debug("channel=%p, couldn't open upstream %s:%d\n", channel, host, port);
+        DCConnectionRelease(upstream->connection);
+        __DCChannelFreeUpstream(channel, upstream);
+        return NULL;
+    }
+
+    __DCChannelAttachUpstream(channel, upstream);
+    return upstream;
+}
+
+// Splits "host", "host:port" or "[v6]:port", leaves `port` as is when absent.
+// False when what follows the host isn't a port between 1 and 65535.
+static bool __DCChannelSplitHostPort(const char *value, size_t valueLength, char *host, size_t hostSize, SInt32 *port) {
+    const char *end = value + valueLength;
+    const char *hostStart = value;
+    const char *hostEnd = end;
+    const char *colon = NULL;
+
+    if (valueLength > 0 && *value == '[') {
+        const char *bracket = memchr(value, ']', valueLength);
+        if (bracket) {
+            hostStart = value + 1;
+            hostEnd = bracket;
+            if (bracket + 1 < end && bracket[1] != ':')
+                return false;
+            if (bracket + 1 < end)
+                colon = bracket + 1;
+        }
+    } else {
+        for (const char *it = end; it > value && !colon; it--) {
+            if (it[-1] == ':')
+                colon = it - 1;
+        }
+        if (colon)
+            hostEnd = colon;
+    }
+
+    if (colon) {
+        SInt32 parsed = 0;
+        if (colon + 1 == end)
+            return false;
+        for (const char *digit = colon + 1; digit < end; digit++) {
+            if (*digit < '0' || *digit > '9')
+                return false;
+            parsed = parsed * 10 + (*digit - '0');
+            if (parsed > 65535)
+                return false;
+        }
+        if (parsed == 0)
+            return false;
+        *port = parsed;
+    }
+
+    size_t length = (size_t) (hostEnd - hostStart);
+    if (length >= hostSize)
+        length = hostSize - 1;
+    memcpy(host, hostStart, length);
+    host[length] = '\0';
+    return true;
+}
+
+// Finds the upstream for the target of `message`, the absolute URI when
+// there is one and the Host header otherwise. `*badRequest` tells whether
+// a NULL is for the request's fault rather than the upstream's.
+static __DCChannelUpstream* __DCChannelRouteRequest(DCChannelRef channel, DCHTTPMessageRef message, bool *badRequest) {
+    DCHTTPSlice target = DCHTTPMessageGetTarget(message);
+
+    char host[NI_MAXHOST];
+    memset(host, 0, sizeof(host));
+    char schemeName[16];
+    strcpy(schemeName, "http");
+    SInt32 port_nbr = -1;
+
+    // "scheme://[userinfo@]authority/path", as sent to a forward proxy
+    const char *separator = target.length > 3 ? memchr(target.data, ':', target.length) : NULL;
+    if (separator && (size_t) (target.data + target.length - separator) > 3 && memcmp(separator, "://", 3) == 0) {
+        size_t schemeLength = (size_t) (separator - target.data);
+        if (schemeLength < sizeof(schemeName)) {
+            memcpy(schemeName, target.data, schemeLength);
+            schemeName[schemeLength] = '\0';
+        }
+
+        const char *authority = separator + 3;
+        const char *end = target.data + target.length;
+        const char *authorityEnd = authority;
+        while (authorityEnd < end && *authorityEnd != '/' && *authorityEnd != '?' && *authorityEnd != '#')
+            authorityEnd++;
+
+        const char *at = NULL;
+        for (const char *it = authority; it < authorityEnd; it++)
+            if (*it == '@') at = it;
+        if (at)
+            authority = at + 1;
+
+        if (!__DCChannelSplitHostPort(authority, (size_t) (authorityEnd - authority), host, sizeof(host), &port_nbr))
+            host[0] = '\0';
+    } else {
+        DCHTTPSlice hostHeader;
+        if (DCHTTPMessageGetHeader(message, "Host", &hostHeader) &&
+            !__DCChannelSplitHostPort(hostHeader.data, hostHeader.length, host, sizeof(host), &port_nbr))
+            host[0] = '\0';
+    }
+
+    if (port_nbr == -1) {
+        port_nbr = strcasecmp(schemeName, "http") == 0 ? 80 : 443;
+    }
+
+    *badRequest = host[0] == '\0';
+    if (*badRequest) {
+        log_debug("channel=%p, request without a usable target host\n", channel);
+        return NULL;
+    }
+
+    __DCChannelUpstream *upstream = __DCChannelFindUpstream(channel, schemeName, host, port_nbr);
+    return upstream ? upstream : __DCChannelOpenUpstream(channel, schemeName, host, port_nbr);
+}
+
+// MARK: - Tunnels
+
+static void __DCChannelStartTunnel(DCChannelRef channel, __DCChannelUpstream *upstream) {
+    TRACE(channel);
+    channel->tunnel = upstream;
+    channel->responseOrderCount = 0;
+    DCConnectionSetAwaitingResponses(channel->client, false);
+    // Nothing is in flight anymore, a throttled client is let go
+    if (channel->clientThrottled)
+        __DCChannelPromoteHead(channel);
+
+    DCConnectionStartTunnel(channel->client);
+    DCConnectionStartTunnel(upstream->connection);
+    DCConnectionSetRelayPeer(channel->client, upstream->connection);
+    DCConnectionSetRelayPeer(upstream->connection, channel->client);
+}
+
+static void __DCChannelRefuseTunnel(DCChannelRef channel, DCConnectionRef server) {
+    log_debug("channel=%p, couldn't open tunnel\n", channel);
+    __DCChannelAnswerUpstreamFailure(channel, server);
+}
+
+static void __DCChannelTunnelEOF(DCChannelRef channel, DCConnectionRef connection) {
+    bool *eof = connection == channel->client ? &(channel->clientEOF) : &(channel->upstreamEOF);
+    if (*eof)
+        return;
+    *eof = true;
+
+    DCConnectionRef peer = DCConnectionGetRelayPeer(connection);
+    if (peer)
+        DCConnectionShutdownWhenFlushed(peer);
+    else
+        __DCChannelClose(channel, false);
+}
+
+static void __DCChannelTunnelFlushed(DCChannelRef channel) {
+    if (++channel->tunnelShutdowns == 2)
+        __DCChannelClose(channel, false);
+}
+
+// "CONNECT host:port", the tunnel is established once the upstream is connected
+static void __DCChannelOpenTunnel(DCChannelRef channel, DCHTTPMessageRef request) {
+    DCHTTPSlice target = DCHTTPMessageGetTarget(request);
+    char host[NI_MAXHOST];
+    SInt32 port = 443;
+    if (!__DCChannelSplitHostPort(target.data, target.length, host, sizeof(host), &port))
+        host[0] = '\0';
+
+    if (host[0] == '\0' && channel->responseOrderCount == 0 && !channel->tunnel) {
+        log_debug("channel=%p, CONNECT without a usable target\n", channel);
+        __DCChannelAnswerAndClose(channel, kDCChannelBadRequest, sizeof(kDCChannelBadRequest) - 1);
+        return;
+    }
+
+    // What was asked before has to be answered before the tunnel, which
+    // we don't wait for; clients don't pipeline in front of a CONNECT.
+    if (host[0] == '\0' || channel->responseOrderCount > 0 || channel->tunnel) {
+        log_debug("channel=%p, unexpected CONNECT\n", channel);
+        __DCChannelClose(channel, false);
+        return;
+    }
+
+    __DCChannelDetachAllUpstreams(channel, true);
+
+    __DCChannelUpstream *upstream = __DCChannelCreateUpstream(channel, "connect", host, port);
+    upstream->connection = DCConnectionCreate(channel);
+    DCConnectionSetTalksTo(upstream->connection, kDCConnectionTypeServer);
+    DCConnectionSetupWithHost(upstream->connection, host, port);
+
+    if (DCConnectionHasFailed(upstream->connection)) {
+        DCConnectionRelease(upstream->connection);
+        __DCChannelFreeUpstream(channel, upstream);
+        __DCChannelRefuseTunnel(channel, NULL);
+        return;
+    }
+
+    __DCChannelAttachUpstream(channel, upstream);
+    __DCChannelStartTunnel(channel, upstream);
+}
+
+static void __DCChannelTunnelCallback(DCChannelRef channel, DCConnectionRef connection, DCConnectionCallbackEvents type) {
+    log_trace("channel=%p, tunnel => %p, event => %s\n", channel, connection, DCConnectionCallbackTypeString(type));
+
+    switch (type) {
+        case kDCConnectionCallbackTypeAvailable:
+            // The upstream's connected, the client may start talking through us
+            channel->tunnelEstablished = true;
+            DCConnectionAddOutgoingBytes(channel->client, (const UInt8 *) kDCChannelConnectionEstablished, sizeof(kDCChannelConnectionEstablished) - 1);
+            break;
+        case kDCConnectionCallbackTypeConnectionEOF:
+            __DCChannelTunnelEOF(channel, connection);
+            break;
+        case kDCConnectionCallbackTypeFlushed:
+            __DCChannelTunnelFlushed(channel);
+            break;
+        case kDCConnectionCallbackTypeFailed:
+            if (!channel->tunnelEstablished && connection != channel->client)
+                __DCChannelRefuseTunnel(channel, connection);
+            else
+                __DCChannelClose(channel, false);
+            break;
+        default:
+            break;
+    }
+}
+
+static void __DCChannelLogHTTP(DCConnectionRef connection, DCHTTPMessageRef next) {
+    if (!log_enabled(LOG_DEBUG))
+        return;
+
+    char *type = DCConnectionGetType(connection) == kDCConnectionTypeServer ? "SERVER" : "CLIENT";
+    DCChannelRef channel = DCConnectionGetChannel(connection);
+    CFSocketNativeHandle fd = DCConnectionGetNativeHandle(connection);
+
+    if (DCHTTPMessageIsRequest(next)) {
+        DCHTTPSlice method = DCHTTPMessageGetMethod(next);
+        DCHTTPSlice target = DCHTTPMessageGetTarget(next);
+        log_debug("%s (fd: %d) (%p) | request => %.*s %.*s\n", type, fd, channel, (int) method.length, method.data, (int) target.length, target.data);
+    } else {
+        log_debug("%s (fd: %d) (%p) | response => %d\n", type, fd, channel, DCHTTPMessageGetStatusCode(next));
     }
 }
 
@@ -75,22 +615,77 @@ static void __DCChannelClientConnectionCallback(DCConnectionRef connection, DCCo
     DCChannelRef channel = (DCChannelRef) info;
     log_trace("channel=%p, connectionCallback => %p, event => %s\n", channel, connection, DCConnectionCallbackTypeString(type));
 
+    if (type == kDCConnectionCallbackTypeClosed) {
+        __DCChannelFinish(channel);
+        return;
+    }
+
+    if (channel->tunnel) {
+        __DCChannelTunnelCallback(channel, connection, type);
+        return;
+    }
+
     switch (type) {
         case kDCConnectionCallbackTypeIncomingMessage:
             {
                 while (DCConnectionHasNext(connection)) {
-                    CFHTTPMessageRef next = DCConnectionPopNext(connection);
-                    if (!channel->host)
-                        __DCChannelSetupServer(channel, next);
+                    DCHTTPMessageRef next = DCConnectionPopNext(connection);
+
+                    DCHTTPSlice method = DCHTTPMessageGetMethod(next);
+                    if (method.length == 7 && memcmp(method.data, "CONNECT", 7) == 0) {
+                        __DCChannelLogHTTP(connection, next);
+                        __DCChannelOpenTunnel(channel, next);
+                        DCHTTPMessageRelease(next);
+                        break;
+                    }
+
+                    bool badRequest = false;
+                    __DCChannelUpstream *upstream = __DCChannelRouteRequest(channel, next, &badRequest);
+                    if (!upstream) {
+                        DCHTTPMessageRelease(next);
+                        // Earlier responses go first, there's no room for ours in between
+                        if (channel->responseOrderCount > 0)
+                            __DCChannelClose(channel, false);
+                        else if (badRequest)
+                            __DCChannelAnswerAndClose(channel, kDCChannelBadRequest, sizeof(kDCChannelBadRequest) - 1);
+                        else
+                            __DCChannelAnswerUpstreamFailure(channel, NULL);
+                        break;
+                    }
+
                     __DCChannelLogHTTP(connection, next);
-                    DCConnectionAddOutgoing(channel->server, next);
+
+                    // The body following this header belongs to the same upstream
+                    DCConnectionSetRelayPeer(channel->client, upstream->connection);
+
+                    upstream->pendingResponses++;
+                    __DCChannelPushResponseOrder(channel, upstream);
+                    if (__DCChannelHeadUpstream(channel) == upstream)
+                        DCConnectionSetRelayPeer(upstream->connection, channel->client);
+                    else
+                        DCConnectionPauseReading(upstream->connection);
+
+                    DCConnectionAddOutgoing(upstream->connection, next);
+                    DCHTTPMessageRelease(next);
+
+                    // Writing may have failed and closed us
+                    if (DCConnectionGetNativeHandle(connection) == -1)
+                        break;
+
+                    // Parsing stops right behind this request, until a response is done
+                    if (channel->responseOrderCount >= kDCChannelMaxPipelinedRequests && !channel->clientThrottled) {
+                        log_debug("channel=%p, %u requests in flight, pausing the client\n", channel, channel->responseOrderCount);
+                        channel->clientThrottled = true;
+                        channel->pipelineThrottles++;
+                        DCConnectionPauseReading(connection);
+                    }
                 }
             }
             break;
         case kDCConnectionCallbackTypeConnectionEOF:
+        case kDCConnectionCallbackTypeFailed:
             log_trace("closing connection=%p\n", connection);
-            DCConnectionClose(channel->client);
-            DCConnectionClose(channel->server);
+            __DCChannelClose(channel, type == kDCConnectionCallbackTypeConnectionEOF);
             break;
         default:
             break;
@@ -98,23 +693,86 @@ static void __DCChannelClientConnectionCallback(DCConnectionRef connection, DCCo
 }
 
 static void __DCChannelServerConnectionCallback(DCConnectionRef connection, DCConnectionCallbackEvents type, CFDataRef address, const void *data, void *info) {
-    DCChannelRef channel = (DCChannelRef) info;
+    __DCChannelUpstream *upstream = (__DCChannelUpstream *) info;
+    DCChannelRef channel = upstream->channel;
     log_trace("channel=%p, connectionCallback => %p, event => %s\n", channel, connection, DCConnectionCallbackTypeString(type));
 
+    if (channel->tunnel == upstream) {
+        __DCChannelTunnelCallback(channel, connection, type);
+        return;
+    }
+
     switch (type) {
         case kDCConnectionCallbackTypeIncomingMessage:
             {
                 while (DCConnectionHasNext(connection)) {
-                    CFHTTPMessageRef next = DCConnectionPopNext(connection);
+                    DCHTTPMessageRef next = DCConnectionPopNext(connection);
                     __DCChannelLogHTTP(connection, next);
                     DCConnectionAddOutgoing(channel->client, next);
+                    unsigned short status = DCHTTPMessageGetStatusCode(next);
+                    DCHTTPMessageRelease(next);
+                    // After an interim response the client still takes a final one from us
+                    if (status >= 200 || status == 101)
+                        upstream->responding = true;
+
+                    // Switching protocols, both sides talk through us as they like from here
+                    if (status == 101 && __DCChannelHeadUpstream(channel) == upstream) {
+                        for (__DCChannelUpstream *other = channel->upstreams; other;) {
+                            __DCChannelUpstream *next = other->next;
+                            if (other != upstream)
+                                __DCChannelDetachUpstream(channel, other, true);
+                            other = next;
+                        }
+                        channel->tunnelEstablished = true;
+                        __DCChannelStartTunnel(channel, upstream);
+                        break;
+                    }
                 }
             }
             break;
+        case kDCConnectionCallbackTypeCompleted:
+            if (upstream->pendingResponses == 0 || __DCChannelHeadUpstream(channel) != upstream) {
+                log_debug("channel=%p, unexpected response from connection=%p\n", channel, connection);
+                __DCChannelClose(channel, false);
+                break;
+            }
+
+            __DCChannelPopResponseOrder(channel);
+            upstream->pendingResponses--;
+            upstream->responding = false;
+
+            // The client only learns where that response ended when we close
+            if (DCConnectionIsCloseDelimited(connection)) {
+                __DCChannelDetachAllUpstreams(channel, false);
+                DCConnectionCloseWhenFlushed(channel->client);
+                break;
+            }
+
+            // Nothing more expected from this upstream, return it to the pool.
+            // Otherwise it waits its turn if some other upstream owes the next response.
+            // One that answered before the client was done sending it a body
+            // would read the next request's bytes as the rest of that body,
+            // so it's closed instead; the remainder is dropped.
+            if (upstream->pendingResponses == 0)
+                __DCChannelDetachUpstream(channel, upstream, !(DCConnectionGetRelayPeer(channel->client) == connection && DCConnectionIsRelayingBody(channel->client)));
+            else if (__DCChannelHeadUpstream(channel) != upstream)
+                DCConnectionPauseReading(connection);
+
+            __DCChannelPromoteHead(channel);
+            break;
         case kDCConnectionCallbackTypeConnectionEOF:
+        case kDCConnectionCallbackTypeFailed:
             log_trace("closing connection=%p\n", connection);
-            DCConnectionClose(channel->client);
-            DCConnectionClose(channel->server);
+            // When it went away while idle the client can carry on. When it
+            // owes the next response and hasn't started on it, the client is
+            // told why. Otherwise the responses it owed can't be delivered in
+            // order anymore.
+            if (upstream->pendingResponses == 0)
+                __DCChannelDetachUpstream(channel, upstream, false);
+            else if (__DCChannelHeadUpstream(channel) == upstream && !upstream->responding)
+                __DCChannelAnswerUpstreamFailure(channel, connection);
+            else
+                __DCChannelClose(channel, false);
             break;
         default:
             break;
@@ -125,31 +783,55 @@ void DCChannelSetupWithFD(DCChannelRef channel, CFSocketNativeHandle fd) {
     channel->client = DCConnectionCreate(channel);
     DCConnectionSetChannel(channel->client, channel);
     DCConnectionSetTalksTo(channel->client, kDCConnectionTypeClient);
-
-    channel->server = DCConnectionCreate(channel);
-    DCConnectionSetChannel(channel->server, channel);
-    DCConnectionSetTalksTo(channel->server, kDCConnectionTypeServer);
+    DCConnectionSetStreamsBody(channel->client, true);
+    DCConnectionSetWatermarks(channel->client, kDCChannelHighWatermark, kDCChannelLowWatermark);
 
     DCConnectionContext context;
     context.info = channel;
 
     DCConnectionSetClient(channel->client,
                           kDCConnectionCallbackTypeIncomingMessage |
-                          kDCConnectionCallbackTypeConnectionEOF,
+                          kDCConnectionCallbackTypeConnectionEOF |
+                          kDCConnectionCallbackTypeFailed |
+                          kDCConnectionCallbackTypeFlushed |
+                          kDCConnectionCallbackTypeClosed,
                           __DCChannelClientConnectionCallback,
                           &context);
 
-    DCConnectionSetClient(channel->server,
-                          kDCConnectionCallbackTypeIncomingMessage |
-                          kDCConnectionCallbackTypeConnectionEOF,
-                          __DCChannelServerConnectionCallback,
-                          &context);
-
     DCConnectionSetupWithFD(channel->client, fd);
 }
 
-void DCChannelRelease(DCChannelRef channel) {
-    if (channel->host) CFRelease(channel->host);
-    free(channel);
+void DCChannelGetStats(DCChannelRef channel, DCChannelStats *stats) {
+    stats->clientThrottles = channel->client ? DCConnectionGetThrottleCount(channel->client) : 0;
+    stats->upstreamThrottles = channel->upstreamThrottles;
+    for (__DCChannelUpstream *upstream = channel->upstreams; upstream; upstream = upstream->next)
+        stats->upstreamThrottles += DCConnectionGetThrottleCount(upstream->connection) - upstream->throttlesAtAttach;
+    stats->pipelineThrottles = channel->pipelineThrottles;
 }
 
+void DCChannelRelease(DCChannelRef channel) {
+    TRACE(channel);
+    channel->closed = true;
+    __DCChannelDetachAllUpstreams(channel, false);
+    if (channel->client) {
+        DCConnectionSetClient(channel->client, kDCConnectionCallbackTypeNone, NULL, &(DCConnectionContext){ NULL });
+        DCConnectionClose(channel->client);
+        DCConnectionRelease(channel->client);
+    }
+
+    if (channel->worker) {
+        if (channel->prev)
+            channel->prev->next = channel->next;
+        else
+            *DCWorkerGetChannelList(channel->worker) = channel->next;
+        if (channel->next)
+            channel->next->prev = channel->prev;
+        DCWorkerChannelClosed(channel->worker);
+    }
+
+    DCBufferPoolFree(channel->buffers, channel->responseOrder, channel->responseOrderSize);
+    if (channel->slab)
+        DCSlabFree(channel->slab, channel);
+    else
+        free(channel);
+}
@@ -2,12 +2,31 @@
 #define DCChannel_h
 
 #include <stdio.h>
-#include <CoreFoundation/CoreFoundation.h>
+#include "DCTypes.h"
 
 typedef struct __DCChannel*         DCChannelRef;
 
+// How often one side had to wait for the other, see `DCChannelGetStats`
+typedef struct DCChannelStats {
+    unsigned int clientThrottles;   // An upstream had too much of the client's to write
+    unsigned int upstreamThrottles; // The client had too much of an upstream's to write
+    unsigned int pipelineThrottles; // The client had too many requests in flight
+} DCChannelStats;
+
+/*
+ * A channel is what one client connection says, and the upstreams it's
+ * routed to. It releases itself once the client is closed, whichever side
+ * closed it, after the batch of events that did. The worker releases the
+ * channels still open when it goes. A channel created outside of an event
+ * loop is released by its creator.
+ */
 DCChannelRef DCChannelCreate(void);
 void DCChannelSetupWithFD(DCChannelRef channel, CFSocketNativeHandle fd);
 void DCChannelRelease(DCChannelRef channel);
 
+void DCChannelGetStats(DCChannelRef channel, DCChannelStats *stats);
+
+// What the worker's channel slab hands out
+size_t DCChannelGetInstanceSize(void);
+
 #endif /* DCChannel_h */
@@ -2,53 +2,224 @@
 #define DCConnection_Private_h
 
 #include "DCConnection.h"
+#include "DCBufferPool.h"
+#include "DCEventLoop.h"
+#include "DCHTTPParser.h"
+#include "DCMessageQueue.h"
+#include "DCResolver.h"
+#include "DCSlab.h"
+#include "DCTimerWheel.h"
+
+// When an upstream has several addresses the next one is tried after this
+// long without an answer from those tried so far (RFC 8305's Connection
+// Attempt Delay), or right away when they all failed
+#define kDCConnectionAttemptDelayMs     250
+
+// Unless `DCConnectionSetTimeouts` or the worker says otherwise
+#define kDCConnectionConnectTimeoutMs   (10 * 1000)
+#define kDCConnectionHeaderTimeoutMs    (60 * 1000)
+#define kDCConnectionBodyIdleTimeoutMs  (60 * 1000)
+#define kDCConnectionKeepAliveTimeoutMs (75 * 1000)
+
+// Pending outgoing bytes at which the connection relaying to us is paused,
+// and below which it's resumed again, unless `DCConnectionSetWatermarks`
+// says otherwise.
+#define kDCConnectionRelayHighWatermark (256 * 1024)
+#define kDCConnectionRelayLowWatermark  (64 * 1024)
+
+// Bodies with at least this much left are moved with splice(2) on Linux,
+// smaller ones usually arrived with the header anyway.
+#define kDCConnectionSpliceThreshold (16 * 1024)
+#define kDCConnectionSpliceChunk     (64 * 1024)
+
+// Segments handed to one writev(2), well below IOV_MAX (1024 on Linux and
+// the BSDs) so the vector stays small enough for the stack.
+#define kDCConnectionWriteBatch 64
+
+// Reading stops once this many received messages wait for the callback to
+// pop them, and starts again when it's down to the low mark.
+#define kDCConnectionIncomingHighWatermark kDCMessageQueueCapacity
+#define kDCConnectionIncomingLowWatermark  (kDCMessageQueueCapacity / 2)
+
+// Requests that may be written before their responses start to come back.
+// Only whether each was a HEAD is remembered, one bit apiece.
+#define kDCConnectionMaxPendingRequests 32
+
+// A read buffer is one buffer pool class. A header must fit in it as a
+// whole, since the parser records spans into it, so the largest header we
+// accept is a little less.
+#define kDCConnectionReadBufferSize  (16 * 1024)
+#define kDCConnectionMaxHeaderSize   ((CFIndex) (kDCConnectionReadBufferSize - sizeof(__DCReadBuffer)))
+
+/*
+ * What a connection costs while it sits idle between messages, on keep-alive
+ * or in the pool: the struct below, with its queues inline, and its loop
+ * handler. The parser and the bytes only exist while a read is in progress.
+ *
+ * `DCConnectionGetInstanceSize` is checked against this at compile time.
+ * Measured as the proxy's RSS on x86_64 Linux with 2000 clients: a client
+ * that connected and sent nothing costs about 670 bytes, one idle on
+ * keep-alive after a request (channel, both connections and their handlers)
+ * about 2 KB. Both were 18 KB and 36 KB with the buffer inside
+ * the connection.
+ */
+#define kDCConnectionIdleSizeTarget  512
 
 typedef enum __DCConnectionState {
     kDCConnectionStateNone = 0,
     kDCConnectionStateAvailable = 1,
     kDCConnectionStateReading,
     kDCConnectionStateResolvingHost,
+    kDCConnectionStateConnecting,
     kDCConnectionStateSending,
     kDCConnectionStateCompleted,
-    kDCConnectionStateFailed
+    kDCConnectionStateFailed,
+    kDCConnectionStateClosed
 } __DCConnectionState;
 
-typedef struct __HTTPWriteMessage {
-    CFHTTPMessageRef msg;
-    CFDataRef data;
-    CFIndex idx;
-} __HTTPWriteMessage;
+// Why reading is paused, it goes on once there's no reason left
+typedef enum __DCReadPause {
+    kDCReadPauseCaller = 1 << 0,  // DCConnectionPauseReading
+    kDCReadPauseRelay = 1 << 1,   // The relay peer has too much to write
+    kDCReadPauseQueue = 1 << 2,   // Received messages aren't being popped
+    kDCReadPauseClosing = 1 << 3  // DCConnectionCloseWhenFlushed, for good
+} __DCReadPause;
+
+// Which of `DCConnectionTimeouts` is armed, one at a time since a
+// connection only ever waits for one thing
+typedef enum __DCConnectionTimeout {
+    kDCConnectionTimeoutNone = 0,
+    kDCConnectionTimeoutConnect,
+    kDCConnectionTimeoutHeader,
+    kDCConnectionTimeoutBodyIdle,
+    kDCConnectionTimeoutKeepAlive
+} __DCConnectionTimeout;
+
+// Pending output, in order. Messages are written straight from their own
+// bytes, relayed raw bytes are copied right behind the segment. Bytes
+// relayed while the source is still going through its read buffer are
+// borrowed from it instead, and copied only if they're still here when
+// the pass is over.
+typedef struct __DCOutgoingSegment {
+    DCHTTPMessageRef msg; // NULL when relaying raw body bytes
+    bool endsMessage;
+    bool borrowed;
+    const UInt8 *bytes;
+    CFIndex length;
+    size_t allocationSize;
+    struct __DCOutgoingSegment *next;
+} __DCOutgoingSegment;
+
+// Taken from the worker's buffer pool when bytes arrive and given back once
+// they're all consumed. Between messages the parser is in its initial state,
+// so it's set up again with every buffer.
+typedef struct __DCReadBuffer {
+    DCHTTPParser parser;
+    UInt8 bytes[];
+} __DCReadBuffer;
 
 typedef enum __HTTPReadMessageState {
     kHTTPReadMessageStateHeader = 0,
     kHTTPReadMessageStateBody = 1
 } __HTTPReadMessageState;
 
+// How the end of a body is found, RFC 7230 3.3.3
+typedef enum __HTTPBodyFraming {
+    kHTTPBodyFramingLength = 0,     // Content-Length
+    kHTTPBodyFramingChunked = 1,    // Chunks are relayed as they are, framing included
+    kHTTPBodyFramingUntilClose = 2, // Responses without a length end at EOF
+    kHTTPBodyFramingTunnel = 3      // No more messages, just bytes until EOF
+} __HTTPBodyFraming;
+
 typedef struct __HTTPReadMessage {
-    CFHTTPMessageRef msg;
+    DCHTTPMessageRef msg; // Only set while its body is being buffered
     __HTTPReadMessageState state;
-    SInt32 bodyLength;
+    __HTTPBodyFraming framing;
+    DCHTTPChunkDecoder chunks;
+    CFIndex bodyLength;
     CFIndex idx;
-    SInt32 eofLeft;
 } __HTTPReadMessage;
 
 struct __DCConnection {
+    // Where the connection and its segments go back to, NULL when it was
+    // created outside of a worker.
+    DCSlabRef slab;
+    DCBufferPoolRef buffers;
+
     CFSocketNativeHandle fd;
     DCConnectionType type;
     DCChannelRef channel;
-    CFStreamClientContext streamContext;
+    DCEventLoopRef loop;
+    __DCConnectionState state;
+
+    // Set while the upstream's name is being looked up, and while its
+    // addresses race to connect when it has several
+    DCResolverRef resolver;
+    struct __DCConnectionRace *race;
+    UInt32 port;
 
-    CFReadStreamRef readStream;
     __HTTPReadMessage readMessage;
-    UInt8 readBuffer[4*BUFSIZ];
-    CFMutableArrayRef recvUnprocessedMessages;
-    CFMutableArrayRef recvProcessedMessages;
+    DCHTTPParserType parserType;
+    bool streamsBody;
+    bool reading;
+    // The loop does the reading and writing for us and calls back when
+    // it's done, see `DCEventLoopHasCompletions`. Nothing is spliced then.
+    bool completions;
+    bool receiving; // A receive is armed
+    UInt8 readPauses; // __DCReadPause
+    bool hungUp; // The peer's FIN is in, read until EOF
+    bool consuming; // Going through `readBuffer`, see `__DCConnectionConsumeReadBuffer`
+    bool keepAlive;
+    // The last body read ended with the connection, see `DCConnectionIsCloseDelimited`
+    bool closeDelimited;
+    DCConnectionRef relayPeer;
+    DCConnectionRef relaySource;
+
+    // Kernel pipe used to move relayed bytes to `relayPeer` without copying
+    // them through user space. Anything left in it must reach the peer
+    // before we read again.
+    int splicePipe[2];
+    CFIndex splicePipeBytes;
+    bool spliceCompletionPending;
+    // Bytes at the start of `readBuffer` that were read but not consumed,
+    // a header that isn't complete yet or what was held back while paused.
+    // NULL whenever that's nothing.
+    __DCReadBuffer *readBuffer;
+    CFIndex readBufferLength;
+    DCMessageQueue incoming;
 
     // Where we write our requests
-    CFWriteStreamRef writeStream;
-    __HTTPWriteMessage writeMessage;
-    CFMutableArrayRef outgoingMessages;
-    CFMutableArrayRef sentMessages;
+    bool writable;
+    __DCOutgoingSegment *outgoingHead;
+    __DCOutgoingSegment *outgoingTail;
+    CFIndex outgoingIdx; // Into `outgoingHead`
+    CFIndex outgoingBytes;
+    bool closeWhenFlushed;
+    bool shutdownWhenFlushed;
+    bool hasBorrowed; // Some segment is `borrowed`
+    bool flushScheduled;
+    // The segments at the head are being sent by the loop, they can't be
+    // freed, and neither can we, until it calls back.
+    bool sendInFlight;
+    bool releasePending;
+    UInt32 highWatermark;
+    UInt32 lowWatermark;
+    // Times reading was paused since our relay peer had too much to write
+    UInt32 nbrThrottles;
+    // Requests we've queued that haven't been answered yet, oldest first.
+    // A response's framing depends on its request, e.g. HEAD, so bit
+    // `(pendingRequestsHead + i) % 32` is set when the i:th one was.
+    UInt32 pendingHeadRequests;
+    UInt8 pendingRequestsHead;
+    UInt8 nbrPendingRequests;
+
+    // On the loop's timer wheel while `timeout` is armed
+    DCTimerWheelEntry timeoutEntry;
+    const DCConnectionTimeouts *timeouts;
+    UInt8 timeout; // __DCConnectionTimeout
+    bool hasReceived; // A message came in, waiting for the next one is keep-alive
+    bool awaitingResponses; // DCConnectionSetAwaitingResponses
+    bool timedOut; // Failed since `timeout` ran out, see `DCConnectionHasTimedOut`
 
     DCConnectionContext context;
     DCConnectionCallback callback;
@@ -1,63 +1,285 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
 #include "DCConnection-Private.h"
+#include "DCWorker.h"
 #include "log.h"
 #include "utils.h"
 
-#include <CFNetwork/CFNetwork.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #define TRACE(p) log_trace("connection=%p (%s)\n", p, p->type == kDCConnectionTypeClient ? "CLIENT" : "SERVER")
 
-CFStringRef const kDCConnectionReceivedHTTPRequest = CFSTR("DCConnectionReceivedHTTPRequest");
+const DCConnectionTimeouts kDCConnectionDefaultTimeouts = {
+    kDCConnectionConnectTimeoutMs,
+    kDCConnectionHeaderTimeoutMs,
+    kDCConnectionBodyIdleTimeoutMs,
+    kDCConnectionKeepAliveTimeoutMs
+};
+
+static void __DCConnectionTimedOut(DCTimerWheelEntry *entry, void *info);
+static void __DCConnectionCancelRace(DCConnectionRef connection, bool timedOut);
 
 // MARK: - Lifecycle
 
+static void __DCConnectionResetReadMessage(DCConnectionRef connection) {
+    if (connection->readMessage.msg)
+        DCHTTPMessageRelease(connection->readMessage.msg);
+    connection->readMessage.msg = NULL;
+    connection->readMessage.state = kHTTPReadMessageStateHeader;
+    connection->readMessage.framing = kHTTPBodyFramingLength;
+    connection->readMessage.bodyLength = 0;
+    connection->readMessage.idx = 0;
+}
+
+// Relayed bytes are copied right behind their segment
+static __DCOutgoingSegment* __DCConnectionAllocSegment(DCConnectionRef connection, CFIndex extraBytes) {
+    size_t size;
+    __DCOutgoingSegment *segment = (__DCOutgoingSegment *) DCBufferPoolAlloc(connection->buffers, sizeof(__DCOutgoingSegment) + extraBytes, &size);
+    segment->allocationSize = size;
+    return segment;
+}
+
+static void __DCConnectionFreeSegment(DCConnectionRef connection, __DCOutgoingSegment *segment) {
+    if (segment->msg)
+        DCHTTPMessageRelease(segment->msg);
+    DCBufferPoolFree(connection->buffers, segment, segment->allocationSize);
+}
+
+static bool __DCConnectionTakeReadBuffer(DCConnectionRef connection) {
+    if (connection->readBuffer)
+        return true;
+
+    connection->readBuffer = (__DCReadBuffer *) DCBufferPoolAlloc(connection->buffers, kDCConnectionReadBufferSize, NULL);
+    if (!connection->readBuffer) {
+        log_error("connection=%p, couldn't allocate a read buffer\n", connection);
+        return false;
+    }
+    DCHTTPParserInit(&(connection->readBuffer->parser), connection->parserType);
+    return true;
+}
+
+// Only once everything read has been consumed, and never from under a read
+static void __DCConnectionReturnReadBuffer(DCConnectionRef connection) {
+    if (!connection->readBuffer || connection->readBufferLength > 0 || connection->reading)
+        return;
+    DCBufferPoolFree(connection->buffers, connection->readBuffer, kDCConnectionReadBufferSize);
+    connection->readBuffer = NULL;
+}
+
 DCConnectionRef DCConnectionCreate(DCChannelRef channel) {
-    struct __DCConnection *connection = (struct __DCConnection *) calloc(1, sizeof(struct __DCConnection));
+    DCWorkerRef worker = DCWorkerGetCurrent();
+    DCSlabRef slab = worker ? DCWorkerGetConnectionSlab(worker) : NULL;
+    struct __DCConnection *connection = (struct __DCConnection *) (slab ? DCSlabAlloc(slab) : calloc(1, sizeof(struct __DCConnection)));
     TRACE(connection);
+    connection->slab = slab;
+    connection->buffers = DCBufferPoolGetCurrent();
     connection->fd = -1;
-    connection->recvUnprocessedMessages = CFArrayCreateMutable(kCFAllocatorDefault, 10, &kCFTypeArrayCallBacks);
-    connection->recvProcessedMessages = CFArrayCreateMutable(kCFAllocatorDefault, 10, &kCFTypeArrayCallBacks);
-    connection->sentMessages = CFArrayCreateMutable(kCFAllocatorDefault, 10, &kCFTypeArrayCallBacks);
-    connection->outgoingMessages = CFArrayCreateMutable(kCFAllocatorDefault, 10, &kCFTypeArrayCallBacks);
-
-    connection->readStream = NULL;
-    connection->writeStream = NULL;
+    connection->state = kDCConnectionStateNone;
+    connection->parserType = kDCHTTPParserTypeResponse;
+    connection->splicePipe[0] = connection->splicePipe[1] = -1;
+    connection->highWatermark = kDCConnectionRelayHighWatermark;
+    connection->lowWatermark = kDCConnectionRelayLowWatermark;
+    connection->timeouts = worker ? DCWorkerGetConnectionTimeouts(worker) : &kDCConnectionDefaultTimeouts;
+    DCTimerWheelEntryInit(&(connection->timeoutEntry), __DCConnectionTimedOut, connection);
     return connection;
 }
 
 void DCConnectionRelease(DCConnectionRef connection) {
     TRACE(connection);
-    if (connection->recvUnprocessedMessages) CFRelease(connection->recvUnprocessedMessages);
-    if (connection->recvProcessedMessages) CFRelease(connection->recvProcessedMessages);
-    if (connection->sentMessages) CFRelease(connection->sentMessages);
-    if (connection->outgoingMessages) CFRelease(connection->outgoingMessages);
-    free(connection);
+    // The loop still sends from our segments, see `__DCConnectionSent`
+    if (connection->sendInFlight) {
+        connection->releasePending = true;
+        return;
+    }
+    if (connection->resolver) DCResolverCancel(connection->resolver, connection);
+    if (connection->race) __DCConnectionCancelRace(connection, false);
+    DCTimerWheelCancel(&(connection->timeoutEntry));
+    DCMessageQueueClear(&(connection->incoming));
+    while (connection->outgoingHead) {
+        __DCOutgoingSegment *segment = connection->outgoingHead;
+        connection->outgoingHead = segment->next;
+        __DCConnectionFreeSegment(connection, segment);
+    }
+    __DCConnectionResetReadMessage(connection);
+    connection->readBufferLength = 0;
+    __DCConnectionReturnReadBuffer(connection);
+    if (connection->slab)
+        DCSlabFree(connection->slab, connection);
+    else
+        free(connection);
 }
 
+_Static_assert(sizeof(struct __DCConnection) <= kDCConnectionIdleSizeTarget, "an idle connection outgrew its budget");
+
+size_t DCConnectionGetInstanceSize(void) {
+    return sizeof(struct __DCConnection);
+}
+
+static void __DCConnectionNotify(DCConnectionRef connection, DCConnectionCallbackEvents type);
+
 void DCConnectionClose(DCConnectionRef connection) {
     TRACE(connection);
+    DCTimerWheelCancel(&(connection->timeoutEntry));
+    connection->timeout = kDCConnectionTimeoutNone;
+
+    bool wasResolving = connection->state == kDCConnectionStateResolvingHost || connection->race;
+    if (connection->state == kDCConnectionStateResolvingHost) {
+        DCResolverCancel(connection->resolver, connection);
+        connection->resolver = NULL;
+    }
+    if (connection->race)
+        __DCConnectionCancelRace(connection, false);
+    if (wasResolving)
+        connection->state = kDCConnectionStateClosed;
+
+    if (connection->fd == -1) {
+        if (wasResolving)
+            __DCConnectionNotify(connection, kDCConnectionCallbackTypeClosed);
+        return;
+    }
+
+    // Unregister from the loop before closing, the fd number may be reused right away
+    if (connection->loop) DCEventLoopRemoveFD(connection->loop, connection->fd);
+    close(connection->fd);
+    connection->fd = -1;
+    connection->writable = false;
+    connection->receiving = false;
+    connection->state = kDCConnectionStateClosed;
+
+    if (connection->splicePipe[0] != -1) {
+        close(connection->splicePipe[0]);
+        close(connection->splicePipe[1]);
+        connection->splicePipe[0] = connection->splicePipe[1] = -1;
+        connection->splicePipeBytes = 0;
+    }
+    connection->readBufferLength = 0;
+    __DCConnectionReturnReadBuffer(connection);
+
+    __DCConnectionNotify(connection, kDCConnectionCallbackTypeClosed);
+}
+
+// MARK: - Timeouts
+
+static inline bool __DCHasOutgoingMessages(DCConnectionRef connection);
+
+static __DCConnectionTimeout __DCConnectionCurrentTimeout(DCConnectionRef connection) {
+    if (connection->state == kDCConnectionStateResolvingHost || connection->state == kDCConnectionStateConnecting)
+        return kDCConnectionTimeoutConnect;
+    if (connection->state != kDCConnectionStateAvailable || connection->fd == -1)
+        return kDCConnectionTimeoutNone;
+
+    // The peer isn't taking what we write
+    if (__DCHasOutgoingMessages(connection))
+        return kDCConnectionTimeoutBodyIdle;
+    // We're the ones waiting, for whoever we relay to or our callback
+    if (connection->readPauses)
+        return kDCConnectionTimeoutNone;
+    if (connection->readMessage.state == kHTTPReadMessageStateBody)
+        return kDCConnectionTimeoutBodyIdle;
+    if (connection->readBufferLength > 0)
+        return kDCConnectionTimeoutHeader;
+    // Idle upstreams are up to the pool
+    if (connection->type == kDCConnectionTypeServer)
+        return connection->nbrPendingRequests > 0 ? kDCConnectionTimeoutHeader : kDCConnectionTimeoutNone;
+    if (!connection->hasReceived)
+        return kDCConnectionTimeoutHeader;
+    return connection->awaitingResponses ? kDCConnectionTimeoutNone : kDCConnectionTimeoutKeepAlive;
+}
+
+static unsigned int __DCConnectionTimeoutMs(DCConnectionRef connection, __DCConnectionTimeout timeout) {
+    switch (timeout) {
+        case kDCConnectionTimeoutConnect: return connection->timeouts->connectMs;
+        case kDCConnectionTimeoutHeader: return connection->timeouts->headerMs;
+        case kDCConnectionTimeoutBodyIdle: return connection->timeouts->bodyIdleMs;
+        case kDCConnectionTimeoutKeepAlive: return connection->timeouts->keepAliveMs;
+        default: return 0;
+    }
+}
+
+static char* __DCConnectionTimeoutString(__DCConnectionTimeout timeout) {
+    switch (timeout) {
+        case kDCConnectionTimeoutConnect: return "connect";
+        case kDCConnectionTimeoutHeader: return "header";
+        case kDCConnectionTimeoutBodyIdle: return "body idle";
+        case kDCConnectionTimeoutKeepAlive: return "keep-alive";
+        default: return "none";
+    }
+}
+
+// Arms whichever timeout applies to what we wait for now. Called whenever
+// that may have changed, and with `progressed` when bytes moved, which
+// pushes back the idle timeouts but not a connect or a header.
+static void __DCConnectionUpdateTimeout(DCConnectionRef connection, bool progressed) {
+    __DCConnectionTimeout timeout = __DCConnectionCurrentTimeout(connection);
+    if (timeout == connection->timeout &&
+        (!progressed || timeout == kDCConnectionTimeoutConnect || timeout == kDCConnectionTimeoutHeader))
+        return;
+    connection->timeout = timeout;
+
+    unsigned int timeoutMs = __DCConnectionTimeoutMs(connection, timeout);
+    DCEventLoopRef loop = connection->loop ? connection->loop : DCEventLoopGetCurrent();
+    if (timeoutMs == 0 || !loop) {
+        DCTimerWheelCancel(&(connection->timeoutEntry));
+        return;
+    }
+
+    unsigned long long deadline = DCEventLoopGetTime(loop) + timeoutMs;
+    // Reads within the same millisecond, the loop's time hasn't moved
+    if (DCTimerWheelEntryIsScheduled(&(connection->timeoutEntry)) && connection->timeoutEntry.deadline == deadline)
+        return;
+    DCTimerWheelSchedule(DCEventLoopGetTimerWheel(loop), &(connection->timeoutEntry), deadline);
+}
+
+static void __DCConnectionTimedOut(DCTimerWheelEntry *entry, void *info) {
+    DCConnectionRef connection = (DCConnectionRef) info;
+    log_debug("connection=%p, %s timeout after %u ms\n", connection, __DCConnectionTimeoutString(connection->timeout),
+              __DCConnectionTimeoutMs(connection, connection->timeout));
+    connection->timeout = kDCConnectionTimeoutNone;
+    connection->timedOut = true;
+    if (connection->state == kDCConnectionStateResolvingHost) {
+        DCResolverCancel(connection->resolver, connection);
+        connection->resolver = NULL;
+    }
+    if (connection->race)
+        __DCConnectionCancelRace(connection, true);
+    connection->state = kDCConnectionStateFailed;
+    __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+}
 
-    // Unregister clients
-    if (connection->readStream) CFReadStreamSetClient(connection->readStream, kCFStreamEventNone, NULL, NULL);
-    if (connection->writeStream) CFWriteStreamSetClient(connection->writeStream, kCFStreamEventNone, NULL, NULL);
+void DCConnectionSetTimeouts(DCConnectionRef connection, const DCConnectionTimeouts *timeouts) {
+    connection->timeouts = timeouts;
+    // Rearmed with the new value
+    connection->timeout = kDCConnectionTimeoutNone;
+    __DCConnectionUpdateTimeout(connection, false);
+}
 
-    // Close streams (and underlaying fd since kCFStreamPropertyShouldCloseNativeSocket was set to true)
-    if (connection->readStream) CFReadStreamClose(connection->readStream);
-    if (connection->writeStream) CFWriteStreamClose(connection->writeStream);
+void DCConnectionSetAwaitingResponses(DCConnectionRef connection, bool awaiting) {
+    if (connection->awaitingResponses == awaiting)
+        return;
+    connection->awaitingResponses = awaiting;
+    __DCConnectionUpdateTimeout(connection, false);
 }
 
 // MARK: - Enum to char* helpers
 
-static inline char* __CFStreamEventTypeString(CFStreamEventType type) {
-    switch (type)
+static inline char* __DCEventLoopEventsString(DCEventLoopEvents events) {
+    switch (events & (kDCEventLoopEventRead | kDCEventLoopEventWrite))
     {
-        case kCFStreamEventNone: return "kCFStreamEventNone";
-        case kCFStreamEventOpenCompleted: return "kCFStreamEventOpenCompleted";
-        case kCFStreamEventHasBytesAvailable: return "kCFStreamEventHasBytesAvailable";
-        case kCFStreamEventCanAcceptBytes: return "kCFStreamEventCanAcceptBytes";
-        case kCFStreamEventErrorOccurred: return "kCFStreamEventErrorOccurred";
-        case kCFStreamEventEndEncountered: return "kCFStreamEventEndEncountered";
+        case kDCEventLoopEventRead: return "kDCEventLoopEventRead";
+        case kDCEventLoopEventWrite: return "kDCEventLoopEventWrite";
+        case kDCEventLoopEventRead | kDCEventLoopEventWrite: return "kDCEventLoopEventRead|kDCEventLoopEventWrite";
     }
-    return "INVALID";
+    return "kDCEventLoopEventNone";
 }
 
 inline char* DCConnectionTypeString(DCConnectionType type) {
@@ -78,6 +300,8 @@ inline char* DCConnectionCallbackTypeString(DCConnectionCallbackEvents type) {
         case kDCConnectionCallbackTypeConnectionEOF: return "kDCConnectionCallbackTypeConnectionEOF";
         case kDCConnectionCallbackTypeCompleted: return "kDCConnectionCallbackTypeCompleted";
         case kDCConnectionCallbackTypeFailed: return "kDCConnectionCallbackTypeFailed";
+        case kDCConnectionCallbackTypeFlushed: return "kDCConnectionCallbackTypeFlushed";
+        case kDCConnectionCallbackTypeClosed: return "kDCConnectionCallbackTypeClosed";
     }
     return "INVALID";
 }
@@ -101,37 +325,25 @@ DCConnectionType DCConnectionGetType(DCConnectionRef connection) {
 // MARK: - GET Native handle (fd)
 
 CFSocketNativeHandle DCConnectionGetNativeHandle(DCConnectionRef connection) {
-    if (connection->fd == -1 && connection->writeStream) {
-        CFDataRef data = CFWriteStreamCopyProperty(connection->writeStream, kCFStreamPropertySocketNativeHandle);
-        CFSocketNativeHandle rawSocket;
-        CFDataGetBytes(data, CFRangeMake(0, sizeof(CFSocketNativeHandle)), (UInt8*)&rawSocket);
-        connection->fd = rawSocket;
-        CFRelease(data);
-    }
     return connection->fd;
 }
 
 // MARK: - Processing of incoming messages
 
+static void __DCConnectionPause(DCConnectionRef connection, __DCReadPause reason);
+static void __DCConnectionResume(DCConnectionRef connection, __DCReadPause reason);
+
 bool DCConnectionHasNext(DCConnectionRef connection) {
-    return CFArrayGetCount(connection->recvUnprocessedMessages) > 0;
+    return !DCMessageQueueIsEmpty(&(connection->incoming));
 }
 
-CFHTTPMessageRef DCConnectionPopNext(DCConnectionRef connection) {
-    CFHTTPMessageRef nextReceived = (CFHTTPMessageRef) CFArrayGetValueAtIndex(connection->recvUnprocessedMessages, 0);
-    CFArrayRemoveValueAtIndex(connection->recvUnprocessedMessages, 0);
-    CFArrayAppendValue(connection->recvProcessedMessages, nextReceived);
+DCHTTPMessageRef DCConnectionPopNext(DCConnectionRef connection) {
+    DCHTTPMessageRef nextReceived = DCMessageQueuePop(&(connection->incoming));
+    if ((connection->readPauses & kDCReadPauseQueue) && DCMessageQueueGetCount(&(connection->incoming)) <= kDCConnectionIncomingLowWatermark)
+        __DCConnectionResume(connection, kDCReadPauseQueue);
     return nextReceived;
 }
 
-static void __DCConnectionSendRequestReceivedNotification(DCConnectionRef connection, CFHTTPMessageRef message) {
-    TRACE(connection);
-    CFStringRef keys[1] = { CFSTR("request") };
-    CFHTTPMessageRef values[1] = { message };
-    CFDictionaryRef dict = CFDictionaryCreate(kCFAllocatorDefault, (void*) keys, (void*) values, 1, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-    CFNotificationCenterPostNotification(CFNotificationCenterGetLocalCenter(), kDCConnectionReceivedHTTPRequest, NULL, dict, false);
-}
-
 void DCConnectionSetClient(DCConnectionRef connection, DCConnectionCallbackEvents events, DCConnectionCallback clientCB, DCConnectionContext *clientContext) {
     TRACE(connection);
     connection->callbackEvents = events;
@@ -141,340 +353,1456 @@ void DCConnectionSetClient(DCConnectionRef connection, DCConnectionCallbackEvent
 
 
 
-static SInt32 __DCConnectionBodyLength(CFHTTPMessageRef message) {
-    SInt32 ret = 0;
-    CFStringRef contentLength = CFHTTPMessageCopyHeaderFieldValue(message, CFSTR("Content-Length"));
-    if (contentLength) {
-        ret = CFStringGetIntValue(contentLength);
-        CFRelease(contentLength);
-    }
-    return ret;
+static void __DCConnectionNotify(DCConnectionRef connection, DCConnectionCallbackEvents type) {
+    if ((connection->callbackEvents & type) != 0 && connection->callback != NULL)
+        connection->callback(connection, type, NULL, NULL, connection->context.info);
 }
 
-static int __DCReadConsumeBytesToMessage(DCConnectionRef connection, const UInt8 *buffer, CFIndex bytes) {
-    TRACE(connection);
-    char *EOM = "\r\n\r\n";
-
-    int nbrMessagesCompleted = 0;
-
-    if (bytes == 0) {
-        /* EOF - Don't do anything, we'll receive another callback about this */
-        return nbrMessagesCompleted;
-    }
-
-    CFIndex bytesLeft = bytes;
-
-    do {
-        // Did our last buffer end with something that was partially a `EOF`?
-        // If so - check if the rest of it comes here.
-        if (connection->readMessage.eofLeft > 0) {
-            SInt32 eofProcessed = 4 - connection->readMessage.eofLeft;
-            if (memcmp(EOM + eofProcessed, buffer, connection->readMessage.eofLeft) == 0) {
-                CFHTTPMessageAppendBytes(connection->readMessage.msg, buffer, connection->readMessage.eofLeft);
-                buffer += connection->readMessage.eofLeft;
-                bytesLeft -= connection->readMessage.eofLeft;
-                SInt32 bodyLength = __DCConnectionBodyLength(connection->readMessage.msg);
-
-                if (bodyLength > 0) {
-                    connection->readMessage.state = kHTTPReadMessageStateBody;
-                    connection->readMessage.bodyLength = bodyLength;
-                    connection->readMessage.idx = 0;
-                } else {
-                    log_trace("connection=%p message recv => %p\n", connection, connection->readMessage.msg);
-                    __DCConnectionSendRequestReceivedNotification(connection, connection->readMessage.msg);
-                    nbrMessagesCompleted++;
-                    CFArrayAppendValue(connection->recvUnprocessedMessages, connection->readMessage.msg);
-
-                    CFRelease(connection->readMessage.msg);
-                    memset(&(connection->readMessage), 0, sizeof(__HTTPReadMessage));
-                }
-            } else {
-                connection->readMessage.eofLeft = -1;
-            }
+static void __DCConnectionMessageReceived(DCConnectionRef connection, DCHTTPMessageRef message) {
+    log_trace("connection=%p message recv => %p\n", connection, message);
+    connection->hasReceived = true;
+    DCMessageQueuePush(&(connection->incoming), message);
+    if (DCMessageQueueGetCount(&(connection->incoming)) >= kDCConnectionIncomingHighWatermark)
+        __DCConnectionPause(connection, kDCReadPauseQueue);
+    __DCConnectionNotify(connection, kDCConnectionCallbackTypeIncomingMessage);
+}
+
+static void __DCConnectionMessageCompleted(DCConnectionRef connection) {
+    __DCConnectionNotify(connection, kDCConnectionCallbackTypeCompleted);
+}
+
+// Decides how the body following the header in `parser` is framed.
+// Returns false when there's no body, and fails the message (by returning
+// -1 in `*framing`) when its framing can't be trusted.
+static bool __DCConnectionBodyFraming(DCConnectionRef connection, const DCHTTPParser *parser, bool headRequest, int *framing) {
+    if (parser->type == kDCHTTPParserTypeResponse) {
+        // These never have a body, whatever their header says
+        if (headRequest || (parser->status >= 100 && parser->status < 200 && parser->status != 101) ||
+            parser->status == 204 || parser->status == 304)
+            return false;
+        if (parser->status == 101) {
+            *framing = kHTTPBodyFramingUntilClose;
+            return true;
         }
+    }
 
-        // Make sure we always have a message to work with
-        if (!connection->readMessage.msg) {
-            connection->readMessage.msg = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, connection->type == kDCConnectionTypeClient);
-            connection->readMessage.state = kHTTPReadMessageStateHeader;
-            connection->readMessage.bodyLength = -1;
-            connection->readMessage.idx = 0;
-            connection->readMessage.eofLeft = -1;
+    if (parser->hasTransferEncoding) {
+        // Transfer-Encoding wins over Content-Length. A request whose last
+        // coding isn't chunked has no reliable end, so it's refused.
+        if (parser->chunked) {
+            *framing = kHTTPBodyFramingChunked;
+            return true;
+        }
+        if (parser->type == kDCHTTPParserTypeRequest) {
+            *framing = -1;
+            return true;
         }
+        *framing = kHTTPBodyFramingUntilClose;
+        return true;
+    }
+
+    if (parser->contentLength > 0) {
+        *framing = kHTTPBodyFramingLength;
+        return true;
+    }
+    if (parser->contentLength == 0 || parser->type == kDCHTTPParserTypeRequest)
+        return false;
+
+    *framing = kHTTPBodyFramingUntilClose;
+    return true;
+}
+
+// `header` holds the complete header the parser just went through.
+// Returns false when the message can't be framed.
+static bool __DCConnectionHeaderReceived(DCConnectionRef connection, const UInt8 *header) {
+    DCHTTPParser *parser = &(connection->readBuffer->parser);
+    DCHTTPMessageRef message = DCHTTPMessageCreate(parser, (const char *) header);
+
+    // An interim response answers nothing yet, the final one follows it
+    bool interim = parser->type == kDCHTTPParserTypeResponse && parser->status >= 100 && parser->status < 200 && parser->status != 101;
+    bool headRequest = false;
+    if (parser->type == kDCHTTPParserTypeResponse && !interim && connection->nbrPendingRequests > 0) {
+        headRequest = (connection->pendingHeadRequests >> connection->pendingRequestsHead) & 1;
+        connection->pendingRequestsHead = (connection->pendingRequestsHead + 1) % kDCConnectionMaxPendingRequests;
+        connection->nbrPendingRequests--;
+    }
+
+    connection->closeDelimited = false;
+    int framing = kHTTPBodyFramingLength;
+    bool hasBody = __DCConnectionBodyFraming(connection, parser, headRequest, &framing);
+    if (framing == -1) {
+        log_debug("connection=%p, request body without a usable length\n", connection);
+        DCHTTPMessageRelease(message);
+        return false;
+    }
+
+    // A body that ends with the connection leaves nothing to reuse it for
+    if (!interim)
+        connection->keepAlive = DCHTTPParserIsKeepAlive(parser) && !(hasBody && framing == kHTTPBodyFramingUntilClose);
+    log_trace("connection=%p body expected => %d (framing %d, length %lld)\n", connection, hasBody, framing, parser->contentLength);
+
+    if (hasBody) {
+        connection->readMessage.state = kHTTPReadMessageStateBody;
+        connection->readMessage.framing = (__HTTPBodyFraming) framing;
+        connection->readMessage.bodyLength = framing == kHTTPBodyFramingLength ? (CFIndex) parser->contentLength : 0;
+        connection->readMessage.idx = 0;
+        if (framing == kHTTPBodyFramingChunked)
+            DCHTTPChunkDecoderInit(&(connection->readMessage.chunks));
+    }
+
+    // The message has its own copy of everything, start over for the next one
+    DCHTTPParserInit(parser, parser->type);
+
+    if (hasBody && !connection->streamsBody) {
+        // Buffered, the message is delivered once the body is appended to it
+        connection->readMessage.msg = message;
+        return true;
+    }
+
+    // Deliver the header right away, the body (if any) is relayed as it
+    // arrives to whatever peer the callback set with `DCConnectionSetRelayPeer`.
+    __DCConnectionMessageReceived(connection, message);
+    DCHTTPMessageRelease(message);
+
+    if (!hasBody && !interim && connection->fd != -1)
+        __DCConnectionMessageCompleted(connection);
+    return true;
+}
+
+// How many of `length` bytes belong to the body being read, -1 when they
+// can't be framed. `*complete` tells if that was the end of it.
+static CFIndex __DCConnectionFrameBody(DCConnectionRef connection, const UInt8 *buffer, CFIndex length, bool *complete) {
+    __HTTPReadMessage *readMessage = &(connection->readMessage);
+    *complete = false;
+
+    switch (readMessage->framing) {
+        case kHTTPBodyFramingLength: {
+            CFIndex bodyLeft = readMessage->bodyLength - readMessage->idx;
+            CFIndex consumed = bodyLeft > length ? length : bodyLeft;
+            readMessage->idx += consumed;
+            *complete = readMessage->idx == readMessage->bodyLength;
+            return consumed;
+        }
+        case kHTTPBodyFramingChunked: {
+            size_t consumed = 0;
+            DCHTTPParserResult result = DCHTTPChunkDecoderExecute(&(readMessage->chunks), (const char *) buffer, length, &consumed);
+            if (result == kDCHTTPParserResultError)
+                return -1;
+            readMessage->idx += consumed;
+            *complete = result == kDCHTTPParserResultComplete;
+            return (CFIndex) consumed;
+        }
+        case kHTTPBodyFramingUntilClose:
+        case kHTTPBodyFramingTunnel:
+            readMessage->idx += length;
+            return length;
+    }
+    return -1;
+}
+
+// The body is all there, deliver the message when it was buffered
+static void __DCConnectionBodyCompleted(DCConnectionRef connection) {
+    DCHTTPMessageRef message = connection->readMessage.msg;
+    connection->readMessage.msg = NULL;
+    __DCConnectionResetReadMessage(connection);
+
+    if (message) {
+        log_trace("connection=%p message recv (w body) => %p\n", connection, message);
+        __DCConnectionMessageReceived(connection, message);
+        DCHTTPMessageRelease(message);
+    } else {
+        log_trace("connection=%p body relayed\n", connection);
+    }
+    if (connection->fd != -1)
+        __DCConnectionMessageCompleted(connection);
+}
+
+static void __DCConnectionMessageFailed(DCConnectionRef connection) {
+    connection->state = kDCConnectionStateFailed;
+    __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+}
+
+static void __DCConnectionEnqueueBorrowed(DCConnectionRef connection, const UInt8 *bytes, CFIndex length);
+static void __DCConnectionKeepBorrowed(DCConnectionRef connection);
+static void __DCConnectionFlushLater(DCConnectionRef connection);
 
+static void __DCConnectionRelayBody(DCConnectionRef connection, const UInt8 *buffer, CFIndex length) {
+    DCConnectionRef peer = connection->relayPeer;
+    if (!peer || peer->fd == -1) {
+        log_trace("connection=%p, no peer, dropping %ld body bytes\n", connection, (long) length);
+        return;
+    }
+
+    // Written together with whatever else this pass queues for the peer
+    if (connection->consuming && peer->relaySource == connection)
+        __DCConnectionEnqueueBorrowed(peer, buffer, length);
+    else
+        DCConnectionAddOutgoingBytes(peer, buffer, length);
+
+    if (peer->outgoingBytes > peer->highWatermark)
+        __DCConnectionPause(connection, kDCReadPauseRelay);
+}
+
+// Parses and relays from `*buffer` until it's all consumed or reading is
+// paused. Returns false when the connection failed or was closed.
+static bool __DCConnectionConsumeBytes(DCConnectionRef connection, const UInt8 **bufferPtr, CFIndex *bytesLeftPtr) {
+    const UInt8 *buffer = *bufferPtr;
+    CFIndex bytesLeft = *bytesLeftPtr;
+
+    while (bytesLeft > 0 && !connection->readPauses) {
         if (connection->readMessage.state == kHTTPReadMessageStateHeader) {
-            char *endOfMessage = strnstr((char*) buffer, EOM, bytesLeft);
-
-            if (endOfMessage) {
-                // We will finish our header in this buffer
-
-                // How much we'll consume
-                CFIndex toConsume = ((const UInt8 *)endOfMessage) - buffer + strlen(EOM);
-
-                // Consume it
-                CFHTTPMessageAppendBytes(connection->readMessage.msg, buffer, toConsume);
-
-                SInt32 bodyLength = __DCConnectionBodyLength(connection->readMessage.msg);
-                log_trace("connection=%p body expected => %d\n", connection, bodyLength);
-
-                if (bodyLength > 0) {
-                    connection->readMessage.state = kHTTPReadMessageStateBody;
-                    connection->readMessage.bodyLength = bodyLength;
-                    connection->readMessage.idx = 0;
-                } else {
-                    log_trace("connection=%p message recv => %p\n", connection, connection->readMessage.msg);
-                    __DCConnectionSendRequestReceivedNotification(connection, connection->readMessage.msg);
-                    nbrMessagesCompleted++;
-                    CFArrayAppendValue(connection->recvUnprocessedMessages, connection->readMessage.msg);
-
-                    CFRelease(connection->readMessage.msg);
-                    memset(&(connection->readMessage), 0, sizeof(__HTTPReadMessage));
-                }
-
-                buffer = (const UInt8*) (endOfMessage + strlen(EOM));
-                bytesLeft -= toConsume;
-
-                log_trace("connection=%p, toConsume=%d, bytesLeft=%d\n", connection, toConsume, bytesLeft);
-            } else {
-                // There's no end of an HTTP-request in the rest of our buffer,
-                // thus we append the whole buffer to our message and we'll continue
-                // to search for a message end in next read.
-
-
-                // Check if the end of our buffer contains a partial `EOM`
-                if (memcmp(EOM, (buffer + bytesLeft) - 3, 3) == 0) {
-                    connection->readMessage.eofLeft = 1;
-                } else if (memcmp(EOM, (buffer + bytesLeft) - 2, 2) == 0) {
-                    connection->readMessage.eofLeft = 2;
-                } else if (memcmp(EOM, (buffer + bytesLeft) - 1, 1) == 0) {
-                    connection->readMessage.eofLeft = 3;
-                }
-
-                CFHTTPMessageAppendBytes(connection->readMessage.msg, buffer, bytesLeft);
-                log_trace("connection=%p, bytesLeft=%d\n", connection, bytesLeft);
-                bytesLeft = 0;
+            DCHTTPParser *parser = &(connection->readBuffer->parser);
+            DCHTTPParserResult result = DCHTTPParserExecute(parser, (const char *) buffer, bytesLeft);
+
+            if (result == kDCHTTPParserResultIncomplete)
+                break;
+
+            if (result == kDCHTTPParserResultError) {
+                log_debug("connection=%p, malformed message: %s\n", connection, DCHTTPParserErrorString(parser->error));
+                __DCConnectionMessageFailed(connection);
+                return false;
+            }
+
+            CFIndex headerLength = parser->idx;
+            log_trace("connection=%p, header => %ld bytes, bytesLeft=%ld\n", connection, (long) headerLength, (long) (bytesLeft - headerLength));
+            if (!__DCConnectionHeaderReceived(connection, buffer)) {
+                __DCConnectionMessageFailed(connection);
+                return false;
+            }
+            buffer += headerLength;
+            bytesLeft -= headerLength;
+        } else {
+            bool complete = false;
+            CFIndex appendToBody = __DCConnectionFrameBody(connection, buffer, bytesLeft, &complete);
+            if (appendToBody < 0) {
+                log_debug("connection=%p, malformed chunked body\n", connection);
+                __DCConnectionMessageFailed(connection);
+                return false;
             }
-        }
 
-        if (connection->readMessage.msg && connection->readMessage.state == kHTTPReadMessageStateBody) {
-            CFIndex appendToBody = connection->readMessage.bodyLength > bytesLeft ? bytesLeft : connection->readMessage.bodyLength;
-            CFHTTPMessageAppendBytes(connection->readMessage.msg, buffer, appendToBody);
-            connection->readMessage.idx += appendToBody;
+            if (connection->readMessage.msg)
+                DCHTTPMessageAppendBody(connection->readMessage.msg, buffer, appendToBody);
+            else
+                __DCConnectionRelayBody(connection, buffer, appendToBody);
 
             bytesLeft -= appendToBody;
             buffer += appendToBody;
 
-            if (connection->readMessage.idx == connection->readMessage.bodyLength) {
-                log_trace("connection=%p message recv (w body) => %p\n", connection, connection->readMessage.msg);
-                __DCConnectionSendRequestReceivedNotification(connection, connection->readMessage.msg);
-                nbrMessagesCompleted++;
-                CFArrayAppendValue(connection->recvUnprocessedMessages, connection->readMessage.msg);
-
-                CFRelease(connection->readMessage.msg);
-                memset(&(connection->readMessage), 0, sizeof(__HTTPReadMessage));
-            }
+            if (complete)
+                __DCConnectionBodyCompleted(connection);
         }
-    } while (bytesLeft > 0);
 
-    return nbrMessagesCompleted;
+        // The callbacks may have closed us
+        if (connection->fd == -1 || connection->state == kDCConnectionStateFailed)
+            return false;
+    }
+
+    *bufferPtr = buffer;
+    *bytesLeftPtr = bytesLeft;
+    return true;
 }
 
-static int __DCReadToMessage(DCConnectionRef connection) {
+static void __DCConnectionUncork(DCConnectionRef connection);
+
+// Consumes the `readBufferLength` bytes at the start of the read buffer.
+// A header that isn't complete yet, or whatever is left when reading got
+// paused, is moved back to the start of the buffer for the next round.
+//
+// What's relayed meanwhile is only queued on the peer, pointing into our
+// buffer, and goes out in one write once the pass is done. Anything the
+// peer didn't take is copied before the buffer is used again.
+static void __DCConnectionConsumeReadBuffer(DCConnectionRef connection) {
     TRACE(connection);
-    int nbrMessagesCompleted = 0;
-    do {
-        memset(connection->readBuffer, 0, sizeof(connection->readBuffer));
-        CFIndex bytesLeft = CFReadStreamRead(connection->readStream, connection->readBuffer, sizeof(connection->readBuffer));
+    const UInt8 *buffer = connection->readBuffer->bytes;
+    CFIndex bytesLeft = connection->readBufferLength;
+    connection->readBufferLength = 0;
+
+    connection->consuming = true;
+    bool open = __DCConnectionConsumeBytes(connection, &buffer, &bytesLeft);
+    connection->consuming = false;
+    if (connection->relayPeer)
+        __DCConnectionUncork(connection->relayPeer);
+    if (!open)
+        return;
 
-        if (log_get_level() <= LOG_TRACE) {
-            dump_hex("CFReadStreamRead", (void*) connection->readBuffer, (int) bytesLeft);
+    if (bytesLeft > 0) {
+        if (connection->readPauses)
+            log_trace("connection=%p, paused with %ld bytes pending\n", connection, (long) bytesLeft);
+        memmove(connection->readBuffer->bytes, buffer, bytesLeft);
+        connection->readBufferLength = bytesLeft;
+    }
+}
+
+static inline bool __DCHasOutgoingMessages(DCConnectionRef connection);
+
+// MARK: - Kernel pass-through
+
+typedef enum __DCSpliceResult {
+    kDCSpliceResultDone = 0,        // Body fully moved to the peer
+    kDCSpliceResultSourceDrained,   // Nothing more to read right now
+    kDCSpliceResultPeerBlocked,     // Peer can't take more, pause until it can
+    kDCSpliceResultEOF,
+    kDCSpliceResultFailed
+} __DCSpliceResult;
+
+#if defined(__linux__)
+
+static bool __DCConnectionCanSplice(DCConnectionRef connection) {
+    DCConnectionRef peer = connection->relayPeer;
+    return connection->streamsBody &&
+        connection->readMessage.state == kHTTPReadMessageStateBody &&
+        connection->readMessage.framing != kHTTPBodyFramingChunked &&
+        !connection->readMessage.msg &&
+        connection->readBufferLength == 0 &&
+        (connection->readMessage.framing != kHTTPBodyFramingLength ||
+         connection->readMessage.bodyLength - connection->readMessage.idx >= kDCConnectionSpliceThreshold) &&
+        peer && peer->fd != -1 &&
+        peer->state == kDCConnectionStateAvailable &&
+        !__DCHasOutgoingMessages(peer);
+}
+
+// Moves whatever sits in our pipe to the relay peer. Returns false when
+// the peer failed, `splicePipeBytes` tells if it had room for everything.
+static bool __DCConnectionFlushSplicePipe(DCConnectionRef connection) {
+    DCConnectionRef peer = connection->relayPeer;
+    while (connection->splicePipeBytes > 0) {
+        ssize_t moved = splice(connection->splicePipe[0], NULL, peer->fd, NULL, connection->splicePipeBytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0) {
+            if (errno == EINTR)
+                continue;
+            peer->writable = false;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            log_debug("connection=%p, splice to peer failed: %s\n", connection, strerror(errno));
+            peer->state = kDCConnectionStateFailed;
+            return false;
         }
+        connection->splicePipeBytes -= moved;
+    }
+    return true;
+}
 
-        nbrMessagesCompleted += __DCReadConsumeBytesToMessage(connection, connection->readBuffer, bytesLeft);
-    } while (CFReadStreamHasBytesAvailable(connection->readStream));
-    return nbrMessagesCompleted;
+static __DCSpliceResult __DCConnectionSpliceBody(DCConnectionRef connection) {
+    TRACE(connection);
+    DCConnectionRef peer = connection->relayPeer;
+
+    if (connection->splicePipe[0] == -1 && pipe2(connection->splicePipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        log_debug("connection=%p, couldn't create splice pipe: %s\n", connection, strerror(errno));
+        connection->splicePipe[0] = connection->splicePipe[1] = -1;
+        return kDCSpliceResultFailed;
+    }
+
+    while (connection->readMessage.state == kHTTPReadMessageStateBody) {
+        // Bodies without a length (tunnels too) just run until EOF
+        bool framedByLength = connection->readMessage.framing == kHTTPBodyFramingLength;
+        CFIndex bodyLeft = framedByLength ? connection->readMessage.bodyLength - connection->readMessage.idx : kDCConnectionSpliceChunk;
+        ssize_t moved = splice(connection->fd, NULL, connection->splicePipe[1], NULL,
+                               bodyLeft < kDCConnectionSpliceChunk ? bodyLeft : kDCConnectionSpliceChunk,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved == 0)
+            return kDCSpliceResultEOF;
+        if (moved < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return kDCSpliceResultSourceDrained;
+            log_debug("connection=%p, splice from socket failed: %s\n", connection, strerror(errno));
+            return kDCSpliceResultFailed;
+        }
+
+        connection->splicePipeBytes += moved;
+        connection->readMessage.idx += moved;
+
+        if (!__DCConnectionFlushSplicePipe(connection)) {
+            __DCConnectionNotify(peer, kDCConnectionCallbackTypeFailed);
+            return kDCSpliceResultFailed;
+        }
+
+        if (framedByLength && connection->readMessage.idx == connection->readMessage.bodyLength) {
+            log_trace("connection=%p body spliced => %ld\n", connection, (long) connection->readMessage.bodyLength);
+            __DCConnectionResetReadMessage(connection);
+
+            // Not complete until the peer has it all, see `__DCProcessOutgoingMessages`
+            if (connection->splicePipeBytes > 0)
+                connection->spliceCompletionPending = true;
+            else
+                __DCConnectionMessageCompleted(connection);
+            if (connection->fd == -1)
+                return kDCSpliceResultFailed;
+        }
+
+        if (connection->splicePipeBytes > 0)
+            return kDCSpliceResultPeerBlocked;
+    }
+
+    return kDCSpliceResultDone;
 }
 
+#endif /* __linux__ */
 
+static void __DCConnectionReadEnded(DCConnectionRef connection, bool eof, bool failed);
+static void __DCConnectionArmReceive(DCConnectionRef connection);
 
-static inline void __DCConnectionReadCallback(CFReadStreamRef stream, CFStreamEventType type, void *info) {
-    DCConnectionRef connection = (DCConnectionRef) info;
-    log_trace("connection=%p, event => %s\n", connection, __CFStreamEventTypeString(type));
+static void __DCConnectionRead(DCConnectionRef connection) {
+    TRACE(connection);
+    bool eof = false;
+    bool failed = false;
 
-    switch (type) {
-        case kCFStreamEventHasBytesAvailable:
-            {
-                int nbrMessagesCompleted = __DCReadToMessage(connection);
-                if (nbrMessagesCompleted > 0 &&
-                    (connection->callbackEvents & kDCConnectionCallbackTypeIncomingMessage) != 0 &&
-                    connection->callback != NULL) {
-                    connection->callback(connection, kDCConnectionCallbackTypeIncomingMessage, NULL, NULL, connection->context.info);
-                }
-            }
+    // Whatever was held back while paused goes first
+    if (!connection->readPauses && connection->readBufferLength > 0) {
+        __DCConnectionConsumeReadBuffer(connection);
+        if (connection->fd == -1 || connection->state == kDCConnectionStateFailed)
+            return;
+    }
+
+    if (connection->completions) {
+        __DCConnectionArmReceive(connection);
+        return;
+    }
+
+    while (!connection->readPauses) {
+#if defined(__linux__)
+        if (__DCConnectionCanSplice(connection)) {
+            __DCSpliceResult result = __DCConnectionSpliceBody(connection);
+            if (connection->fd == -1)
+                return;
+            if (result == kDCSpliceResultDone)
+                continue;
+            if (result == kDCSpliceResultPeerBlocked)
+                __DCConnectionPause(connection, kDCReadPauseRelay);
+            eof = result == kDCSpliceResultEOF;
+            failed = result == kDCSpliceResultFailed;
             break;
-        case kCFStreamEventErrorOccurred:
+        }
+#endif
+
+        CFIndex space = kDCConnectionMaxHeaderSize - connection->readBufferLength;
+        if (space == 0) {
+            log_debug("connection=%p, header larger than %ld bytes\n", connection, (long) kDCConnectionMaxHeaderSize);
+            __DCConnectionMessageFailed(connection);
+            return;
+        }
+
+        if (!__DCConnectionTakeReadBuffer(connection)) {
+            failed = true;
             break;
-        case kCFStreamEventEndEncountered:
-            if ((connection->callbackEvents & kDCConnectionCallbackTypeConnectionEOF) != 0 &&
-                connection->callback != NULL)
-                connection->callback(connection, kDCConnectionCallbackTypeConnectionEOF, NULL, NULL, connection->context.info);
+        }
+        ssize_t bytes = read(connection->fd, connection->readBuffer->bytes + connection->readBufferLength, space);
+
+        if (bytes > 0) {
+            if (log_enabled(LOG_TRACE)) {
+                dump_hex("read", (void*) (connection->readBuffer->bytes + connection->readBufferLength), (int) bytes);
+            }
+
+            connection->readBufferLength += bytes;
+            __DCConnectionConsumeReadBuffer(connection);
+
+            // The callbacks may have closed us
+            if (connection->fd == -1 || connection->state == kDCConnectionStateFailed)
+                return;
+
+            // A short read means the socket is drained; the loop is edge-triggered
+            // and will tell us when more arrives, so skip the extra EAGAIN read.
+            // Not after a hang-up though, its FIN came with the same edge.
+            if (bytes < space && !connection->hungUp)
+                break;
+        } else if (bytes == 0) {
+            eof = true;
             break;
-        case kCFStreamEventOpenCompleted:
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            failed = errno != EAGAIN && errno != EWOULDBLOCK;
             break;
+        }
+    }
+
+    __DCConnectionReadEnded(connection, eof, failed);
+}
+
+// `errno` tells why when it failed
+static void __DCConnectionReadEnded(DCConnectionRef connection, bool eof, bool failed) {
+    if (failed) {
+        log_debug("connection=%p, read failed: %s\n", connection, strerror(errno));
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+    } else if (eof) {
+        // A body running until the connection closes is complete now
+        if (connection->readMessage.state == kHTTPReadMessageStateBody &&
+            connection->readMessage.framing == kHTTPBodyFramingUntilClose) {
+            connection->closeDelimited = true;
+            __DCConnectionBodyCompleted(connection);
+            if (connection->fd == -1)
+                return;
+        }
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeConnectionEOF);
     }
 }
 
-bool __DCProcessSingleMessage(DCConnectionRef connection, CFHTTPMessageRef message) {
+// Callbacks may resume reading while we're still consuming what was read,
+// that's picked up by the loop already running.
+static void __DCConnectionReadAvailable(DCConnectionRef connection) {
+    if (connection->reading)
+        return;
+    connection->reading = true;
+    __DCConnectionRead(connection);
+    connection->reading = false;
+    __DCConnectionReturnReadBuffer(connection);
+    __DCConnectionUpdateTimeout(connection, true);
+}
+
+// MARK: - Completion based reading
+
+static void __DCConnectionReceived(DCEventLoopRef loop, int fd, const void *bytes, ssize_t result, void *info) {
+    DCConnectionRef connection = (DCConnectionRef) info;
+    log_trace("connection=%p, received => %zd\n", connection, result);
+    connection->receiving = false;
+
+    if (result <= 0) {
+        errno = (int) -result;
+        __DCConnectionReadEnded(connection, result == 0, result < 0);
+        return;
+    }
+
+    // Armed with no more than there's room for, see `__DCConnectionArmReceive`
+    if (!__DCConnectionTakeReadBuffer(connection)) {
+        errno = ENOMEM;
+        __DCConnectionReadEnded(connection, false, true);
+        return;
+    }
+    if (log_enabled(LOG_TRACE)) {
+        dump_hex("read", (void*) bytes, (int) result);
+    }
+    memcpy(connection->readBuffer->bytes + connection->readBufferLength, bytes, result);
+    connection->readBufferLength += result;
+
+    // Consumed unless reading was paused since, and the next receive armed
+    __DCConnectionReadAvailable(connection);
+}
+
+// One receive at a time, and none while paused. What arrives meanwhile
+// waits in the socket, which is what makes the peer slow down.
+static void __DCConnectionArmReceive(DCConnectionRef connection) {
+    if (connection->receiving || connection->readPauses || connection->fd == -1 ||
+        connection->state != kDCConnectionStateAvailable)
+        return;
+
+    CFIndex space = kDCConnectionMaxHeaderSize - connection->readBufferLength;
+    if (space == 0) {
+        log_debug("connection=%p, header larger than %ld bytes\n", connection, (long) kDCConnectionMaxHeaderSize);
+        __DCConnectionMessageFailed(connection);
+        return;
+    }
+
+    if (!DCEventLoopReceive(connection->loop, connection->fd, space, __DCConnectionReceived)) {
+        __DCConnectionReadEnded(connection, false, true);
+        return;
+    }
+    connection->receiving = true;
+}
+
+// MARK: - Relaying and flow control
+
+void DCConnectionSetStreamsBody(DCConnectionRef connection, bool streamsBody) {
+    connection->streamsBody = streamsBody;
+}
+
+void DCConnectionSetRelayPeer(DCConnectionRef connection, DCConnectionRef peer) {
+    log_trace("connection=%p, relay peer => %p\n", connection, peer);
+    if (connection->relayPeer == peer)
+        return;
+    // What we queued on the old peer this pass would be written at the end of it
+    if (connection->consuming && connection->relayPeer) {
+        __DCConnectionKeepBorrowed(connection->relayPeer);
+        __DCConnectionFlushLater(connection->relayPeer);
+    }
+    if (connection->relayPeer && connection->relayPeer->relaySource == connection)
+        connection->relayPeer->relaySource = NULL;
+    // Whatever we waited on to drain isn't ours anymore. Reading goes on
+    // with the next resume, or right away when we're inside a read.
+    connection->readPauses &= ~kDCReadPauseRelay;
+    connection->relayPeer = peer;
+    if (peer) peer->relaySource = connection;
+}
+
+DCConnectionRef DCConnectionGetRelayPeer(DCConnectionRef connection) {
+    return connection->relayPeer;
+}
+
+void DCConnectionStartTunnel(DCConnectionRef connection) {
     TRACE(connection);
+    __DCConnectionResetReadMessage(connection);
+    connection->readMessage.state = kHTTPReadMessageStateBody;
+    connection->readMessage.framing = kHTTPBodyFramingTunnel;
+    connection->streamsBody = true;
+    connection->keepAlive = false;
+    __DCConnectionUpdateTimeout(connection, false);
+}
+
+bool DCConnectionIsTunnel(DCConnectionRef connection) {
+    return connection->readMessage.state == kHTTPReadMessageStateBody &&
+        connection->readMessage.framing == kHTTPBodyFramingTunnel;
+}
 
-    if (!connection->writeMessage.msg) {
-        log_trace("connection=%p, no active message, settings %p to active\n", connection, message);
+static void __DCConnectionPause(DCConnectionRef connection, __DCReadPause reason) {
+    if (connection->readPauses & reason)
+        return;
+    log_trace("connection=%p, pausing reads, reasons => 0x%x\n", connection, connection->readPauses | reason);
+    connection->readPauses |= reason;
+    if (reason == kDCReadPauseRelay)
+        connection->nbrThrottles++;
+    __DCConnectionUpdateTimeout(connection, false);
+}
 
-        connection->writeMessage.msg = message;
-        connection->writeMessage.idx = 0;
-        connection->writeMessage.data = CFHTTPMessageCopySerializedMessage(message);
+static void __DCConnectionResume(DCConnectionRef connection, __DCReadPause reason) {
+    if (!(connection->readPauses & reason))
+        return;
+    connection->readPauses &= ~reason;
+    if (connection->readPauses) {
+        log_trace("connection=%p, still paused, reasons => 0x%x\n", connection, connection->readPauses);
+        __DCConnectionUpdateTimeout(connection, false);
+        return;
     }
+    log_trace("connection=%p, resuming reads\n", connection);
 
-    const UInt8 *buffer = CFDataGetBytePtr(connection->writeMessage.data);
-    CFIndex bufferLen = CFDataGetLength(connection->writeMessage.data);
-    CFIndex bufferLeft = bufferLen - connection->writeMessage.idx;
+    // No new edge will be reported for bytes that arrived while paused
+    if (connection->fd != -1 && connection->state == kDCConnectionStateAvailable)
+        __DCConnectionReadAvailable(connection);
+    // Within a read, which updates it once it's done
+    if (connection->reading)
+        return;
+    __DCConnectionUpdateTimeout(connection, false);
+}
 
-    CFIndex nbrWritten = CFWriteStreamWrite(connection->writeStream, buffer + connection->writeMessage.idx, bufferLeft);
-    connection->writeMessage.idx += nbrWritten;
+void DCConnectionPauseReading(DCConnectionRef connection) {
+    __DCConnectionPause(connection, kDCReadPauseCaller);
+}
 
-    if (connection->writeMessage.idx == bufferLen) {
-        // Message finished
-        CFArrayAppendValue(connection->sentMessages, connection->writeMessage.msg);
-        CFRelease(connection->writeMessage.msg);
-        CFRelease(connection->writeMessage.data);
-        connection->writeMessage.data = NULL;
-        memset(&(connection->writeMessage), 0, sizeof(__HTTPWriteMessage));
-        return true;
+void DCConnectionResumeReading(DCConnectionRef connection) {
+    __DCConnectionResume(connection, kDCReadPauseCaller);
+}
+
+void DCConnectionSetWatermarks(DCConnectionRef connection, CFIndex high, CFIndex low) {
+    connection->highWatermark = (UInt32) high;
+    connection->lowWatermark = (UInt32) (low < high ? low : high);
+}
+
+unsigned int DCConnectionGetThrottleCount(DCConnectionRef connection) {
+    return connection->nbrThrottles;
+}
+
+bool DCConnectionHasFailed(DCConnectionRef connection) {
+    return connection->state == kDCConnectionStateFailed;
+}
+
+bool DCConnectionHasTimedOut(DCConnectionRef connection) {
+    return connection->timedOut;
+}
+
+CFIndex DCConnectionGetOutgoingBytes(DCConnectionRef connection) {
+    return connection->outgoingBytes;
+}
+
+bool DCConnectionIsKeepAlive(DCConnectionRef connection) {
+    return connection->keepAlive;
+}
+
+bool DCConnectionIsCloseDelimited(DCConnectionRef connection) {
+    return connection->closeDelimited;
+}
+
+bool DCConnectionIsIdle(DCConnectionRef connection) {
+    return connection->fd != -1 &&
+        connection->state == kDCConnectionStateAvailable &&
+        !connection->readMessage.msg &&
+        connection->readMessage.state == kHTTPReadMessageStateHeader &&
+        connection->splicePipeBytes == 0 &&
+        connection->readBufferLength == 0 &&
+        connection->nbrPendingRequests == 0 &&
+        DCMessageQueueIsEmpty(&(connection->incoming)) &&
+        !__DCHasOutgoingMessages(connection);
+}
+
+bool DCConnectionIsRelayingBody(DCConnectionRef connection) {
+    return connection->fd != -1 &&
+        ((connection->readMessage.state == kHTTPReadMessageStateBody && !connection->readMessage.msg) ||
+         connection->splicePipeBytes > 0);
+}
+
+// MARK: - Processing of outgoing messages
+
+static inline ssize_t __DCConnectionWrite(DCConnectionRef connection, const UInt8 *buffer, size_t length) {
+#if defined(MSG_NOSIGNAL)
+    return send(connection->fd, buffer, length, MSG_NOSIGNAL);
+#else
+    return write(connection->fd, buffer, length);
+#endif
+}
+
+static inline ssize_t __DCConnectionWriteVector(DCConnectionRef connection, struct iovec *vector, int count) {
+#if defined(MSG_NOSIGNAL)
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vector;
+    msg.msg_iovlen = count;
+    return sendmsg(connection->fd, &msg, MSG_NOSIGNAL);
+#else
+    return writev(connection->fd, vector, count);
+#endif
+}
+
+// Writes as much of `buffer` as the socket takes, returns the number of bytes
+// written or -1 when the connection failed.
+static CFIndex __DCConnectionWriteBytes(DCConnectionRef connection, const UInt8 *buffer, CFIndex length) {
+    CFIndex written = 0;
+    while (written < length) {
+        ssize_t nbrWritten = __DCConnectionWrite(connection, buffer + written, length - written);
+        if (nbrWritten < 0) {
+            if (errno == EINTR)
+                continue;
+            connection->writable = false;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_debug("connection=%p, write failed: %s\n", connection, strerror(errno));
+                connection->state = kDCConnectionStateFailed;
+                return -1;
+            }
+            break;
+        }
+        written += nbrWritten;
+    }
+    return written;
+}
+
+static void __DCConnectionEnqueue(DCConnectionRef connection, __DCOutgoingSegment *segment) {
+    segment->next = NULL;
+    if (connection->outgoingTail) connection->outgoingTail->next = segment;
+    else connection->outgoingHead = segment;
+    connection->outgoingTail = segment;
+    connection->outgoingBytes += segment->length;
+}
+
+static void __DCConnectionEnqueueMessage(DCConnectionRef connection, DCHTTPMessageRef message, const UInt8 *bytes, CFIndex length, bool endsMessage) {
+    __DCOutgoingSegment *segment = __DCConnectionAllocSegment(connection, 0);
+    segment->msg = DCHTTPMessageRetain(message);
+    segment->endsMessage = endsMessage;
+    segment->borrowed = false;
+    segment->bytes = bytes;
+    segment->length = length;
+    __DCConnectionEnqueue(connection, segment);
+}
+
+// `bytes` stay valid until our relay source is done with its read buffer
+static void __DCConnectionEnqueueBorrowed(DCConnectionRef connection, const UInt8 *bytes, CFIndex length) {
+    __DCOutgoingSegment *segment = __DCConnectionAllocSegment(connection, 0);
+    segment->msg = NULL;
+    segment->endsMessage = false;
+    segment->borrowed = true;
+    segment->bytes = bytes;
+    segment->length = length;
+    __DCConnectionEnqueue(connection, segment);
+    connection->hasBorrowed = true;
+}
+
+// Copies what's left of borrowed segments into segments of our own
+static void __DCConnectionKeepBorrowed(DCConnectionRef connection) {
+    if (!connection->hasBorrowed)
+        return;
+    connection->hasBorrowed = false;
+
+    __DCOutgoingSegment *previous = NULL;
+    for (__DCOutgoingSegment *segment = connection->outgoingHead; segment; previous = segment, segment = segment->next) {
+        if (!segment->borrowed)
+            continue;
+
+        CFIndex skip = segment == connection->outgoingHead ? connection->outgoingIdx : 0;
+        CFIndex length = segment->length - skip;
+        __DCOutgoingSegment *copy = __DCConnectionAllocSegment(connection, length);
+        copy->msg = NULL;
+        copy->endsMessage = segment->endsMessage;
+        copy->borrowed = false;
+        copy->bytes = (const UInt8 *) (copy + 1);
+        copy->length = length;
+        memcpy(copy + 1, segment->bytes + skip, length);
+
+        copy->next = segment->next;
+        if (previous) previous->next = copy;
+        else {
+            connection->outgoingHead = copy;
+            connection->outgoingIdx = 0;
+        }
+        if (connection->outgoingTail == segment)
+            connection->outgoingTail = copy;
+        __DCConnectionFreeSegment(connection, segment);
+        segment = copy;
+    }
+}
+
+// Drops the `nbrWritten` bytes at the front of the queue
+static void __DCConnectionRetireSegments(DCConnectionRef connection, CFIndex nbrWritten) {
+    connection->outgoingBytes -= nbrWritten;
+    while (connection->outgoingHead) {
+        __DCOutgoingSegment *segment = connection->outgoingHead;
+        CFIndex left = segment->length - connection->outgoingIdx;
+        if (nbrWritten < left) {
+            connection->outgoingIdx += nbrWritten;
+            return;
+        }
+
+        nbrWritten -= left;
+        connection->outgoingHead = segment->next;
+        if (!connection->outgoingHead)
+            connection->outgoingTail = NULL;
+        connection->outgoingIdx = 0;
+        __DCConnectionFreeSegment(connection, segment);
+    }
+}
+
+// Fills `vector` with up to `kDCConnectionWriteBatch` segments from the head
+static int __DCConnectionGatherSegments(DCConnectionRef connection, struct iovec *vector, size_t *batchBytes) {
+    int count = 0;
+    CFIndex idx = connection->outgoingIdx;
+    *batchBytes = 0;
+    for (__DCOutgoingSegment *segment = connection->outgoingHead; segment && count < kDCConnectionWriteBatch; segment = segment->next) {
+        vector[count].iov_base = (void *) (segment->bytes + idx);
+        vector[count].iov_len = (size_t) (segment->length - idx);
+        *batchBytes += vector[count].iov_len;
+        count++;
+        idx = 0;
+    }
+    return count;
+}
+
+static bool __DCConnectionSubmitSends(DCConnectionRef connection);
+
+// Writes queued segments, up to `kDCConnectionWriteBatch` per call, until
+// the socket would block. Returns false when the connection failed.
+static bool __DCProcessSegments(DCConnectionRef connection) {
+    struct iovec vector[kDCConnectionWriteBatch];
+
+    if (connection->completions)
+        return __DCConnectionSubmitSends(connection);
+
+    while (connection->outgoingHead) {
+        size_t batchBytes;
+        int count = __DCConnectionGatherSegments(connection, vector, &batchBytes);
+
+        ssize_t nbrWritten = __DCConnectionWriteVector(connection, vector, count);
+        if (nbrWritten < 0) {
+            if (errno == EINTR)
+                continue;
+            connection->writable = false;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_debug("connection=%p, write failed: %s\n", connection, strerror(errno));
+                connection->state = kDCConnectionStateFailed;
+                return false;
+            }
+            return true;
+        }
+
+        __DCConnectionRetireSegments(connection, nbrWritten);
+
+        // The socket buffer is full, the next edge tells when there's room
+        if ((size_t) nbrWritten < batchBytes) {
+            log_trace("connection=%p, wrote %zd of %zu bytes, waiting for room\n", connection, nbrWritten, batchBytes);
+            connection->writable = false;
+            return true;
+        }
     }
+    return true;
+}
+
+void __DCProcessOutgoingMessages(DCConnectionRef connection);
+
+static void __DCConnectionSent(DCEventLoopRef loop, size_t written, int error, void *info) {
+    DCConnectionRef connection = (DCConnectionRef) info;
+    log_trace("connection=%p, sent => %zu, error => %d\n", connection, written, error);
+    connection->sendInFlight = false;
 
-    return false;
+    if (connection->releasePending) {
+        DCConnectionRelease(connection);
+        return;
+    }
+    if (connection->fd == -1)
+        return;
+
+    __DCConnectionRetireSegments(connection, (CFIndex) written);
+    if (error != 0 && error != EAGAIN) {
+        log_debug("connection=%p, send failed: %s\n", connection, strerror(error));
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
+
+    // Sends what was queued meanwhile, and what a short send left
+    __DCProcessOutgoingMessages(connection);
+}
+
+// Hands the loop up to `kDCConnectionWriteBatch` segments to send as one
+// chain. They stay queued until it calls back, so they're our own copies
+// rather than bytes borrowed from a read buffer that is about to be reused.
+static bool __DCConnectionSubmitSends(DCConnectionRef connection) {
+    if (connection->sendInFlight || !connection->outgoingHead)
+        return true;
+
+    __DCConnectionKeepBorrowed(connection);
+
+    struct iovec vector[kDCConnectionWriteBatch];
+    size_t batchBytes;
+    int count = __DCConnectionGatherSegments(connection, vector, &batchBytes);
+    if (!DCEventLoopSend(connection->loop, connection->fd, vector, count, __DCConnectionSent, connection)) {
+        log_debug("connection=%p, couldn't submit %d sends: %s\n", connection, count, strerror(errno));
+        connection->state = kDCConnectionStateFailed;
+        return false;
+    }
+    connection->sendInFlight = true;
+    return true;
 }
 
 static inline bool __DCHasOutgoingMessages(DCConnectionRef connection) {
-    return connection->writeMessage.msg || CFArrayGetCount(connection->outgoingMessages) > 0;
+    return connection->outgoingHead ||
+        (connection->relaySource && connection->relaySource->splicePipeBytes > 0);
 }
 
-void __DCProcessOutgoingMessages(DCConnectionRef connection) {
-    TRACE(connection);
-    bool didSend;
+static void __DCConnectionWriteOutgoing(DCConnectionRef connection) {
 
-    if (!CFWriteStreamCanAcceptBytes(connection->writeStream)) {
+    if (connection->state != kDCConnectionStateAvailable || !connection->writable) {
         log_trace("connection=%p, can't write without blocking\n", connection);
         return;
     }
 
-    if (connection->writeMessage.msg) {
-        didSend = __DCProcessSingleMessage(connection, connection->writeMessage.msg);
-
-        if (!didSend) {
-            log_trace("connection=%p, first active wasn't fully processed, won't continue process more\n" ,connection);
+#if defined(__linux__)
+    // Spliced bytes were read before anything still queued, so they go first
+    DCConnectionRef source = connection->relaySource;
+    if (source && source->splicePipeBytes > 0) {
+        if (!__DCConnectionFlushSplicePipe(source)) {
+            __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+            return;
+        }
+        if (source->splicePipeBytes > 0)
             return;
+        if (source->spliceCompletionPending) {
+            source->spliceCompletionPending = false;
+            __DCConnectionMessageCompleted(source);
+            if (connection->fd == -1)
+                return;
         }
     }
+#endif
 
-    CFIndex nbrOutgoing = CFArrayGetCount(connection->outgoingMessages);
+    if (!__DCProcessSegments(connection)) {
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
 
-    if (!nbrOutgoing) {
-        log_trace("connection=%p, no messages to process\n");
+    if (connection->closeWhenFlushed && !__DCHasOutgoingMessages(connection)) {
+        DCConnectionClose(connection);
         return;
     }
 
-    if (nbrOutgoing == 0 || !CFWriteStreamCanAcceptBytes(connection->writeStream))
+    if (connection->shutdownWhenFlushed && !__DCHasOutgoingMessages(connection)) {
+        connection->shutdownWhenFlushed = false;
+        shutdown(connection->fd, SHUT_WR);
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFlushed);
         return;
+    }
 
-    do {
-        CFHTTPMessageRef message = (CFHTTPMessageRef) CFArrayGetValueAtIndex(connection->outgoingMessages, 0);
-        CFArrayRemoveValueAtIndex(connection->outgoingMessages, 0);
-        didSend = __DCProcessSingleMessage(connection, message);
-    } while (CFArrayGetCount(connection->outgoingMessages) > 0 && didSend && CFWriteStreamCanAcceptBytes(connection->writeStream));
+    // We've drained enough, let whoever is relaying to us continue
+    if (connection->relaySource && connection->outgoingBytes < connection->lowWatermark)
+        __DCConnectionResume(connection->relaySource, kDCReadPauseRelay);
 }
 
-void DCConnectionAddOutgoing(DCConnectionRef connection, CFHTTPMessageRef outgoingMessage) {
+// Writing counts as progress for the idle timeouts even when the socket
+// took nothing, whoever feeds us stops at the watermark soon enough.
+void __DCProcessOutgoingMessages(DCConnectionRef connection) {
     TRACE(connection);
-    CFArrayAppendValue(connection->outgoingMessages, outgoingMessage);
+    __DCConnectionWriteOutgoing(connection);
+    __DCConnectionUpdateTimeout(connection, true);
+}
+
+// Writes what was queued while our relay source went through its buffer
+static void __DCConnectionUncork(DCConnectionRef connection) {
     __DCProcessOutgoingMessages(connection);
+    __DCConnectionKeepBorrowed(connection);
+}
+
+static void __DCConnectionDeferredFlush(DCEventLoopRef loop, void *info) {
+    DCConnectionRef connection = (DCConnectionRef) info;
+    connection->flushScheduled = false;
+    if (connection->fd != -1)
+        __DCProcessOutgoingMessages(connection);
+}
+
+// For output queued while corked that nobody will write otherwise. It may
+// not be written from where we are, since writing can fail and call back.
+static void __DCConnectionFlushLater(DCConnectionRef connection) {
+    if (connection->flushScheduled || !connection->loop || connection->fd == -1 || !__DCHasOutgoingMessages(connection))
+        return;
+    connection->flushScheduled = true;
+    DCEventLoopDefer(connection->loop, __DCConnectionDeferredFlush, connection);
+}
+
+void DCConnectionShutdownWhenFlushed(DCConnectionRef connection) {
+    TRACE(connection);
+    connection->shutdownWhenFlushed = true;
+    if (!__DCHasOutgoingMessages(connection) || connection->fd == -1 || connection->state == kDCConnectionStateFailed) {
+        connection->shutdownWhenFlushed = false;
+        if (connection->fd != -1)
+            shutdown(connection->fd, SHUT_WR);
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFlushed);
+    }
+}
+
+void DCConnectionCloseWhenFlushed(DCConnectionRef connection) {
+    TRACE(connection);
+    __DCConnectionPause(connection, kDCReadPauseClosing);
+    if (!__DCHasOutgoingMessages(connection) || connection->fd == -1 || connection->state == kDCConnectionStateFailed)
+        DCConnectionClose(connection);
+    else
+        connection->closeWhenFlushed = true;
+}
+
+// Remembers whether `request` was a HEAD until its response arrives. The
+// channel never has more than that in flight, so running out means the
+// responses can't be framed and the connection fails.
+static bool __DCConnectionPushPendingRequest(DCConnectionRef connection, DCHTTPMessageRef request) {
+    if (connection->nbrPendingRequests == kDCConnectionMaxPendingRequests) {
+        log_error("connection=%p, more than %d requests in flight\n", connection, kDCConnectionMaxPendingRequests);
+        __DCConnectionMessageFailed(connection);
+        return false;
+    }
+
+    UInt32 bit = 1u << ((connection->pendingRequestsHead + connection->nbrPendingRequests) % kDCConnectionMaxPendingRequests);
+    if (DCHTTPSliceEqualsCaseInsensitive(DCHTTPMessageGetMethod(request), "HEAD"))
+        connection->pendingHeadRequests |= bit;
+    else
+        connection->pendingHeadRequests &= ~bit;
+    connection->nbrPendingRequests++;
+    return true;
+}
+
+void DCConnectionAddOutgoing(DCConnectionRef connection, DCHTTPMessageRef outgoingMessage) {
+    TRACE(connection);
+    size_t bodyLength = DCHTTPMessageGetBodyLength(outgoingMessage);
+    if (DCHTTPMessageIsRequest(outgoingMessage) && !__DCConnectionPushPendingRequest(connection, outgoingMessage))
+        return;
+    __DCConnectionEnqueueMessage(connection, outgoingMessage,
+                                 DCHTTPMessageGetHeaderBytes(outgoingMessage),
+                                 DCHTTPMessageGetHeaderLength(outgoingMessage),
+                                 bodyLength == 0);
+    if (bodyLength > 0)
+        __DCConnectionEnqueueMessage(connection, outgoingMessage, DCHTTPMessageGetBody(outgoingMessage), bodyLength, true);
+
+    // Goes out with the body bytes behind it when those are being read right now
+    if (!connection->relaySource || !connection->relaySource->consuming)
+        __DCProcessOutgoingMessages(connection);
+
+    // Headers and buffered bodies count against the budget like relayed bytes
+    if (connection->relaySource && connection->outgoingBytes > connection->highWatermark)
+        __DCConnectionPause(connection->relaySource, kDCReadPauseRelay);
+}
+
+void DCConnectionAddOutgoingBytes(DCConnectionRef connection, const UInt8 *bytes, CFIndex length) {
+    TRACE(connection);
+
+    // Nothing queued ahead of us, so write straight out of the caller's
+    // buffer and only copy whatever the socket didn't take.
+    bool direct = !connection->completions;
+    if (direct && !__DCHasOutgoingMessages(connection) && connection->state == kDCConnectionStateAvailable && connection->writable) {
+        CFIndex nbrWritten = __DCConnectionWriteBytes(connection, bytes, length);
+        if (nbrWritten < 0) {
+            __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+            return;
+        }
+        bytes += nbrWritten;
+        length -= nbrWritten;
+    }
+
+    if (length > 0) {
+        __DCOutgoingSegment *segment = __DCConnectionAllocSegment(connection, length);
+        segment->msg = NULL;
+        segment->endsMessage = false;
+        segment->borrowed = false;
+        segment->bytes = (const UInt8 *) (segment + 1);
+        segment->length = length;
+        memcpy(segment + 1, bytes, length);
+        __DCConnectionEnqueue(connection, segment);
+        if (!direct)
+            __DCProcessOutgoingMessages(connection);
+    }
+    if (direct)
+        __DCConnectionUpdateTimeout(connection, true);
 }
 
 void DCConnectionSetTalksTo(DCConnectionRef connection, DCConnectionType type) {
     log_trace("connection=%p, type => %s\n", connection, DCConnectionTypeString(type));
     connection->type = type;
+
+    // We parse what the other side sends: requests from clients, responses from servers
+    connection->parserType = type == kDCConnectionTypeClient ? kDCHTTPParserTypeRequest : kDCHTTPParserTypeResponse;
+    if (connection->readBuffer)
+        DCHTTPParserInit(&(connection->readBuffer->parser), connection->parserType);
 }
 
-static void __DCConnectionWriteCallback(CFWriteStreamRef stream, CFStreamEventType type, void *info) {
+static void __DCConnectionFinishConnect(DCConnectionRef connection) {
+    TRACE(connection);
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+
+    if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0)
+        error = errno;
+
+    if (error != 0) {
+        log_debug("connection=%p, connect failed: %s\n", connection, strerror(error));
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
+
+    connection->state = kDCConnectionStateAvailable;
+    // From here on the loop calls back with what it read and wrote
+    if (connection->completions) {
+        DCEventLoopSetEvents(connection->loop, connection->fd, kDCEventLoopEventNone);
+        connection->writable = true;
+    }
+    __DCConnectionNotify(connection, kDCConnectionCallbackTypeAvailable);
+    if (connection->completions && connection->fd != -1)
+        __DCConnectionReadAvailable(connection);
+    __DCConnectionUpdateTimeout(connection, false);
+}
+
+static void __DCConnectionEventCallback(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
     DCConnectionRef connection = (DCConnectionRef) info;
-    log_trace("connection=%p, event => %s\n", connection, __CFStreamEventTypeString(type));
+    log_trace("connection=%p, event => %s\n", connection, __DCEventLoopEventsString(events));
 
-    switch (type) {
-        case kCFStreamEventCanAcceptBytes:
-            {
-                if (__DCHasOutgoingMessages(connection))
-                    __DCProcessOutgoingMessages(connection);
-            }
-            break;
-        case kCFStreamEventErrorOccurred:
-            break;
-        case kCFStreamEventEndEncountered:
-            break;
-        case kCFStreamEventOpenCompleted:
-            break;
+    if (events & kDCEventLoopEventWrite) {
+        if (connection->state == kDCConnectionStateConnecting)
+            __DCConnectionFinishConnect(connection);
+
+        connection->writable = true;
+        if (connection->fd != -1 && __DCHasOutgoingMessages(connection))
+            __DCProcessOutgoingMessages(connection);
     }
+
+    if (connection->fd == -1 || connection->state == kDCConnectionStateFailed)
+        return;
+
+    if (events & kDCEventLoopEventHangUp)
+        connection->hungUp = true;
+    if (events & (kDCEventLoopEventRead | kDCEventLoopEventHangUp | kDCEventLoopEventError))
+        __DCConnectionReadAvailable(connection);
+}
+
+static void __DCConnectionConfigureSocket(CFSocketNativeHandle fd) {
+    int on = 1;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#if defined(SO_NOSIGPIPE)
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
 }
 
-void __DCFinishSetup(DCConnectionRef connection) {
+static void __DCFinishSetup(DCConnectionRef connection) {
     TRACE(connection);
+    connection->loop = DCEventLoopGetCurrent();
+    connection->completions = connection->loop && DCEventLoopHasCompletions(connection->loop);
+
+    // With completions only a connect is waited for, as writability
+    DCEventLoopEvents events = kDCEventLoopEventRead | kDCEventLoopEventWrite;
+    if (connection->completions)
+        events = connection->state == kDCConnectionStateConnecting ? kDCEventLoopEventWrite : kDCEventLoopEventNone;
+
+    if (!connection->loop || !DCEventLoopAddFDWithEvents(connection->loop, connection->fd, events, __DCConnectionEventCallback, connection)) {
+        log_error("connection=%p, couldn't schedule fd=%d\n", connection, connection->fd);
+        connection->loop = NULL;
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
+
+    if (connection->completions && connection->state == kDCConnectionStateAvailable) {
+        connection->writable = true;
+        __DCConnectionReadAvailable(connection);
+    }
+}
+
+// MARK: - Connecting
+
+/*
+ * An upstream with several addresses is raced for (RFC 8305): they're tried
+ * one after the other, each `kDCConnectionAttemptDelayMs` after the one
+ * before, or right away once every attempt so far has failed, and the first
+ * to connect wins. The others are closed. The attempts alternate between
+ * IPv6 and IPv4, starting with IPv6, and within that the addresses that
+ * failed lately go last, see `DCAddressStats`. One that's black-holed
+ * costs a delay instead of the whole connect timeout, and once it's known
+ * not even that. An address counts as failed when its connect did, when
+ * an address tried after it connected first, or when it was still trying
+ * at the timeout.
+ */
+typedef struct __DCConnectionAttempt {
+    struct __DCConnectionRace *race;
+    CFSocketNativeHandle fd;
+} __DCConnectionAttempt;
+
+typedef struct __DCConnectionRace {
+    DCConnectionRef connection;
+    DCEventLoopRef loop;
+    DCAddressStatsRef stats;
+    DCTimerWheelEntry delayEntry;
+    // In the order they're tried, with their attempts at the same index
+    struct sockaddr_storage addresses[kDCResolverMaxAddresses];
+    __DCConnectionAttempt attempts[kDCResolverMaxAddresses];
+    unsigned int nbrAddresses;
+    unsigned int nbrStarted;
+    unsigned int nbrPending;
+} __DCConnectionRace;
+
+static socklen_t __DCConnectionSetAddressPort(DCConnectionRef connection, struct sockaddr_storage *address) {
+    if (address->ss_family == AF_INET) {
+        ((struct sockaddr_in *) address)->sin_port = htons(connection->port);
+        return sizeof(struct sockaddr_in);
+    }
+    ((struct sockaddr_in6 *) address)->sin6_port = htons(connection->port);
+    return sizeof(struct sockaddr_in6);
+}
 
-    if (connection->readStream) {
-        CFReadStreamSetProperty(connection->readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+// A non-blocking connect under way, -1 with errno when it failed already
+static CFSocketNativeHandle __DCConnectionStartConnect(const struct sockaddr_storage *address, socklen_t addressLength) {
+    CFSocketNativeHandle fd = socket(address->ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+
+    __DCConnectionConfigureSocket(fd);
+    if (connect(fd, (const struct sockaddr *) address, addressLength) == 0 || errno == EINPROGRESS)
+        return fd;
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+}
+
+static void __DCConnectionRaceStopAttempt(__DCConnectionRace *race, __DCConnectionAttempt *attempt) {
+    DCEventLoopRemoveFD(race->loop, attempt->fd);
+    close(attempt->fd);
+    attempt->fd = -1;
+    race->nbrPending--;
+}
+
+static void __DCConnectionRaceFree(DCConnectionRef connection) {
+    __DCConnectionRace *race = connection->race;
+    DCTimerWheelCancel(&(race->delayEntry));
+    connection->race = NULL;
+    DCBufferPoolFree(connection->buffers, race, sizeof(__DCConnectionRace));
+}
+
+static void __DCConnectionCancelRace(DCConnectionRef connection, bool timedOut) {
+    __DCConnectionRace *race = connection->race;
+    for (unsigned int i = 0; i < race->nbrStarted; i++) {
+        if (race->attempts[i].fd == -1)
+            continue;
+        if (timedOut && race->stats)
+            DCAddressStatsRecordFailure(race->stats, &(race->addresses[i]), DCEventLoopGetTime(race->loop));
+        __DCConnectionRaceStopAttempt(race, &(race->attempts[i]));
     }
+    __DCConnectionRaceFree(connection);
+}
 
-    if (connection->writeStream) {
-        CFWriteStreamSetProperty(connection->writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+static void __DCConnectionRaceLost(__DCConnectionRace *race) {
+    DCConnectionRef connection = race->connection;
+    log_debug("connection=%p, couldn't connect to port %u on any of %u addresses\n", connection, (unsigned int) connection->port, race->nbrAddresses);
+    __DCConnectionRaceFree(connection);
+    connection->state = kDCConnectionStateFailed;
+    __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+}
+
+static void __DCConnectionRaceWon(__DCConnectionRace *race, unsigned int winner) {
+    DCConnectionRef connection = race->connection;
+    unsigned long long now = DCEventLoopGetTime(race->loop);
+    if (race->stats)
+        DCAddressStatsRecordSuccess(race->stats, &(race->addresses[winner]));
+
+    // Those tried before the winner were slower than it, those after it
+    // just didn't get the chance
+    for (unsigned int i = 0; i < race->nbrStarted; i++) {
+        if (i == winner || race->attempts[i].fd == -1)
+            continue;
+        if (i < winner && race->stats)
+            DCAddressStatsRecordFailure(race->stats, &(race->addresses[i]), now);
+        __DCConnectionRaceStopAttempt(race, &(race->attempts[i]));
     }
 
-    connection->streamContext.version = 0;
-    connection->streamContext.info = (void *)(connection);
-    connection->streamContext.retain = nil;
-    connection->streamContext.release = nil;
-    connection->streamContext.copyDescription = nil;
+    // Handed over to the connection, as if it had been the only address
+    CFSocketNativeHandle fd = race->attempts[winner].fd;
+    DCEventLoopRemoveFD(race->loop, fd);
+    log_debug("connection=%p, connected to address %u of %u\n", connection, winner + 1, race->nbrAddresses);
+    __DCConnectionRaceFree(connection);
+    connection->fd = fd;
+    __DCFinishSetup(connection);
+    if (connection->state == kDCConnectionStateConnecting)
+        __DCConnectionFinishConnect(connection);
+}
+
+static void __DCConnectionRaceAttemptReady(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info);
+
+// Starts attempts until one is under way, and arms the delay for the next
+static void __DCConnectionRaceStartNext(__DCConnectionRace *race) {
+    DCTimerWheelCancel(&(race->delayEntry));
+    while (race->nbrStarted < race->nbrAddresses) {
+        unsigned int i = race->nbrStarted++;
+        __DCConnectionAttempt *attempt = &(race->attempts[i]);
+        socklen_t addressLength = __DCConnectionSetAddressPort(race->connection, &(race->addresses[i]));
+        attempt->race = race;
+        attempt->fd = __DCConnectionStartConnect(&(race->addresses[i]), addressLength);
+        if (attempt->fd != -1 && !DCEventLoopAddFDWithEvents(race->loop, attempt->fd, kDCEventLoopEventWrite, __DCConnectionRaceAttemptReady, attempt)) {
+            close(attempt->fd);
+            attempt->fd = -1;
+        }
+        if (attempt->fd == -1) {
+            log_debug("connection=%p, connect to address %u of %u failed: %s\n", race->connection, i + 1, race->nbrAddresses, strerror(errno));
+            if (race->stats)
+                DCAddressStatsRecordFailure(race->stats, &(race->addresses[i]), DCEventLoopGetTime(race->loop));
+            continue;
+        }
 
-    CFWriteStreamSetClient(connection->writeStream,
-                           kCFStreamEventOpenCompleted     |
-                           kCFStreamEventErrorOccurred     |
-                           kCFStreamEventEndEncountered    |
-                           kCFStreamEventCanAcceptBytes,
-                           &__DCConnectionWriteCallback,
-                           &connection->streamContext);
+        race->nbrPending++;
+        if (race->nbrStarted < race->nbrAddresses)
+            DCTimerWheelSchedule(DCEventLoopGetTimerWheel(race->loop), &(race->delayEntry), DCEventLoopGetTime(race->loop) + kDCConnectionAttemptDelayMs);
+        return;
+    }
 
-    CFWriteStreamScheduleWithRunLoop(connection->writeStream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
-    CFWriteStreamOpen(connection->writeStream);
+    if (race->nbrPending == 0)
+        __DCConnectionRaceLost(race);
+}
 
-    CFReadStreamSetClient(connection->readStream,
-                          kCFStreamEventOpenCompleted      |
-                          kCFStreamEventErrorOccurred      |
-                          kCFStreamEventEndEncountered     |
-                          kCFStreamEventHasBytesAvailable,
-                          &__DCConnectionReadCallback,
-                          &connection->streamContext);
+static void __DCConnectionRaceDelayed(DCTimerWheelEntry *entry, void *info) {
+    __DCConnectionRaceStartNext((__DCConnectionRace *) info);
+}
 
-    CFReadStreamScheduleWithRunLoop(connection->readStream, CFRunLoopGetCurrent(), kCFRunLoopDefaultMode);
-    CFReadStreamOpen(connection->readStream);
+static void __DCConnectionRaceAttemptReady(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    __DCConnectionAttempt *attempt = (__DCConnectionAttempt *) info;
+    __DCConnectionRace *race = attempt->race;
+    unsigned int i = (unsigned int) (attempt - race->attempts);
+
+    int error = 0;
+    socklen_t errorLength = sizeof(error);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) != 0)
+        error = errno;
+    if (error == 0 && (events & kDCEventLoopEventWrite)) {
+        __DCConnectionRaceWon(race, i);
+        return;
+    }
+
+    log_debug("connection=%p, connect to address %u of %u failed: %s\n", race->connection, i + 1, race->nbrAddresses, strerror(error ? error : ECONNREFUSED));
+    if (race->stats)
+        DCAddressStatsRecordFailure(race->stats, &(race->addresses[i]), DCEventLoopGetTime(loop));
+    __DCConnectionRaceStopAttempt(race, attempt);
+    // Nothing is under way anymore, so the next doesn't wait for the delay
+    if (race->nbrPending == 0)
+        __DCConnectionRaceStartNext(race);
 }
 
-void DCConnectionSetupWithHost(DCConnectionRef connection, CFHostRef host, UInt32 port) {
+static void __DCConnectionStartRace(DCConnectionRef connection, const struct sockaddr_storage *addresses, unsigned int nbrAddresses) {
+    __DCConnectionRace *race = (__DCConnectionRace *) DCBufferPoolAlloc(connection->buffers, sizeof(__DCConnectionRace), NULL);
+    if (!race) {
+        log_error("connection=%p, couldn't allocate a connect race\n", connection);
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
+    memset(race, 0, sizeof(__DCConnectionRace));
+    DCWorkerRef worker = DCWorkerGetCurrent();
+    race->connection = connection;
+    race->loop = DCEventLoopGetCurrent();
+    race->stats = worker ? DCWorkerGetAddressStats(worker) : NULL;
+    DCTimerWheelEntryInit(&(race->delayEntry), __DCConnectionRaceDelayed, race);
+
+    // IPv6 and IPv4 take turns, starting with IPv6
+    const struct sockaddr_storage *byFamily[2][kDCResolverMaxAddresses];
+    unsigned int nbrByFamily[2] = { 0, 0 }, nbrTaken[2] = { 0, 0 };
+    for (unsigned int i = 0; i < nbrAddresses; i++) {
+        int family = addresses[i].ss_family == AF_INET6 ? 0 : 1;
+        byFamily[family][nbrByFamily[family]++] = &addresses[i];
+    }
+    for (unsigned int i = 0; i < nbrAddresses; i++) {
+        int family = nbrTaken[0] < nbrByFamily[0] && (i % 2 == 0 || nbrTaken[1] == nbrByFamily[1]) ? 0 : 1;
+        race->addresses[i] = *byFamily[family][nbrTaken[family]++];
+        // The stats know addresses with their port
+        __DCConnectionSetAddressPort(connection, &(race->addresses[i]));
+    }
+    race->nbrAddresses = nbrAddresses;
+    if (race->stats)
+        DCAddressStatsSort(race->stats, race->addresses, nbrAddresses, DCEventLoopGetTime(race->loop));
+
+    connection->race = race;
+    connection->state = kDCConnectionStateConnecting;
+    __DCConnectionRaceStartNext(race);
+}
+
+static void __DCConnectionHostResolved(DCResolverRef resolver, DCResolverStatus status, const struct sockaddr_storage *addresses, unsigned int nbrAddresses, void *info) {
+    DCConnectionRef connection = (DCConnectionRef) info;
     TRACE(connection);
-    CFStreamCreatePairWithSocketToCFHost(kCFAllocatorDefault, host, port, &connection->readStream, &connection->writeStream);
+
+    // Closed while we were waiting for the answer
+    if (connection->state != kDCConnectionStateResolvingHost)
+        return;
+    connection->resolver = NULL;
+
+    if (status != kDCResolverStatusResolved || nbrAddresses == 0) {
+        log_debug("connection=%p, couldn't resolve host: %s\n", connection, DCResolverStatusString(status));
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
+
+    if (nbrAddresses > 1) {
+        __DCConnectionStartRace(connection, addresses, nbrAddresses);
+        return;
+    }
+
+    struct sockaddr_storage address = addresses[0];
+    socklen_t addressLength = __DCConnectionSetAddressPort(connection, &address);
+    connection->fd = __DCConnectionStartConnect(&address, addressLength);
+    if (connection->fd == -1) {
+        log_debug("connection=%p, couldn't connect to port %u: %s\n", connection, (unsigned int) connection->port, strerror(errno));
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
+
+    // Completion is reported as writability, see `__DCConnectionFinishConnect`
+    connection->state = kDCConnectionStateConnecting;
     __DCFinishSetup(connection);
 }
 
+void DCConnectionSetupWithHost(DCConnectionRef connection, const char *hostname, UInt32 port) {
+    TRACE(connection);
+    DCWorkerRef worker = DCWorkerGetCurrent();
+    DCResolverRef resolver = worker ? DCWorkerGetResolver(worker) : NULL;
+
+    if (!resolver) {
+        log_error("connection=%p, no resolver on this thread\n", connection);
+        connection->state = kDCConnectionStateFailed;
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeFailed);
+        return;
+    }
+
+    connection->port = port;
+    connection->resolver = resolver;
+    connection->state = kDCConnectionStateResolvingHost;
+    __DCConnectionUpdateTimeout(connection, false);
+    DCResolverResolve(resolver, hostname, __DCConnectionHostResolved, connection);
+
+    // Cached names are connected to by now, anything else waits for the nameserver
+    if (connection->state == kDCConnectionStateResolvingHost)
+        __DCConnectionNotify(connection, kDCConnectionCallbackTypeResolvingHost);
+}
+
 void DCConnectionSetupWithFD(DCConnectionRef connection, CFSocketNativeHandle fd) {
     TRACE(connection);
     connection->fd = fd;
-    CFStreamCreatePairWithSocket(kCFAllocatorDefault, fd, &connection->readStream, &connection->writeStream);
+    connection->state = kDCConnectionStateAvailable;
+    __DCConnectionConfigureSocket(fd);
     __DCFinishSetup(connection);
+    __DCConnectionUpdateTimeout(connection, false);
 }
-
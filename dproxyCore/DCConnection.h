@@ -2,11 +2,11 @@
 #define DCConnection_h
 
 #include "DCChannel.h"
+#include "DCHTTPMessage.h"
 
 #include <stdio.h>
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <CFNetwork/CFNetwork.h>
+#include "DCTypes.h"
 
 typedef struct __DCConnection*         DCConnectionRef;
 
@@ -14,8 +14,6 @@ typedef struct {
     void *info;
 } DCConnectionContext;
 
-extern CFStringRef const kDCConnectionReceivedHTTPRequest;
-
 typedef enum DCConnectionCallbackEvents {
     kDCConnectionCallbackTypeNone = 0,
     kDCConnectionCallbackTypeAvailable = 1,
@@ -23,7 +21,9 @@ typedef enum DCConnectionCallbackEvents {
     kDCConnectionCallbackTypeResolvingHost = 4,
     kDCConnectionCallbackTypeConnectionEOF = 8,
     kDCConnectionCallbackTypeCompleted = 16,
-    kDCConnectionCallbackTypeFailed = 32
+    kDCConnectionCallbackTypeFailed = 32,
+    kDCConnectionCallbackTypeFlushed = 64,
+    kDCConnectionCallbackTypeClosed = 128
 } DCConnectionCallbackEvents;
 
 typedef enum DCConnectionType {
@@ -31,14 +31,38 @@ typedef enum DCConnectionType {
     kDCConnectionTypeClient = 1
 } DCConnectionType;
 
+// Milliseconds a connection waits for its peer before it fails, 0 for as
+// long as it takes. Only the one matching what it waits for is armed.
+typedef struct DCConnectionTimeouts {
+    unsigned int connectMs;   // Resolving the upstream's name and connecting to it
+    unsigned int headerMs;    // A whole header from its first byte, a client's first one
+                              // from when it connected, a response's from when its
+                              // request was queued. Not extended as it trickles in.
+    unsigned int bodyIdleMs;  // Between reads of a body or tunnel, and between writes
+                              // the peer is slow to take
+    unsigned int keepAliveMs; // A client between requests, with no response owed to it
+} DCConnectionTimeouts;
+
+extern const DCConnectionTimeouts kDCConnectionDefaultTimeouts;
+
 typedef void (*DCConnectionCallback)(DCConnectionRef connection, DCConnectionCallbackEvents type, CFDataRef address, const void *data, void *info);
 
 DCConnectionRef DCConnectionCreate(DCChannelRef channel);
 void DCConnectionRelease(DCConnectionRef connection);
+// Notifies `kDCConnectionCallbackTypeClosed` when it was still open, whoever
+// closed it. Its memory stays until it's released.
 void DCConnectionClose(DCConnectionRef connection);
+// Stops reading and closes once everything queued has been written
+void DCConnectionCloseWhenFlushed(DCConnectionRef connection);
+// Sends a FIN once everything queued has been written, then notifies
+// `kDCConnectionCallbackTypeFlushed`. Reading carries on.
+void DCConnectionShutdownWhenFlushed(DCConnectionRef connection);
+
+// What the worker's connection slab hands out
+size_t DCConnectionGetInstanceSize(void);
 
 void DCConnectionSetupWithFD(DCConnectionRef connection, CFSocketNativeHandle fd);
-void DCConnectionSetupWithHost(DCConnectionRef connection, CFHostRef host, UInt32 port);
+void DCConnectionSetupWithHost(DCConnectionRef connection, const char *hostname, UInt32 port);
 
 void DCConnectionSetTalksTo(DCConnectionRef connection, DCConnectionType type);
 DCConnectionType DCConnectionGetType(DCConnectionRef connection);
@@ -50,10 +74,63 @@ DCChannelRef DCConnectionGetChannel(DCConnectionRef connection);
 
 CFSocketNativeHandle DCConnectionGetNativeHandle(DCConnectionRef connection);
 
-void DCConnectionAddOutgoing(DCConnectionRef connection, CFHTTPMessageRef outgoingMessage);
-
+void DCConnectionAddOutgoing(DCConnectionRef connection, DCHTTPMessageRef outgoingMessage);
+void DCConnectionAddOutgoingBytes(DCConnectionRef connection, const UInt8 *bytes, CFIndex length);
+CFIndex DCConnectionGetOutgoingBytes(DCConnectionRef connection);
+
+/*
+ * In streaming mode a message is delivered as soon as its header is parsed
+ * and its body is forwarded to the relay peer as it's read, pausing reads
+ * while the peer has too much pending output. Otherwise the message is
+ * delivered with its whole body buffered.
+ */
+void DCConnectionSetStreamsBody(DCConnectionRef connection, bool streamsBody);
+void DCConnectionSetRelayPeer(DCConnectionRef connection, DCConnectionRef peer);
+
+// Stops parsing: from now on everything read, including what's already
+// buffered, goes to the relay peer as it is until EOF.
+void DCConnectionStartTunnel(DCConnectionRef connection);
+bool DCConnectionIsTunnel(DCConnectionRef connection);
+DCConnectionRef DCConnectionGetRelayPeer(DCConnectionRef connection);
+
+// Not copied, `timeouts` has to outlive the connection. Those created on a
+// worker use the worker's, see `DCWorkerSetConnectionTimeouts`.
+void DCConnectionSetTimeouts(DCConnectionRef connection, const DCConnectionTimeouts *timeouts);
+// A client still owed responses isn't idle, whatever is answering it has
+// its own timeouts. Its keep-alive timeout starts once it's false again.
+void DCConnectionSetAwaitingResponses(DCConnectionRef connection, bool awaiting);
+
+// Whether the last message received allows the connection to be reused
+bool DCConnectionIsKeepAlive(DCConnectionRef connection);
+// The last response had no length and ended with the connection, whoever
+// it was relayed to can only tell where it ends by being closed as well.
+bool DCConnectionIsCloseDelimited(DCConnectionRef connection);
+bool DCConnectionHasFailed(DCConnectionRef connection);
+// It failed because one of its timeouts ran out, see `DCConnectionSetTimeouts`
+bool DCConnectionHasTimedOut(DCConnectionRef connection);
+
+// Open, with nothing half read or waiting to be written
+bool DCConnectionIsIdle(DCConnectionRef connection);
+// Reading a body that goes on to the relay peer, or still moving its bytes
+bool DCConnectionIsRelayingBody(DCConnectionRef connection);
+
+// Takes effect at once, also from within a callback: whatever was read
+// but not yet consumed is held back until reading is resumed. Relaying and
+// a full message queue pause on their own as well, resuming only lifts the
+// caller's pause.
+void DCConnectionPauseReading(DCConnectionRef connection);
+void DCConnectionResumeReading(DCConnectionRef connection);
+
+// Once more than `high` bytes wait to be written, whoever relays to this
+// connection stops reading until it's down to `low`.
+void DCConnectionSetWatermarks(DCConnectionRef connection, CFIndex high, CFIndex low);
+// Times this connection stopped reading for a relay peer over its watermark
+unsigned int DCConnectionGetThrottleCount(DCConnectionRef connection);
+
+// Received messages, oldest first. Only a few are held, reading stops while
+// the queue is full, so pop them as they come. The caller owns what's popped.
 bool DCConnectionHasNext(DCConnectionRef connection);
-CFHTTPMessageRef DCConnectionPopNext(DCConnectionRef connection);
+DCHTTPMessageRef DCConnectionPopNext(DCConnectionRef connection);
 
 char* DCConnectionCallbackTypeString(DCConnectionCallbackEvents type);
 char* DCConnectionTypeString(DCConnectionType type);
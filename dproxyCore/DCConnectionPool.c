@@ -0,0 +1,277 @@
+#include "DCConnectionPool.h"
+#include "DCSlab.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE(p) log_trace("pool=%p\n", p)
+
+#define kDCConnectionPoolBuckets 256
+#define kDCConnectionPoolKeyLength 320
+
+#define kDCConnectionPoolDefaultMaxIdle 1024
+#define kDCConnectionPoolDefaultMaxIdlePerHost 32
+#define kDCConnectionPoolDefaultIdleTimeoutMs 30000
+
+#define kDCConnectionPoolObjectsPerBlock 64
+
+typedef struct __DCConnectionPoolHost __DCConnectionPoolHost;
+
+typedef struct __DCConnectionPoolEntry {
+    DCConnectionRef connection;
+    __DCConnectionPoolHost *host;
+    DCConnectionPoolRef pool;
+    unsigned long long idleSince;
+
+    // Every idle connection, oldest first
+    struct __DCConnectionPoolEntry *prev;
+    struct __DCConnectionPoolEntry *next;
+
+    // Idle connections for the same key, newest first
+    struct __DCConnectionPoolEntry *hostPrev;
+    struct __DCConnectionPoolEntry *hostNext;
+} __DCConnectionPoolEntry;
+
+struct __DCConnectionPoolHost {
+    char key[kDCConnectionPoolKeyLength];
+    uint32_t hash;
+    unsigned int nbrIdle;
+    __DCConnectionPoolEntry *newest;
+    __DCConnectionPoolEntry *oldest;
+    __DCConnectionPoolHost *nextInBucket;
+};
+
+struct __DCConnectionPool {
+    DCEventLoopRef loop;
+    unsigned int maxIdle;
+    unsigned int maxIdlePerHost;
+    unsigned int idleTimeoutMs;
+
+    unsigned int nbrIdle;
+    __DCConnectionPoolEntry *oldest;
+    __DCConnectionPoolEntry *newest;
+    __DCConnectionPoolHost *buckets[kDCConnectionPoolBuckets];
+
+    // Entries come and go with every checkin, hosts with their last entry
+    DCSlabRef entrySlab;
+    DCSlabRef hostSlab;
+
+    unsigned long long hits;
+    unsigned long long misses;
+};
+
+// MARK: - Lifecycle
+
+static void __DCConnectionPoolTimer(DCEventLoopRef loop, void *info) {
+    DCConnectionPoolPurgeExpired((DCConnectionPoolRef) info);
+}
+
+DCConnectionPoolRef DCConnectionPoolCreate(DCEventLoopRef loop) {
+    struct __DCConnectionPool *pool = (struct __DCConnectionPool *) calloc(1, sizeof(struct __DCConnectionPool));
+    TRACE(pool);
+    pool->loop = loop;
+    pool->maxIdle = kDCConnectionPoolDefaultMaxIdle;
+    pool->maxIdlePerHost = kDCConnectionPoolDefaultMaxIdlePerHost;
+    pool->idleTimeoutMs = kDCConnectionPoolDefaultIdleTimeoutMs;
+    pool->entrySlab = DCSlabCreate("pool entry", sizeof(__DCConnectionPoolEntry), kDCConnectionPoolObjectsPerBlock);
+    pool->hostSlab = DCSlabCreate("pool host", sizeof(__DCConnectionPoolHost), kDCConnectionPoolObjectsPerBlock);
+    DCEventLoopAddTimer(loop, 1000, __DCConnectionPoolTimer, pool);
+    return pool;
+}
+
+static void __DCConnectionPoolReleaseConnection(DCEventLoopRef loop, void *info) {
+    DCConnectionRelease((DCConnectionRef) info);
+}
+
+static void __DCConnectionPoolRemove(DCConnectionPoolRef pool, __DCConnectionPoolEntry *entry);
+
+void DCConnectionPoolRelease(DCConnectionPoolRef pool) {
+    TRACE(pool);
+    while (pool->oldest) {
+        DCConnectionRef connection = pool->oldest->connection;
+        __DCConnectionPoolRemove(pool, pool->oldest);
+        DCConnectionClose(connection);
+        DCConnectionRelease(connection);
+    }
+    DCSlabRelease(pool->entrySlab);
+    DCSlabRelease(pool->hostSlab);
+    free(pool);
+}
+
+void DCConnectionPoolSetLimits(DCConnectionPoolRef pool, unsigned int maxIdle, unsigned int maxIdlePerHost, unsigned int idleTimeoutMs) {
+    pool->maxIdle = maxIdle;
+    pool->maxIdlePerHost = maxIdlePerHost;
+    pool->idleTimeoutMs = idleTimeoutMs;
+}
+
+unsigned int DCConnectionPoolGetIdleCount(DCConnectionPoolRef pool) {
+    return pool->nbrIdle;
+}
+
+// MARK: - Keys
+
+static uint32_t __DCConnectionPoolHash(const char *key) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *key; key++) {
+        hash ^= (unsigned char) *key;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static bool __DCConnectionPoolMakeKey(char *key, const char *scheme, const char *host, UInt32 port) {
+    int length = snprintf(key, kDCConnectionPoolKeyLength, "%s://%s:%u", scheme, host, (unsigned int) port);
+    return length > 0 && length < kDCConnectionPoolKeyLength;
+}
+
+static __DCConnectionPoolHost* __DCConnectionPoolFindHost(DCConnectionPoolRef pool, const char *key, uint32_t hash) {
+    __DCConnectionPoolHost *host = pool->buckets[hash % kDCConnectionPoolBuckets];
+    for (; host; host = host->nextInBucket) {
+        if (host->hash == hash && strcmp(host->key, key) == 0)
+            return host;
+    }
+    return NULL;
+}
+
+static void __DCConnectionPoolFreeHost(DCConnectionPoolRef pool, __DCConnectionPoolHost *host) {
+    __DCConnectionPoolHost **link = &pool->buckets[host->hash % kDCConnectionPoolBuckets];
+    while (*link != host)
+        link = &(*link)->nextInBucket;
+    *link = host->nextInBucket;
+    DCSlabFree(pool->hostSlab, host);
+}
+
+// MARK: - Entries
+
+static void __DCConnectionPoolRemove(DCConnectionPoolRef pool, __DCConnectionPoolEntry *entry) {
+    if (entry->prev) entry->prev->next = entry->next; else pool->oldest = entry->next;
+    if (entry->next) entry->next->prev = entry->prev; else pool->newest = entry->prev;
+
+    __DCConnectionPoolHost *host = entry->host;
+    if (entry->hostPrev) entry->hostPrev->hostNext = entry->hostNext; else host->newest = entry->hostNext;
+    if (entry->hostNext) entry->hostNext->hostPrev = entry->hostPrev; else host->oldest = entry->hostPrev;
+
+    pool->nbrIdle--;
+    if (--host->nbrIdle == 0)
+        __DCConnectionPoolFreeHost(pool, host);
+
+    DCConnectionSetClient(entry->connection, kDCConnectionCallbackTypeNone, NULL, &(DCConnectionContext){ NULL });
+    DCSlabFree(pool->entrySlab, entry);
+}
+
+// Closes an idle connection. It's released after the current batch, since
+// this may run from inside one of its own callbacks.
+static void __DCConnectionPoolDiscard(DCConnectionPoolRef pool, __DCConnectionPoolEntry *entry) {
+    DCConnectionRef connection = entry->connection;
+    log_trace("pool=%p, discarding connection=%p (%s)\n", pool, connection, entry->host->key);
+    __DCConnectionPoolRemove(pool, entry);
+    DCConnectionClose(connection);
+    DCEventLoopDefer(pool->loop, __DCConnectionPoolReleaseConnection, connection);
+}
+
+static void __DCConnectionPoolCallback(DCConnectionRef connection, DCConnectionCallbackEvents type, CFDataRef address, const void *data, void *info) {
+    __DCConnectionPoolEntry *entry = (__DCConnectionPoolEntry *) info;
+    log_trace("pool=%p, idle connection=%p, event => %s\n", entry->pool, connection, DCConnectionCallbackTypeString(type));
+
+    // The upstream closed, failed or sent something we never asked for
+    __DCConnectionPoolDiscard(entry->pool, entry);
+}
+
+// MARK: - Checkout/Checkin
+
+DCConnectionRef DCConnectionPoolCheckout(DCConnectionPoolRef pool, const char *scheme, const char *host, UInt32 port) {
+    char key[kDCConnectionPoolKeyLength];
+    if (!__DCConnectionPoolMakeKey(key, scheme, host, port))
+        return NULL;
+
+    __DCConnectionPoolHost *poolHost = __DCConnectionPoolFindHost(pool, key, __DCConnectionPoolHash(key));
+    if (!poolHost) {
+        pool->misses++;
+        return NULL;
+    }
+
+    // Most recently used first, it's the least likely to have been closed by the upstream
+    __DCConnectionPoolEntry *entry = poolHost->newest;
+    DCConnectionRef connection = entry->connection;
+    __DCConnectionPoolRemove(pool, entry);
+    pool->hits++;
+
+    log_trace("pool=%p, checkout connection=%p (%s)\n", pool, connection, key);
+    return connection;
+}
+
+bool DCConnectionPoolCheckin(DCConnectionPoolRef pool, DCConnectionRef connection, const char *scheme, const char *host, UInt32 port) {
+    char key[kDCConnectionPoolKeyLength];
+    if (pool->maxIdle == 0 || pool->maxIdlePerHost == 0 ||
+        !DCConnectionIsIdle(connection) ||
+        !__DCConnectionPoolMakeKey(key, scheme, host, port))
+        return false;
+
+    uint32_t hash = __DCConnectionPoolHash(key);
+    __DCConnectionPoolHost *poolHost = __DCConnectionPoolFindHost(pool, key, hash);
+
+    if (poolHost && poolHost->nbrIdle >= pool->maxIdlePerHost) {
+        __DCConnectionPoolDiscard(pool, poolHost->oldest);
+        // Discarding the last one frees the host
+        poolHost = __DCConnectionPoolFindHost(pool, key, hash);
+    }
+
+    if (pool->nbrIdle >= pool->maxIdle) {
+        __DCConnectionPoolDiscard(pool, pool->oldest);
+        poolHost = __DCConnectionPoolFindHost(pool, key, hash);
+    }
+
+    if (!poolHost) {
+        poolHost = (__DCConnectionPoolHost *) DCSlabAlloc(pool->hostSlab);
+        strcpy(poolHost->key, key);
+        poolHost->hash = hash;
+        poolHost->nextInBucket = pool->buckets[hash % kDCConnectionPoolBuckets];
+        pool->buckets[hash % kDCConnectionPoolBuckets] = poolHost;
+    }
+
+    __DCConnectionPoolEntry *entry = (__DCConnectionPoolEntry *) DCSlabAlloc(pool->entrySlab);
+    entry->connection = connection;
+    entry->host = poolHost;
+    entry->pool = pool;
+    entry->idleSince = DCEventLoopGetTime(pool->loop);
+
+    entry->prev = pool->newest;
+    if (pool->newest) pool->newest->next = entry; else pool->oldest = entry;
+    pool->newest = entry;
+
+    entry->hostNext = poolHost->newest;
+    if (poolHost->newest) poolHost->newest->hostPrev = entry; else poolHost->oldest = entry;
+    poolHost->newest = entry;
+
+    poolHost->nbrIdle++;
+    pool->nbrIdle++;
+
+    DCConnectionSetChannel(connection, NULL);
+    DCConnectionSetRelayPeer(connection, NULL);
+    DCConnectionContext context;
+    context.info = entry;
+    DCConnectionSetClient(connection,
+                          kDCConnectionCallbackTypeIncomingMessage |
+                          kDCConnectionCallbackTypeConnectionEOF |
+                          kDCConnectionCallbackTypeFailed,
+                          __DCConnectionPoolCallback,
+                          &context);
+
+    log_trace("pool=%p, checkin connection=%p (%s), idle => %u\n", pool, connection, key, pool->nbrIdle);
+
+    // Keep reading while idle so an upstream close is noticed right away
+    DCConnectionResumeReading(connection);
+    return true;
+}
+
+void DCConnectionPoolPurgeExpired(DCConnectionPoolRef pool) {
+    unsigned long long now = DCEventLoopGetTime(pool->loop);
+    while (pool->oldest && now - pool->oldest->idleSince >= pool->idleTimeoutMs)
+        __DCConnectionPoolDiscard(pool, pool->oldest);
+
+    if (pool->hits + pool->misses > 0)
+        log_trace("pool=%p, idle => %u, hits => %llu, misses => %llu\n", pool, pool->nbrIdle, pool->hits, pool->misses);
+}
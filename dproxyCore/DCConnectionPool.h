@@ -0,0 +1,34 @@
+#ifndef DCConnectionPool_h
+#define DCConnectionPool_h
+
+#include "DCConnection.h"
+#include "DCEventLoop.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+
+typedef struct __DCConnectionPool*         DCConnectionPoolRef;
+
+/*
+ * Idle upstream connections kept warm for reuse, keyed by scheme, host and
+ * port. A pool belongs to one event loop (one worker) and isn't thread safe.
+ *
+ * `maxIdle` caps the whole pool, `maxIdlePerHost` each key; when either is
+ * reached the longest idle connection is closed to make room. Connections
+ * idle for longer than `idleTimeoutMs` are closed by a timer on the loop.
+ */
+DCConnectionPoolRef DCConnectionPoolCreate(DCEventLoopRef loop);
+void DCConnectionPoolRelease(DCConnectionPoolRef pool);
+
+void DCConnectionPoolSetLimits(DCConnectionPoolRef pool, unsigned int maxIdle, unsigned int maxIdlePerHost, unsigned int idleTimeoutMs);
+
+// Returns NULL when there's no idle connection for the key
+DCConnectionRef DCConnectionPoolCheckout(DCConnectionPoolRef pool, const char *scheme, const char *host, UInt32 port);
+// Returns false when the connection wasn't taken, it's then up to the caller to close it
+bool DCConnectionPoolCheckin(DCConnectionPoolRef pool, DCConnectionRef connection, const char *scheme, const char *host, UInt32 port);
+
+void DCConnectionPoolPurgeExpired(DCConnectionPoolRef pool);
+
+unsigned int DCConnectionPoolGetIdleCount(DCConnectionPoolRef pool);
+
+#endif /* DCConnectionPool_h */
@@ -0,0 +1,117 @@
+#ifndef DCEventLoop_Private_h
+#define DCEventLoop_Private_h
+
+#include "DCEventLoop.h"
+#include "DCSlab.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+// Multishot accept and buffer rings came with the same kernel, 5.19
+#if defined(IORING_ACCEPT_MULTISHOT)
+#define DC_HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+#define kDCEventLoopMaxTimers 8
+#define kDCEventLoopMaxEvents 256
+#define kDCEventLoopHandlersPerBlock 256
+
+typedef struct __DCEventLoopHandler {
+    int fd;
+    DCEventLoopEvents events;
+    DCEventLoopCallback callback;
+    DCEventLoopAcceptCallback acceptCallback; // Listeners only
+    bool acceptPaused;
+    DCEventLoopReceiveCallback receiveCallback; // While a receive is pending
+    void *info;
+    // Requests the backend still has in flight for us, the handler can't
+    // be freed before they're done even once it's removed.
+    unsigned int pendingRequests;
+    // The backend's own record of what it has in flight
+    unsigned int armed;
+    struct __DCEventLoopSend *sends;
+    struct __DCEventLoopHandler *nextRemoved;
+} __DCEventLoopHandler;
+
+typedef struct __DCEventLoopTimer {
+    unsigned int intervalMs;
+    uint64_t fireAt;
+    DCEventLoopTimerCallback callback;
+    void *info;
+} __DCEventLoopTimer;
+
+typedef struct __DCEventLoopDeferred {
+    DCEventLoopTimerCallback callback;
+    void *info;
+} __DCEventLoopDeferred;
+
+typedef struct __DCEventLoopBackendOps {
+    bool (*create)(DCEventLoopRef loop);
+    void (*release)(DCEventLoopRef loop);
+    bool (*add)(DCEventLoopRef loop, __DCEventLoopHandler *handler);
+    void (*remove)(DCEventLoopRef loop, __DCEventLoopHandler *handler);
+    // `handler->events` changed
+    bool (*update)(DCEventLoopRef loop, __DCEventLoopHandler *handler);
+    // Calls `__DCEventLoopUpdateTime` once the kernel is done waiting, before
+    // anything is dispatched, so deadlines armed by handlers start from then
+    int (*poll)(DCEventLoopRef loop, int timeoutMs);
+
+    // Optional, NULL when the backend only reports readiness. Listeners are
+    // then drained with accept(2) when they're readable, and paused by not
+    // watching them. Accepting again while it still is does nothing.
+    bool (*accept)(DCEventLoopRef loop, __DCEventLoopHandler *handler);
+    void (*pauseAccept)(DCEventLoopRef loop, __DCEventLoopHandler *handler);
+    bool (*receive)(DCEventLoopRef loop, __DCEventLoopHandler *handler, size_t maxLength);
+    bool (*send)(DCEventLoopRef loop, int fd, const struct iovec *vector, int count, DCEventLoopSendCallback callback, void *info);
+} __DCEventLoopBackendOps;
+
+struct __DCEventLoop {
+    DCEventLoopBackend backend;
+    const __DCEventLoopBackendOps *ops;
+    int backendFD;
+    void *backendData;
+
+    // Indexed by fd, so add/remove never has to search
+    __DCEventLoopHandler **handlers;
+    int handlersCapacity;
+
+    // Handlers removed while dispatching, freed once the batch is done
+    __DCEventLoopHandler *removedHandlers;
+    DCSlabRef handlerSlab;
+
+    __DCEventLoopTimer timers[kDCEventLoopMaxTimers];
+    int nbrTimers;
+    uint64_t now;
+    DCTimerWheelRef wheel;
+
+    __DCEventLoopDeferred *deferred;
+    int nbrDeferred;
+    int deferredCapacity;
+
+    int wakeupFDs[2];
+    atomic_bool stopped;
+};
+
+void __DCEventLoopUpdateTime(DCEventLoopRef loop);
+void __DCEventLoopDispatch(DCEventLoopRef loop, __DCEventLoopHandler *handler, DCEventLoopEvents events);
+void __DCEventLoopDispatchAccept(DCEventLoopRef loop, __DCEventLoopHandler *handler, int fd);
+void __DCEventLoopDispatchReceive(DCEventLoopRef loop, __DCEventLoopHandler *handler, const void *bytes, ssize_t result);
+
+#if defined(__linux__)
+extern const __DCEventLoopBackendOps __DCEventLoopEpollOps;
+#endif
+
+#if defined(DC_HAVE_IO_URING)
+extern const __DCEventLoopBackendOps __DCEventLoopIOUringOps;
+#endif
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+extern const __DCEventLoopBackendOps __DCEventLoopKqueueOps;
+#endif
+
+#endif /* DCEventLoop_Private_h */
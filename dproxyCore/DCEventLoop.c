@@ -0,0 +1,489 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "DCEventLoop-Private.h"
+#include "log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE(p) log_trace("loop=%p\n", p)
+
+static __thread DCEventLoopRef __DCCurrentEventLoop = NULL;
+
+// MARK: - Helpers
+
+static uint64_t __DCEventLoopNowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static const __DCEventLoopBackendOps* __DCEventLoopOpsForBackend(DCEventLoopBackend backend) {
+    switch (backend) {
+#if defined(DC_HAVE_IO_URING)
+        case kDCEventLoopBackendIOUring:
+            return &__DCEventLoopIOUringOps;
+#endif
+#if defined(__linux__)
+        case kDCEventLoopBackendDefault:
+        case kDCEventLoopBackendEpoll:
+            return &__DCEventLoopEpollOps;
+#endif
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        case kDCEventLoopBackendDefault:
+        case kDCEventLoopBackendKqueue:
+            return &__DCEventLoopKqueueOps;
+#endif
+        default:
+            return NULL;
+    }
+}
+
+inline char* DCEventLoopBackendString(DCEventLoopBackend backend) {
+    switch (backend) {
+        case kDCEventLoopBackendDefault: return "kDCEventLoopBackendDefault";
+        case kDCEventLoopBackendEpoll: return "kDCEventLoopBackendEpoll";
+        case kDCEventLoopBackendKqueue: return "kDCEventLoopBackendKqueue";
+        case kDCEventLoopBackendIOUring: return "kDCEventLoopBackendIOUring";
+    }
+    return "INVALID";
+}
+
+static void __DCEventLoopWakeupCallback(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    char buffer[64];
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+}
+
+// MARK: - Lifecycle
+
+DCEventLoopRef DCEventLoopCreate(DCEventLoopBackend backend) {
+    const __DCEventLoopBackendOps *ops = __DCEventLoopOpsForBackend(backend);
+#if defined(__linux__)
+    // Built without it, io_uring is the same as asking for epoll
+    if (!ops && backend == kDCEventLoopBackendIOUring) {
+        log_warn("io_uring isn't part of this build, using epoll\n");
+        return DCEventLoopCreate(kDCEventLoopBackendEpoll);
+    }
+#endif
+    if (!ops) {
+        log_error("event loop backend %s isn't available on this platform\n", DCEventLoopBackendString(backend));
+        return NULL;
+    }
+
+    if (backend == kDCEventLoopBackendDefault) {
+#if defined(__linux__)
+        backend = kDCEventLoopBackendEpoll;
+#else
+        backend = kDCEventLoopBackendKqueue;
+#endif
+    }
+
+    struct __DCEventLoop *loop = (struct __DCEventLoop *) calloc(1, sizeof(struct __DCEventLoop));
+    TRACE(loop);
+    loop->backend = backend;
+    loop->ops = ops;
+    loop->backendFD = -1;
+    loop->wakeupFDs[0] = loop->wakeupFDs[1] = -1;
+    loop->now = __DCEventLoopNowMs();
+    atomic_init(&loop->stopped, false);
+
+    if (!loop->ops->create(loop)) {
+#if defined(__linux__)
+        if (backend == kDCEventLoopBackendIOUring) {
+            log_warn("loop=%p, kernel can't do io_uring as needed (%s), using epoll\n", loop, strerror(errno));
+            free(loop);
+            return DCEventLoopCreate(kDCEventLoopBackendEpoll);
+        }
+#endif
+        log_error("loop=%p, couldn't create %s backend: %s\n", loop, DCEventLoopBackendString(backend), strerror(errno));
+        free(loop);
+        return NULL;
+    }
+
+    loop->handlerSlab = DCSlabCreate("handler", sizeof(__DCEventLoopHandler), kDCEventLoopHandlersPerBlock);
+    loop->wheel = DCTimerWheelCreate(loop->now);
+
+    // Used by `DCEventLoopStop` to interrupt a blocking poll from another thread
+    if (pipe(loop->wakeupFDs) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(loop->wakeupFDs[i], F_SETFL, fcntl(loop->wakeupFDs[i], F_GETFL) | O_NONBLOCK);
+            fcntl(loop->wakeupFDs[i], F_SETFD, FD_CLOEXEC);
+        }
+        DCEventLoopAddFD(loop, loop->wakeupFDs[0], __DCEventLoopWakeupCallback, NULL);
+    }
+
+    if (!__DCCurrentEventLoop)
+        __DCCurrentEventLoop = loop;
+
+    return loop;
+}
+
+// Those the backend is done with, or all of them once it's gone
+static void __DCEventLoopReclaimHandlers(DCEventLoopRef loop, bool all) {
+    __DCEventLoopHandler **link = &(loop->removedHandlers);
+    while (*link) {
+        __DCEventLoopHandler *handler = *link;
+        if (handler->pendingRequests > 0 && !all) {
+            link = &(handler->nextRemoved);
+            continue;
+        }
+        *link = handler->nextRemoved;
+        DCSlabFree(loop->handlerSlab, handler);
+    }
+}
+
+static void __DCEventLoopRunDeferred(DCEventLoopRef loop);
+
+void DCEventLoopRelease(DCEventLoopRef loop) {
+    TRACE(loop);
+    // Whatever was deferred while tearing down what used the loop, those
+    // calls usually free something
+    __DCEventLoopRunDeferred(loop);
+
+    if (loop->wakeupFDs[0] != -1) {
+        DCEventLoopRemoveFD(loop, loop->wakeupFDs[0]);
+        close(loop->wakeupFDs[0]);
+        close(loop->wakeupFDs[1]);
+    }
+
+    loop->ops->release(loop);
+
+    for (int fd = 0; fd < loop->handlersCapacity; fd++) {
+        if (loop->handlers[fd])
+            DCSlabFree(loop->handlerSlab, loop->handlers[fd]);
+    }
+    __DCEventLoopReclaimHandlers(loop, true);
+    DCSlabRelease(loop->handlerSlab);
+    free(loop->handlers);
+    free(loop->deferred);
+    DCTimerWheelRelease(loop->wheel);
+
+    if (__DCCurrentEventLoop == loop)
+        __DCCurrentEventLoop = NULL;
+    free(loop);
+}
+
+DCEventLoopRef DCEventLoopGetCurrent(void) {
+    return __DCCurrentEventLoop;
+}
+
+DCEventLoopBackend DCEventLoopGetBackend(DCEventLoopRef loop) {
+    return loop->backend;
+}
+
+unsigned long long DCEventLoopGetTime(DCEventLoopRef loop) {
+    return loop->now;
+}
+
+DCTimerWheelRef DCEventLoopGetTimerWheel(DCEventLoopRef loop) {
+    return loop->wheel;
+}
+
+// MARK: - File descriptors
+
+bool DCEventLoopAddFD(DCEventLoopRef loop, int fd, DCEventLoopCallback callback, void *info) {
+    return DCEventLoopAddFDWithEvents(loop, fd, kDCEventLoopEventRead | kDCEventLoopEventWrite, callback, info);
+}
+
+static __DCEventLoopHandler* __DCEventLoopCreateHandler(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    log_trace("loop=%p, add fd => %d\n", loop, fd);
+    assert(fd >= 0);
+
+    if (fd >= loop->handlersCapacity) {
+        int capacity = loop->handlersCapacity ? loop->handlersCapacity : 64;
+        while (capacity <= fd)
+            capacity *= 2;
+        __DCEventLoopHandler **handlers = realloc(loop->handlers, capacity * sizeof(__DCEventLoopHandler *));
+        if (!handlers)
+            return NULL;
+        memset(handlers + loop->handlersCapacity, 0, (capacity - loop->handlersCapacity) * sizeof(__DCEventLoopHandler *));
+        loop->handlers = handlers;
+        loop->handlersCapacity = capacity;
+    }
+
+    if (loop->handlers[fd])
+        DCEventLoopRemoveFD(loop, fd);
+
+    __DCEventLoopHandler *handler = (__DCEventLoopHandler *) DCSlabAlloc(loop->handlerSlab);
+    handler->fd = fd;
+    handler->events = events;
+    handler->info = info;
+    return handler;
+}
+
+bool DCEventLoopAddFDWithEvents(DCEventLoopRef loop, int fd, DCEventLoopEvents events, DCEventLoopCallback callback, void *info) {
+    __DCEventLoopHandler *handler = __DCEventLoopCreateHandler(loop, fd, events, info);
+    if (!handler)
+        return false;
+    handler->callback = callback;
+
+    if (!loop->ops->add(loop, handler)) {
+        log_error("loop=%p, couldn't add fd=%d: %s\n", loop, fd, strerror(errno));
+        DCSlabFree(loop->handlerSlab, handler);
+        return false;
+    }
+
+    loop->handlers[fd] = handler;
+    return true;
+}
+
+void DCEventLoopSetEvents(DCEventLoopRef loop, int fd, DCEventLoopEvents events) {
+    if (fd < 0 || fd >= loop->handlersCapacity || !loop->handlers[fd])
+        return;
+    __DCEventLoopHandler *handler = loop->handlers[fd];
+    if (handler->events == events)
+        return;
+    handler->events = events;
+    if (!loop->ops->update(loop, handler))
+        log_error("loop=%p, couldn't change events of fd=%d: %s\n", loop, fd, strerror(errno));
+}
+
+void DCEventLoopRemoveFD(DCEventLoopRef loop, int fd) {
+    log_trace("loop=%p, remove fd => %d\n", loop, fd);
+    if (fd < 0 || fd >= loop->handlersCapacity || !loop->handlers[fd])
+        return;
+
+    __DCEventLoopHandler *handler = loop->handlers[fd];
+    loop->handlers[fd] = NULL;
+    loop->ops->remove(loop, handler);
+
+    // Events for this handler may still be pending in the current batch,
+    // so it's only marked dead here and freed after the batch is dispatched.
+    handler->callback = NULL;
+    handler->acceptCallback = NULL;
+    handler->receiveCallback = NULL;
+    handler->nextRemoved = loop->removedHandlers;
+    loop->removedHandlers = handler;
+}
+
+void __DCEventLoopUpdateTime(DCEventLoopRef loop) {
+    loop->now = __DCEventLoopNowMs();
+}
+
+void __DCEventLoopDispatch(DCEventLoopRef loop, __DCEventLoopHandler *handler, DCEventLoopEvents events) {
+    if (handler->callback)
+        handler->callback(loop, handler->fd, events, handler->info);
+}
+
+void __DCEventLoopDispatchAccept(DCEventLoopRef loop, __DCEventLoopHandler *handler, int fd) {
+    if (handler->acceptCallback)
+        handler->acceptCallback(loop, handler->fd, fd, handler->info);
+    else
+        close(fd);
+}
+
+void __DCEventLoopDispatchReceive(DCEventLoopRef loop, __DCEventLoopHandler *handler, const void *bytes, ssize_t result) {
+    DCEventLoopReceiveCallback callback = handler->receiveCallback;
+    handler->receiveCallback = NULL;
+    if (callback)
+        callback(loop, handler->fd, bytes, result, handler->info);
+}
+
+// MARK: - Listeners
+
+static int __DCEventLoopAcceptOne(int fd) {
+#if defined(__linux__)
+    return accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int clientFD = accept(fd, NULL, NULL);
+    if (clientFD != -1) {
+        fcntl(clientFD, F_SETFL, fcntl(clientFD, F_GETFL) | O_NONBLOCK);
+        fcntl(clientFD, F_SETFD, FD_CLOEXEC);
+    }
+    return clientFD;
+#endif
+}
+
+static void __DCEventLoopListenerReadable(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    __DCEventLoopHandler *handler = loop->handlers[fd];
+    if (!(events & kDCEventLoopEventRead) || handler->acceptPaused)
+        return;
+
+    // Edge-triggered, so drain the whole backlog before returning. When the
+    // listener is shared between loops the losers just get EAGAIN.
+    for (;;) {
+        int clientFD = __DCEventLoopAcceptOne(fd);
+        if (clientFD == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("loop=%p, accept failed: %s\n", loop, strerror(errno));
+            break;
+        }
+        __DCEventLoopDispatchAccept(loop, handler, clientFD);
+
+        // The callback may have removed or paused the listener, what's left
+        // stays in the backlog
+        if (loop->handlers[fd] != handler || handler->acceptPaused)
+            break;
+    }
+}
+
+bool DCEventLoopAddListener(DCEventLoopRef loop, int fd, DCEventLoopAcceptCallback callback, void *info) {
+    if (!loop->ops->accept) {
+        if (!DCEventLoopAddFDWithEvents(loop, fd, kDCEventLoopEventRead, __DCEventLoopListenerReadable, info))
+            return false;
+        loop->handlers[fd]->acceptCallback = callback;
+        return true;
+    }
+
+    __DCEventLoopHandler *handler = __DCEventLoopCreateHandler(loop, fd, kDCEventLoopEventNone, info);
+    if (!handler)
+        return false;
+    handler->acceptCallback = callback;
+
+    if (!loop->ops->accept(loop, handler)) {
+        log_error("loop=%p, couldn't accept on fd=%d: %s\n", loop, fd, strerror(errno));
+        DCSlabFree(loop->handlerSlab, handler);
+        return false;
+    }
+
+    loop->handlers[fd] = handler;
+    return true;
+}
+
+void DCEventLoopSetAccepting(DCEventLoopRef loop, int fd, bool accepting) {
+    if (fd < 0 || fd >= loop->handlersCapacity || !loop->handlers[fd])
+        return;
+    __DCEventLoopHandler *handler = loop->handlers[fd];
+    if (handler->acceptPaused == !accepting)
+        return;
+    handler->acceptPaused = !accepting;
+
+    if (!loop->ops->accept) {
+        // Watched again, it's reported readable with whatever waited meanwhile
+        DCEventLoopSetEvents(loop, fd, accepting ? kDCEventLoopEventRead : kDCEventLoopEventNone);
+    } else if (!accepting) {
+        loop->ops->pauseAccept(loop, handler);
+    } else if (!loop->ops->accept(loop, handler)) {
+        log_error("loop=%p, couldn't accept on fd=%d: %s\n", loop, fd, strerror(errno));
+    }
+}
+
+// MARK: - Completions
+
+bool DCEventLoopHasCompletions(DCEventLoopRef loop) {
+    return loop->ops->receive != NULL;
+}
+
+bool DCEventLoopReceive(DCEventLoopRef loop, int fd, size_t maxLength, DCEventLoopReceiveCallback callback) {
+    if (!loop->ops->receive || fd < 0 || fd >= loop->handlersCapacity || !loop->handlers[fd])
+        return false;
+
+    __DCEventLoopHandler *handler = loop->handlers[fd];
+    assert(!handler->receiveCallback);
+    handler->receiveCallback = callback;
+    if (!loop->ops->receive(loop, handler, maxLength)) {
+        handler->receiveCallback = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool DCEventLoopSend(DCEventLoopRef loop, int fd, const struct iovec *vector, int count, DCEventLoopSendCallback callback, void *info) {
+    if (!loop->ops->send)
+        return false;
+    return loop->ops->send(loop, fd, vector, count, callback, info);
+}
+
+// MARK: - Timers
+
+bool DCEventLoopAddTimer(DCEventLoopRef loop, unsigned int intervalMs, DCEventLoopTimerCallback callback, void *info) {
+    if (loop->nbrTimers == kDCEventLoopMaxTimers || intervalMs == 0)
+        return false;
+
+    __DCEventLoopTimer *timer = &loop->timers[loop->nbrTimers++];
+    timer->intervalMs = intervalMs;
+    timer->fireAt = __DCEventLoopNowMs() + intervalMs;
+    timer->callback = callback;
+    timer->info = info;
+    return true;
+}
+
+static int __DCEventLoopNextTimeout(DCEventLoopRef loop) {
+    uint64_t now = __DCEventLoopNowMs();
+    int timeout = DCTimerWheelGetTimeout(loop->wheel, now);
+    if (loop->nbrTimers == 0)
+        return timeout;
+
+    uint64_t next = UINT64_MAX;
+    for (int i = 0; i < loop->nbrTimers; i++) {
+        if (loop->timers[i].fireAt < next)
+            next = loop->timers[i].fireAt;
+    }
+    int timersTimeout = next <= now ? 0 : (int) (next - now);
+    return timeout == -1 || timersTimeout < timeout ? timersTimeout : timeout;
+}
+
+static void __DCEventLoopFireTimers(DCEventLoopRef loop) {
+    uint64_t now = loop->now;
+    for (int i = 0; i < loop->nbrTimers; i++) {
+        __DCEventLoopTimer *timer = &loop->timers[i];
+        if (timer->fireAt <= now) {
+            timer->fireAt = now + timer->intervalMs;
+            timer->callback(loop, timer->info);
+        }
+    }
+}
+
+// MARK: - Deferred calls
+
+void DCEventLoopDefer(DCEventLoopRef loop, DCEventLoopTimerCallback callback, void *info) {
+    if (loop->nbrDeferred == loop->deferredCapacity) {
+        int capacity = loop->deferredCapacity ? loop->deferredCapacity * 2 : 64;
+        __DCEventLoopDeferred *deferred = realloc(loop->deferred, capacity * sizeof(__DCEventLoopDeferred));
+        assert(deferred);
+        loop->deferred = deferred;
+        loop->deferredCapacity = capacity;
+    }
+    loop->deferred[loop->nbrDeferred].callback = callback;
+    loop->deferred[loop->nbrDeferred].info = info;
+    loop->nbrDeferred++;
+}
+
+static void __DCEventLoopRunDeferred(DCEventLoopRef loop) {
+    // Deferred calls may defer more, those run in the same pass
+    for (int i = 0; i < loop->nbrDeferred; i++)
+        loop->deferred[i].callback(loop, loop->deferred[i].info);
+    loop->nbrDeferred = 0;
+}
+
+// MARK: - Run
+
+void DCEventLoopRun(DCEventLoopRef loop) {
+    TRACE(loop);
+    __DCCurrentEventLoop = loop;
+    atomic_store(&loop->stopped, false);
+
+    while (!atomic_load(&loop->stopped)) {
+        int nbrEvents = loop->ops->poll(loop, loop->nbrDeferred ? 0 : __DCEventLoopNextTimeout(loop));
+        if (nbrEvents < 0 && errno != EINTR) {
+            log_error("loop=%p, poll failed: %s\n", loop, strerror(errno));
+            break;
+        }
+        // Again after the handlers, which may have taken a while
+        __DCEventLoopUpdateTime(loop);
+        __DCEventLoopFireTimers(loop);
+        DCTimerWheelAdvance(loop->wheel, loop->now);
+        __DCEventLoopRunDeferred(loop);
+        __DCEventLoopReclaimHandlers(loop, false);
+    }
+}
+
+void DCEventLoopStop(DCEventLoopRef loop) {
+    TRACE(loop);
+    atomic_store(&loop->stopped, true);
+    if (loop->wakeupFDs[1] != -1) {
+        char wakeup = 1;
+        ssize_t ignored = write(loop->wakeupFDs[1], &wakeup, 1);
+        (void) ignored;
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef DCEventLoop_h
+#define DCEventLoop_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "DCTimerWheel.h"
+
+typedef struct __DCEventLoop*         DCEventLoopRef;
+
+typedef enum DCEventLoopBackend {
+    kDCEventLoopBackendDefault = 0,
+    kDCEventLoopBackendEpoll = 1,
+    kDCEventLoopBackendKqueue = 2,
+    // Linux 5.19 and later, falls back to epoll when the kernel can't
+    kDCEventLoopBackendIOUring = 3
+} DCEventLoopBackend;
+
+typedef enum DCEventLoopEvents {
+    kDCEventLoopEventNone = 0,
+    kDCEventLoopEventRead = 1,
+    kDCEventLoopEventWrite = 2,
+    kDCEventLoopEventError = 4,
+    kDCEventLoopEventHangUp = 8
+} DCEventLoopEvents;
+
+/*
+ * Readiness is edge-triggered on every backend: a callback is only invoked
+ * when the state of `fd` changes, so the callee must read/write until the
+ * syscall returns EAGAIN before it returns.
+ */
+typedef void (*DCEventLoopCallback)(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info);
+typedef void (*DCEventLoopTimerCallback)(DCEventLoopRef loop, void *info);
+
+DCEventLoopRef DCEventLoopCreate(DCEventLoopBackend backend);
+void DCEventLoopRelease(DCEventLoopRef loop);
+
+DCEventLoopRef DCEventLoopGetCurrent(void);
+DCEventLoopBackend DCEventLoopGetBackend(DCEventLoopRef loop);
+
+bool DCEventLoopAddFD(DCEventLoopRef loop, int fd, DCEventLoopCallback callback, void *info);
+void DCEventLoopRemoveFD(DCEventLoopRef loop, int fd);
+
+// `DCEventLoopAddFD` watches both directions, these only what's in `events`.
+// Errors and hang-ups are reported with whatever is watched.
+bool DCEventLoopAddFDWithEvents(DCEventLoopRef loop, int fd, DCEventLoopEvents events, DCEventLoopCallback callback, void *info);
+void DCEventLoopSetEvents(DCEventLoopRef loop, int fd, DCEventLoopEvents events);
+
+/*
+ * Calls back with every connection accepted on the listening socket `fd`,
+ * already non-blocking. io_uring accepts with a single multishot request,
+ * the other backends drain the backlog whenever the listener is readable.
+ * Removed with `DCEventLoopRemoveFD`.
+ */
+typedef void (*DCEventLoopAcceptCallback)(DCEventLoopRef loop, int listenFD, int fd, void *info);
+bool DCEventLoopAddListener(DCEventLoopRef loop, int fd, DCEventLoopAcceptCallback callback, void *info);
+// While paused the kernel keeps queueing connections in the backlog. A few
+// it had accepted already may still be called back with.
+void DCEventLoopSetAccepting(DCEventLoopRef loop, int fd, bool accepting);
+
+/*
+ * Completion based I/O, only where `DCEventLoopHasCompletions` (io_uring).
+ * Instead of being told an fd is ready and reading it, the loop is asked
+ * to read and calls back with the bytes, so a read costs no syscall of
+ * its own and many go out with one submission.
+ */
+bool DCEventLoopHasCompletions(DCEventLoopRef loop);
+
+// One receive of at most `maxLength` bytes on an fd added to the loop. The
+// bytes come from a buffer the kernel picks from the loop's buffer ring when
+// data arrives, so nothing is set aside while the peer is idle. They're only
+// valid during the callback, which gets the fd's `info`, 0 at EOF and a
+// negative errno on failure. Nothing is called back once the fd is removed.
+typedef void (*DCEventLoopReceiveCallback)(DCEventLoopRef loop, int fd, const void *bytes, ssize_t result, void *info);
+bool DCEventLoopReceive(DCEventLoopRef loop, int fd, size_t maxLength, DCEventLoopReceiveCallback callback);
+
+// Sends `vector` as linked sends that go out in order. The buffers must stay
+// valid until the callback, which is called even if the fd is closed or
+// removed meanwhile. `error` is 0 when all of it was written.
+typedef void (*DCEventLoopSendCallback)(DCEventLoopRef loop, size_t written, int error, void *info);
+bool DCEventLoopSend(DCEventLoopRef loop, int fd, const struct iovec *vector, int count, DCEventLoopSendCallback callback, void *info);
+
+bool DCEventLoopAddTimer(DCEventLoopRef loop, unsigned int intervalMs, DCEventLoopTimerCallback callback, void *info);
+
+// Runs `callback` once the current batch of events has been dispatched,
+// e.g. to free an object whose callback is still on the stack. What's left
+// when the loop is released runs then.
+void DCEventLoopDefer(DCEventLoopRef loop, DCEventLoopTimerCallback callback, void *info);
+
+// Monotonic milliseconds, sampled once per loop iteration
+unsigned long long DCEventLoopGetTime(DCEventLoopRef loop);
+
+// For deadlines that mostly get cancelled or pushed back, e.g. timeouts,
+// in the loop's time. Due entries fire right after the periodic timers.
+DCTimerWheelRef DCEventLoopGetTimerWheel(DCEventLoopRef loop);
+
+void DCEventLoopRun(DCEventLoopRef loop);
+void DCEventLoopStop(DCEventLoopRef loop);
+
+char* DCEventLoopBackendString(DCEventLoopBackend backend);
+
+#endif /* DCEventLoop_h */
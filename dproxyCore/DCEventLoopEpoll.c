@@ -0,0 +1,88 @@
+#include "DCEventLoop-Private.h"
+#include "log.h"
+
+#if defined(__linux__)
+
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+/*
+ * Most fds are registered once for both directions with EPOLLET, so
+ * switching interest between reading and writing never costs an
+ * `epoll_ctl`. One `epoll_wait` returns the whole ready batch.
+ */
+
+static uint32_t __DCEventLoopEpollMask(DCEventLoopEvents events) {
+    uint32_t mask = EPOLLET;
+    if (events & kDCEventLoopEventRead) mask |= EPOLLIN | EPOLLRDHUP;
+    if (events & kDCEventLoopEventWrite) mask |= EPOLLOUT;
+    return mask;
+}
+
+static bool __DCEventLoopEpollCreate(DCEventLoopRef loop) {
+    loop->backendFD = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->backendFD == -1)
+        return false;
+    loop->backendData = calloc(kDCEventLoopMaxEvents, sizeof(struct epoll_event));
+    return loop->backendData != NULL;
+}
+
+static void __DCEventLoopEpollRelease(DCEventLoopRef loop) {
+    if (loop->backendFD != -1)
+        close(loop->backendFD);
+    free(loop->backendData);
+}
+
+static bool __DCEventLoopEpollAdd(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    struct epoll_event event;
+    event.events = __DCEventLoopEpollMask(handler->events);
+    event.data.ptr = handler;
+    return epoll_ctl(loop->backendFD, EPOLL_CTL_ADD, handler->fd, &event) == 0;
+}
+
+static bool __DCEventLoopEpollUpdate(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    struct epoll_event event;
+    event.events = __DCEventLoopEpollMask(handler->events);
+    event.data.ptr = handler;
+    return epoll_ctl(loop->backendFD, EPOLL_CTL_MOD, handler->fd, &event) == 0;
+}
+
+static void __DCEventLoopEpollRemove(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    // Fails with EBADF when the fd has been closed already, which
+    // removes it from the interest list anyway.
+    epoll_ctl(loop->backendFD, EPOLL_CTL_DEL, handler->fd, NULL);
+}
+
+static int __DCEventLoopEpollPoll(DCEventLoopRef loop, int timeoutMs) {
+    struct epoll_event *events = (struct epoll_event *) loop->backendData;
+    int nbrEvents = epoll_wait(loop->backendFD, events, kDCEventLoopMaxEvents, timeoutMs);
+    __DCEventLoopUpdateTime(loop);
+
+    for (int i = 0; i < nbrEvents; i++) {
+        DCEventLoopEvents ready = kDCEventLoopEventNone;
+        if (events[i].events & EPOLLIN) ready |= kDCEventLoopEventRead;
+        if (events[i].events & EPOLLOUT) ready |= kDCEventLoopEventWrite;
+        if (events[i].events & EPOLLERR) ready |= kDCEventLoopEventError;
+        if (events[i].events & (EPOLLHUP | EPOLLRDHUP)) ready |= kDCEventLoopEventHangUp | kDCEventLoopEventRead;
+
+        __DCEventLoopDispatch(loop, (__DCEventLoopHandler *) events[i].data.ptr, ready);
+    }
+
+    return nbrEvents;
+}
+
+const __DCEventLoopBackendOps __DCEventLoopEpollOps = {
+    __DCEventLoopEpollCreate,
+    __DCEventLoopEpollRelease,
+    __DCEventLoopEpollAdd,
+    __DCEventLoopEpollRemove,
+    __DCEventLoopEpollUpdate,
+    __DCEventLoopEpollPoll,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+#endif /* __linux__ */
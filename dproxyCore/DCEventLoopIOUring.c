@@ -0,0 +1,652 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "DCEventLoop-Private.h"
+#include "log.h"
+
+#if defined(DC_HAVE_IO_URING)
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Talks to the kernel with the raw syscalls, there's no liburing to lean
+ * on. Readiness is a multishot poll per fd, which stays armed and fires
+ * on every wakeup like EPOLLET. Listeners get one multishot accept. Reads
+ * are single receives that pick a buffer from a ring shared with the
+ * kernel, and writes are chains of linked sends, so a whole output queue
+ * goes out with one submission that's folded into the next wait.
+ */
+
+#define kDCIOUringEntries 512
+#define kDCIOUringCompletionEntries 4096
+#define kDCIOUringReceiveBuffers 256 // Must be a power of two
+#define kDCIOUringReceiveBufferSize (16 * 1024)
+#define kDCIOUringReceiveGroup 0
+#define kDCIOUringSendsPerBlock 64
+
+// What a request is, kept in the low bits of its `user_data`. Handlers and
+// sends come from slabs of pointer aligned objects, so those bits are free.
+typedef enum __DCIOUringRequest {
+    kDCIOUringRequestIgnore = 0,
+    kDCIOUringRequestPoll = 1,
+    kDCIOUringRequestAccept = 2,
+    kDCIOUringRequestReceive = 3,
+    kDCIOUringRequestSend = 4
+} __DCIOUringRequest;
+
+#define kDCIOUringRequestMask 7
+
+typedef struct __DCEventLoopSend {
+    __DCEventLoopHandler *handler;
+    struct __DCEventLoopSend *next;
+    struct __DCEventLoopSend *prev;
+    DCEventLoopSendCallback callback;
+    void *info;
+    size_t expected;
+    size_t written;
+    int error;
+    unsigned int remaining; // Completions still to come, one per send
+} __DCEventLoopSend;
+
+typedef struct __DCIOUring {
+    unsigned int features;
+
+    void *ringMemory;
+    size_t ringSize;
+    void *completionMemory;
+    size_t completionSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+
+    _Atomic unsigned int *sqHead;
+    _Atomic unsigned int *sqTail;
+    unsigned int *sqArray;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int sqLocalTail;
+
+    _Atomic unsigned int *cqHead;
+    _Atomic unsigned int *cqTail;
+    struct io_uring_cqe *cqes;
+    unsigned int cqMask;
+
+    struct io_uring_buf_ring *bufferRing;
+    size_t bufferRingSize;
+    char *buffers;
+    unsigned short bufferTail;
+
+    DCSlabRef sendSlab;
+} __DCIOUring;
+
+// MARK: - Syscalls
+
+static int __DCIOUringSetup(unsigned int entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int __DCIOUringEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags, void *arg, size_t argSize) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+static int __DCIOUringRegister(int fd, unsigned int opcode, void *arg, unsigned int nbrArgs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nbrArgs);
+}
+
+// MARK: - Submission
+
+static unsigned int __DCIOUringUnsubmitted(__DCIOUring *ring) {
+    return ring->sqLocalTail - atomic_load_explicit(ring->sqHead, memory_order_acquire);
+}
+
+static void __DCIOUringPublish(__DCIOUring *ring) {
+    atomic_store_explicit(ring->sqTail, ring->sqLocalTail, memory_order_release);
+}
+
+static bool __DCIOUringSubmit(DCEventLoopRef loop) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    __DCIOUringPublish(ring);
+    unsigned int pending = __DCIOUringUnsubmitted(ring);
+    while (pending) {
+        int submitted = __DCIOUringEnter(loop->backendFD, pending, 0, 0, NULL, 0);
+        if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return false;
+        pending = __DCIOUringUnsubmitted(ring);
+        if (submitted <= 0)
+            break;
+    }
+    return true;
+}
+
+// Room for `count` entries in a row, submitting what's queued if there isn't
+static bool __DCIOUringReserve(DCEventLoopRef loop, unsigned int count) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    if (ring->sqEntries - __DCIOUringUnsubmitted(ring) >= count)
+        return true;
+    __DCIOUringSubmit(loop);
+    return ring->sqEntries - __DCIOUringUnsubmitted(ring) >= count;
+}
+
+static struct io_uring_sqe* __DCIOUringGetSQE(DCEventLoopRef loop) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    if (!__DCIOUringReserve(loop, 1)) {
+        log_error("loop=%p, io_uring submission queue is stuck\n", loop);
+        return NULL;
+    }
+
+    unsigned int index = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+static uint64_t __DCIOUringUserData(void *object, __DCIOUringRequest request) {
+    return (uint64_t) (uintptr_t) object | request;
+}
+
+static bool __DCIOUringCancel(DCEventLoopRef loop, void *object, __DCIOUringRequest request) {
+    struct io_uring_sqe *sqe = __DCIOUringGetSQE(loop);
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = __DCIOUringUserData(object, request);
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    sqe->user_data = kDCIOUringRequestIgnore;
+    return true;
+}
+
+// MARK: - Receive buffers
+
+static void __DCIOUringRecycleBuffer(__DCIOUring *ring, unsigned short bid) {
+    struct io_uring_buf *buffer = &ring->bufferRing->bufs[ring->bufferTail & (kDCIOUringReceiveBuffers - 1)];
+    buffer->addr = (uint64_t) (uintptr_t) (ring->buffers + (size_t) bid * kDCIOUringReceiveBufferSize);
+    buffer->len = kDCIOUringReceiveBufferSize;
+    buffer->bid = bid;
+    ring->bufferTail++;
+    atomic_store_explicit((_Atomic unsigned short *) &ring->bufferRing->tail, ring->bufferTail, memory_order_release);
+}
+
+static bool __DCIOUringRegisterBuffers(DCEventLoopRef loop) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+
+    ring->bufferRingSize = kDCIOUringReceiveBuffers * sizeof(struct io_uring_buf);
+    ring->bufferRing = mmap(NULL, ring->bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufferRing == MAP_FAILED) {
+        ring->bufferRing = NULL;
+        return false;
+    }
+    ring->buffers = malloc((size_t) kDCIOUringReceiveBuffers * kDCIOUringReceiveBufferSize);
+    if (!ring->buffers)
+        return false;
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (uint64_t) (uintptr_t) ring->bufferRing;
+    registration.ring_entries = kDCIOUringReceiveBuffers;
+    registration.bgid = kDCIOUringReceiveGroup;
+    if (__DCIOUringRegister(loop->backendFD, IORING_REGISTER_PBUF_RING, &registration, 1) != 0)
+        return false;
+
+    for (unsigned short bid = 0; bid < kDCIOUringReceiveBuffers; bid++)
+        __DCIOUringRecycleBuffer(ring, bid);
+    return true;
+}
+
+// MARK: - Lifecycle
+
+static void __DCEventLoopIOUringRelease(DCEventLoopRef loop);
+
+static bool __DCEventLoopIOUringCreate(DCEventLoopRef loop) {
+    __DCIOUring *ring = (__DCIOUring *) calloc(1, sizeof(__DCIOUring));
+    if (!ring)
+        return false;
+    loop->backendData = ring;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    params.cq_entries = kDCIOUringCompletionEntries;
+    loop->backendFD = __DCIOUringSetup(kDCIOUringEntries, &params);
+    if (loop->backendFD == -1 && errno == EINVAL) {
+        // Kernels before 5.19 don't know about cooperative task running
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = kDCIOUringCompletionEntries;
+        loop->backendFD = __DCIOUringSetup(kDCIOUringEntries, &params);
+    }
+    if (loop->backendFD == -1)
+        goto fail;
+
+    // The wait takes a timeout without a timeout request of its own
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+    ring->features = params.features;
+
+    ring->ringSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->completionSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->completionSize > ring->ringSize)
+            ring->ringSize = ring->completionSize;
+    }
+
+    ring->ringMemory = mmap(NULL, ring->ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->backendFD, IORING_OFF_SQ_RING);
+    if (ring->ringMemory == MAP_FAILED) {
+        ring->ringMemory = NULL;
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->completionMemory = ring->ringMemory;
+    } else {
+        ring->completionMemory = mmap(NULL, ring->completionSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->backendFD, IORING_OFF_CQ_RING);
+        if (ring->completionMemory == MAP_FAILED) {
+            ring->completionMemory = NULL;
+            goto fail;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, loop->backendFD, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = (char *) ring->ringMemory;
+    ring->sqHead = (_Atomic unsigned int *) (sq + params.sq_off.head);
+    ring->sqTail = (_Atomic unsigned int *) (sq + params.sq_off.tail);
+    ring->sqArray = (unsigned int *) (sq + params.sq_off.array);
+    ring->sqMask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = atomic_load_explicit(ring->sqTail, memory_order_relaxed);
+
+    char *cq = (char *) ring->completionMemory;
+    ring->cqHead = (_Atomic unsigned int *) (cq + params.cq_off.head);
+    ring->cqTail = (_Atomic unsigned int *) (cq + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    ring->cqMask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+
+    // Buffer rings need 5.19, which is also when multishot accept came
+    if (!__DCIOUringRegisterBuffers(loop))
+        goto fail;
+
+    ring->sendSlab = DCSlabCreate("send", sizeof(__DCEventLoopSend), kDCIOUringSendsPerBlock);
+    log_info("loop=%p, io_uring with %u entries and %d receive buffers of %d bytes\n",
+             loop, ring->sqEntries, kDCIOUringReceiveBuffers, kDCIOUringReceiveBufferSize);
+    return true;
+
+fail:
+    {
+        int error = errno;
+        __DCEventLoopIOUringRelease(loop);
+        loop->backendFD = -1;
+        loop->backendData = NULL;
+        errno = error;
+    }
+    return false;
+}
+
+static void __DCIOUringDropSends(__DCIOUring *ring, __DCEventLoopHandler *handler) {
+    while (handler->sends) {
+        __DCEventLoopSend *send = handler->sends;
+        handler->sends = send->next;
+        DCSlabFree(ring->sendSlab, send);
+    }
+}
+
+static void __DCEventLoopIOUringRelease(DCEventLoopRef loop) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    if (loop->backendFD != -1)
+        close(loop->backendFD);
+    if (!ring)
+        return;
+
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqesSize);
+    if (ring->completionMemory && ring->completionMemory != ring->ringMemory)
+        munmap(ring->completionMemory, ring->completionSize);
+    if (ring->ringMemory)
+        munmap(ring->ringMemory, ring->ringSize);
+    if (ring->bufferRing)
+        munmap(ring->bufferRing, ring->bufferRingSize);
+    free(ring->buffers);
+    if (ring->sendSlab) {
+        // Sends that never completed are dropped with the ring
+        for (int fd = 0; fd < loop->handlersCapacity; fd++) {
+            if (loop->handlers[fd])
+                __DCIOUringDropSends(ring, loop->handlers[fd]);
+        }
+        for (__DCEventLoopHandler *handler = loop->removedHandlers; handler; handler = handler->nextRemoved)
+            __DCIOUringDropSends(ring, handler);
+        DCSlabRelease(ring->sendSlab);
+    }
+    free(ring);
+}
+
+// MARK: - Readiness
+
+static unsigned int __DCIOUringPollMask(DCEventLoopEvents events) {
+    unsigned int mask = 0;
+    if (events & kDCEventLoopEventRead) mask |= POLLIN | POLLRDHUP;
+    if (events & kDCEventLoopEventWrite) mask |= POLLOUT;
+    return mask;
+}
+
+static bool __DCIOUringArmPoll(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    struct io_uring_sqe *sqe = __DCIOUringGetSQE(loop);
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = handler->fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = __DCIOUringPollMask(handler->events);
+    sqe->user_data = __DCIOUringUserData(handler, kDCIOUringRequestPoll);
+    handler->armed |= 1 << kDCIOUringRequestPoll;
+    handler->pendingRequests++;
+    return true;
+}
+
+static bool __DCEventLoopIOUringAdd(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    if (handler->events == kDCEventLoopEventNone)
+        return true;
+    return __DCIOUringArmPoll(loop, handler);
+}
+
+static bool __DCEventLoopIOUringUpdate(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    // At most one poll per fd. One that's armed is cancelled and re-armed
+    // with the new events when its last completion comes in.
+    if (handler->armed & (1 << kDCIOUringRequestPoll))
+        return __DCIOUringCancel(loop, handler, kDCIOUringRequestPoll);
+    if (handler->events == kDCEventLoopEventNone)
+        return true;
+    return __DCIOUringArmPoll(loop, handler);
+}
+
+static void __DCEventLoopIOUringRemove(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    // In flight requests hold on to the socket, it isn't really closed
+    // before they're all cancelled.
+    if (handler->armed & (1 << kDCIOUringRequestPoll))
+        __DCIOUringCancel(loop, handler, kDCIOUringRequestPoll);
+    if (handler->armed & (1 << kDCIOUringRequestAccept))
+        __DCIOUringCancel(loop, handler, kDCIOUringRequestAccept);
+    if (handler->armed & (1 << kDCIOUringRequestReceive))
+        __DCIOUringCancel(loop, handler, kDCIOUringRequestReceive);
+    for (__DCEventLoopSend *send = handler->sends; send; send = send->next)
+        __DCIOUringCancel(loop, send, kDCIOUringRequestSend);
+    handler->events = kDCEventLoopEventNone;
+}
+
+static void __DCIOUringPollCompleted(DCEventLoopRef loop, __DCEventLoopHandler *handler, struct io_uring_cqe *cqe) {
+    if (cqe->res > 0) {
+        DCEventLoopEvents ready = kDCEventLoopEventNone;
+        if (cqe->res & POLLIN) ready |= kDCEventLoopEventRead;
+        if (cqe->res & POLLOUT) ready |= kDCEventLoopEventWrite;
+        if (cqe->res & POLLERR) ready |= kDCEventLoopEventError;
+        if (cqe->res & (POLLHUP | POLLRDHUP)) ready |= kDCEventLoopEventHangUp | kDCEventLoopEventRead;
+        __DCEventLoopDispatch(loop, handler, ready);
+    }
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+    handler->armed &= ~(1 << kDCIOUringRequestPoll);
+    handler->pendingRequests--;
+
+    // Overflow, a cancel for new events, or an error, all mean re-arm as
+    // long as someone still wants to hear about the fd
+    if (handler->callback && handler->events != kDCEventLoopEventNone)
+        __DCIOUringArmPoll(loop, handler);
+}
+
+// MARK: - Accept
+
+static bool __DCEventLoopIOUringAccept(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    // Still armed, or still being cancelled and re-armed once that's done
+    if (handler->armed & (1 << kDCIOUringRequestAccept))
+        return true;
+    struct io_uring_sqe *sqe = __DCIOUringGetSQE(loop);
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = handler->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = __DCIOUringUserData(handler, kDCIOUringRequestAccept);
+    handler->armed |= 1 << kDCIOUringRequestAccept;
+    handler->pendingRequests++;
+    return true;
+}
+
+static void __DCIOUringAcceptCompleted(DCEventLoopRef loop, __DCEventLoopHandler *handler, struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0)
+        __DCEventLoopDispatchAccept(loop, handler, cqe->res);
+    else if (cqe->res != -ECANCELED && cqe->res != -ECONNABORTED)
+        log_error("loop=%p, accept failed: %s\n", loop, strerror(-cqe->res));
+
+    if (cqe->flags & IORING_CQE_F_MORE)
+        return;
+    handler->armed &= ~(1 << kDCIOUringRequestAccept);
+    handler->pendingRequests--;
+
+    if (handler->acceptCallback && !handler->acceptPaused)
+        __DCEventLoopIOUringAccept(loop, handler);
+}
+
+// What the kernel accepted before the cancel arrives is still handed over
+static void __DCEventLoopIOUringPauseAccept(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    if (handler->armed & (1 << kDCIOUringRequestAccept))
+        __DCIOUringCancel(loop, handler, kDCIOUringRequestAccept);
+}
+
+// MARK: - Receive
+
+static bool __DCIOUringArmReceive(DCEventLoopRef loop, __DCEventLoopHandler *handler, unsigned int length) {
+    struct io_uring_sqe *sqe = __DCIOUringGetSQE(loop);
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = handler->fd;
+    sqe->len = length;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kDCIOUringReceiveGroup;
+    sqe->user_data = __DCIOUringUserData(handler, kDCIOUringRequestReceive);
+    handler->armed |= 1 << kDCIOUringRequestReceive;
+    handler->pendingRequests++;
+    return true;
+}
+
+static bool __DCEventLoopIOUringReceive(DCEventLoopRef loop, __DCEventLoopHandler *handler, size_t maxLength) {
+    if (handler->armed & (1 << kDCIOUringRequestReceive)) {
+        errno = EBUSY;
+        return false;
+    }
+    unsigned int length = maxLength < kDCIOUringReceiveBufferSize ? (unsigned int) maxLength : kDCIOUringReceiveBufferSize;
+    return __DCIOUringArmReceive(loop, handler, length);
+}
+
+static void __DCIOUringReceiveCompleted(DCEventLoopRef loop, __DCEventLoopHandler *handler, struct io_uring_cqe *cqe) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    handler->armed &= ~(1 << kDCIOUringRequestReceive);
+    handler->pendingRequests--;
+
+    // Every buffer is out, the ones handed out in this batch are back by
+    // the time the retry is submitted
+    if (cqe->res == -ENOBUFS && handler->receiveCallback) {
+        __DCIOUringArmReceive(loop, handler, kDCIOUringReceiveBufferSize);
+        return;
+    }
+
+    const void *bytes = NULL;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        bytes = ring->buffers + (size_t) bid * kDCIOUringReceiveBufferSize;
+        __DCEventLoopDispatchReceive(loop, handler, bytes, cqe->res);
+        __DCIOUringRecycleBuffer(ring, bid);
+    } else {
+        __DCEventLoopDispatchReceive(loop, handler, bytes, cqe->res);
+    }
+}
+
+// MARK: - Send
+
+static bool __DCEventLoopIOUringSend(DCEventLoopRef loop, int fd, const struct iovec *vector, int count, DCEventLoopSendCallback callback, void *info) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    if (fd < 0 || fd >= loop->handlersCapacity || !loop->handlers[fd] || count <= 0) {
+        errno = EINVAL;
+        return false;
+    }
+    // A chain can't be split over two submissions
+    if ((unsigned int) count > ring->sqEntries || !__DCIOUringReserve(loop, count)) {
+        errno = EAGAIN;
+        return false;
+    }
+
+    __DCEventLoopHandler *handler = loop->handlers[fd];
+    __DCEventLoopSend *send = (__DCEventLoopSend *) DCSlabAlloc(ring->sendSlab);
+    if (!send) {
+        errno = ENOMEM;
+        return false;
+    }
+    send->handler = handler;
+    send->callback = callback;
+    send->info = info;
+    send->remaining = count;
+    send->next = handler->sends;
+    if (send->next)
+        send->next->prev = send;
+    handler->sends = send;
+    handler->pendingRequests++;
+
+    for (int i = 0; i < count; i++) {
+        struct io_uring_sqe *sqe = __DCIOUringGetSQE(loop);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) vector[i].iov_base;
+        sqe->len = (unsigned int) vector[i].iov_len;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        // A short send fails the link, so what follows is cancelled rather
+        // than sent out of order
+        if (i < count - 1)
+            sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = __DCIOUringUserData(send, kDCIOUringRequestSend);
+        send->expected += vector[i].iov_len;
+    }
+    return true;
+}
+
+static void __DCIOUringSendCompleted(DCEventLoopRef loop, __DCEventLoopSend *send, struct io_uring_cqe *cqe) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    if (cqe->res > 0)
+        send->written += cqe->res;
+    else if (cqe->res < 0 && cqe->res != -ECANCELED && send->error == 0)
+        send->error = -cqe->res;
+
+    if (--send->remaining > 0)
+        return;
+
+    __DCEventLoopHandler *handler = send->handler;
+    if (send->prev)
+        send->prev->next = send->next;
+    else
+        handler->sends = send->next;
+    if (send->next)
+        send->next->prev = send->prev;
+    handler->pendingRequests--;
+
+    int error = send->error;
+    if (error == 0 && send->written < send->expected)
+        error = EAGAIN;
+    DCEventLoopSendCallback callback = send->callback;
+    void *info = send->info;
+    size_t written = send->written;
+    DCSlabFree(ring->sendSlab, send);
+    callback(loop, written, error, info);
+}
+
+// MARK: - Poll
+
+static int __DCEventLoopIOUringPoll(DCEventLoopRef loop, int timeoutMs) {
+    __DCIOUring *ring = (__DCIOUring *) loop->backendData;
+    __DCIOUringPublish(ring);
+
+    unsigned int head = atomic_load_explicit(ring->cqHead, memory_order_relaxed);
+    bool ready = head != atomic_load_explicit(ring->cqTail, memory_order_acquire);
+
+    struct __kernel_timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = timeoutMs < 0 ? 0 : (uint64_t) (uintptr_t) &timeout;
+
+    // Submitting and waiting is the same syscall
+    unsigned int waitFor = (ready || timeoutMs == 0) ? 0 : 1;
+    if (waitFor || __DCIOUringUnsubmitted(ring)) {
+        int result = __DCIOUringEnter(loop->backendFD, __DCIOUringUnsubmitted(ring), waitFor,
+                                      IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        __DCEventLoopUpdateTime(loop);
+        if (result < 0 && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+            if (errno != EINTR || !ready)
+                return -1;
+        }
+    }
+
+    int nbrCompletions = 0;
+    unsigned int tail = atomic_load_explicit(ring->cqTail, memory_order_acquire);
+    while (head != tail) {
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+        head++;
+        // Handing the entry back first lets callbacks reap and submit freely
+        atomic_store_explicit(ring->cqHead, head, memory_order_release);
+        nbrCompletions++;
+
+        void *object = (void *) (uintptr_t) (cqe.user_data & ~(uint64_t) kDCIOUringRequestMask);
+        switch ((__DCIOUringRequest) (cqe.user_data & kDCIOUringRequestMask)) {
+            case kDCIOUringRequestPoll:
+                __DCIOUringPollCompleted(loop, (__DCEventLoopHandler *) object, &cqe);
+                break;
+            case kDCIOUringRequestAccept:
+                __DCIOUringAcceptCompleted(loop, (__DCEventLoopHandler *) object, &cqe);
+                break;
+            case kDCIOUringRequestReceive:
+                __DCIOUringReceiveCompleted(loop, (__DCEventLoopHandler *) object, &cqe);
+                break;
+            case kDCIOUringRequestSend:
+                __DCIOUringSendCompleted(loop, (__DCEventLoopSend *) object, &cqe);
+                break;
+            case kDCIOUringRequestIgnore:
+                break;
+        }
+
+        if (head == tail)
+            tail = atomic_load_explicit(ring->cqTail, memory_order_acquire);
+    }
+
+    return nbrCompletions;
+}
+
+const __DCEventLoopBackendOps __DCEventLoopIOUringOps = {
+    __DCEventLoopIOUringCreate,
+    __DCEventLoopIOUringRelease,
+    __DCEventLoopIOUringAdd,
+    __DCEventLoopIOUringRemove,
+    __DCEventLoopIOUringUpdate,
+    __DCEventLoopIOUringPoll,
+    __DCEventLoopIOUringAccept,
+    __DCEventLoopIOUringPauseAccept,
+    __DCEventLoopIOUringReceive,
+    __DCEventLoopIOUringSend
+};
+
+#endif /* DC_HAVE_IO_URING */
@@ -0,0 +1,91 @@
+#include "DCEventLoop-Private.h"
+#include "log.h"
+
+#if defined(__APPLE__) || defined(__FreeBSD__)
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*
+ * EV_CLEAR gives the same edge-triggered semantics as EPOLLET on Linux,
+ * so `DCConnection` doesn't have to care which backend it runs on.
+ */
+
+static bool __DCEventLoopKqueueCreate(DCEventLoopRef loop) {
+    loop->backendFD = kqueue();
+    if (loop->backendFD == -1)
+        return false;
+    loop->backendData = calloc(kDCEventLoopMaxEvents, sizeof(struct kevent));
+    return loop->backendData != NULL;
+}
+
+static void __DCEventLoopKqueueRelease(DCEventLoopRef loop) {
+    if (loop->backendFD != -1)
+        close(loop->backendFD);
+    free(loop->backendData);
+}
+
+// Both filters always exist, the ones not asked for are just disabled
+static bool __DCEventLoopKqueueApply(DCEventLoopRef loop, __DCEventLoopHandler *handler, unsigned short flags) {
+    struct kevent changes[2];
+    unsigned short readFlags = flags | ((handler->events & kDCEventLoopEventRead) ? EV_ENABLE : EV_DISABLE);
+    unsigned short writeFlags = flags | ((handler->events & kDCEventLoopEventWrite) ? EV_ENABLE : EV_DISABLE);
+    EV_SET(&changes[0], handler->fd, EVFILT_READ, readFlags, 0, 0, handler);
+    EV_SET(&changes[1], handler->fd, EVFILT_WRITE, writeFlags, 0, 0, handler);
+    return kevent(loop->backendFD, changes, 2, NULL, 0, NULL) == 0;
+}
+
+static bool __DCEventLoopKqueueAdd(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    return __DCEventLoopKqueueApply(loop, handler, EV_ADD | EV_CLEAR);
+}
+
+static bool __DCEventLoopKqueueUpdate(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    return __DCEventLoopKqueueApply(loop, handler, 0);
+}
+
+static void __DCEventLoopKqueueRemove(DCEventLoopRef loop, __DCEventLoopHandler *handler) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], handler->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], handler->fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(loop->backendFD, changes, 2, NULL, 0, NULL);
+}
+
+static int __DCEventLoopKqueuePoll(DCEventLoopRef loop, int timeoutMs) {
+    struct kevent *events = (struct kevent *) loop->backendData;
+    struct timespec timeout;
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_nsec = (timeoutMs % 1000) * 1000000;
+
+    int nbrEvents = kevent(loop->backendFD, NULL, 0, events, kDCEventLoopMaxEvents, timeoutMs < 0 ? NULL : &timeout);
+    __DCEventLoopUpdateTime(loop);
+
+    for (int i = 0; i < nbrEvents; i++) {
+        DCEventLoopEvents ready = kDCEventLoopEventNone;
+        if (events[i].filter == EVFILT_READ) ready |= kDCEventLoopEventRead;
+        if (events[i].filter == EVFILT_WRITE) ready |= kDCEventLoopEventWrite;
+        if (events[i].flags & EV_ERROR) ready |= kDCEventLoopEventError;
+        if (events[i].flags & EV_EOF) ready |= kDCEventLoopEventHangUp;
+
+        __DCEventLoopDispatch(loop, (__DCEventLoopHandler *) events[i].udata, ready);
+    }
+
+    return nbrEvents;
+}
+
+const __DCEventLoopBackendOps __DCEventLoopKqueueOps = {
+    __DCEventLoopKqueueCreate,
+    __DCEventLoopKqueueRelease,
+    __DCEventLoopKqueueAdd,
+    __DCEventLoopKqueueRemove,
+    __DCEventLoopKqueueUpdate,
+    __DCEventLoopKqueuePoll,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+#endif /* __APPLE__ || __FreeBSD__ */
@@ -0,0 +1,218 @@
+#include "DCHTTPMessage.h"
+#include "DCBufferPool.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define TRACE(p) log_trace("message=%p\n", p)
+
+struct __DCHTTPMessage {
+    unsigned int refCount;
+    // The worker's pool, the message and its body go back there
+    DCBufferPoolRef buffers;
+    size_t allocationSize;
+
+    bool isRequest;
+
+    DCHTTPSpan method;
+    DCHTTPSpan target;
+    DCHTTPSpan reason;
+    unsigned short status;
+    unsigned char versionMajor;
+    unsigned char versionMinor;
+
+    long long contentLength;
+    bool chunked;
+    bool hasTransferEncoding;
+    bool keepAlive;
+
+    unsigned int nbrHeaders;
+    DCHTTPHeader *headers;
+
+    // Both point into the same allocation as the message itself
+    size_t headerLength;
+    uint8_t *header;
+
+    uint8_t *body;
+    size_t bodyLength;
+    size_t bodyCapacity;
+};
+
+// MARK: - Lifecycle
+
+DCHTTPMessageRef DCHTTPMessageCreate(const DCHTTPParser *parser, const char *header) {
+    size_t headersSize = parser->nbrHeaders * sizeof(DCHTTPHeader);
+    DCBufferPoolRef buffers = DCBufferPoolGetCurrent();
+    size_t allocationSize;
+    struct __DCHTTPMessage *message = (struct __DCHTTPMessage *) DCBufferPoolAlloc(buffers, sizeof(struct __DCHTTPMessage) + headersSize + parser->idx, &allocationSize);
+    if (!message)
+        return NULL;
+
+    message->refCount = 1;
+    message->buffers = buffers;
+    message->allocationSize = allocationSize;
+    message->isRequest = parser->type == kDCHTTPParserTypeRequest;
+    message->method = parser->method;
+    message->target = parser->target;
+    message->reason = parser->reason;
+    message->status = parser->status;
+    message->versionMajor = parser->versionMajor;
+    message->versionMinor = parser->versionMinor;
+    message->contentLength = parser->contentLength;
+    message->chunked = parser->chunked;
+    message->hasTransferEncoding = parser->hasTransferEncoding;
+    message->keepAlive = DCHTTPParserIsKeepAlive(parser);
+
+    message->nbrHeaders = parser->nbrHeaders;
+    message->headers = (DCHTTPHeader *) (message + 1);
+    memcpy(message->headers, parser->headers, headersSize);
+
+    message->headerLength = parser->idx;
+    message->header = ((uint8_t *) message->headers) + headersSize;
+    memcpy(message->header, header, parser->idx);
+
+    message->body = NULL;
+    message->bodyLength = 0;
+    message->bodyCapacity = 0;
+    return message;
+}
+
+DCHTTPMessageRef DCHTTPMessageCreateWithBytes(DCHTTPParserType type, const char *bytes, size_t length) {
+    DCHTTPParser parser;
+    DCHTTPParserInit(&parser, type);
+    if (DCHTTPParserExecute(&parser, bytes, length) != kDCHTTPParserResultComplete)
+        return NULL;
+    return DCHTTPMessageCreate(&parser, bytes);
+}
+
+DCHTTPMessageRef DCHTTPMessageRetain(DCHTTPMessageRef message) {
+    message->refCount++;
+    return message;
+}
+
+void DCHTTPMessageRelease(DCHTTPMessageRef message) {
+    if (--message->refCount > 0)
+        return;
+    TRACE(message);
+    DCBufferPoolFree(message->buffers, message->body, message->bodyCapacity);
+    DCBufferPoolFree(message->buffers, message, message->allocationSize);
+}
+
+// MARK: - Getters
+
+static inline DCHTTPSlice __DCHTTPMessageSlice(DCHTTPMessageRef message, DCHTTPSpan span) {
+    DCHTTPSlice slice = { (const char *) message->header + span.offset, span.length };
+    return slice;
+}
+
+bool DCHTTPMessageIsRequest(DCHTTPMessageRef message) {
+    return message->isRequest;
+}
+
+DCHTTPSlice DCHTTPMessageGetMethod(DCHTTPMessageRef message) {
+    return __DCHTTPMessageSlice(message, message->method);
+}
+
+DCHTTPSlice DCHTTPMessageGetTarget(DCHTTPMessageRef message) {
+    return __DCHTTPMessageSlice(message, message->target);
+}
+
+unsigned short DCHTTPMessageGetStatusCode(DCHTTPMessageRef message) {
+    return message->status;
+}
+
+DCHTTPSlice DCHTTPMessageGetReason(DCHTTPMessageRef message) {
+    return __DCHTTPMessageSlice(message, message->reason);
+}
+
+unsigned int DCHTTPMessageGetVersionMajor(DCHTTPMessageRef message) {
+    return message->versionMajor;
+}
+
+unsigned int DCHTTPMessageGetVersionMinor(DCHTTPMessageRef message) {
+    return message->versionMinor;
+}
+
+unsigned int DCHTTPMessageGetHeaderCount(DCHTTPMessageRef message) {
+    return message->nbrHeaders;
+}
+
+void DCHTTPMessageGetHeaderAtIndex(DCHTTPMessageRef message, unsigned int idx, DCHTTPSlice *name, DCHTTPSlice *value) {
+    if (name) *name = __DCHTTPMessageSlice(message, message->headers[idx].name);
+    if (value) *value = __DCHTTPMessageSlice(message, message->headers[idx].value);
+}
+
+bool DCHTTPMessageGetHeader(DCHTTPMessageRef message, const char *name, DCHTTPSlice *value) {
+    size_t length = strlen(name);
+    for (unsigned int i = 0; i < message->nbrHeaders; i++) {
+        DCHTTPSpan span = message->headers[i].name;
+        if (span.length == length && strncasecmp((const char *) message->header + span.offset, name, length) == 0) {
+            if (value) *value = __DCHTTPMessageSlice(message, message->headers[i].value);
+            return true;
+        }
+    }
+    return false;
+}
+
+long long DCHTTPMessageGetContentLength(DCHTTPMessageRef message) {
+    return message->contentLength;
+}
+
+bool DCHTTPMessageIsChunked(DCHTTPMessageRef message) {
+    return message->chunked;
+}
+
+bool DCHTTPMessageHasTransferEncoding(DCHTTPMessageRef message) {
+    return message->hasTransferEncoding;
+}
+
+bool DCHTTPMessageIsKeepAlive(DCHTTPMessageRef message) {
+    return message->keepAlive;
+}
+
+const uint8_t* DCHTTPMessageGetHeaderBytes(DCHTTPMessageRef message) {
+    return message->header;
+}
+
+size_t DCHTTPMessageGetHeaderLength(DCHTTPMessageRef message) {
+    return message->headerLength;
+}
+
+// MARK: - Body
+
+void DCHTTPMessageAppendBody(DCHTTPMessageRef message, const uint8_t *bytes, size_t length) {
+    if (message->bodyLength + length > message->bodyCapacity) {
+        size_t capacity = message->bodyCapacity ? message->bodyCapacity : 1024;
+        while (capacity < message->bodyLength + length)
+            capacity *= 2;
+        uint8_t *body = (uint8_t *) DCBufferPoolAlloc(message->buffers, capacity, &capacity);
+        if (!body) {
+            log_error("message=%p, couldn't grow body to %zu bytes\n", message, capacity);
+            return;
+        }
+        if (message->body)
+            memcpy(body, message->body, message->bodyLength);
+        DCBufferPoolFree(message->buffers, message->body, message->bodyCapacity);
+        message->body = body;
+        message->bodyCapacity = capacity;
+    }
+    memcpy(message->body + message->bodyLength, bytes, length);
+    message->bodyLength += length;
+}
+
+const uint8_t* DCHTTPMessageGetBody(DCHTTPMessageRef message) {
+    return message->body;
+}
+
+size_t DCHTTPMessageGetBodyLength(DCHTTPMessageRef message) {
+    return message->bodyLength;
+}
+
+// MARK: - Slices
+
+bool DCHTTPSliceEqualsCaseInsensitive(DCHTTPSlice slice, const char *string) {
+    size_t length = strlen(string);
+    return slice.length == length && strncasecmp(slice.data, string, length) == 0;
+}
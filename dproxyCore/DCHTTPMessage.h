@@ -0,0 +1,57 @@
+#ifndef DCHTTPMessage_h
+#define DCHTTPMessage_h
+
+#include "DCHTTPParser.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct __DCHTTPMessage*         DCHTTPMessageRef;
+
+typedef struct DCHTTPSlice {
+    const char *data;
+    size_t length;
+} DCHTTPSlice;
+
+/*
+ * A received message header, copied out of the read buffer in one
+ * allocation together with the parser's spans so it outlives the buffer.
+ * It's forwarded byte for byte as it was received. The body is only part
+ * of the message when the connection doesn't stream bodies.
+ */
+DCHTTPMessageRef DCHTTPMessageCreate(const DCHTTPParser *parser, const char *header);
+// NULL unless `bytes` start with a complete header
+DCHTTPMessageRef DCHTTPMessageCreateWithBytes(DCHTTPParserType type, const char *bytes, size_t length);
+DCHTTPMessageRef DCHTTPMessageRetain(DCHTTPMessageRef message);
+void DCHTTPMessageRelease(DCHTTPMessageRef message);
+
+bool DCHTTPMessageIsRequest(DCHTTPMessageRef message);
+DCHTTPSlice DCHTTPMessageGetMethod(DCHTTPMessageRef message);
+DCHTTPSlice DCHTTPMessageGetTarget(DCHTTPMessageRef message);
+unsigned short DCHTTPMessageGetStatusCode(DCHTTPMessageRef message);
+DCHTTPSlice DCHTTPMessageGetReason(DCHTTPMessageRef message);
+unsigned int DCHTTPMessageGetVersionMajor(DCHTTPMessageRef message);
+unsigned int DCHTTPMessageGetVersionMinor(DCHTTPMessageRef message);
+
+unsigned int DCHTTPMessageGetHeaderCount(DCHTTPMessageRef message);
+void DCHTTPMessageGetHeaderAtIndex(DCHTTPMessageRef message, unsigned int idx, DCHTTPSlice *name, DCHTTPSlice *value);
+// First header called `name`, compared case insensitively
+bool DCHTTPMessageGetHeader(DCHTTPMessageRef message, const char *name, DCHTTPSlice *value);
+
+// -1 when there's no Content-Length
+long long DCHTTPMessageGetContentLength(DCHTTPMessageRef message);
+bool DCHTTPMessageIsChunked(DCHTTPMessageRef message);
+bool DCHTTPMessageHasTransferEncoding(DCHTTPMessageRef message);
+bool DCHTTPMessageIsKeepAlive(DCHTTPMessageRef message);
+
+const uint8_t* DCHTTPMessageGetHeaderBytes(DCHTTPMessageRef message);
+size_t DCHTTPMessageGetHeaderLength(DCHTTPMessageRef message);
+
+void DCHTTPMessageAppendBody(DCHTTPMessageRef message, const uint8_t *bytes, size_t length);
+const uint8_t* DCHTTPMessageGetBody(DCHTTPMessageRef message);
+size_t DCHTTPMessageGetBodyLength(DCHTTPMessageRef message);
+
+bool DCHTTPSliceEqualsCaseInsensitive(DCHTTPSlice slice, const char *string);
+
+#endif /* DCHTTPMessage_h */
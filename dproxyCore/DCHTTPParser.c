@@ -0,0 +1,557 @@
+#include "DCHTTPParser.h"
+#include "DCHTTPScan-Private.h"
+#include "log.h"
+
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#define TRACE(p) log_trace("parser=%p\n", p)
+
+typedef enum __DCHTTPParserState {
+    kDCHTTPParserStateStart = 0,
+    kDCHTTPParserStateMethod,
+    kDCHTTPParserStateTarget,
+    kDCHTTPParserStateRequestVersion,
+    kDCHTTPParserStateResponseVersion,
+    kDCHTTPParserStateStatus,
+    kDCHTTPParserStateReason,
+    kDCHTTPParserStateStartLineLF,
+    kDCHTTPParserStateHeaderStart,
+    kDCHTTPParserStateHeaderName,
+    kDCHTTPParserStateHeaderValueStart,
+    kDCHTTPParserStateHeaderValue,
+    kDCHTTPParserStateHeaderLF,
+    kDCHTTPParserStateHeadersLF,
+    kDCHTTPParserStateDone,
+    kDCHTTPParserStateError
+} __DCHTTPParserState;
+
+typedef enum __DCHTTPChunkState {
+    kDCHTTPChunkStateSize = 0,
+    kDCHTTPChunkStateSizeWhitespace,
+    kDCHTTPChunkStateExtension,
+    kDCHTTPChunkStateSizeLF,
+    kDCHTTPChunkStateData,
+    kDCHTTPChunkStateDataCR,
+    kDCHTTPChunkStateDataLF,
+    kDCHTTPChunkStateTrailerStart,
+    kDCHTTPChunkStateTrailer,
+    kDCHTTPChunkStateTrailerLF,
+    kDCHTTPChunkStateTrailersLF,
+    kDCHTTPChunkStateDone,
+    kDCHTTPChunkStateError
+} __DCHTTPChunkState;
+
+static inline DCHTTPSpan __DCHTTPSpanMake(size_t offset, size_t length) {
+    DCHTTPSpan span = { (uint32_t) offset, (uint32_t) length };
+    return span;
+}
+
+// MARK: - Enum to char* helpers
+
+inline char* DCHTTPParserErrorString(DCHTTPParserError error) {
+    switch (error) {
+        case kDCHTTPParserErrorNone: return "kDCHTTPParserErrorNone";
+        case kDCHTTPParserErrorInvalidMethod: return "kDCHTTPParserErrorInvalidMethod";
+        case kDCHTTPParserErrorInvalidTarget: return "kDCHTTPParserErrorInvalidTarget";
+        case kDCHTTPParserErrorInvalidVersion: return "kDCHTTPParserErrorInvalidVersion";
+        case kDCHTTPParserErrorInvalidStatus: return "kDCHTTPParserErrorInvalidStatus";
+        case kDCHTTPParserErrorInvalidHeader: return "kDCHTTPParserErrorInvalidHeader";
+        case kDCHTTPParserErrorInvalidContentLength: return "kDCHTTPParserErrorInvalidContentLength";
+        case kDCHTTPParserErrorTooManyHeaders: return "kDCHTTPParserErrorTooManyHeaders";
+        case kDCHTTPParserErrorTooLarge: return "kDCHTTPParserErrorTooLarge";
+        case kDCHTTPParserErrorInvalidChunk: return "kDCHTTPParserErrorInvalidChunk";
+    }
+    return "INVALID";
+}
+
+// MARK: - Lifecycle
+
+void DCHTTPParserInit(DCHTTPParser *parser, DCHTTPParserType type) {
+    // Only what's read before it's written is reset, the header table is
+    // left alone so that starting a new message stays cheap.
+    parser->type = type;
+    parser->state = kDCHTTPParserStateStart;
+    parser->error = kDCHTTPParserErrorNone;
+    parser->idx = 0;
+    parser->mark = 0;
+    parser->method = parser->target = parser->reason = __DCHTTPSpanMake(0, 0);
+    parser->status = 0;
+    parser->versionMajor = parser->versionMinor = 0;
+    parser->nbrHeaders = 0;
+    parser->contentLength = -1;
+    parser->chunked = false;
+    parser->hasTransferEncoding = false;
+    parser->connectionClose = false;
+    parser->connectionKeepAlive = false;
+    parser->connectionUpgrade = false;
+}
+
+// MARK: - Header semantics
+
+static inline bool __DCHTTPNameIs(const char *buffer, DCHTTPSpan span, const char *name, size_t length) {
+    return span.length == length && strncasecmp(buffer + span.offset, name, length) == 0;
+}
+
+// Next element of a comma separated list, returns where to continue from
+static const char* __DCHTTPNextListElement(const char *p, const char *end, const char **element, size_t *length) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        p++;
+    *element = p;
+    while (p < end && *p != ',')
+        p++;
+
+    const char *last = p;
+    while (last > *element && (last[-1] == ' ' || last[-1] == '\t'))
+        last--;
+    *length = (size_t) (last - *element);
+    return p;
+}
+
+static bool __DCHTTPParserHeaderComplete(DCHTTPParser *parser, const char *buffer, const DCHTTPHeader *header) {
+    const char *value = buffer + header->value.offset;
+    const char *end = value + header->value.length;
+
+    if (__DCHTTPNameIs(buffer, header->name, "content-length", 14)) {
+        if (value == end)
+            return false;
+
+        long long contentLength = 0;
+        for (const char *p = value; p < end; p++) {
+            if (*p < '0' || *p > '9' || contentLength > (LLONG_MAX - 9) / 10)
+                return false;
+            contentLength = contentLength * 10 + (*p - '0');
+        }
+
+        // Repeated with another value is how requests get smuggled
+        if (parser->contentLength != -1 && parser->contentLength != contentLength)
+            return false;
+        parser->contentLength = contentLength;
+    } else if (__DCHTTPNameIs(buffer, header->name, "transfer-encoding", 17)) {
+        // Only a final "chunked" frames the body, see RFC 7230 3.3.3
+        parser->hasTransferEncoding = true;
+        parser->chunked = false;
+        const char *element;
+        size_t length;
+        for (const char *p = value; p < end;) {
+            p = __DCHTTPNextListElement(p, end, &element, &length);
+            if (length > 0)
+                parser->chunked = length == 7 && strncasecmp(element, "chunked", 7) == 0;
+        }
+    } else if (__DCHTTPNameIs(buffer, header->name, "connection", 10)) {
+        const char *element;
+        size_t length;
+        for (const char *p = value; p < end;) {
+            p = __DCHTTPNextListElement(p, end, &element, &length);
+            if (length == 5 && strncasecmp(element, "close", 5) == 0)
+                parser->connectionClose = true;
+            else if (length == 10 && strncasecmp(element, "keep-alive", 10) == 0)
+                parser->connectionKeepAlive = true;
+            else if (length == 7 && strncasecmp(element, "upgrade", 7) == 0)
+                parser->connectionUpgrade = true;
+        }
+    }
+    return true;
+}
+
+bool DCHTTPParserIsKeepAlive(const DCHTTPParser *parser) {
+    if (parser->connectionClose)
+        return false;
+    if (parser->versionMajor > 1 || (parser->versionMajor == 1 && parser->versionMinor >= 1))
+        return true;
+    return parser->connectionKeepAlive;
+}
+
+static bool __DCHTTPParseVersion(DCHTTPParser *parser, const char *version, size_t length) {
+    if (length != 8 || memcmp(version, "HTTP/", 5) != 0 ||
+        version[5] < '0' || version[5] > '9' || version[6] != '.' || version[7] < '0' || version[7] > '9')
+        return false;
+    parser->versionMajor = (unsigned char) (version[5] - '0');
+    parser->versionMinor = (unsigned char) (version[7] - '0');
+    return true;
+}
+
+// MARK: - Parsing
+
+DCHTTPParserResult DCHTTPParserExecute(DCHTTPParser *parser, const char *buffer, size_t length) {
+    if (parser->state == kDCHTTPParserStateDone)
+        return kDCHTTPParserResultComplete;
+    if (parser->state == kDCHTTPParserStateError)
+        return kDCHTTPParserResultError;
+
+    DCHTTPParserError error = kDCHTTPParserErrorNone;
+    if (length > UINT32_MAX) {
+        error = kDCHTTPParserErrorTooLarge;
+        goto fail;
+    }
+
+    __DCHTTPParserState state = (__DCHTTPParserState) parser->state;
+    size_t mark = parser->mark;
+    size_t i = parser->idx;
+    const unsigned char *bytes = (const unsigned char *) buffer;
+    const DCHTTPScanner *scan = DCHTTPScanGetDefault();
+
+    while (i < length) {
+        switch (state) {
+            case kDCHTTPParserStateStart:
+                // Empty lines in front of a message are ignored, RFC 7230 3.5
+                if (bytes[i] == '\r' || bytes[i] == '\n') {
+                    i++;
+                    break;
+                }
+                mark = i;
+                state = parser->type == kDCHTTPParserTypeRequest ? kDCHTTPParserStateMethod : kDCHTTPParserStateResponseVersion;
+                break;
+
+            case kDCHTTPParserStateMethod:
+                i = scan->token(bytes, i, length);
+                if (i == length)
+                    break;
+                if (bytes[i] != ' ' || i == mark) {
+                    error = kDCHTTPParserErrorInvalidMethod;
+                    goto fail;
+                }
+                parser->method = __DCHTTPSpanMake(mark, i - mark);
+                mark = ++i;
+                state = kDCHTTPParserStateTarget;
+                break;
+
+            case kDCHTTPParserStateTarget:
+                i = scan->target(bytes, i, length);
+                if (i == length)
+                    break;
+                if (bytes[i] != ' ' || i == mark) {
+                    error = kDCHTTPParserErrorInvalidTarget;
+                    goto fail;
+                }
+                parser->target = __DCHTTPSpanMake(mark, i - mark);
+                mark = ++i;
+                state = kDCHTTPParserStateRequestVersion;
+                break;
+
+            case kDCHTTPParserStateRequestVersion:
+                while (i < length && bytes[i] != '\r' && i - mark < 8)
+                    i++;
+                if (i == length)
+                    break;
+                if (bytes[i] != '\r' || !__DCHTTPParseVersion(parser, buffer + mark, i - mark)) {
+                    error = kDCHTTPParserErrorInvalidVersion;
+                    goto fail;
+                }
+                i++;
+                state = kDCHTTPParserStateStartLineLF;
+                break;
+
+            case kDCHTTPParserStateResponseVersion:
+                while (i < length && bytes[i] != ' ' && i - mark < 8)
+                    i++;
+                if (i == length)
+                    break;
+                if (bytes[i] != ' ' || !__DCHTTPParseVersion(parser, buffer + mark, i - mark)) {
+                    error = kDCHTTPParserErrorInvalidVersion;
+                    goto fail;
+                }
+                mark = ++i;
+                state = kDCHTTPParserStateStatus;
+                break;
+
+            case kDCHTTPParserStateStatus:
+                while (i < length && bytes[i] >= '0' && bytes[i] <= '9' && i - mark < 3)
+                    i++;
+                if (i == length)
+                    break;
+                if (i - mark != 3 || (bytes[i] != ' ' && bytes[i] != '\r')) {
+                    error = kDCHTTPParserErrorInvalidStatus;
+                    goto fail;
+                }
+                parser->status = (unsigned short) ((bytes[mark] - '0') * 100 + (bytes[mark + 1] - '0') * 10 + (bytes[mark + 2] - '0'));
+
+                // The reason phrase may be left out, space and all
+                if (bytes[i] == '\r') {
+                    parser->reason = __DCHTTPSpanMake(i, 0);
+                    i++;
+                    state = kDCHTTPParserStateStartLineLF;
+                } else {
+                    mark = ++i;
+                    state = kDCHTTPParserStateReason;
+                }
+                break;
+
+            case kDCHTTPParserStateReason:
+                i = scan->value(bytes, i, length);
+                if (i == length)
+                    break;
+                if (bytes[i] != '\r') {
+                    error = kDCHTTPParserErrorInvalidStatus;
+                    goto fail;
+                }
+                parser->reason = __DCHTTPSpanMake(mark, i - mark);
+                i++;
+                state = kDCHTTPParserStateStartLineLF;
+                break;
+
+            case kDCHTTPParserStateStartLineLF:
+            case kDCHTTPParserStateHeaderLF:
+                if (bytes[i] != '\n') {
+                    error = kDCHTTPParserErrorInvalidHeader;
+                    goto fail;
+                }
+                i++;
+                state = kDCHTTPParserStateHeaderStart;
+                break;
+
+            case kDCHTTPParserStateHeaderStart:
+                if (bytes[i] == '\r') {
+                    i++;
+                    state = kDCHTTPParserStateHeadersLF;
+                    break;
+                }
+                // Also rejects obsolete line folding, which starts with whitespace
+                if (!__DCHTTPIsToken(bytes[i])) {
+                    error = kDCHTTPParserErrorInvalidHeader;
+                    goto fail;
+                }
+                if (parser->nbrHeaders == kDCHTTPParserMaxHeaders) {
+                    error = kDCHTTPParserErrorTooManyHeaders;
+                    goto fail;
+                }
+                mark = i;
+                state = kDCHTTPParserStateHeaderName;
+                break;
+
+            case kDCHTTPParserStateHeaderName:
+                i = scan->token(bytes, i, length);
+                if (i == length)
+                    break;
+                // No whitespace is allowed in front of the colon, RFC 7230 3.2.4
+                if (bytes[i] != ':') {
+                    error = kDCHTTPParserErrorInvalidHeader;
+                    goto fail;
+                }
+                parser->headers[parser->nbrHeaders].name = __DCHTTPSpanMake(mark, i - mark);
+                i++;
+                state = kDCHTTPParserStateHeaderValueStart;
+                break;
+
+            case kDCHTTPParserStateHeaderValueStart:
+                while (i < length && (bytes[i] == ' ' || bytes[i] == '\t'))
+                    i++;
+                if (i == length)
+                    break;
+                mark = i;
+                state = kDCHTTPParserStateHeaderValue;
+                break;
+
+            case kDCHTTPParserStateHeaderValue:
+                i = scan->value(bytes, i, length);
+                if (i == length)
+                    break;
+                if (bytes[i] != '\r') {
+                    error = kDCHTTPParserErrorInvalidHeader;
+                    goto fail;
+                }
+                {
+                    size_t end = i;
+                    while (end > mark && (bytes[end - 1] == ' ' || bytes[end - 1] == '\t'))
+                        end--;
+
+                    DCHTTPHeader *header = &(parser->headers[parser->nbrHeaders]);
+                    header->value = __DCHTTPSpanMake(mark, end - mark);
+                    if (!__DCHTTPParserHeaderComplete(parser, buffer, header)) {
+                        error = kDCHTTPParserErrorInvalidContentLength;
+                        goto fail;
+                    }
+                    parser->nbrHeaders++;
+                }
+                i++;
+                state = kDCHTTPParserStateHeaderLF;
+                break;
+
+            case kDCHTTPParserStateHeadersLF:
+                if (bytes[i] != '\n') {
+                    error = kDCHTTPParserErrorInvalidHeader;
+                    goto fail;
+                }
+                i++;
+                parser->state = kDCHTTPParserStateDone;
+                parser->idx = (uint32_t) i;
+                parser->mark = (uint32_t) i;
+                return kDCHTTPParserResultComplete;
+
+            case kDCHTTPParserStateDone:
+            case kDCHTTPParserStateError:
+                break;
+        }
+    }
+
+    parser->state = state;
+    parser->idx = (uint32_t) i;
+    parser->mark = (uint32_t) mark;
+    return kDCHTTPParserResultIncomplete;
+
+fail:
+    log_debug("parser=%p, %s\n", parser, DCHTTPParserErrorString(error));
+    parser->state = kDCHTTPParserStateError;
+    parser->error = error;
+    return kDCHTTPParserResultError;
+}
+
+// MARK: - Chunked bodies
+
+void DCHTTPChunkDecoderInit(DCHTTPChunkDecoder *decoder) {
+    decoder->state = kDCHTTPChunkStateSize;
+    decoder->error = kDCHTTPParserErrorNone;
+    decoder->chunkLeft = 0;
+    decoder->lineLength = 0;
+}
+
+static inline int __DCHTTPHexValue(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+DCHTTPParserResult DCHTTPChunkDecoderExecute(DCHTTPChunkDecoder *decoder, const char *buffer, size_t length, size_t *consumed) {
+    const unsigned char *bytes = (const unsigned char *) buffer;
+    __DCHTTPChunkState state = (__DCHTTPChunkState) decoder->state;
+    size_t i = 0;
+    *consumed = 0;
+
+    if (state == kDCHTTPChunkStateDone)
+        return kDCHTTPParserResultComplete;
+    if (state == kDCHTTPChunkStateError)
+        return kDCHTTPParserResultError;
+
+    while (i < length) {
+        switch (state) {
+            case kDCHTTPChunkStateSize: {
+                int digit = __DCHTTPHexValue(bytes[i]);
+                if (digit >= 0) {
+                    // 15 hex digits is more than any body we could relay
+                    if (++decoder->lineLength > 15)
+                        goto fail;
+                    decoder->chunkLeft = decoder->chunkLeft * 16 + (unsigned long long) digit;
+                    i++;
+                    break;
+                }
+                if (decoder->lineLength == 0)
+                    goto fail;
+                state = kDCHTTPChunkStateSizeWhitespace;
+                break;
+            }
+
+            case kDCHTTPChunkStateSizeWhitespace:
+                // Only whitespace may come between the size and its extensions
+                if (bytes[i] == ' ' || bytes[i] == '\t') {
+                    if (++decoder->lineLength > kDCHTTPChunkMaxLine)
+                        goto fail;
+                    i++;
+                } else if (bytes[i] == ';') {
+                    state = kDCHTTPChunkStateExtension;
+                } else if (bytes[i] == '\r') {
+                    i++;
+                    state = kDCHTTPChunkStateSizeLF;
+                } else {
+                    goto fail;
+                }
+                break;
+
+            case kDCHTTPChunkStateExtension:
+                // Extensions (and whitespace in front of them) are passed on, not interpreted
+                while (i < length && bytes[i] != '\r' && __DCHTTPIsValue(bytes[i]) && decoder->lineLength < kDCHTTPChunkMaxLine) {
+                    decoder->lineLength++;
+                    i++;
+                }
+                if (i == length)
+                    break;
+                if (bytes[i] != '\r')
+                    goto fail;
+                i++;
+                state = kDCHTTPChunkStateSizeLF;
+                break;
+
+            case kDCHTTPChunkStateSizeLF:
+                if (bytes[i] != '\n')
+                    goto fail;
+                i++;
+                decoder->lineLength = 0;
+                state = decoder->chunkLeft > 0 ? kDCHTTPChunkStateData : kDCHTTPChunkStateTrailerStart;
+                break;
+
+            case kDCHTTPChunkStateData: {
+                size_t available = length - i;
+                size_t take = decoder->chunkLeft < available ? (size_t) decoder->chunkLeft : available;
+                decoder->chunkLeft -= take;
+                i += take;
+                if (decoder->chunkLeft == 0)
+                    state = kDCHTTPChunkStateDataCR;
+                break;
+            }
+
+            case kDCHTTPChunkStateDataCR:
+            case kDCHTTPChunkStateTrailerLF:
+                if (bytes[i] != (state == kDCHTTPChunkStateDataCR ? '\r' : '\n'))
+                    goto fail;
+                i++;
+                state = state == kDCHTTPChunkStateDataCR ? kDCHTTPChunkStateDataLF : kDCHTTPChunkStateTrailerStart;
+                break;
+
+            case kDCHTTPChunkStateDataLF:
+                if (bytes[i] != '\n')
+                    goto fail;
+                i++;
+                state = kDCHTTPChunkStateSize;
+                break;
+
+            case kDCHTTPChunkStateTrailerStart:
+                if (bytes[i] == '\r') {
+                    i++;
+                    state = kDCHTTPChunkStateTrailersLF;
+                    break;
+                }
+                if (!__DCHTTPIsToken(bytes[i]))
+                    goto fail;
+                decoder->lineLength = 0;
+                state = kDCHTTPChunkStateTrailer;
+                break;
+
+            case kDCHTTPChunkStateTrailer:
+                while (i < length && bytes[i] != '\r' && __DCHTTPIsValue(bytes[i]) && decoder->lineLength < kDCHTTPChunkMaxLine) {
+                    decoder->lineLength++;
+                    i++;
+                }
+                if (i == length)
+                    break;
+                if (bytes[i] != '\r')
+                    goto fail;
+                i++;
+                state = kDCHTTPChunkStateTrailerLF;
+                break;
+
+            case kDCHTTPChunkStateTrailersLF:
+                if (bytes[i] != '\n')
+                    goto fail;
+                i++;
+                decoder->state = kDCHTTPChunkStateDone;
+                *consumed = i;
+                return kDCHTTPParserResultComplete;
+
+            case kDCHTTPChunkStateDone:
+            case kDCHTTPChunkStateError:
+                break;
+        }
+    }
+
+    decoder->state = state;
+    *consumed = i;
+    return kDCHTTPParserResultIncomplete;
+
+fail:
+    log_debug("decoder=%p, %s\n", decoder, DCHTTPParserErrorString(kDCHTTPParserErrorInvalidChunk));
+    decoder->state = kDCHTTPChunkStateError;
+    decoder->error = kDCHTTPParserErrorInvalidChunk;
+    *consumed = i;
+    return kDCHTTPParserResultError;
+}
@@ -0,0 +1,113 @@
+#ifndef DCHTTPParser_h
+#define DCHTTPParser_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define kDCHTTPParserMaxHeaders 64
+// Longest chunk-size line (extensions included) or trailer field
+#define kDCHTTPChunkMaxLine     4096
+
+typedef enum DCHTTPParserType {
+    kDCHTTPParserTypeRequest = 0,
+    kDCHTTPParserTypeResponse = 1
+} DCHTTPParserType;
+
+typedef enum DCHTTPParserResult {
+    kDCHTTPParserResultIncomplete = 0,
+    kDCHTTPParserResultComplete = 1,
+    kDCHTTPParserResultError = 2
+} DCHTTPParserResult;
+
+typedef enum DCHTTPParserError {
+    kDCHTTPParserErrorNone = 0,
+    kDCHTTPParserErrorInvalidMethod,
+    kDCHTTPParserErrorInvalidTarget,
+    kDCHTTPParserErrorInvalidVersion,
+    kDCHTTPParserErrorInvalidStatus,
+    kDCHTTPParserErrorInvalidHeader,
+    kDCHTTPParserErrorInvalidContentLength,
+    kDCHTTPParserErrorTooManyHeaders,
+    kDCHTTPParserErrorTooLarge,
+    kDCHTTPParserErrorInvalidChunk
+} DCHTTPParserError;
+
+// A piece of the message, relative to its first byte
+typedef struct DCHTTPSpan {
+    uint32_t offset;
+    uint32_t length;
+} DCHTTPSpan;
+
+typedef struct DCHTTPHeader {
+    DCHTTPSpan name;
+    DCHTTPSpan value;
+} DCHTTPHeader;
+
+/*
+ * Resumable HTTP/1.x header parser that never allocates. Everything it
+ * records is a span into the caller's buffer, which must hold the message
+ * from its first byte: feed it the same buffer again, grown by whatever
+ * arrived since, and it picks up where it stopped. Any split point works.
+ *
+ * The struct is public so it can live inline in whatever owns the buffer.
+ */
+typedef struct DCHTTPParser {
+    DCHTTPParserType type;
+    int state;
+    DCHTTPParserError error;
+
+    // Bytes parsed so far; the header length once complete
+    uint32_t idx;
+    // Where the token being parsed started
+    uint32_t mark;
+
+    DCHTTPSpan method;
+    DCHTTPSpan target;
+    DCHTTPSpan reason;
+    unsigned short status;
+    unsigned char versionMajor;
+    unsigned char versionMinor;
+
+    DCHTTPHeader headers[kDCHTTPParserMaxHeaders];
+    unsigned int nbrHeaders;
+
+    // Framing, from Content-Length, Transfer-Encoding and Connection
+    long long contentLength;    // -1 when absent
+    bool chunked;
+    bool hasTransferEncoding;
+    bool connectionClose;
+    bool connectionKeepAlive;
+    bool connectionUpgrade;
+} DCHTTPParser;
+
+void DCHTTPParserInit(DCHTTPParser *parser, DCHTTPParserType type);
+
+// `buffer` holds `length` bytes of the message, starting at its first byte
+DCHTTPParserResult DCHTTPParserExecute(DCHTTPParser *parser, const char *buffer, size_t length);
+
+// HTTP/1.1 unless "Connection: close", HTTP/1.0 only with "Connection: keep-alive"
+bool DCHTTPParserIsKeepAlive(const DCHTTPParser *parser);
+
+char* DCHTTPParserErrorString(DCHTTPParserError error);
+
+/*
+ * Finds where a chunked body ends without keeping any of it, so the body
+ * can be relayed as it passes through, framing and trailers included.
+ * Unlike the header parser it's fed every byte only once.
+ */
+typedef struct DCHTTPChunkDecoder {
+    int state;
+    DCHTTPParserError error;
+    unsigned long long chunkLeft;
+    unsigned int lineLength;
+} DCHTTPChunkDecoder;
+
+void DCHTTPChunkDecoderInit(DCHTTPChunkDecoder *decoder);
+
+// `*consumed` is how many of the `length` bytes belong to the body, all of
+// them unless it's complete.
+DCHTTPParserResult DCHTTPChunkDecoderExecute(DCHTTPChunkDecoder *decoder, const char *buffer, size_t length, size_t *consumed);
+
+#endif /* DCHTTPParser_h */
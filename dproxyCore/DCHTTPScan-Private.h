@@ -0,0 +1,23 @@
+#ifndef DCHTTPScan_Private_h
+#define DCHTTPScan_Private_h
+
+#include "DCHTTPScan.h"
+
+// RFC 7230 tchar: "!#$%&'*+-.^_`|~", digits and letters
+extern const unsigned char __DCHTTPTokenChars[256];
+
+static inline bool __DCHTTPIsToken(unsigned char c) {
+    return __DCHTTPTokenChars[c] != 0;
+}
+
+// Field values and reason phrases: visible characters, SP, HTAB and obs-text
+static inline bool __DCHTTPIsValue(unsigned char c) {
+    return (c >= 0x20 && c != 0x7F) || c == '\t';
+}
+
+// Request targets never contain whitespace or control characters
+static inline bool __DCHTTPIsTarget(unsigned char c) {
+    return c > 0x20 && c != 0x7F;
+}
+
+#endif /* DCHTTPScan_Private_h */
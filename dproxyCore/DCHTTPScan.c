@@ -0,0 +1,277 @@
+#include "DCHTTPScan-Private.h"
+#include "log.h"
+
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(DC_DISABLE_SIMD)
+#define DC_HTTP_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+const unsigned char __DCHTTPTokenChars[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+    ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+    ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1
+};
+
+// MARK: - Enum to char* helpers
+
+inline char* DCHTTPScanLevelString(DCHTTPScanLevel level) {
+    switch (level) {
+        case kDCHTTPScanLevelScalar: return "kDCHTTPScanLevelScalar";
+        case kDCHTTPScanLevelSSE42: return "kDCHTTPScanLevelSSE42";
+        case kDCHTTPScanLevelAVX2: return "kDCHTTPScanLevelAVX2";
+    }
+    return "INVALID";
+}
+
+// MARK: - Scalar
+
+static size_t __DCHTTPScanTokenScalar(const uint8_t *bytes, size_t i, size_t length) {
+    while (i < length && __DCHTTPIsToken(bytes[i]))
+        i++;
+    return i;
+}
+
+static size_t __DCHTTPScanTargetScalar(const uint8_t *bytes, size_t i, size_t length) {
+    while (i < length && __DCHTTPIsTarget(bytes[i]))
+        i++;
+    return i;
+}
+
+static size_t __DCHTTPScanValueScalar(const uint8_t *bytes, size_t i, size_t length) {
+    while (i < length && __DCHTTPIsValue(bytes[i]))
+        i++;
+    return i;
+}
+
+static const DCHTTPScanner __DCHTTPScannerScalar = {
+    kDCHTTPScanLevelScalar,
+    __DCHTTPScanTokenScalar,
+    __DCHTTPScanTargetScalar,
+    __DCHTTPScanValueScalar
+};
+
+#if DC_HTTP_SCAN_X86
+
+// MARK: - Token classification
+//
+// tchar doesn't fit the 8 ranges PCMPESTRI takes, so tokens are classified
+// with two PSHUFB lookups instead: one bit per high nibble (row of the ASCII
+// table) and, per low nibble, the rows where that column is a token. A byte
+// is a token when the two lookups share a bit. Only rows 0-7 have tokens.
+
+static uint8_t __DCHTTPTokenLow[16];
+static uint8_t __DCHTTPTokenHigh[16];
+
+static void __DCHTTPScanBuildTokenTables(void) {
+    for (unsigned int row = 0; row < 8; row++) {
+        __DCHTTPTokenHigh[row] = (uint8_t) (1 << row);
+        for (unsigned int column = 0; column < 16; column++) {
+            if (__DCHTTPTokenChars[row * 16 + column])
+                __DCHTTPTokenLow[column] |= (uint8_t) (1 << row);
+        }
+    }
+}
+
+// MARK: - SSE4.2
+
+// Excluded ranges for PCMPESTRI, as (low, high) pairs
+static const char __DCHTTPTargetRanges[16] = "\x00\x20\x7f\x7f";
+static const char __DCHTTPValueRanges[16] = "\x00\x08\x0a\x1f\x7f\x7f";
+
+__attribute__((target("sse4.2")))
+static size_t __DCHTTPScanTokenSSE42(const uint8_t *bytes, size_t i, size_t length) {
+    const __m128i low = _mm_loadu_si128((const __m128i *) __DCHTTPTokenLow);
+    const __m128i high = _mm_loadu_si128((const __m128i *) __DCHTTPTokenHigh);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+        __m128i rows = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        __m128i columns = _mm_shuffle_epi8(low, _mm_and_si128(v, nibble));
+        __m128i invalid = _mm_cmpeq_epi8(_mm_and_si128(rows, columns), _mm_setzero_si128());
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(invalid);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return __DCHTTPScanTokenScalar(bytes, i, length);
+}
+
+__attribute__((target("sse4.2")))
+static size_t __DCHTTPScanTargetSSE42(const uint8_t *bytes, size_t i, size_t length) {
+    const __m128i ranges = _mm_loadu_si128((const __m128i *) __DCHTTPTargetRanges);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+        int idx = _mm_cmpestri(ranges, 4, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16)
+            return i + idx;
+    }
+    return __DCHTTPScanTargetScalar(bytes, i, length);
+}
+
+__attribute__((target("sse4.2")))
+static size_t __DCHTTPScanValueSSE42(const uint8_t *bytes, size_t i, size_t length) {
+    const __m128i ranges = _mm_loadu_si128((const __m128i *) __DCHTTPValueRanges);
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+        int idx = _mm_cmpestri(ranges, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_LEAST_SIGNIFICANT);
+        if (idx != 16)
+            return i + idx;
+    }
+    return __DCHTTPScanValueScalar(bytes, i, length);
+}
+
+static const DCHTTPScanner __DCHTTPScannerSSE42 = {
+    kDCHTTPScanLevelSSE42,
+    __DCHTTPScanTokenSSE42,
+    __DCHTTPScanTargetSSE42,
+    __DCHTTPScanValueSSE42
+};
+
+// MARK: - AVX2
+//
+// Whatever is left after the last 32 bytes takes one 16 byte step before
+// going scalar. That step is done here too rather than by calling into the
+// SSE4.2 kernels, so that short fields, which is most of them, stay cheap.
+
+#define __DCHTTPFirstInvalid(i, mask) \
+    do { unsigned int m = (unsigned int) (mask); if (m) return (i) + __builtin_ctz(m); } while (0)
+
+// Bytes <= `max`, compared unsigned
+__attribute__((target("avx2")))
+static inline __m256i __DCHTTPAtMost256(__m256i v, char max) {
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(max)), v);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i __DCHTTPAtMost128(__m128i v, char max) {
+    return _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(max)), v);
+}
+
+__attribute__((target("avx2")))
+static size_t __DCHTTPScanTokenAVX2(const uint8_t *bytes, size_t i, size_t length) {
+    const __m128i low = _mm_loadu_si128((const __m128i *) __DCHTTPTokenLow);
+    const __m128i high = _mm_loadu_si128((const __m128i *) __DCHTTPTokenHigh);
+
+    if (i + 32 <= length) {
+        const __m256i low256 = _mm256_broadcastsi128_si256(low);
+        const __m256i high256 = _mm256_broadcastsi128_si256(high);
+        const __m256i nibble = _mm256_set1_epi8(0x0F);
+        for (; i + 32 <= length; i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *) (bytes + i));
+            __m256i rows = _mm256_shuffle_epi8(high256, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            __m256i columns = _mm256_shuffle_epi8(low256, _mm256_and_si256(v, nibble));
+            __DCHTTPFirstInvalid(i, _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(rows, columns), _mm256_setzero_si256())));
+        }
+    }
+    if (i + 16 <= length) {
+        const __m128i nibble = _mm_set1_epi8(0x0F);
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+        __m128i rows = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        __m128i columns = _mm_shuffle_epi8(low, _mm_and_si128(v, nibble));
+        __DCHTTPFirstInvalid(i, _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(rows, columns), _mm_setzero_si128())));
+        i += 16;
+    }
+    return __DCHTTPScanTokenScalar(bytes, i, length);
+}
+
+__attribute__((target("avx2")))
+static size_t __DCHTTPScanTargetAVX2(const uint8_t *bytes, size_t i, size_t length) {
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (bytes + i));
+        __m256i invalid = _mm256_or_si256(__DCHTTPAtMost256(v, 0x20), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+        __DCHTTPFirstInvalid(i, _mm256_movemask_epi8(invalid));
+    }
+    if (i + 16 <= length) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+        __m128i invalid = _mm_or_si128(__DCHTTPAtMost128(v, 0x20), _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+        __DCHTTPFirstInvalid(i, _mm_movemask_epi8(invalid));
+        i += 16;
+    }
+    return __DCHTTPScanTargetScalar(bytes, i, length);
+}
+
+__attribute__((target("avx2")))
+static size_t __DCHTTPScanValueAVX2(const uint8_t *bytes, size_t i, size_t length) {
+    for (; i + 32 <= length; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (bytes + i));
+        __m256i control = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')), __DCHTTPAtMost256(v, 0x1F));
+        __m256i invalid = _mm256_or_si256(control, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F)));
+        __DCHTTPFirstInvalid(i, _mm256_movemask_epi8(invalid));
+    }
+    if (i + 16 <= length) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + i));
+        __m128i control = _mm_andnot_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\t')), __DCHTTPAtMost128(v, 0x1F));
+        __m128i invalid = _mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F)));
+        __DCHTTPFirstInvalid(i, _mm_movemask_epi8(invalid));
+        i += 16;
+    }
+    return __DCHTTPScanValueScalar(bytes, i, length);
+}
+
+static const DCHTTPScanner __DCHTTPScannerAVX2 = {
+    kDCHTTPScanLevelAVX2,
+    __DCHTTPScanTokenAVX2,
+    __DCHTTPScanTargetAVX2,
+    __DCHTTPScanValueAVX2
+};
+
+#endif /* DC_HTTP_SCAN_X86 */
+
+// MARK: - Dispatch
+
+static pthread_once_t __DCHTTPScanOnce = PTHREAD_ONCE_INIT;
+static DCHTTPScanLevel __DCHTTPScanSupported = kDCHTTPScanLevelScalar;
+static const DCHTTPScanner *__DCHTTPScanDefault = &__DCHTTPScannerScalar;
+
+static const DCHTTPScanner* __DCHTTPScannerForLevel(DCHTTPScanLevel level) {
+    switch (level) {
+#if DC_HTTP_SCAN_X86
+        case kDCHTTPScanLevelAVX2: return &__DCHTTPScannerAVX2;
+        case kDCHTTPScanLevelSSE42: return &__DCHTTPScannerSSE42;
+#endif
+        default: return &__DCHTTPScannerScalar;
+    }
+}
+
+static void __DCHTTPScanDetect(void) {
+#if DC_HTTP_SCAN_X86
+    __DCHTTPScanBuildTokenTables();
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        __DCHTTPScanSupported = kDCHTTPScanLevelSSE42;
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("avx2"))
+        __DCHTTPScanSupported = kDCHTTPScanLevelAVX2;
+#endif
+    __DCHTTPScanDefault = __DCHTTPScannerForLevel(__DCHTTPScanSupported);
+    log_debug("http scan level => %s\n", DCHTTPScanLevelString(__DCHTTPScanSupported));
+}
+
+const DCHTTPScanner* DCHTTPScanGetLevel(DCHTTPScanLevel level) {
+    pthread_once(&__DCHTTPScanOnce, __DCHTTPScanDetect);
+    if (level > __DCHTTPScanSupported)
+        return NULL;
+    return __DCHTTPScannerForLevel(level);
+}
+
+const DCHTTPScanner* DCHTTPScanGetDefault(void) {
+    pthread_once(&__DCHTTPScanOnce, __DCHTTPScanDetect);
+    return __DCHTTPScanDefault;
+}
+
+bool DCHTTPScanSetDefault(DCHTTPScanLevel level) {
+    const DCHTTPScanner *scanner = DCHTTPScanGetLevel(level);
+    if (!scanner)
+        return false;
+    __DCHTTPScanDefault = scanner;
+    return true;
+}
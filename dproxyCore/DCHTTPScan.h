@@ -0,0 +1,41 @@
+#ifndef DCHTTPScan_h
+#define DCHTTPScan_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum DCHTTPScanLevel {
+    kDCHTTPScanLevelScalar = 0,
+    kDCHTTPScanLevelSSE42 = 1,  // 16 bytes at a time, PCMPESTRI and PSHUFB
+    kDCHTTPScanLevelAVX2 = 2    // 32 bytes at a time
+} DCHTTPScanLevel;
+
+// Each returns the index of the first byte at or after `idx` that isn't of
+// its class, or `length` when there's none. Nothing past `length` is read.
+typedef size_t (*DCHTTPScanFunction)(const uint8_t *bytes, size_t idx, size_t length);
+
+typedef struct DCHTTPScanner {
+    DCHTTPScanLevel level;
+    DCHTTPScanFunction token;   // RFC 7230 tchar: methods and field names
+    DCHTTPScanFunction target;  // Anything but whitespace and controls
+    DCHTTPScanFunction value;   // Field values and reasons, stops at CR
+} DCHTTPScanner;
+
+/*
+ * The kernels the parser uses to find the next delimiter while validating
+ * everything in front of it. The best level the CPU supports is picked the
+ * first time it's asked for; anything that isn't x86 gets the scalar one.
+ */
+const DCHTTPScanner* DCHTTPScanGetDefault(void);
+
+// NULL when the CPU (or the build) doesn't support `level`
+const DCHTTPScanner* DCHTTPScanGetLevel(DCHTTPScanLevel level);
+
+// Only meant for tests and benchmarks, not thread safe against parsing
+bool DCHTTPScanSetDefault(DCHTTPScanLevel level);
+
+char* DCHTTPScanLevelString(DCHTTPScanLevel level);
+
+#endif /* DCHTTPScan_h */
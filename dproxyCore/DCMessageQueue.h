@@ -0,0 +1,66 @@
+#ifndef DCMessageQueue_h
+#define DCMessageQueue_h
+
+#include <stdbool.h>
+
+#include "DCHTTPMessage.h"
+
+// Must be a power of two
+#define kDCMessageQueueCapacity 16
+
+/*
+ * Fixed size FIFO of messages, kept inline in its owner. Pushing retains,
+ * popping hands that reference over to the caller. A queue that's full
+ * refuses more, whoever fills it is expected to stop producing before that
+ * happens (see `DCMessageQueueIsFull`).
+ */
+typedef struct DCMessageQueue {
+    DCHTTPMessageRef messages[kDCMessageQueueCapacity];
+    unsigned int head;
+    unsigned int count;
+} DCMessageQueue;
+
+static inline unsigned int DCMessageQueueGetCount(const DCMessageQueue *queue) {
+    return queue->count;
+}
+
+static inline bool DCMessageQueueIsEmpty(const DCMessageQueue *queue) {
+    return queue->count == 0;
+}
+
+static inline bool DCMessageQueueIsFull(const DCMessageQueue *queue) {
+    return queue->count == kDCMessageQueueCapacity;
+}
+
+static inline bool DCMessageQueuePush(DCMessageQueue *queue, DCHTTPMessageRef message) {
+    if (queue->count == kDCMessageQueueCapacity)
+        return false;
+    queue->messages[(queue->head + queue->count) & (kDCMessageQueueCapacity - 1)] = DCHTTPMessageRetain(message);
+    queue->count++;
+    return true;
+}
+
+// NULL when empty
+static inline DCHTTPMessageRef DCMessageQueuePeek(const DCMessageQueue *queue) {
+    return queue->count ? queue->messages[queue->head] : NULL;
+}
+
+// The caller owns the message, NULL when empty
+static inline DCHTTPMessageRef DCMessageQueuePop(DCMessageQueue *queue) {
+    if (queue->count == 0)
+        return NULL;
+    DCHTTPMessageRef message = queue->messages[queue->head];
+    queue->messages[queue->head] = NULL;
+    queue->head = (queue->head + 1) & (kDCMessageQueueCapacity - 1);
+    queue->count--;
+    return message;
+}
+
+static inline void DCMessageQueueClear(DCMessageQueue *queue) {
+    DCHTTPMessageRef message;
+    while ((message = DCMessageQueuePop(queue)))
+        DCHTTPMessageRelease(message);
+    queue->head = 0;
+}
+
+#endif /* DCMessageQueue_h */
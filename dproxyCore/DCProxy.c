@@ -1,33 +1,242 @@
 #include "DCProxy.h"
 #include "DCChannel.h"
+#include "DCEventLoop.h"
+#include "DCWorker.h"
 #include "log.h"
 
-#include <CoreFoundation/CoreFoundation.h>
-#include <CFNetwork/CFNetwork.h>
-#include <assert.h>
-#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #define TRACE(p) log_trace("proxy=%p\n", p)
 
+#define kDCProxyDefaultDeferAcceptSeconds 5
+// Without a limit on the channels, what RLIMIT_NOFILE leaves: a client and an
+// upstream per channel, besides what pools, resolvers and the loops hold
+#define kDCProxyFDsPerChannel 2
+#define kDCProxyReservedFDs   256
+
+typedef struct __DCProxyListenAddress {
+    struct sockaddr_storage address;
+    char device[IF_NAMESIZE];
+    // IPv6 wildcards take IPv4 as well, unless it's listened on separately
+    bool dualStack;
+    int sharedFD;
+} __DCProxyListenAddress;
+
 struct __DCProxy {
     unsigned int port;
-    CFRunLoopTimerRef timer;
+    DCEventLoopBackend backend;
+    unsigned int nbrWorkers;
+    DCWorkerRef *workers;
+    __DCProxyListenAddress *listenAddresses;
+    unsigned int nbrListenAddresses;
+    int listenBacklog;
+    unsigned int deferAcceptSeconds;
+
+    bool hasChannelLimits;
+    unsigned int maxChannelsPerWorker;
+    DCWorkerChannelBudget channelBudget;
+
+    bool hasPoolLimits;
+    unsigned int poolMaxIdle;
+    unsigned int poolMaxIdlePerHost;
+    unsigned int poolIdleTimeoutMs;
+
+    bool hasTimeouts;
+    DCConnectionTimeouts timeouts;
+
+    char *nameserver;
+    UInt16 nameserverPort;
 };
 
 DCProxyRef DCProxyCreate(unsigned int port) {
     struct __DCProxy *proxy = (struct __DCProxy *) calloc(1, sizeof(struct __DCProxy));
     if (proxy) {
         proxy->port = port;
+        proxy->backend = kDCEventLoopBackendDefault;
+        proxy->listenBacklog = SOMAXCONN;
+        proxy->deferAcceptSeconds = kDCProxyDefaultDeferAcceptSeconds;
     }
     return proxy;
 }
 
+void DCProxySetEventLoopBackend(DCProxyRef proxy, DCEventLoopBackend backend) {
+    proxy->backend = backend;
+}
+
+void DCProxySetWorkerCount(DCProxyRef proxy, unsigned int nbrWorkers) {
+    proxy->nbrWorkers = nbrWorkers;
+}
+
+void DCProxySetUpstreamPoolLimits(DCProxyRef proxy, unsigned int maxIdle, unsigned int maxIdlePerHost, unsigned int idleTimeoutMs) {
+    proxy->hasPoolLimits = true;
+    proxy->poolMaxIdle = maxIdle;
+    proxy->poolMaxIdlePerHost = maxIdlePerHost;
+    proxy->poolIdleTimeoutMs = idleTimeoutMs;
+}
+
+void DCProxySetConnectionTimeouts(DCProxyRef proxy, unsigned int connectMs, unsigned int headerMs, unsigned int bodyIdleMs, unsigned int keepAliveMs) {
+    proxy->hasTimeouts = true;
+    proxy->timeouts.connectMs = connectMs;
+    proxy->timeouts.headerMs = headerMs;
+    proxy->timeouts.bodyIdleMs = bodyIdleMs;
+    proxy->timeouts.keepAliveMs = keepAliveMs;
+}
+
+static socklen_t __DCProxyAddressLength(const struct sockaddr_storage *address) {
+    return address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static void __DCProxySetAddressPort(struct sockaddr_storage *address, UInt16 port) {
+    if (address->ss_family == AF_INET6)
+        ((struct sockaddr_in6 *) address)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *) address)->sin_port = htons(port);
+}
+
+static UInt16 __DCProxyAddressPort(const struct sockaddr_storage *address) {
+    if (address->ss_family == AF_INET6)
+        return ntohs(((const struct sockaddr_in6 *) address)->sin6_port);
+    return ntohs(((const struct sockaddr_in *) address)->sin_port);
+}
+
+static bool __DCProxyIsWildcard(const struct sockaddr_storage *address) {
+    if (address->ss_family == AF_INET6)
+        return IN6_IS_ADDR_UNSPECIFIED(&(((const struct sockaddr_in6 *) address)->sin6_addr));
+    return ((const struct sockaddr_in *) address)->sin_addr.s_addr == htonl(INADDR_ANY);
+}
+
+// [::1]:1080 or 127.0.0.1:1080, and the device it's bound to if any
+static void __DCProxyAddressString(const __DCProxyListenAddress *listenAddress, char *string, size_t size) {
+    const struct sockaddr_storage *address = &(listenAddress->address);
+    char host[INET6_ADDRSTRLEN];
+    if (address->ss_family == AF_INET6)
+        inet_ntop(AF_INET6, &(((const struct sockaddr_in6 *) address)->sin6_addr), host, sizeof(host));
+    else
+        inet_ntop(AF_INET, &(((const struct sockaddr_in *) address)->sin_addr), host, sizeof(host));
+    snprintf(string, size, address->ss_family == AF_INET6 ? "[%s]:%u%s%s" : "%s:%u%s%s", host, __DCProxyAddressPort(address), listenAddress->device[0] ? "%" : "", listenAddress->device);
+}
+
+bool DCProxyAddListenAddress(DCProxyRef proxy, const char *address, UInt16 port, const char *device) {
+    __DCProxyListenAddress listenAddress;
+    memset(&listenAddress, 0, sizeof(listenAddress));
+    listenAddress.sharedFD = -1;
+    if (!DCResolverParseLiteral(address, &(listenAddress.address))) {
+        log_error("proxy=%p, can't listen on '%s', not an IP address\n", proxy, address);
+        return false;
+    }
+    __DCProxySetAddressPort(&(listenAddress.address), port ? port : (UInt16) proxy->port);
+
+    if (device && device[0]) {
+#if !defined(SO_BINDTODEVICE) && !defined(IP_BOUND_IF)
+        log_error("proxy=%p, can't bind to devices on this platform\n", proxy);
+        return false;
+#endif
+        if (strlen(device) >= sizeof(listenAddress.device)) {
+            log_error("proxy=%p, device name '%s' is too long\n", proxy, device);
+            return false;
+        }
+        strcpy(listenAddress.device, device);
+    }
+
+    __DCProxyListenAddress *listenAddresses = (__DCProxyListenAddress *) realloc(proxy->listenAddresses, (proxy->nbrListenAddresses + 1) * sizeof(__DCProxyListenAddress));
+    if (!listenAddresses)
+        return false;
+    proxy->listenAddresses = listenAddresses;
+    proxy->listenAddresses[proxy->nbrListenAddresses++] = listenAddress;
+    return true;
+}
+
+void DCProxySetListenBacklog(DCProxyRef proxy, int backlog) {
+    proxy->listenBacklog = backlog > 0 ? backlog : SOMAXCONN;
+}
+
+void DCProxySetDeferAccept(DCProxyRef proxy, unsigned int seconds) {
+    proxy->deferAcceptSeconds = seconds;
+}
+
+void DCProxySetChannelLimits(DCProxyRef proxy, unsigned int maxPerWorker, unsigned int maxTotal) {
+    proxy->hasChannelLimits = true;
+    proxy->maxChannelsPerWorker = maxPerWorker;
+    proxy->channelBudget.maxOpen = maxTotal;
+}
+
+void DCProxySetNameserver(DCProxyRef proxy, const char *address, UInt16 port) {
+    free(proxy->nameserver);
+    proxy->nameserver = address ? strdup(address) : NULL;
+    proxy->nameserverPort = port;
+}
+
+static unsigned int __DCProxyDefaultWorkerCount(void) {
+    long nbrCPUs = sysconf(_SC_NPROCESSORS_ONLN);
+    return nbrCPUs > 0 ? (unsigned int) nbrCPUs : 1;
+}
+
+static unsigned int __DCProxyDefaultMaxChannels(void) {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY)
+        return 0;
+    if (limit.rlim_cur <= kDCProxyReservedFDs + kDCProxyFDsPerChannel)
+        return 1;
+    rlim_t maxChannels = (limit.rlim_cur - kDCProxyReservedFDs) / kDCProxyFDsPerChannel;
+    return maxChannels > UINT_MAX ? UINT_MAX : (unsigned int) maxChannels;
+}
+
+// An IPv6 wildcard is dual-stack unless the IPv4 one is listened on with
+// the same port and device, then they'd conflict
+static void __DCProxyResolveDualStack(DCProxyRef proxy) {
+    for (unsigned int i = 0; i < proxy->nbrListenAddresses; i++) {
+        __DCProxyListenAddress *listenAddress = &(proxy->listenAddresses[i]);
+        listenAddress->dualStack = listenAddress->address.ss_family == AF_INET6 && __DCProxyIsWildcard(&(listenAddress->address));
+        for (unsigned int j = 0; j < proxy->nbrListenAddresses && listenAddress->dualStack; j++) {
+            __DCProxyListenAddress *other = &(proxy->listenAddresses[j]);
+            if (other->address.ss_family == AF_INET && __DCProxyIsWildcard(&(other->address)) &&
+                __DCProxyAddressPort(&(other->address)) == __DCProxyAddressPort(&(listenAddress->address)) &&
+                strcmp(other->device, listenAddress->device) == 0)
+                listenAddress->dualStack = false;
+        }
+    }
+}
+
+// Every interface, over IPv6 and IPv4 when there's IPv6
+static bool __DCProxyAddDefaultListenAddress(DCProxyRef proxy) {
+    int probe = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    if (probe != -1) {
+        close(probe);
+        return DCProxyAddListenAddress(proxy, "::", 0, NULL);
+    }
+    return DCProxyAddListenAddress(proxy, "0.0.0.0", 0, NULL);
+}
+
+static bool __DCProxyBindToDevice(int fd, sa_family_t family, const char *device) {
+#if defined(SO_BINDTODEVICE)
+    return setsockopt(fd, SOL_SOCKET, SO_BINDTODEVICE, device, (socklen_t) strlen(device) + 1) == 0;
+#elif defined(IP_BOUND_IF)
+    unsigned int index = if_nametoindex(device);
+    if (index == 0)
+        return false;
+    if (family == AF_INET6)
+        return setsockopt(fd, IPPROTO_IPV6, IPV6_BOUND_IF, &index, sizeof(index)) == 0;
+    return setsockopt(fd, IPPROTO_IP, IP_BOUND_IF, &index, sizeof(index)) == 0;
+#else
+    errno = ENOTSUP;
+    return false;
+#endif
+}
+
 static int tick = 0;
-void __DCProxyTimerTick(CFRunLoopTimerRef timer, void *info) {
+void __DCProxyTimerTick(DCEventLoopRef loop, void *info) {
     if (tick % 2)
         printf("tock\n");
     else
@@ -35,106 +244,170 @@ void __DCProxyTimerTick(CFRunLoopTimerRef timer, void *info) {
     tick++;
 }
 
-void __DCProxyAccept(CFSocketRef socket, CFSocketCallBackType type, CFDataRef address, const void *data, void *info)
-{
-    assert(kCFSocketAcceptCallBack == type);
-    // DCProxyRef proxy = (DCProxyRef) data;
-    DCChannelRef channel = DCChannelCreate();
-    DCChannelSetupWithFD(channel, *(CFSocketNativeHandle *)data);
-}
-
-void* __DCProxyRunServer(void* data) {
-    DCProxyRef proxy = (DCProxyRef) data;
-
-    // CREATE AND SCHEDULE TIMER
-    CFRunLoopTimerContext timerContext = {0, NULL, NULL, NULL, NULL};
-    CFRunLoopTimerRef timer = CFRunLoopTimerCreate(kCFAllocatorDefault,
-                                                   CFAbsoluteTimeGetCurrent(),
-                                                   1,
-                                                   0,
-                                                   0,
-                                                   &__DCProxyTimerTick, &timerContext);
-
-    CFRunLoopRef runLoop = CFRunLoopGetCurrent();
-    CFRunLoopAddTimer(runLoop, timer, kCFRunLoopCommonModes);
-
-    CFSocketContext socketAcceptContext;
-    socketAcceptContext.info = proxy;
-    socketAcceptContext.copyDescription = NULL;
-    socketAcceptContext.release = NULL;
-    socketAcceptContext.retain = NULL;
-    socketAcceptContext.version = 0;
+static int __DCProxyCreateListener(DCProxyRef proxy, __DCProxyListenAddress *listenAddress, bool reusePort) {
+    struct sockaddr_storage *address = &(listenAddress->address);
+    char addressString[INET6_ADDRSTRLEN + IF_NAMESIZE + 8];
+    __DCProxyAddressString(listenAddress, addressString, sizeof(addressString));
 
     // CREATE SOCKET FOR ACCEPT
-    CFSocketRef serverSocket = CFSocketCreate(kCFAllocatorDefault,
-                                              PF_INET,
-                                              SOCK_STREAM,
-                                              IPPROTO_TCP,
-                                              kCFSocketAcceptCallBack,
-                                              __DCProxyAccept,
-                                              &socketAcceptContext);
+    int fileDescriptor = socket(address->ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (fileDescriptor == -1) {
+        log_error("Couldn't create server socket for %s: %s\n", addressString, strerror(errno));
+        return -1;
+    }
 
     // CONFIGURE SOCKET
     int reuse = true;
-    int fileDescriptor = CFSocketGetNative(serverSocket);
     if (setsockopt(fileDescriptor, SOL_SOCKET, SO_REUSEADDR, (void *)&reuse, sizeof(int)) != 0)
     {
         log_error("Coulnd't set SO_REUSEADDR for server socket.\n");
     }
+#if defined(SO_REUSEPORT)
+    if (reusePort && setsockopt(fileDescriptor, SOL_SOCKET, SO_REUSEPORT, (void *)&reuse, sizeof(int)) != 0)
+    {
+        log_error("Coulnd't set SO_REUSEPORT for server socket.\n");
+    }
+#endif
+    if (address->ss_family == AF_INET6) {
+        int v6Only = !listenAddress->dualStack;
+        if (setsockopt(fileDescriptor, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&v6Only, sizeof(int)) != 0)
+        {
+            log_error("Couldn't set IPV6_V6ONLY for server socket.\n");
+        }
+    }
+    if (listenAddress->device[0] && !__DCProxyBindToDevice(fileDescriptor, address->ss_family, listenAddress->device)) {
+        log_error("Couldn't bind server socket to %s: %s\n", listenAddress->device, strerror(errno));
+        close(fileDescriptor);
+        return -1;
+    }
+    fcntl(fileDescriptor, F_SETFL, fcntl(fileDescriptor, F_GETFL) | O_NONBLOCK);
+    fcntl(fileDescriptor, F_SETFD, FD_CLOEXEC);
+#if defined(TCP_DEFER_ACCEPT)
+    int deferSeconds = (int) proxy->deferAcceptSeconds;
+    if (deferSeconds > 0 && setsockopt(fileDescriptor, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSeconds, sizeof(int)) != 0)
+    {
+        log_error("Couldn't set TCP_DEFER_ACCEPT for server socket.\n");
+    }
+#endif
+
+    if (bind(fileDescriptor, (struct sockaddr *) address, __DCProxyAddressLength(address)) != 0 || listen(fileDescriptor, proxy->listenBacklog) != 0) {
+        log_error("Couldn't listen on %s: %s\n", addressString, strerror(errno));
+        close(fileDescriptor);
+        return -1;
+    }
+
+#if !defined(TCP_DEFER_ACCEPT) && defined(SO_ACCEPTFILTER)
+    // Only once listening, and only with the accf_data module loaded
+    struct accept_filter_arg filter;
+    memset(&filter, 0, sizeof(filter));
+    strcpy(filter.af_name, "dataready");
+    if (proxy->deferAcceptSeconds > 0 && setsockopt(fileDescriptor, SOL_SOCKET, SO_ACCEPTFILTER, &filter, sizeof(filter)) != 0)
+    {
+        log_debug("Couldn't set the dataready accept filter for server socket.\n");
+    }
+#endif
+
+    return fileDescriptor;
+}
 
-    struct sockaddr_in sin;
-    memset(&sin, 0, sizeof(sin));
-    sin.sin_len = sizeof(sin);
-    sin.sin_family = AF_INET;
-    sin.sin_port = htons(proxy->port);
-    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+static bool __DCProxySetupWorkers(DCProxyRef proxy) {
+    if (proxy->nbrWorkers == 0)
+        proxy->nbrWorkers = __DCProxyDefaultWorkerCount();
+    if (!proxy->hasChannelLimits)
+        proxy->channelBudget.maxOpen = __DCProxyDefaultMaxChannels();
+    if (proxy->nbrListenAddresses == 0 && !__DCProxyAddDefaultListenAddress(proxy))
+        return false;
+    __DCProxyResolveDualStack(proxy);
 
-    CFDataRef sincfd = CFDataCreate(kCFAllocatorDefault, (UInt8 *)&sin, sizeof(sin));
-    CFSocketSetAddress(serverSocket, sincfd);
-    CFRelease(sincfd);
+    // Only Linux balances connections between SO_REUSEPORT listeners, so
+    // there every worker has its own for each address. Elsewhere every worker
+    // watches the same ones and whoever wakes first accepts.
+#if defined(__linux__)
+    bool listenerPerWorker = true;
+#else
+    bool listenerPerWorker = false;
+    for (unsigned int i = 0; i < proxy->nbrListenAddresses; i++) {
+        proxy->listenAddresses[i].sharedFD = __DCProxyCreateListener(proxy, &(proxy->listenAddresses[i]), false);
+        if (proxy->listenAddresses[i].sharedFD == -1)
+            return false;
+    }
+#endif
+
+    proxy->workers = (DCWorkerRef *) calloc(proxy->nbrWorkers, sizeof(DCWorkerRef));
+    for (unsigned int i = 0; i < proxy->nbrWorkers; i++) {
+        DCWorkerRef worker = DCWorkerCreate(i, proxy->backend);
+        if (!worker) {
+            log_error("Couldn't create worker %u.\n", i);
+            return false;
+        }
+        proxy->workers[i] = worker;
 
-    // ADD SOCKET TO RUNLOOP
-    CFRunLoopSourceRef socketSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault, serverSocket, 0);
-    CFRunLoopAddSource(CFRunLoopGetCurrent(), socketSource, kCFRunLoopDefaultMode);
+        if (proxy->hasPoolLimits)
+            DCConnectionPoolSetLimits(DCWorkerGetConnectionPool(worker), proxy->poolMaxIdle, proxy->poolMaxIdlePerHost, proxy->poolIdleTimeoutMs);
+        if (proxy->nameserver)
+            DCResolverSetNameserver(DCWorkerGetResolver(worker), proxy->nameserver, proxy->nameserverPort);
+        if (proxy->hasTimeouts)
+            DCWorkerSetConnectionTimeouts(worker, &(proxy->timeouts));
+        DCWorkerSetChannelLimits(worker, proxy->maxChannelsPerWorker, proxy->channelBudget.maxOpen ? &(proxy->channelBudget) : NULL);
 
-    CFRunLoopRun();
+        for (unsigned int j = 0; j < proxy->nbrListenAddresses; j++) {
+            __DCProxyListenAddress *listenAddress = &(proxy->listenAddresses[j]);
+            int listenFD = listenerPerWorker ? __DCProxyCreateListener(proxy, listenAddress, true) : listenAddress->sharedFD;
+            if (listenFD == -1)
+                return false;
+            if (!DCWorkerAddListener(worker, listenFD, listenerPerWorker)) {
+                if (listenerPerWorker) close(listenFD);
+                return false;
+            }
+        }
+    }
 
-    return NULL;
+    // CREATE AND SCHEDULE TIMER
+    DCEventLoopAddTimer(DCWorkerGetEventLoop(proxy->workers[0]), 1000, &__DCProxyTimerTick, proxy);
+
+    for (unsigned int i = 0; i < proxy->nbrListenAddresses; i++) {
+        char addressString[INET6_ADDRSTRLEN + IF_NAMESIZE + 8];
+        __DCProxyAddressString(&(proxy->listenAddresses[i]), addressString, sizeof(addressString));
+        log_info("proxy=%p, listening on %s%s with %u worker(s)\n", proxy, addressString, proxy->listenAddresses[i].dualStack ? " (and IPv4)" : "", proxy->nbrWorkers);
+    }
+    log_debug("proxy=%p, backlog => %d, channels => %u per worker, %u in total\n", proxy, proxy->listenBacklog, proxy->maxChannelsPerWorker, proxy->channelBudget.maxOpen);
+    return true;
 }
 
 bool DCProxyRunServer(DCProxyRef proxy, bool CurrentThread) {
     log_set_level(LOG_DEBUG);
 
-    if (CurrentThread) {
-        __DCProxyRunServer((void*) proxy);
-    } else {
-        // Create the thread using POSIX routines.
-        pthread_attr_t  attr;
-        pthread_t       posixThreadID;
-        int             returnVal;
+    if (!__DCProxySetupWorkers(proxy))
+        return false;
 
-        returnVal = pthread_attr_init(&attr);
-        assert(!returnVal);
-        returnVal = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-        assert(!returnVal);
-
-        int threadError = pthread_create(&posixThreadID, &attr, &__DCProxyRunServer, proxy);
-
-        returnVal = pthread_attr_destroy(&attr);
-        assert(!returnVal);
-        if (threadError != 0)
-        {
-            // Report an error.
-        }
+    // When running on the current thread, that thread becomes worker 0
+    for (unsigned int i = CurrentThread ? 1 : 0; i < proxy->nbrWorkers; i++) {
+        if (!DCWorkerStart(proxy->workers[i]))
+            return false;
     }
 
+    if (CurrentThread)
+        DCWorkerRun(proxy->workers[0]);
+
     return true;
 }
 
 void DCProxyStopServer(DCProxyRef proxy) {
-    CFRunLoopStop(CFRunLoopGetCurrent());
+    for (unsigned int i = 0; proxy->workers && i < proxy->nbrWorkers; i++) {
+        if (proxy->workers[i]) DCWorkerStop(proxy->workers[i]);
+    }
 }
 
 void DCProxyRelease(DCProxyRef proxy) {
+    DCProxyStopServer(proxy);
+    for (unsigned int i = 0; proxy->workers && i < proxy->nbrWorkers; i++) {
+        if (proxy->workers[i]) DCWorkerRelease(proxy->workers[i]);
+    }
+    free(proxy->workers);
+    for (unsigned int i = 0; i < proxy->nbrListenAddresses; i++) {
+        if (proxy->listenAddresses[i].sharedFD != -1) close(proxy->listenAddresses[i].sharedFD);
+    }
+    free(proxy->listenAddresses);
+    free(proxy->nameserver);
     free(proxy);
 }
@@ -1,14 +1,54 @@
 #ifndef DCProxy_h
 #define DCProxy_h
 
+#include "DCEventLoop.h"
+
 #include <stdio.h>
-#include <CoreFoundation/CoreFoundation.h>
+#include "DCTypes.h"
 
 typedef struct __DCProxy*         DCProxyRef;
 
+// Listens on every interface unless addresses are added, over IPv6 and IPv4
 DCProxyRef DCProxyCreate(unsigned int port);
 void DCProxyRelease(DCProxyRef proxy);
 
+/*
+ * Listens on `address`, an IPv4 or IPv6 literal, with `port` or the one the
+ * proxy was created with when 0. Can be called for several addresses, each
+ * gets a listener in every worker. "::" takes IPv4 too, unless "0.0.0.0" is
+ * added with the same port. `device` (NULL for any) only takes connections
+ * that arrive on that interface: SO_BINDTODEVICE on Linux, which needs
+ * CAP_NET_RAW, and IP_BOUND_IF on macOS.
+ */
+bool DCProxyAddListenAddress(DCProxyRef proxy, const char *address, UInt16 port, const char *device);
+
+void DCProxySetEventLoopBackend(DCProxyRef proxy, DCEventLoopBackend backend);
+
+// Defaults to the number of online CPUs
+void DCProxySetWorkerCount(DCProxyRef proxy, unsigned int nbrWorkers);
+
+// Limits for each worker's pool of idle upstream connections, see `DCConnectionPool.h`
+void DCProxySetUpstreamPoolLimits(DCProxyRef proxy, unsigned int maxIdle, unsigned int maxIdlePerHost, unsigned int idleTimeoutMs);
+
+// How long connections wait for their peers, see `DCConnectionTimeouts`, 0 for no limit
+void DCProxySetConnectionTimeouts(DCProxyRef proxy, unsigned int connectMs, unsigned int headerMs, unsigned int bodyIdleMs, unsigned int keepAliveMs);
+
+// Length of the listen(2) queue, SOMAXCONN (also the kernel's cap) until set
+void DCProxySetListenBacklog(DCProxyRef proxy, int backlog);
+
+// Connections are only handed over once the client has sent something, or
+// after `seconds` without (TCP_DEFER_ACCEPT, a data filter on FreeBSD).
+// Clients of a proxy always speak first. 0 to accept right away.
+void DCProxySetDeferAccept(DCProxyRef proxy, unsigned int seconds);
+
+// Channels each worker and all workers together keep open before they stop
+// accepting, see `DCWorkerSetChannelLimits`. 0 for no limit. By default
+// there's none per worker and, in total, what the fd limit leaves room for.
+void DCProxySetChannelLimits(DCProxyRef proxy, unsigned int maxPerWorker, unsigned int maxTotal);
+
+// Nameserver every worker's resolver queries, instead of the one in /etc/resolv.conf
+void DCProxySetNameserver(DCProxyRef proxy, const char *address, UInt16 port);
+
 bool DCProxyRunServer(DCProxyRef proxy, bool CurrentThread);
 void DCProxyStopServer(DCProxyRef proxy);
 
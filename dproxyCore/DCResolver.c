@@ -0,0 +1,849 @@
+#include "DCResolver.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE(p) log_trace("resolver=%p\n", p)
+
+#define kDCResolverBuckets 256
+#define kDCResolverMaxEntries 4096
+#define kDCResolverMaxNameLength 253
+#define kDCResolverMaxPacket 4096
+
+#define kDCResolverDefaultTimeoutMs 2000
+#define kDCResolverDefaultAttempts 2
+#define kDCResolverDefaultNegativeTTLMs 30000
+#define kDCResolverFailedTTLMs 2000
+#define kDCResolverMaxTTLMs (3600 * 1000)
+#define kDCResolverTickMs 100
+#define kDCResolverPurgeIntervalMs 1000
+
+#define kDCResolverTypeA 1
+#define kDCResolverTypeSOA 6
+#define kDCResolverTypeAAAA 28
+#define kDCResolverClassIN 1
+
+#define kDCResolverRcodeNXDomain 3
+
+// Each name is looked up with one query per address family
+#define kDCResolverQueryA 0
+#define kDCResolverQueryAAAA 1
+
+typedef enum __DCResolverEntryState {
+    kDCResolverEntryStatePending = 0,
+    kDCResolverEntryStateResolved,
+    kDCResolverEntryStateNotFound,
+    kDCResolverEntryStateFailed
+} __DCResolverEntryState;
+
+typedef struct __DCResolverWaiter {
+    DCResolverCallback callback;
+    void *info;
+    struct __DCResolverWaiter *next;
+} __DCResolverWaiter;
+
+typedef struct __DCResolverEntry {
+    char *name;
+    uint32_t hash;
+    __DCResolverEntryState state;
+
+    struct sockaddr_storage addresses[kDCResolverMaxAddresses];
+    unsigned int nbrAddresses;
+    // 0 for entries that never expire, i.e. those from /etc/hosts
+    unsigned long long expiresAt;
+
+    // While in flight
+    uint16_t queryIDs[2];
+    bool answered[2];
+    bool notFound[2];
+    bool failed[2];
+    uint32_t ttl;
+    uint32_t negativeTTL;
+    unsigned int attempts;
+    unsigned long long sentAt;
+    __DCResolverWaiter *waiters;
+    __DCResolverWaiter *lastWaiter;
+
+    struct __DCResolverEntry *nextInBucket;
+    struct __DCResolverEntry *nextInflight;
+
+    // Every entry, oldest first
+    struct __DCResolverEntry *prev;
+    struct __DCResolverEntry *next;
+} __DCResolverEntry;
+
+struct __DCResolver {
+    DCEventLoopRef loop;
+    int fd;
+    unsigned int timeoutMs;
+    unsigned int attempts;
+    unsigned int negativeTTLMs;
+    uint32_t seed;
+
+    unsigned int nbrEntries;
+    __DCResolverEntry *oldest;
+    __DCResolverEntry *newest;
+    __DCResolverEntry *buckets[kDCResolverBuckets];
+    __DCResolverEntry *inflight;
+    unsigned long long lastPurge;
+
+    // Waiters being called back, so `DCResolverCancel` can reach them
+    __DCResolverWaiter *dispatching;
+
+    unsigned long long queries;
+    unsigned long long cacheHits;
+};
+
+// MARK: - Enum to char* helpers
+
+inline char* DCResolverStatusString(DCResolverStatus status) {
+    switch (status) {
+        case kDCResolverStatusResolved: return "kDCResolverStatusResolved";
+        case kDCResolverStatusNotFound: return "kDCResolverStatusNotFound";
+        case kDCResolverStatusFailed: return "kDCResolverStatusFailed";
+    }
+    return "INVALID";
+}
+
+// MARK: - Helpers
+
+static uint32_t __DCResolverHash(const char *name) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *name; name++) {
+        hash ^= (unsigned char) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static uint16_t __DCResolverNextID(DCResolverRef resolver) {
+    // xorshift32, the kernel picks a random source port on top of this
+    uint32_t x = resolver->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    resolver->seed = x;
+    return (uint16_t) (x >> 8);
+}
+
+static inline uint16_t __DCResolverRead16(const uint8_t *p) {
+    return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t __DCResolverRead32(const uint8_t *p) {
+    return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+bool DCResolverParseLiteral(const char *hostname, struct sockaddr_storage *address) {
+    memset(address, 0, sizeof(struct sockaddr_storage));
+
+    struct sockaddr_in *in4 = (struct sockaddr_in *) address;
+    if (inet_pton(AF_INET, hostname, &(in4->sin_addr)) == 1) {
+        in4->sin_family = AF_INET;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        in4->sin_len = sizeof(struct sockaddr_in);
+#endif
+        return true;
+    }
+
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) address;
+    if (inet_pton(AF_INET6, hostname, &(in6->sin6_addr)) == 1) {
+        in6->sin6_family = AF_INET6;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        in6->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+        return true;
+    }
+    return false;
+}
+
+// Lower cased without the trailing dot, false when it can't be a host name
+static bool __DCResolverNormalizeName(const char *hostname, char *name) {
+    size_t length = strlen(hostname);
+    if (length > 0 && hostname[length - 1] == '.')
+        length--;
+    if (length == 0 || length > kDCResolverMaxNameLength)
+        return false;
+
+    for (size_t i = 0; i < length; i++)
+        name[i] = (char) tolower((unsigned char) hostname[i]);
+    name[length] = '\0';
+    return true;
+}
+
+// MARK: - Cache
+
+static __DCResolverEntry* __DCResolverFindEntry(DCResolverRef resolver, const char *name, uint32_t hash) {
+    for (__DCResolverEntry *entry = resolver->buckets[hash % kDCResolverBuckets]; entry; entry = entry->nextInBucket) {
+        if (entry->hash == hash && strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static void __DCResolverRemoveEntry(DCResolverRef resolver, __DCResolverEntry *entry) {
+    for (__DCResolverEntry **it = &(resolver->buckets[entry->hash % kDCResolverBuckets]); *it; it = &((*it)->nextInBucket)) {
+        if (*it == entry) {
+            *it = entry->nextInBucket;
+            break;
+        }
+    }
+
+    if (entry->prev) entry->prev->next = entry->next;
+    else resolver->oldest = entry->next;
+    if (entry->next) entry->next->prev = entry->prev;
+    else resolver->newest = entry->prev;
+
+    resolver->nbrEntries--;
+    free(entry->name);
+    free(entry);
+}
+
+static __DCResolverEntry* __DCResolverInsertEntry(DCResolverRef resolver, const char *name, uint32_t hash) {
+    // Make room by dropping the oldest answer, in-flight and /etc/hosts entries stay
+    if (resolver->nbrEntries >= kDCResolverMaxEntries) {
+        DCResolverPurgeExpired(resolver);
+        for (__DCResolverEntry *entry = resolver->oldest; entry && resolver->nbrEntries >= kDCResolverMaxEntries; entry = entry->next) {
+            if (entry->state != kDCResolverEntryStatePending && entry->expiresAt != 0) {
+                __DCResolverRemoveEntry(resolver, entry);
+                break;
+            }
+        }
+    }
+
+    __DCResolverEntry *entry = (__DCResolverEntry *) calloc(1, sizeof(__DCResolverEntry));
+    entry->name = strdup(name);
+    entry->hash = hash;
+    entry->ttl = UINT32_MAX;
+    entry->negativeTTL = UINT32_MAX;
+
+    entry->nextInBucket = resolver->buckets[hash % kDCResolverBuckets];
+    resolver->buckets[hash % kDCResolverBuckets] = entry;
+
+    entry->prev = resolver->newest;
+    if (resolver->newest) resolver->newest->next = entry;
+    else resolver->oldest = entry;
+    resolver->newest = entry;
+
+    resolver->nbrEntries++;
+    return entry;
+}
+
+static void __DCResolverAddAddress(__DCResolverEntry *entry, int family, const uint8_t *bytes) {
+    if (entry->nbrAddresses == kDCResolverMaxAddresses)
+        return;
+
+    struct sockaddr_storage *address = &(entry->addresses[entry->nbrAddresses++]);
+    memset(address, 0, sizeof(struct sockaddr_storage));
+    if (family == AF_INET) {
+        struct sockaddr_in *in4 = (struct sockaddr_in *) address;
+        in4->sin_family = AF_INET;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        in4->sin_len = sizeof(struct sockaddr_in);
+#endif
+        memcpy(&(in4->sin_addr), bytes, 4);
+    } else {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) address;
+        in6->sin6_family = AF_INET6;
+#if defined(__APPLE__) || defined(__FreeBSD__)
+        in6->sin6_len = sizeof(struct sockaddr_in6);
+#endif
+        memcpy(&(in6->sin6_addr), bytes, 16);
+    }
+}
+
+void DCResolverPurgeExpired(DCResolverRef resolver) {
+    unsigned long long now = DCEventLoopGetTime(resolver->loop);
+    resolver->lastPurge = now;
+
+    __DCResolverEntry *entry = resolver->oldest;
+    while (entry) {
+        __DCResolverEntry *next = entry->next;
+        if (entry->state != kDCResolverEntryStatePending && entry->expiresAt != 0 && entry->expiresAt <= now)
+            __DCResolverRemoveEntry(resolver, entry);
+        entry = next;
+    }
+}
+
+// MARK: - Configuration
+
+static void __DCResolverLoadHosts(DCResolverRef resolver, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        char *save = NULL;
+        char *literal = strtok_r(line, " \t\r\n", &save);
+        struct sockaddr_storage address;
+        if (!literal || !DCResolverParseLiteral(literal, &address))
+            continue;
+
+        for (char *hostname = strtok_r(NULL, " \t\r\n", &save); hostname; hostname = strtok_r(NULL, " \t\r\n", &save)) {
+            char name[kDCResolverMaxNameLength + 1];
+            if (!__DCResolverNormalizeName(hostname, name))
+                continue;
+
+            uint32_t hash = __DCResolverHash(name);
+            __DCResolverEntry *entry = __DCResolverFindEntry(resolver, name, hash);
+            if (!entry) {
+                entry = __DCResolverInsertEntry(resolver, name, hash);
+                entry->state = kDCResolverEntryStateResolved;
+            }
+
+            if (entry->nbrAddresses < kDCResolverMaxAddresses)
+                entry->addresses[entry->nbrAddresses++] = address;
+        }
+    }
+    fclose(file);
+}
+
+static void __DCResolverLoadResolvConf(DCResolverRef resolver, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file)
+        return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        char *save = NULL;
+        char *keyword = strtok_r(line, " \t\r\n", &save);
+        if (!keyword || strcmp(keyword, "nameserver") != 0)
+            continue;
+
+        char *address = strtok_r(NULL, " \t\r\n", &save);
+        if (address && DCResolverSetNameserver(resolver, address, 53))
+            break;
+    }
+    fclose(file);
+}
+
+static void __DCResolverReadable(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info);
+
+bool DCResolverSetNameserver(DCResolverRef resolver, const char *address, uint16_t port) {
+    struct sockaddr_storage nameserver;
+    if (!DCResolverParseLiteral(address, &nameserver)) {
+        log_debug("resolver=%p, nameserver %s isn't an IP address\n", resolver, address);
+        return false;
+    }
+
+    socklen_t length;
+    if (nameserver.ss_family == AF_INET) {
+        ((struct sockaddr_in *) &nameserver)->sin_port = htons(port);
+        length = sizeof(struct sockaddr_in);
+    } else {
+        ((struct sockaddr_in6 *) &nameserver)->sin6_port = htons(port);
+        length = sizeof(struct sockaddr_in6);
+    }
+
+    int fd = socket(nameserver.ss_family, SOCK_DGRAM, 0);
+    if (fd == -1) {
+        log_error("resolver=%p, couldn't create socket: %s\n", resolver, strerror(errno));
+        return false;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    // Connected, so the kernel drops datagrams from anyone but the nameserver
+    if (connect(fd, (struct sockaddr *) &nameserver, length) != 0) {
+        log_error("resolver=%p, couldn't connect to nameserver %s: %s\n", resolver, address, strerror(errno));
+        close(fd);
+        return false;
+    }
+
+    if (resolver->fd != -1) {
+        DCEventLoopRemoveFD(resolver->loop, resolver->fd);
+        close(resolver->fd);
+    }
+    resolver->fd = fd;
+    DCEventLoopAddFD(resolver->loop, fd, __DCResolverReadable, resolver);
+
+    log_debug("resolver=%p, nameserver => %s:%u\n", resolver, address, (unsigned int) port);
+    return true;
+}
+
+void DCResolverSetTimeout(DCResolverRef resolver, unsigned int timeoutMs, unsigned int attempts) {
+    resolver->timeoutMs = timeoutMs > 0 ? timeoutMs : kDCResolverDefaultTimeoutMs;
+    resolver->attempts = attempts > 0 ? attempts : 1;
+}
+
+void DCResolverSetNegativeTTL(DCResolverRef resolver, unsigned int negativeTTLMs) {
+    resolver->negativeTTLMs = negativeTTLMs;
+}
+
+// MARK: - Lifecycle
+
+static void __DCResolverTimer(DCEventLoopRef loop, void *info);
+
+DCResolverRef DCResolverCreate(DCEventLoopRef loop) {
+    struct __DCResolver *resolver = (struct __DCResolver *) calloc(1, sizeof(struct __DCResolver));
+    TRACE(resolver);
+    resolver->loop = loop;
+    resolver->fd = -1;
+    resolver->timeoutMs = kDCResolverDefaultTimeoutMs;
+    resolver->attempts = kDCResolverDefaultAttempts;
+    resolver->negativeTTLMs = kDCResolverDefaultNegativeTTLMs;
+    resolver->lastPurge = DCEventLoopGetTime(loop);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    resolver->seed = (uint32_t) (ts.tv_nsec ^ (ts.tv_sec << 16) ^ (uintptr_t) resolver) | 1;
+    int urandom = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (urandom != -1) {
+        uint32_t seed = 0;
+        if (read(urandom, &seed, sizeof(seed)) == sizeof(seed) && seed != 0)
+            resolver->seed = seed;
+        close(urandom);
+    }
+
+    __DCResolverLoadHosts(resolver, "/etc/hosts");
+    __DCResolverLoadResolvConf(resolver, "/etc/resolv.conf");
+    if (resolver->fd == -1)
+        DCResolverSetNameserver(resolver, "127.0.0.1", 53);
+
+    DCEventLoopAddTimer(loop, kDCResolverTickMs, __DCResolverTimer, resolver);
+    return resolver;
+}
+
+static void __DCResolverFreeWaiters(__DCResolverWaiter *waiter) {
+    while (waiter) {
+        __DCResolverWaiter *next = waiter->next;
+        free(waiter);
+        waiter = next;
+    }
+}
+
+void DCResolverRelease(DCResolverRef resolver) {
+    TRACE(resolver);
+    while (resolver->oldest) {
+        __DCResolverFreeWaiters(resolver->oldest->waiters);
+        __DCResolverRemoveEntry(resolver, resolver->oldest);
+    }
+    if (resolver->fd != -1) {
+        DCEventLoopRemoveFD(resolver->loop, resolver->fd);
+        close(resolver->fd);
+    }
+    free(resolver);
+}
+
+// MARK: - Queries
+
+static int __DCResolverBuildQuery(uint8_t *packet, size_t size, uint16_t id, const char *name, uint16_t type) {
+    size_t nameLength = strlen(name);
+    if (12 + nameLength + 2 + 4 > size)
+        return -1;
+
+    memset(packet, 0, 12);
+    packet[0] = (uint8_t) (id >> 8);
+    packet[1] = (uint8_t) id;
+    packet[2] = 0x01;   // Recursion desired
+    packet[5] = 1;      // One question
+
+    // "www.example.com" => 3www7example3com0
+    uint8_t *out = packet + 12;
+    const char *label = name;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t labelLength = dot ? (size_t) (dot - label) : strlen(label);
+        if (labelLength == 0 || labelLength > 63)
+            return -1;
+        *out++ = (uint8_t) labelLength;
+        memcpy(out, label, labelLength);
+        out += labelLength;
+        label += labelLength + (dot ? 1 : 0);
+    }
+    *out++ = 0;
+
+    *out++ = (uint8_t) (type >> 8);
+    *out++ = (uint8_t) type;
+    *out++ = 0;
+    *out++ = kDCResolverClassIN;
+    return (int) (out - packet);
+}
+
+static inline uint16_t __DCResolverQueryType(int query) {
+    return query == kDCResolverQueryA ? kDCResolverTypeA : kDCResolverTypeAAAA;
+}
+
+static bool __DCResolverSendQueries(DCResolverRef resolver, __DCResolverEntry *entry) {
+    uint8_t packet[512];
+    entry->sentAt = DCEventLoopGetTime(resolver->loop);
+
+    for (int query = kDCResolverQueryA; query <= kDCResolverQueryAAAA; query++) {
+        if (entry->answered[query])
+            continue;
+        if (entry->queryIDs[query] == 0)
+            entry->queryIDs[query] = __DCResolverNextID(resolver);
+
+        int length = __DCResolverBuildQuery(packet, sizeof(packet), entry->queryIDs[query], entry->name, __DCResolverQueryType(query));
+        if (length < 0)
+            return false;
+
+        // A full socket buffer is handled like a lost datagram, the timer resends
+        if (send(resolver->fd, packet, (size_t) length, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            log_debug("resolver=%p, couldn't send query for %s: %s\n", resolver, entry->name, strerror(errno));
+        resolver->queries++;
+    }
+    return true;
+}
+
+static void __DCResolverDispatch(DCResolverRef resolver, __DCResolverWaiter *waiters, DCResolverStatus status, const struct sockaddr_storage *addresses, unsigned int nbrAddresses) {
+    // Callbacks may cancel waiters still in the list, or evict the entry
+    // the addresses came from, hence the copies.
+    __DCResolverWaiter *outer = resolver->dispatching;
+    resolver->dispatching = waiters;
+    while (resolver->dispatching) {
+        __DCResolverWaiter *waiter = resolver->dispatching;
+        resolver->dispatching = waiter->next;
+        if (waiter->callback)
+            waiter->callback(resolver, status, addresses, nbrAddresses, waiter->info);
+        free(waiter);
+    }
+    resolver->dispatching = outer;
+}
+
+static DCResolverStatus __DCResolverEntryStatus(__DCResolverEntry *entry) {
+    switch (entry->state) {
+        case kDCResolverEntryStateResolved: return kDCResolverStatusResolved;
+        case kDCResolverEntryStateNotFound: return kDCResolverStatusNotFound;
+        default: return kDCResolverStatusFailed;
+    }
+}
+
+static void __DCResolverComplete(DCResolverRef resolver, __DCResolverEntry *entry) {
+    unsigned long long now = DCEventLoopGetTime(resolver->loop);
+
+    for (__DCResolverEntry **it = &(resolver->inflight); *it; it = &((*it)->nextInflight)) {
+        if (*it == entry) {
+            *it = entry->nextInflight;
+            break;
+        }
+    }
+    entry->nextInflight = NULL;
+
+    if (entry->nbrAddresses > 0) {
+        unsigned long long ttlMs = (unsigned long long) entry->ttl * 1000;
+        entry->state = kDCResolverEntryStateResolved;
+        entry->expiresAt = now + (ttlMs < kDCResolverMaxTTLMs ? ttlMs : kDCResolverMaxTTLMs);
+
+        // IPv4 first, stable otherwise
+        struct sockaddr_storage sorted[kDCResolverMaxAddresses];
+        unsigned int nbrSorted = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (unsigned int i = 0; i < entry->nbrAddresses; i++) {
+                if ((entry->addresses[i].ss_family == AF_INET) == (pass == 0))
+                    sorted[nbrSorted++] = entry->addresses[i];
+            }
+        }
+        memcpy(entry->addresses, sorted, nbrSorted * sizeof(struct sockaddr_storage));
+    } else if ((entry->notFound[kDCResolverQueryA] || entry->notFound[kDCResolverQueryAAAA]) &&
+               !entry->failed[kDCResolverQueryA] && !entry->failed[kDCResolverQueryAAAA] &&
+               entry->answered[kDCResolverQueryA] && entry->answered[kDCResolverQueryAAAA]) {
+        unsigned long long ttlMs = entry->negativeTTL == UINT32_MAX ? resolver->negativeTTLMs : (unsigned long long) entry->negativeTTL * 1000;
+        entry->state = kDCResolverEntryStateNotFound;
+        entry->expiresAt = now + (ttlMs < resolver->negativeTTLMs ? ttlMs : resolver->negativeTTLMs);
+    } else {
+        entry->state = kDCResolverEntryStateFailed;
+        entry->expiresAt = now + kDCResolverFailedTTLMs;
+    }
+
+    log_debug("resolver=%p, %s => %s (%u addresses)\n", resolver, entry->name, DCResolverStatusString(__DCResolverEntryStatus(entry)), entry->nbrAddresses);
+
+    struct sockaddr_storage addresses[kDCResolverMaxAddresses];
+    unsigned int nbrAddresses = entry->nbrAddresses;
+    memcpy(addresses, entry->addresses, nbrAddresses * sizeof(struct sockaddr_storage));
+
+    __DCResolverWaiter *waiters = entry->waiters;
+    entry->waiters = entry->lastWaiter = NULL;
+    __DCResolverDispatch(resolver, waiters, __DCResolverEntryStatus(entry), addresses, nbrAddresses);
+}
+
+// MARK: - Responses
+
+// Reads the possibly compressed name at `offset` into `name` (unless NULL),
+// returns the offset following it in the record or -1 when it's malformed.
+static int __DCResolverReadName(const uint8_t *packet, int length, int offset, char *name, size_t nameSize) {
+    int end = -1;
+    int jumps = 0;
+    size_t nameLength = 0;
+
+    while (true) {
+        if (offset >= length)
+            return -1;
+
+        uint8_t label = packet[offset];
+        if ((label & 0xC0) == 0xC0) {
+            if (offset + 1 >= length || ++jumps > 16)
+                return -1;
+            if (end == -1)
+                end = offset + 2;
+            offset = ((label & 0x3F) << 8) | packet[offset + 1];
+            continue;
+        }
+        if (label & 0xC0)
+            return -1;
+
+        offset++;
+        if (label == 0)
+            break;
+        if (offset + label > length)
+            return -1;
+
+        if (name) {
+            if (nameLength + label + 2 > nameSize)
+                return -1;
+            if (nameLength > 0)
+                name[nameLength++] = '.';
+            memcpy(name + nameLength, packet + offset, label);
+            nameLength += label;
+        }
+        offset += label;
+    }
+
+    if (name)
+        name[nameLength] = '\0';
+    return end == -1 ? offset : end;
+}
+
+static __DCResolverEntry* __DCResolverFindInflight(DCResolverRef resolver, uint16_t id, int *query) {
+    for (__DCResolverEntry *entry = resolver->inflight; entry; entry = entry->nextInflight) {
+        for (int q = kDCResolverQueryA; q <= kDCResolverQueryAAAA; q++) {
+            if (entry->queryIDs[q] == id && !entry->answered[q]) {
+                *query = q;
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void __DCResolverHandleResponse(DCResolverRef resolver, const uint8_t *packet, int length) {
+    if (length < 12)
+        return;
+
+    uint16_t id = __DCResolverRead16(packet);
+    uint16_t flags = __DCResolverRead16(packet + 2);
+    uint16_t nbrQuestions = __DCResolverRead16(packet + 4);
+    uint16_t nbrAnswers = __DCResolverRead16(packet + 6);
+    uint16_t nbrAuthorities = __DCResolverRead16(packet + 8);
+
+    if (!(flags & 0x8000) || nbrQuestions != 1)
+        return;
+
+    int query = 0;
+    __DCResolverEntry *entry = __DCResolverFindInflight(resolver, id, &query);
+    if (!entry) {
+        log_trace("resolver=%p, dropping response with unknown id %u\n", resolver, (unsigned int) id);
+        return;
+    }
+
+    char name[kDCResolverMaxNameLength + 2];
+    int offset = __DCResolverReadName(packet, length, 12, name, sizeof(name));
+    if (offset < 0 || offset + 4 > length)
+        return;
+
+    uint16_t type = __DCResolverQueryType(query);
+    if (__DCResolverRead16(packet + offset) != type || strcasecmp(name, entry->name) != 0) {
+        log_debug("resolver=%p, response %u doesn't match the query for %s\n", resolver, (unsigned int) id, entry->name);
+        return;
+    }
+    offset += 4;
+
+    unsigned int rcode = flags & 0x000F;
+    entry->answered[query] = true;
+
+    if (rcode != 0 && rcode != kDCResolverRcodeNXDomain) {
+        log_debug("resolver=%p, nameserver answered %s with rcode %u\n", resolver, entry->name, rcode);
+        entry->failed[query] = true;
+    } else {
+        bool found = false;
+        for (int i = 0; i < nbrAnswers + nbrAuthorities; i++) {
+            offset = __DCResolverReadName(packet, length, offset, NULL, 0);
+            if (offset < 0 || offset + 10 > length)
+                break;
+
+            uint16_t recordType = __DCResolverRead16(packet + offset);
+            uint16_t recordClass = __DCResolverRead16(packet + offset + 2);
+            uint32_t ttl = __DCResolverRead32(packet + offset + 4);
+            uint16_t dataLength = __DCResolverRead16(packet + offset + 8);
+            offset += 10;
+            if (offset + dataLength > length)
+                break;
+
+            if (i < nbrAnswers && recordClass == kDCResolverClassIN && recordType == type &&
+                dataLength == (type == kDCResolverTypeA ? 4 : 16)) {
+                // Any CNAMEs in front are followed by the nameserver, the
+                // addresses at the end of the chain are what we're after.
+                __DCResolverAddAddress(entry, type == kDCResolverTypeA ? AF_INET : AF_INET6, packet + offset);
+                if (ttl < entry->ttl)
+                    entry->ttl = ttl;
+                found = true;
+            } else if (i >= nbrAnswers && recordType == kDCResolverTypeSOA) {
+                // RFC 2308, negative answers live for min(SOA TTL, SOA MINIMUM)
+                int soa = __DCResolverReadName(packet, length, offset, NULL, 0);
+                soa = soa < 0 ? -1 : __DCResolverReadName(packet, length, soa, NULL, 0);
+                if (soa >= 0 && soa + 20 <= offset + dataLength) {
+                    uint32_t minimum = __DCResolverRead32(packet + soa + 16);
+                    uint32_t negativeTTL = minimum < ttl ? minimum : ttl;
+                    if (negativeTTL < entry->negativeTTL)
+                        entry->negativeTTL = negativeTTL;
+                }
+            }
+            offset += dataLength;
+        }
+
+        if (!found)
+            entry->notFound[query] = true;
+    }
+
+    if (entry->answered[kDCResolverQueryA] && entry->answered[kDCResolverQueryAAAA])
+        __DCResolverComplete(resolver, entry);
+}
+
+static void __DCResolverReadable(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    DCResolverRef resolver = (DCResolverRef) info;
+    uint8_t packet[kDCResolverMaxPacket];
+
+    while (true) {
+        ssize_t length = recv(fd, packet, sizeof(packet), 0);
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            // ECONNREFUSED is reported here when nothing listens on the
+            // nameserver's port, the queries then time out and fail.
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_debug("resolver=%p, recv failed: %s\n", resolver, strerror(errno));
+            if (errno != ECONNREFUSED)
+                break;
+            continue;
+        }
+        __DCResolverHandleResponse(resolver, packet, (int) length);
+    }
+}
+
+static void __DCResolverTimer(DCEventLoopRef loop, void *info) {
+    DCResolverRef resolver = (DCResolverRef) info;
+    unsigned long long now = DCEventLoopGetTime(loop);
+
+    __DCResolverEntry *entry = resolver->inflight;
+    while (entry) {
+        __DCResolverEntry *next = entry->nextInflight;
+        if (now - entry->sentAt >= resolver->timeoutMs) {
+            entry->attempts++;
+            if (entry->attempts >= resolver->attempts) {
+                log_debug("resolver=%p, %s timed out\n", resolver, entry->name);
+                __DCResolverComplete(resolver, entry);
+            } else {
+                __DCResolverSendQueries(resolver, entry);
+            }
+        }
+        entry = next;
+    }
+
+    if (now - resolver->lastPurge >= kDCResolverPurgeIntervalMs)
+        DCResolverPurgeExpired(resolver);
+}
+
+// MARK: - Resolving
+
+void DCResolverResolve(DCResolverRef resolver, const char *hostname, DCResolverCallback callback, void *info) {
+    struct sockaddr_storage literal;
+    if (DCResolverParseLiteral(hostname, &literal)) {
+        callback(resolver, kDCResolverStatusResolved, &literal, 1, info);
+        return;
+    }
+
+    char name[kDCResolverMaxNameLength + 1];
+    if (!__DCResolverNormalizeName(hostname, name)) {
+        callback(resolver, kDCResolverStatusNotFound, NULL, 0, info);
+        return;
+    }
+
+    uint32_t hash = __DCResolverHash(name);
+    __DCResolverEntry *entry = __DCResolverFindEntry(resolver, name, hash);
+
+    if (entry && entry->state != kDCResolverEntryStatePending) {
+        if (entry->expiresAt == 0 || entry->expiresAt > DCEventLoopGetTime(resolver->loop)) {
+            resolver->cacheHits++;
+            log_trace("resolver=%p, cached %s\n", resolver, name);
+            // The callback may evict the entry, see `__DCResolverDispatch`
+            struct sockaddr_storage addresses[kDCResolverMaxAddresses];
+            unsigned int nbrAddresses = entry->nbrAddresses;
+            memcpy(addresses, entry->addresses, nbrAddresses * sizeof(struct sockaddr_storage));
+            callback(resolver, __DCResolverEntryStatus(entry), addresses, nbrAddresses, info);
+            return;
+        }
+        __DCResolverRemoveEntry(resolver, entry);
+        entry = NULL;
+    }
+
+    __DCResolverWaiter *waiter = (__DCResolverWaiter *) calloc(1, sizeof(__DCResolverWaiter));
+    waiter->callback = callback;
+    waiter->info = info;
+
+    if (entry) {
+        log_trace("resolver=%p, %s already in flight\n", resolver, name);
+        if (entry->lastWaiter) entry->lastWaiter->next = waiter;
+        else entry->waiters = waiter;
+        entry->lastWaiter = waiter;
+        return;
+    }
+
+    entry = __DCResolverInsertEntry(resolver, name, hash);
+    entry->state = kDCResolverEntryStatePending;
+    entry->waiters = entry->lastWaiter = waiter;
+    entry->nextInflight = resolver->inflight;
+    resolver->inflight = entry;
+
+    if (!__DCResolverSendQueries(resolver, entry)) {
+        entry->answered[kDCResolverQueryA] = entry->answered[kDCResolverQueryAAAA] = true;
+        entry->failed[kDCResolverQueryA] = true;
+        __DCResolverComplete(resolver, entry);
+    }
+}
+
+void DCResolverCancel(DCResolverRef resolver, void *info) {
+    for (__DCResolverWaiter *waiter = resolver->dispatching; waiter; waiter = waiter->next) {
+        if (waiter->info == info)
+            waiter->callback = NULL;
+    }
+
+    for (__DCResolverEntry *entry = resolver->inflight; entry; entry = entry->nextInflight) {
+        __DCResolverWaiter **it = &(entry->waiters);
+        entry->lastWaiter = NULL;
+        while (*it) {
+            if ((*it)->info == info) {
+                __DCResolverWaiter *waiter = *it;
+                *it = waiter->next;
+                free(waiter);
+            } else {
+                entry->lastWaiter = *it;
+                it = &((*it)->next);
+            }
+        }
+    }
+}
+
+// MARK: - Statistics
+
+unsigned long long DCResolverGetQueryCount(DCResolverRef resolver) {
+    return resolver->queries;
+}
+
+unsigned long long DCResolverGetCacheHits(DCResolverRef resolver) {
+    return resolver->cacheHits;
+}
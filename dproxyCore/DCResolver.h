@@ -0,0 +1,57 @@
+#ifndef DCResolver_h
+#define DCResolver_h
+
+#include "DCEventLoop.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+typedef struct __DCResolver*         DCResolverRef;
+
+#define kDCResolverMaxAddresses 16
+
+typedef enum DCResolverStatus {
+    kDCResolverStatusResolved = 0,
+    kDCResolverStatusNotFound = 1,  // NXDOMAIN, or no A/AAAA records
+    kDCResolverStatusFailed = 2     // Timed out or the nameserver failed
+} DCResolverStatus;
+
+// `addresses` have port 0, IPv4 before IPv6
+typedef void (*DCResolverCallback)(DCResolverRef resolver, DCResolverStatus status, const struct sockaddr_storage *addresses, unsigned int nbrAddresses, void *info);
+
+/*
+ * Non-blocking stub resolver driven by an event loop. A and AAAA queries go
+ * over UDP to one nameserver, the first in /etc/resolv.conf unless another
+ * is set. Answers are cached for their TTL and names that don't exist for
+ * the SOA minimum (capped by the negative TTL). A lookup for a name that's
+ * already in flight waits for that query instead of sending its own, so
+ * any number of requests to one host cost a single round trip.
+ *
+ * A resolver belongs to one event loop (one worker) and isn't thread safe.
+ */
+DCResolverRef DCResolverCreate(DCEventLoopRef loop);
+void DCResolverRelease(DCResolverRef resolver);
+
+// `address` is an IPv4 or IPv6 literal
+bool DCResolverSetNameserver(DCResolverRef resolver, const char *address, uint16_t port);
+void DCResolverSetTimeout(DCResolverRef resolver, unsigned int timeoutMs, unsigned int attempts);
+void DCResolverSetNegativeTTL(DCResolverRef resolver, unsigned int negativeTTLMs);
+
+// Cached names, /etc/hosts entries and IP literals call back before this returns
+void DCResolverResolve(DCResolverRef resolver, const char *hostname, DCResolverCallback callback, void *info);
+// Drops every pending callback for `info`
+void DCResolverCancel(DCResolverRef resolver, void *info);
+
+void DCResolverPurgeExpired(DCResolverRef resolver);
+
+// An IPv4 or IPv6 literal, with port 0
+bool DCResolverParseLiteral(const char *hostname, struct sockaddr_storage *address);
+
+unsigned long long DCResolverGetQueryCount(DCResolverRef resolver);
+unsigned long long DCResolverGetCacheHits(DCResolverRef resolver);
+
+char* DCResolverStatusString(DCResolverStatus status);
+
+#endif /* DCResolver_h */
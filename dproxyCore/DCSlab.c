@@ -0,0 +1,124 @@
+#include "DCSlab.h"
+#include "log.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE(p) log_trace("slab=%p\n", p)
+
+// Objects are aligned like malloc's, the block header is padded to match
+#define kDCSlabAlignment 16
+
+typedef struct __DCSlabBlock {
+    struct __DCSlabBlock *next;
+} __DCSlabBlock;
+
+typedef struct __DCSlabFreeObject {
+    struct __DCSlabFreeObject *next;
+} __DCSlabFreeObject;
+
+struct __DCSlab {
+    const char *name;
+    size_t objectSize;
+    unsigned int objectsPerBlock;
+
+    __DCSlabBlock *blocks;
+    __DCSlabFreeObject *freeList;
+    unsigned int count;
+    unsigned int capacity;
+};
+
+static inline size_t __DCSlabAlign(size_t size) {
+    return (size + kDCSlabAlignment - 1) & ~((size_t) kDCSlabAlignment - 1);
+}
+
+// MARK: - Lifecycle
+
+DCSlabRef DCSlabCreate(const char *name, size_t objectSize, unsigned int objectsPerBlock) {
+    struct __DCSlab *slab = (struct __DCSlab *) calloc(1, sizeof(struct __DCSlab));
+    TRACE(slab);
+    slab->name = name;
+    slab->objectSize = __DCSlabAlign(objectSize < sizeof(__DCSlabFreeObject) ? sizeof(__DCSlabFreeObject) : objectSize);
+    slab->objectsPerBlock = objectsPerBlock ? objectsPerBlock : 1;
+    return slab;
+}
+
+void DCSlabRelease(DCSlabRef slab) {
+    TRACE(slab);
+    if (slab->count > 0)
+        log_warn("slab=%p, %s released with %u object(s) still in use\n", slab, slab->name, slab->count);
+
+    while (slab->blocks) {
+        __DCSlabBlock *block = slab->blocks;
+        slab->blocks = block->next;
+        free(block);
+    }
+    free(slab);
+}
+
+// MARK: - Objects
+
+#if !defined(DC_DISABLE_POOLING)
+static bool __DCSlabGrow(DCSlabRef slab) {
+    size_t headerSize = __DCSlabAlign(sizeof(__DCSlabBlock));
+    __DCSlabBlock *block = (__DCSlabBlock *) malloc(headerSize + slab->objectSize * slab->objectsPerBlock);
+    if (!block) {
+        log_error("slab=%p, couldn't allocate a block of %u %s(s)\n", slab, slab->objectsPerBlock, slab->name);
+        return false;
+    }
+    block->next = slab->blocks;
+    slab->blocks = block;
+
+    // Pushed back to front so the block is handed out in address order
+    uint8_t *objects = ((uint8_t *) block) + headerSize;
+    for (unsigned int i = slab->objectsPerBlock; i > 0; i--) {
+        __DCSlabFreeObject *object = (__DCSlabFreeObject *) (objects + (i - 1) * slab->objectSize);
+        object->next = slab->freeList;
+        slab->freeList = object;
+    }
+    slab->capacity += slab->objectsPerBlock;
+
+    log_debug("slab=%p, %s grown to %u\n", slab, slab->name, slab->capacity);
+    return true;
+}
+#endif
+
+void* DCSlabAlloc(DCSlabRef slab) {
+#if defined(DC_DISABLE_POOLING)
+    slab->count++;
+    return calloc(1, slab->objectSize);
+#else
+    if (!slab->freeList && !__DCSlabGrow(slab))
+        return NULL;
+
+    __DCSlabFreeObject *object = slab->freeList;
+    slab->freeList = object->next;
+    slab->count++;
+    memset(object, 0, slab->objectSize);
+    return object;
+#endif
+}
+
+void DCSlabFree(DCSlabRef slab, void *object) {
+    if (!object)
+        return;
+    slab->count--;
+#if defined(DC_DISABLE_POOLING)
+    free(object);
+#else
+    __DCSlabFreeObject *freeObject = (__DCSlabFreeObject *) object;
+    freeObject->next = slab->freeList;
+    slab->freeList = freeObject;
+#endif
+}
+
+// MARK: - Getters
+
+unsigned int DCSlabGetCount(DCSlabRef slab) {
+    return slab->count;
+}
+
+unsigned int DCSlabGetCapacity(DCSlabRef slab) {
+    return slab->capacity;
+}
@@ -0,0 +1,30 @@
+#ifndef DCSlab_h
+#define DCSlab_h
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct __DCSlab*         DCSlabRef;
+
+/*
+ * Objects of one size carved out of larger blocks and recycled through a
+ * free list, so creating and releasing them is a couple of pointer moves.
+ * A slab belongs to one worker and isn't thread safe. Blocks are only given
+ * back when the slab is released, memory stays at its high water mark.
+ *
+ * Building with `DC_DISABLE_POOLING` makes every object a plain calloc/free,
+ * which is what the address sanitizer wants to see.
+ */
+DCSlabRef DCSlabCreate(const char *name, size_t objectSize, unsigned int objectsPerBlock);
+void DCSlabRelease(DCSlabRef slab);
+
+// Zeroed, like calloc. NULL only when a new block couldn't be allocated.
+void* DCSlabAlloc(DCSlabRef slab);
+void DCSlabFree(DCSlabRef slab, void *object);
+
+// Objects handed out, and objects there's room for without allocating
+unsigned int DCSlabGetCount(DCSlabRef slab);
+unsigned int DCSlabGetCapacity(DCSlabRef slab);
+
+#endif /* DCSlab_h */
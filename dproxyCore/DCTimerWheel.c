@@ -0,0 +1,222 @@
+#include "DCTimerWheel.h"
+#include "log.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TRACE(p) log_trace("wheel=%p\n", p)
+
+#define kDCTimerWheelBits   6
+#define kDCTimerWheelSlots  (1 << kDCTimerWheelBits)
+#define kDCTimerWheelLevels 4
+// Ticks covered by all levels together, the overflow is looked at once per turn
+#define kDCTimerWheelSpan   (1ull << (kDCTimerWheelLevels * kDCTimerWheelBits))
+
+struct __DCTimerWheel {
+    // The last tick that was processed
+    unsigned long long now;
+
+    // An entry sits in the level of the highest digit (base 64) where its
+    // deadline differs from `now`, in the slot of its own digit there. All
+    // higher digits being equal, that slot is always ahead of `now`, and
+    // the entry moves down when `now` gets there with zeros below.
+    DCTimerWheelEntry slots[kDCTimerWheelLevels][kDCTimerWheelSlots];
+    // A bit per slot that may hold entries. Cancelling leaves it set, it's
+    // cleared when the slot turns out to be empty.
+    uint64_t occupied[kDCTimerWheelLevels];
+    DCTimerWheelEntry overflow;
+};
+
+// MARK: - Lists
+
+// Every list is circular around a head that's never scheduled itself, so
+// an entry can be unlinked without knowing which list it's in.
+static inline void __DCTimerWheelListInit(DCTimerWheelEntry *head) {
+    head->prev = head->next = head;
+}
+
+static inline bool __DCTimerWheelListIsEmpty(const DCTimerWheelEntry *head) {
+    return head->next == head;
+}
+
+static inline void __DCTimerWheelListAppend(DCTimerWheelEntry *head, DCTimerWheelEntry *entry) {
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static inline void __DCTimerWheelUnlink(DCTimerWheelEntry *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = entry->next = NULL;
+}
+
+// Moves the whole of `head` to `into`, so what callbacks schedule meanwhile
+// can go back in the same slot
+static void __DCTimerWheelListTake(DCTimerWheelEntry *head, DCTimerWheelEntry *into) {
+    if (__DCTimerWheelListIsEmpty(head)) {
+        __DCTimerWheelListInit(into);
+        return;
+    }
+    into->next = head->next;
+    into->prev = head->prev;
+    into->next->prev = into;
+    into->prev->next = into;
+    __DCTimerWheelListInit(head);
+}
+
+// MARK: - Lifecycle
+
+DCTimerWheelRef DCTimerWheelCreate(unsigned long long now) {
+    struct __DCTimerWheel *wheel = (struct __DCTimerWheel *) calloc(1, sizeof(struct __DCTimerWheel));
+    TRACE(wheel);
+    wheel->now = now;
+    for (int level = 0; level < kDCTimerWheelLevels; level++)
+        for (int slot = 0; slot < kDCTimerWheelSlots; slot++)
+            __DCTimerWheelListInit(&(wheel->slots[level][slot]));
+    __DCTimerWheelListInit(&(wheel->overflow));
+    return wheel;
+}
+
+static void __DCTimerWheelUnlinkAll(DCTimerWheelEntry *head) {
+    while (!__DCTimerWheelListIsEmpty(head))
+        __DCTimerWheelUnlink(head->next);
+}
+
+void DCTimerWheelRelease(DCTimerWheelRef wheel) {
+    TRACE(wheel);
+    for (int level = 0; level < kDCTimerWheelLevels; level++)
+        for (int slot = 0; slot < kDCTimerWheelSlots; slot++)
+            __DCTimerWheelUnlinkAll(&(wheel->slots[level][slot]));
+    __DCTimerWheelUnlinkAll(&(wheel->overflow));
+    free(wheel);
+}
+
+void DCTimerWheelEntryInit(DCTimerWheelEntry *entry, DCTimerWheelCallback callback, void *info) {
+    entry->prev = entry->next = NULL;
+    entry->deadline = 0;
+    entry->callback = callback;
+    entry->info = info;
+}
+
+bool DCTimerWheelEntryIsScheduled(const DCTimerWheelEntry *entry) {
+    return entry->next != NULL;
+}
+
+// MARK: - Scheduling
+
+static void __DCTimerWheelPlace(DCTimerWheelRef wheel, DCTimerWheelEntry *entry) {
+    unsigned long long differs = entry->deadline ^ wheel->now;
+    int level = differs < kDCTimerWheelSlots ? 0 : (63 - __builtin_clzll(differs)) / kDCTimerWheelBits;
+    if (level >= kDCTimerWheelLevels) {
+        __DCTimerWheelListAppend(&(wheel->overflow), entry);
+        return;
+    }
+
+    unsigned int slot = (unsigned int) (entry->deadline >> (level * kDCTimerWheelBits)) & (kDCTimerWheelSlots - 1);
+    __DCTimerWheelListAppend(&(wheel->slots[level][slot]), entry);
+    wheel->occupied[level] |= 1ull << slot;
+}
+
+void DCTimerWheelSchedule(DCTimerWheelRef wheel, DCTimerWheelEntry *entry, unsigned long long deadline) {
+    if (entry->next)
+        __DCTimerWheelUnlink(entry);
+    entry->deadline = deadline > wheel->now ? deadline : wheel->now + 1;
+    __DCTimerWheelPlace(wheel, entry);
+}
+
+void DCTimerWheelCancel(DCTimerWheelEntry *entry) {
+    if (entry->next)
+        __DCTimerWheelUnlink(entry);
+}
+
+// MARK: - Ticking
+
+// The first tick after `now` with something to do, ULLONG_MAX when there's
+// nothing. Everything in a level is due before anything in the levels above.
+static unsigned long long __DCTimerWheelNextTick(DCTimerWheelRef wheel) {
+    unsigned long long now = wheel->now;
+    for (int level = 0; level < kDCTimerWheelLevels; level++) {
+        unsigned int shift = level * kDCTimerWheelBits;
+        unsigned int digit = (unsigned int) (now >> shift) & (kDCTimerWheelSlots - 1);
+        uint64_t ahead = digit == kDCTimerWheelSlots - 1 ? 0 : wheel->occupied[level] & (~0ull << (digit + 1));
+        while (ahead) {
+            unsigned int slot = (unsigned int) __builtin_ctzll(ahead);
+            if (!__DCTimerWheelListIsEmpty(&(wheel->slots[level][slot]))) {
+                unsigned long long turn = now & ~((1ull << (shift + kDCTimerWheelBits)) - 1);
+                return turn | ((unsigned long long) slot << shift);
+            }
+            wheel->occupied[level] &= ~(1ull << slot);
+            ahead &= ahead - 1;
+        }
+    }
+    if (!__DCTimerWheelListIsEmpty(&(wheel->overflow)))
+        return (now / kDCTimerWheelSpan + 1) * kDCTimerWheelSpan;
+    return ULLONG_MAX;
+}
+
+static void __DCTimerWheelCascade(DCTimerWheelRef wheel, DCTimerWheelEntry *head) {
+    DCTimerWheelEntry pending;
+    __DCTimerWheelListTake(head, &pending);
+    while (!__DCTimerWheelListIsEmpty(&pending)) {
+        DCTimerWheelEntry *entry = pending.next;
+        __DCTimerWheelUnlink(entry);
+        __DCTimerWheelPlace(wheel, entry);
+    }
+}
+
+// Moves down what's due within the turn that starts at `now`, then fires
+// the slot of `now` itself. Whatever is in there is due right now.
+static void __DCTimerWheelTick(DCTimerWheelRef wheel) {
+    unsigned long long now = wheel->now;
+    if (now % kDCTimerWheelSpan == 0)
+        __DCTimerWheelCascade(wheel, &(wheel->overflow));
+
+    for (int level = kDCTimerWheelLevels - 1; level > 0; level--) {
+        unsigned int shift = level * kDCTimerWheelBits;
+        if (now & ((1ull << shift) - 1))
+            continue;
+        unsigned int slot = (unsigned int) (now >> shift) & (kDCTimerWheelSlots - 1);
+        if (!(wheel->occupied[level] & (1ull << slot)))
+            continue;
+        wheel->occupied[level] &= ~(1ull << slot);
+        __DCTimerWheelCascade(wheel, &(wheel->slots[level][slot]));
+    }
+
+    unsigned int slot = (unsigned int) now & (kDCTimerWheelSlots - 1);
+    if (!(wheel->occupied[0] & (1ull << slot)))
+        return;
+    wheel->occupied[0] &= ~(1ull << slot);
+
+    DCTimerWheelEntry due;
+    __DCTimerWheelListTake(&(wheel->slots[0][slot]), &due);
+    while (!__DCTimerWheelListIsEmpty(&due)) {
+        DCTimerWheelEntry *entry = due.next;
+        __DCTimerWheelUnlink(entry);
+        entry->callback(entry, entry->info);
+    }
+}
+
+// Only the ticks with something to do are visited, `now` jumps the others
+void DCTimerWheelAdvance(DCTimerWheelRef wheel, unsigned long long now) {
+    while (wheel->now < now) {
+        unsigned long long next = __DCTimerWheelNextTick(wheel);
+        if (next > now) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now = next;
+        __DCTimerWheelTick(wheel);
+    }
+}
+
+int DCTimerWheelGetTimeout(DCTimerWheelRef wheel, unsigned long long now) {
+    unsigned long long next = __DCTimerWheelNextTick(wheel);
+    if (next == ULLONG_MAX)
+        return -1;
+    if (next <= now)
+        return 0;
+    return next - now > INT_MAX ? INT_MAX : (int) (next - now);
+}
@@ -0,0 +1,54 @@
+#ifndef DCTimerWheel_h
+#define DCTimerWheel_h
+
+#include <stdio.h>
+#include <stdbool.h>
+
+typedef struct __DCTimerWheel*         DCTimerWheelRef;
+
+typedef struct DCTimerWheelEntry DCTimerWheelEntry;
+typedef void (*DCTimerWheelCallback)(DCTimerWheelEntry *entry, void *info);
+
+// Lives inside whatever it times, e.g. a connection, so scheduling never
+// allocates. The links are the wheel's, both NULL while it isn't scheduled.
+struct DCTimerWheelEntry {
+    DCTimerWheelEntry *prev;
+    DCTimerWheelEntry *next;
+    unsigned long long deadline;
+    DCTimerWheelCallback callback;
+    void *info;
+};
+
+/*
+ * Deadlines in milliseconds, kept in a hierarchical timing wheel: four
+ * levels of 64 slots, where a slot of one level spans a whole turn of the
+ * level below. An entry goes in the level matching how far off its deadline
+ * is and moves down as that comes closer, so scheduling, cancelling and
+ * firing cost the same however many entries there are, and a tick only
+ * looks at the slots due. Deadlines further out than the wheel reaches,
+ * about 4.6 hours, wait in an overflow list. A wheel belongs to one thread,
+ * usually through its event loop, see `DCEventLoopGetTimerWheel`.
+ */
+DCTimerWheelRef DCTimerWheelCreate(unsigned long long now);
+// Entries still scheduled are unlinked, cancelling them later does nothing
+void DCTimerWheelRelease(DCTimerWheelRef wheel);
+
+void DCTimerWheelEntryInit(DCTimerWheelEntry *entry, DCTimerWheelCallback callback, void *info);
+bool DCTimerWheelEntryIsScheduled(const DCTimerWheelEntry *entry);
+
+// Moves `entry` when it's already scheduled. A deadline that has passed
+// fires with the next tick.
+void DCTimerWheelSchedule(DCTimerWheelRef wheel, DCTimerWheelEntry *entry, unsigned long long deadline);
+// Just unlinks `entry`, which is why it doesn't need the wheel
+void DCTimerWheelCancel(DCTimerWheelEntry *entry);
+
+// Fires everything due by `now`, unlinked before its callback is called.
+// Callbacks may schedule and cancel any entry, their own included.
+void DCTimerWheelAdvance(DCTimerWheelRef wheel, unsigned long long now);
+
+// Milliseconds from `now` until the wheel has something to do, -1 when it's
+// empty. Never later than the next deadline, earlier when entries are due
+// to move down a level first.
+int DCTimerWheelGetTimeout(DCTimerWheelRef wheel, unsigned long long now);
+
+#endif /* DCTimerWheel_h */
@@ -0,0 +1,29 @@
+#ifndef DCTypes_h
+#define DCTypes_h
+
+/*
+ * The few CoreFoundation scalar types dproxyCore still uses. On Apple they
+ * come from CoreFoundation itself, elsewhere they're defined the same way
+ * so nothing else has to change.
+ */
+
+#if defined(__APPLE__)
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#else
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint8_t                     UInt8;
+typedef uint16_t                    UInt16;
+typedef uint32_t                    UInt32;
+typedef int32_t                     SInt32;
+typedef signed long                 CFIndex;
+typedef int                         CFSocketNativeHandle;
+typedef const struct __CFData*      CFDataRef;
+
+#endif
+
+#endif /* DCTypes_h */
@@ -0,0 +1,297 @@
+#include "DCWorker.h"
+#include "DCChannel.h"
+#include "DCConnection.h"
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define TRACE(p) log_trace("worker=%p\n", p)
+
+// Objects per slab block; a channel has a client and usually one upstream
+#define kDCWorkerChannelsPerBlock     64
+#define kDCWorkerConnectionsPerBlock  128
+
+// How often a worker that stopped accepting for its budget looks again,
+// other workers' channels closing don't tell it
+#define kDCWorkerAdmissionRetryMs     10
+
+struct __DCWorker {
+    unsigned int index;
+    DCEventLoopRef loop;
+    DCConnectionPoolRef connectionPool;
+    DCResolverRef resolver;
+    DCAddressStatsRef addressStats;
+    DCSlabRef channelSlab;
+    DCSlabRef connectionSlab;
+    DCBufferPoolRef bufferPool;
+    DCChannelRef channels;
+    DCConnectionTimeouts timeouts;
+    struct __DCWorkerListener *listeners;
+    unsigned int nbrListeners;
+    // All listeners are paused while the worker is full
+    bool accepting;
+
+    unsigned int nbrChannels;
+    unsigned int maxChannels;
+    DCWorkerChannelBudget *budget;
+    DCTimerWheelEntry admissionEntry;
+    bool started;
+    pthread_t thread;
+};
+
+typedef struct __DCWorkerListener {
+    int fd;
+    bool closeOnRelease;
+} __DCWorkerListener;
+
+static __thread DCWorkerRef __DCCurrentWorker = NULL;
+
+static void __DCWorkerAdmissionRetry(DCTimerWheelEntry *entry, void *info);
+
+// MARK: - Lifecycle
+
+DCWorkerRef DCWorkerCreate(unsigned int index, DCEventLoopBackend backend) {
+    DCEventLoopRef loop = DCEventLoopCreate(backend);
+    if (!loop)
+        return NULL;
+
+    struct __DCWorker *worker = (struct __DCWorker *) calloc(1, sizeof(struct __DCWorker));
+    TRACE(worker);
+    worker->index = index;
+    worker->loop = loop;
+    worker->connectionPool = DCConnectionPoolCreate(loop);
+    worker->resolver = DCResolverCreate(loop);
+    worker->addressStats = DCAddressStatsCreate();
+    worker->channelSlab = DCSlabCreate("channel", DCChannelGetInstanceSize(), kDCWorkerChannelsPerBlock);
+    worker->connectionSlab = DCSlabCreate("connection", DCConnectionGetInstanceSize(), kDCWorkerConnectionsPerBlock);
+    worker->bufferPool = DCBufferPoolCreate(kDCBufferPoolDefaultMaxCachedBytes);
+    worker->timeouts = kDCConnectionDefaultTimeouts;
+    worker->accepting = true;
+    DCTimerWheelEntryInit(&(worker->admissionEntry), __DCWorkerAdmissionRetry, worker);
+    return worker;
+}
+
+void DCWorkerRelease(DCWorkerRef worker) {
+    TRACE(worker);
+    DCWorkerJoin(worker);
+    DCTimerWheelCancel(&(worker->admissionEntry));
+    for (unsigned int i = 0; i < worker->nbrListeners; i++) {
+        DCEventLoopRemoveFD(worker->loop, worker->listeners[i].fd);
+        if (worker->listeners[i].closeOnRelease) close(worker->listeners[i].fd);
+    }
+    // So the channels closing below don't resume accepting on them
+    free(worker->listeners);
+    worker->listeners = NULL;
+    worker->nbrListeners = 0;
+
+    // What their connections defer is run when the loop is released, before
+    // the slabs and buffers go
+    unsigned int nbrOpen = 0;
+    for (; worker->channels; nbrOpen++)
+        DCChannelRelease(worker->channels);
+    if (nbrOpen > 0)
+        log_debug("worker=%p, released %u open channel(s)\n", worker, nbrOpen);
+
+    DCConnectionPoolRelease(worker->connectionPool);
+    DCResolverRelease(worker->resolver);
+    DCAddressStatsRelease(worker->addressStats);
+    DCEventLoopRelease(worker->loop);
+    DCSlabRelease(worker->channelSlab);
+    DCSlabRelease(worker->connectionSlab);
+    DCBufferPoolRelease(worker->bufferPool);
+    free(worker);
+}
+
+// MARK: - Getters
+
+DCWorkerRef DCWorkerGetCurrent(void) {
+    return __DCCurrentWorker;
+}
+
+unsigned int DCWorkerGetIndex(DCWorkerRef worker) {
+    return worker->index;
+}
+
+DCEventLoopRef DCWorkerGetEventLoop(DCWorkerRef worker) {
+    return worker->loop;
+}
+
+DCConnectionPoolRef DCWorkerGetConnectionPool(DCWorkerRef worker) {
+    return worker->connectionPool;
+}
+
+DCResolverRef DCWorkerGetResolver(DCWorkerRef worker) {
+    return worker->resolver;
+}
+
+DCAddressStatsRef DCWorkerGetAddressStats(DCWorkerRef worker) {
+    return worker->addressStats;
+}
+
+DCSlabRef DCWorkerGetChannelSlab(DCWorkerRef worker) {
+    return worker->channelSlab;
+}
+
+DCSlabRef DCWorkerGetConnectionSlab(DCWorkerRef worker) {
+    return worker->connectionSlab;
+}
+
+DCBufferPoolRef DCWorkerGetBufferPool(DCWorkerRef worker) {
+    return worker->bufferPool;
+}
+
+DCChannelRef* DCWorkerGetChannelList(DCWorkerRef worker) {
+    return &(worker->channels);
+}
+
+void DCWorkerSetConnectionTimeouts(DCWorkerRef worker, const DCConnectionTimeouts *timeouts) {
+    worker->timeouts = *timeouts;
+}
+
+const DCConnectionTimeouts* DCWorkerGetConnectionTimeouts(DCWorkerRef worker) {
+    return &(worker->timeouts);
+}
+
+// MARK: - Accept
+
+// Already non-blocking, see `DCEventLoopAddListener`
+static void __DCWorkerAccept(DCEventLoopRef loop, int listenFD, int fd, void *info) {
+    DCChannelRef channel = DCChannelCreate();
+    DCChannelSetupWithFD(channel, fd);
+}
+
+bool DCWorkerAddListener(DCWorkerRef worker, int fd, bool closeOnRelease) {
+    TRACE(worker);
+    __DCWorkerListener *listeners = (__DCWorkerListener *) realloc(worker->listeners, (worker->nbrListeners + 1) * sizeof(__DCWorkerListener));
+    if (!listeners)
+        return false;
+    worker->listeners = listeners;
+    if (!DCEventLoopAddListener(worker->loop, fd, __DCWorkerAccept, worker))
+        return false;
+    if (!worker->accepting)
+        DCEventLoopSetAccepting(worker->loop, fd, false);
+    worker->listeners[worker->nbrListeners].fd = fd;
+    worker->listeners[worker->nbrListeners].closeOnRelease = closeOnRelease;
+    worker->nbrListeners++;
+    return true;
+}
+
+static void __DCWorkerSetAccepting(DCWorkerRef worker, bool accepting) {
+    for (unsigned int i = 0; i < worker->nbrListeners; i++)
+        DCEventLoopSetAccepting(worker->loop, worker->listeners[i].fd, accepting);
+    worker->accepting = accepting;
+}
+
+// MARK: - Admission
+
+void DCWorkerSetChannelLimits(DCWorkerRef worker, unsigned int maxChannels, DCWorkerChannelBudget *budget) {
+    worker->maxChannels = maxChannels;
+    worker->budget = budget;
+}
+
+unsigned int DCWorkerGetChannelCount(DCWorkerRef worker) {
+    return worker->nbrChannels;
+}
+
+bool DCWorkerIsAccepting(DCWorkerRef worker) {
+    return worker->accepting;
+}
+
+// Accepting stops at a limit and starts again an eighth below it, so a
+// worker at its limit doesn't pause and resume for every channel
+static bool __DCWorkerIsOver(unsigned int nbrOpen, unsigned int maxOpen, bool resuming) {
+    if (maxOpen == 0)
+        return false;
+    return nbrOpen >= (resuming ? maxOpen - maxOpen / 8 : maxOpen);
+}
+
+static bool __DCWorkerIsFull(DCWorkerRef worker, bool resuming) {
+    if (__DCWorkerIsOver(worker->nbrChannels, worker->maxChannels, resuming))
+        return true;
+    return worker->budget && __DCWorkerIsOver(atomic_load_explicit(&(worker->budget->nbrOpen), memory_order_relaxed), worker->budget->maxOpen, resuming);
+}
+
+static void __DCWorkerUpdateAdmission(DCWorkerRef worker) {
+    if (worker->nbrListeners == 0)
+        return;
+
+    if (worker->accepting) {
+        if (!__DCWorkerIsFull(worker, false))
+            return;
+        __DCWorkerSetAccepting(worker, false);
+        log_debug("worker=%p, stopped accepting at %u channel(s)\n", worker, worker->nbrChannels);
+    } else if (!__DCWorkerIsFull(worker, true)) {
+        DCTimerWheelCancel(&(worker->admissionEntry));
+        __DCWorkerSetAccepting(worker, true);
+        log_debug("worker=%p, accepting again at %u channel(s)\n", worker, worker->nbrChannels);
+        return;
+    }
+
+    if (!DCTimerWheelEntryIsScheduled(&(worker->admissionEntry))) {
+        unsigned long long deadline = DCEventLoopGetTime(worker->loop) + kDCWorkerAdmissionRetryMs;
+        DCTimerWheelSchedule(DCEventLoopGetTimerWheel(worker->loop), &(worker->admissionEntry), deadline);
+    }
+}
+
+static void __DCWorkerAdmissionRetry(DCTimerWheelEntry *entry, void *info) {
+    __DCWorkerUpdateAdmission((DCWorkerRef) info);
+}
+
+void DCWorkerChannelOpened(DCWorkerRef worker) {
+    worker->nbrChannels++;
+    if (worker->budget)
+        atomic_fetch_add_explicit(&(worker->budget->nbrOpen), 1, memory_order_relaxed);
+    __DCWorkerUpdateAdmission(worker);
+}
+
+void DCWorkerChannelClosed(DCWorkerRef worker) {
+    worker->nbrChannels--;
+    if (worker->budget)
+        atomic_fetch_sub_explicit(&(worker->budget->nbrOpen), 1, memory_order_relaxed);
+    if (!worker->accepting)
+        __DCWorkerUpdateAdmission(worker);
+}
+
+// MARK: - Run
+
+void DCWorkerRun(DCWorkerRef worker) {
+    log_debug("worker=%p, index => %u, event loop => %s\n", worker, worker->index, DCEventLoopBackendString(DCEventLoopGetBackend(worker->loop)));
+    __DCCurrentWorker = worker;
+    DCBufferPoolSetCurrent(worker->bufferPool);
+    DCEventLoopRun(worker->loop);
+    DCBufferPoolSetCurrent(NULL);
+    __DCCurrentWorker = NULL;
+}
+
+static void* __DCWorkerThread(void *data) {
+    DCWorkerRun((DCWorkerRef) data);
+    return NULL;
+}
+
+bool DCWorkerStart(DCWorkerRef worker) {
+    TRACE(worker);
+    int threadError = pthread_create(&worker->thread, NULL, &__DCWorkerThread, worker);
+    if (threadError != 0) {
+        log_error("worker=%p, couldn't create thread: %s\n", worker, strerror(threadError));
+        return false;
+    }
+    worker->started = true;
+    return true;
+}
+
+void DCWorkerStop(DCWorkerRef worker) {
+    TRACE(worker);
+    DCEventLoopStop(worker->loop);
+}
+
+void DCWorkerJoin(DCWorkerRef worker) {
+    if (!worker->started || pthread_equal(worker->thread, pthread_self()))
+        return;
+    pthread_join(worker->thread, NULL);
+    worker->started = false;
+}
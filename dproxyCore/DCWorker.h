@@ -0,0 +1,75 @@
+#ifndef DCWorker_h
+#define DCWorker_h
+
+#include "DCAddressStats.h"
+#include "DCBufferPool.h"
+#include "DCChannel.h"
+#include "DCConnection.h"
+#include "DCConnectionPool.h"
+#include "DCEventLoop.h"
+#include "DCResolver.h"
+#include "DCSlab.h"
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef struct __DCWorker*         DCWorkerRef;
+
+/*
+ * A worker is one thread with its own event loop and listeners. Everything
+ * a worker creates (channels, connections) stays on that worker, so nothing
+ * on the request path is shared between threads. That includes their memory:
+ * channels and connections come from the worker's slabs and everything of
+ * variable size from its buffer pool, which is current on the worker thread.
+ */
+DCWorkerRef DCWorkerCreate(unsigned int index, DCEventLoopBackend backend);
+void DCWorkerRelease(DCWorkerRef worker);
+
+DCWorkerRef DCWorkerGetCurrent(void);
+unsigned int DCWorkerGetIndex(DCWorkerRef worker);
+DCEventLoopRef DCWorkerGetEventLoop(DCWorkerRef worker);
+DCConnectionPoolRef DCWorkerGetConnectionPool(DCWorkerRef worker);
+DCResolverRef DCWorkerGetResolver(DCWorkerRef worker);
+DCAddressStatsRef DCWorkerGetAddressStats(DCWorkerRef worker);
+DCSlabRef DCWorkerGetChannelSlab(DCWorkerRef worker);
+DCSlabRef DCWorkerGetConnectionSlab(DCWorkerRef worker);
+DCBufferPoolRef DCWorkerGetBufferPool(DCWorkerRef worker);
+// Head of the channels open on the worker, they link themselves in and out.
+// Those still open when the worker is released go with it.
+DCChannelRef* DCWorkerGetChannelList(DCWorkerRef worker);
+
+// Copied, every connection the worker creates from then on uses them.
+// `kDCConnectionDefaultTimeouts` until set.
+void DCWorkerSetConnectionTimeouts(DCWorkerRef worker, const DCConnectionTimeouts *timeouts);
+const DCConnectionTimeouts* DCWorkerGetConnectionTimeouts(DCWorkerRef worker);
+
+// Any number of them, one per address the proxy listens on
+bool DCWorkerAddListener(DCWorkerRef worker, int fd, bool closeOnRelease);
+
+/*
+ * Admission: once a worker has `maxChannels` open it stops accepting, and
+ * new connections wait in the listen backlog (or go to other workers) until
+ * some of its channels have closed. A budget caps the channels of several
+ * workers together; it's checked without locking, so they may overshoot it
+ * by one each. 0 and NULL for no limit, the default.
+ */
+typedef struct DCWorkerChannelBudget {
+    atomic_uint nbrOpen;
+    unsigned int maxOpen;
+} DCWorkerChannelBudget;
+
+// The budget isn't copied, it has to outlive the worker
+void DCWorkerSetChannelLimits(DCWorkerRef worker, unsigned int maxChannels, DCWorkerChannelBudget *budget);
+unsigned int DCWorkerGetChannelCount(DCWorkerRef worker);
+bool DCWorkerIsAccepting(DCWorkerRef worker);
+// Called by channels as they're created and released on the worker
+void DCWorkerChannelOpened(DCWorkerRef worker);
+void DCWorkerChannelClosed(DCWorkerRef worker);
+
+bool DCWorkerStart(DCWorkerRef worker);
+void DCWorkerRun(DCWorkerRef worker);
+void DCWorkerStop(DCWorkerRef worker);
+void DCWorkerJoin(DCWorkerRef worker);
+
+#endif /* DCWorker_h */
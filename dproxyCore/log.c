@@ -20,6 +20,12 @@
  * IN THE SOFTWARE.
  */
 
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -28,6 +34,87 @@
 
 #include "log.h"
 
+/*
+ * Each thread that logs gets a ring of records that only it writes to and
+ * only the writer thread reads from, so neither side takes a lock or shares
+ * a cache line with other threads' logging.
+ *
+ * A record holds the format string (a literal, it outlives the record) and
+ * the raw arguments, strings copied in. Formatting, timestamps and I/O are
+ * left to the writer. A format this can't capture (%n, or arguments larger
+ * than LOG_MAX_MESSAGE) is formatted on the spot instead.
+ *
+ * Output is in order per thread. Records of different threads are only as
+ * ordered as the writer's passes over the rings.
+ */
+
+#define LOG_RING_SIZE       (128 * 1024)    // Per thread, a power of two
+#define LOG_MAX_MESSAGE     2048            // Longer messages are truncated
+#define LOG_MAX_STRING      1024            // Longer %s arguments are cut
+#define LOG_MAX_ARGS        16              // More and the message is formatted on the spot
+#define LOG_FORMAT_CACHE    64              // Formats each thread remembers the arguments of
+#define LOG_BATCH_SIZE      65536           // Writer output between writes
+#define LOG_IDLE_SLEEP_NS   2000000         // Writer's nap when there was nothing to write
+#define LOG_PADDING         0x80000000u     // Marks the filler before the ring wraps
+
+typedef struct log_record {
+    uint32_t size;          // All of it, 8-byte aligned
+    uint32_t length;        // Of the payload
+    int level;
+    int line;
+    uint64_t time;          // Milliseconds since the epoch, see `log_now`
+    const char *file;
+    const char *func;
+    const char *fmt;        // NULL when the payload is the formatted text
+    _Alignas(8) unsigned char payload[];
+} log_record;
+
+// What a conversion takes from the arguments, besides any '*'
+typedef enum {
+    LOG_ARG_NONE = 0,   // %%
+    LOG_ARG_INT,
+    LOG_ARG_LONG,
+    LOG_ARG_LONG_LONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LONG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING,
+    LOG_ARG_STAR = 0x10,            // An int for a '*'
+    LOG_ARG_STAR_PRECISION = 0x20   // With LOG_ARG_STAR, the precision of the %s after it
+} log_arg;
+
+typedef struct log_spec {
+    log_arg arg;
+    int stars;              // Width and/or precision given as arguments
+    bool star_precision;    // The last star is the precision
+    int precision;          // A literal one, -1 when absent
+} log_spec;
+
+// The arguments a format takes, worked out the first time a thread uses it
+typedef struct log_format {
+    const char *fmt;
+    int count;                          // -1 when it can't be captured
+    uint8_t args[LOG_MAX_ARGS];         // log_arg
+    int16_t precision[LOG_MAX_ARGS];    // A literal one of a %s, -1 when absent
+} log_format;
+
+typedef struct log_ring {
+    _Atomic uint64_t tail;          // Written by the owning thread
+    uint64_t head_seen;             // Its last look at `head`, which only grows
+    char pad0[64 - 2 * sizeof(uint64_t)];
+    _Atomic uint64_t head;          // Written by the writer
+    char pad1[64 - sizeof(uint64_t)];
+    _Atomic unsigned long dropped;  // By the owning thread, when full
+    unsigned long reported;         // Drops the writer has already told about
+    _Atomic int closed;             // The owning thread has exited
+    struct log_ring *next;
+    log_format formats[LOG_FORMAT_CACHE];
+    _Alignas(64) unsigned char bytes[LOG_RING_SIZE];
+} log_ring;
+
 static struct {
     void *udata;
     log_LockFn lock;
@@ -36,6 +123,15 @@ static struct {
     int quiet;
 } L;
 
+int log_threshold = LOG_TRACE;
+
+static _Atomic(log_ring *) rings;
+static _Atomic uint64_t log_now;   // Refreshed by the writer, read when logging
+static _Thread_local log_ring *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;  // Also guards what the writer reads of L
+
 
 static const char *level_names[] = {
     "TRACE", "DEBUG", "INFO", "WARN", "ERROR", "FATAL"
@@ -63,23 +159,30 @@ static void unlock(void) {
 
 
 void log_set_udata(void *udata) {
+    pthread_mutex_lock(&drain_mutex);
     L.udata = udata;
+    pthread_mutex_unlock(&drain_mutex);
 }
 
 
 void log_set_lock(log_LockFn fn) {
+    pthread_mutex_lock(&drain_mutex);
     L.lock = fn;
+    pthread_mutex_unlock(&drain_mutex);
 }
 
 
 void log_set_fp(FILE *fp) {
+    pthread_mutex_lock(&drain_mutex);
     L.fp = fp;
+    pthread_mutex_unlock(&drain_mutex);
 }
 
 
 void log_set_level(int level) {
     printf("LOG LEVEL %s => %s\n", level_names[L.level], level_names[level]);
     L.level = level;
+    log_threshold = level;
 }
 
 int log_get_level() {
@@ -87,62 +190,544 @@ int log_get_level() {
 }
 
 void log_set_quiet(int enable) {
+    pthread_mutex_lock(&drain_mutex);
     L.quiet = enable ? 1 : 0;
+    pthread_mutex_unlock(&drain_mutex);
 }
 
 
-void log_log(int level, const char *file, const char *f, int line, const char *fmt, ...) {
-    if (level < L.level) {
-        return;
+static uint64_t clock_ms(void) {
+    struct timespec ts;
+#if defined(CLOCK_REALTIME_COARSE)
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+
+/* Format strings */
+
+// Reads the conversion after a '%', returns what follows it or NULL when
+// it's one this doesn't handle
+static const char *parse_spec(const char *p, log_spec *spec) {
+    spec->stars = 0;
+    spec->star_precision = false;
+    spec->precision = -1;
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'')
+        p++;
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            spec->star_precision = true;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9')
+                spec->precision = spec->precision * 10 + (*p++ - '0');
+        }
     }
 
-    /* Acquire lock */
-    lock();
+    log_arg integer = LOG_ARG_INT;
+    bool long_double = false;
+    switch (*p) {
+        case 'h': p += p[1] == 'h' ? 2 : 1; break;
+        case 'l':
+            if (p[1] == 'l') {
+                integer = LOG_ARG_LONG_LONG;
+                p += 2;
+            } else {
+                integer = LOG_ARG_LONG;
+                p++;
+            }
+            break;
+        case 'z': integer = LOG_ARG_SIZE; p++; break;
+        case 'j': integer = LOG_ARG_INTMAX; p++; break;
+        case 't': integer = LOG_ARG_PTRDIFF; p++; break;
+        case 'L': long_double = true; p++; break;
+        default: break;
+    }
+
+    switch (*p) {
+        case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+            spec->arg = integer;
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+            spec->arg = long_double ? LOG_ARG_LONG_DOUBLE : LOG_ARG_DOUBLE;
+            break;
+        case 'p': spec->arg = LOG_ARG_POINTER; break;
+        case 's': spec->arg = integer == LOG_ARG_INT ? LOG_ARG_STRING : LOG_ARG_NONE; break;
+        case '%': spec->arg = LOG_ARG_NONE; return spec->stars == 0 ? p + 1 : NULL;
+        default: return NULL;
+    }
+    // %ls and friends
+    if (spec->arg == LOG_ARG_NONE)
+        return NULL;
+    return p + 1;
+}
 
-    /* Get current time */
-    time_t t = time(NULL);
-    struct tm *lt = localtime(&t);
+
+static void compile(log_format *format, const char *fmt) {
+    format->fmt = fmt;
+    format->count = 0;
+    const char *p = fmt;
+    while ((p = strchr(p, '%'))) {
+        log_spec spec;
+        if (!(p = parse_spec(p + 1, &spec)) || format->count + spec.stars + 1 > LOG_MAX_ARGS) {
+            format->count = -1;
+            return;
+        }
+        for (int i = 0; i < spec.stars; i++) {
+            bool precision = spec.star_precision && i == spec.stars - 1;
+            format->args[format->count++] = LOG_ARG_STAR | (precision ? LOG_ARG_STAR_PRECISION : 0);
+        }
+        if (spec.arg != LOG_ARG_NONE) {
+            format->precision[format->count] = (int16_t) (spec.precision < LOG_MAX_STRING ? spec.precision : LOG_MAX_STRING);
+            format->args[format->count++] = spec.arg;
+        }
+    }
+}
+
+
+// Copies the arguments into `out`, eight bytes each and strings inline.
+// Returns the bytes used, or 0 when it can't.
+static size_t capture(unsigned char *out, size_t room, const log_format *format, va_list args) {
+    size_t used = 0;
+    int precision = -1;
+    for (int i = 0; i < format->count; i++) {
+        uint8_t arg = format->args[i];
+        uint64_t v;
+        switch (arg) {
+            case LOG_ARG_INT:         v = (uint64_t) (int64_t) va_arg(args, int); break;
+            case LOG_ARG_LONG:        v = (uint64_t) (int64_t) va_arg(args, long); break;
+            case LOG_ARG_LONG_LONG:   v = (uint64_t) va_arg(args, long long); break;
+            case LOG_ARG_SIZE:        v = (uint64_t) va_arg(args, size_t); break;
+            case LOG_ARG_INTMAX:      v = (uint64_t) va_arg(args, intmax_t); break;
+            case LOG_ARG_PTRDIFF:     v = (uint64_t) (int64_t) va_arg(args, ptrdiff_t); break;
+            case LOG_ARG_POINTER:     v = (uint64_t) (uintptr_t) va_arg(args, void *); break;
+            case LOG_ARG_DOUBLE:      { double d = va_arg(args, double); memcpy(&v, &d, 8); break; }
+            case LOG_ARG_LONG_DOUBLE: { double d = (double) va_arg(args, long double); memcpy(&v, &d, 8); break; }
+            case LOG_ARG_STRING: {
+                // The precision may be all there is of it, %.*s of a slice
+                const char *string = va_arg(args, const char *);
+                if (!string)
+                    string = "(null)";
+                int limit = precision >= 0 ? precision : format->precision[i];
+                size_t length = strnlen(string, limit >= 0 && limit < LOG_MAX_STRING ? (size_t) limit : LOG_MAX_STRING);
+                size_t padded = (length + 1 + 7) & ~(size_t) 7;
+                if (used + 8 + padded > room)
+                    return 0;
+                v = length;
+                memcpy(out + used, &v, 8);
+                memcpy(out + used + 8, string, length);
+                out[used + 8 + length] = '\0';
+                used += 8 + padded;
+                precision = -1;
+                continue;
+            }
+            default: {
+                // A '*'
+                int star = va_arg(args, int);
+                if (arg & LOG_ARG_STAR_PRECISION)
+                    precision = star;
+                v = (uint64_t) (int64_t) star;
+                break;
+            }
+        }
+        if (used + 8 > room)
+            return 0;
+        memcpy(out + used, &v, 8);
+        used += 8;
+    }
+    // Even one without arguments takes a byte, 0 means it couldn't
+    return used > 0 ? used : 1;
+}
+
+
+// Formats a captured record into `out`, returns the length
+static size_t replay(char *out, size_t room, const char *fmt, const unsigned char *payload) {
+    size_t length = 0;
+    const char *p = fmt;
+    while (*p && length + 1 < room) {
+        const char *percent = strchr(p, '%');
+        size_t literal = percent ? (size_t) (percent - p) : strlen(p);
+        if (literal > room - 1 - length)
+            literal = room - 1 - length;
+        memcpy(out + length, p, literal);
+        length += literal;
+        if (!percent)
+            break;
+
+        log_spec spec;
+        const char *end = parse_spec(percent + 1, &spec);
+        char conversion[32];
+        if (!end)
+            break;
+        size_t conversion_length = (size_t) (end - percent);
+        if (conversion_length >= sizeof(conversion))
+            break;
+        memcpy(conversion, percent, conversion_length);
+        conversion[conversion_length] = '\0';
+        p = end;
+
+        int stars[2] = { 0, 0 };
+        for (int i = 0; i < spec.stars; i++) {
+            int64_t star;
+            memcpy(&star, payload, 8);
+            stars[i] = (int) star;
+            payload += 8;
+        }
+
+        int64_t integer = 0;
+        double real = 0;
+        void *pointer = NULL;
+        const char *string = NULL;
+        if (spec.arg == LOG_ARG_DOUBLE || spec.arg == LOG_ARG_LONG_DOUBLE) {
+            memcpy(&real, payload, 8);
+            payload += 8;
+        } else if (spec.arg == LOG_ARG_POINTER) {
+            uint64_t address;
+            memcpy(&address, payload, 8);
+            pointer = (void *) (uintptr_t) address;
+            payload += 8;
+        } else if (spec.arg == LOG_ARG_STRING) {
+            uint64_t string_length;
+            memcpy(&string_length, payload, 8);
+            string = (const char *) payload + 8;
+            payload += 8 + ((string_length + 1 + 7) & ~(uint64_t) 7);
+        } else if (spec.arg != LOG_ARG_NONE) {
+            memcpy(&integer, payload, 8);
+            payload += 8;
+        }
+
+        size_t left = room - length;
+        int written = 0;
+#define LOG_REPLAY(value) (spec.stars == 0 ? snprintf(out + length, left, conversion, value) : \
+                           spec.stars == 1 ? snprintf(out + length, left, conversion, stars[0], value) : \
+                           snprintf(out + length, left, conversion, stars[0], stars[1], value))
+        switch (spec.arg) {
+            case LOG_ARG_NONE:        written = snprintf(out + length, left, "%%"); break;
+            case LOG_ARG_INT:         written = LOG_REPLAY((int) integer); break;
+            case LOG_ARG_LONG:        written = LOG_REPLAY((long) integer); break;
+            case LOG_ARG_LONG_LONG:   written = LOG_REPLAY((long long) integer); break;
+            case LOG_ARG_SIZE:        written = LOG_REPLAY((size_t) integer); break;
+            case LOG_ARG_INTMAX:      written = LOG_REPLAY((intmax_t) integer); break;
+            case LOG_ARG_PTRDIFF:     written = LOG_REPLAY((ptrdiff_t) integer); break;
+            case LOG_ARG_DOUBLE:      written = LOG_REPLAY(real); break;
+            case LOG_ARG_LONG_DOUBLE: written = LOG_REPLAY((long double) real); break;
+            case LOG_ARG_POINTER:     written = LOG_REPLAY(pointer); break;
+            case LOG_ARG_STRING:      written = LOG_REPLAY(string); break;
+            default: break;
+        }
+#undef LOG_REPLAY
+        if (written < 0)
+            break;
+        length += (size_t) written < left ? (size_t) written : left - 1;
+    }
+    out[length] = '\0';
+    return length;
+}
+
+
+/* Writer */
+
+typedef struct log_batch {
+    FILE *fp;
+    size_t length;
+    char bytes[LOG_BATCH_SIZE];
+} log_batch;
+
+static log_batch batch_stderr, batch_fp;
+
+static void batch_flush(log_batch *batch) {
+    if (batch->length > 0 && batch->fp) {
+        fwrite(batch->bytes, 1, batch->length, batch->fp);
+        fflush(batch->fp);
+    }
+    batch->length = 0;
+}
+
+static void batch_printf(log_batch *batch, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void batch_printf(log_batch *batch, const char *fmt, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list args;
+        va_start(args, fmt);
+        int length = vsnprintf(batch->bytes + batch->length, LOG_BATCH_SIZE - batch->length, fmt, args);
+        va_end(args);
+        if (length < 0)
+            return;
+        if ((size_t) length < LOG_BATCH_SIZE - batch->length) {
+            batch->length += length;
+            return;
+        }
+        // Didn't fit, write out what's there and try once more
+        batch_flush(batch);
+    }
+}
+
+static void batch_append(log_batch *batch, const char *bytes, size_t length) {
+    if (length > LOG_BATCH_SIZE - batch->length)
+        batch_flush(batch);
+    if (length > LOG_BATCH_SIZE)
+        length = LOG_BATCH_SIZE;
+    memcpy(batch->bytes + batch->length, bytes, length);
+    batch->length += length;
+}
+
+
+// Seconds only change once a second, so does their formatting
+static void format_time(uint64_t ms, const char **time_string, const char **date_string) {
+    static time_t cached = (time_t) -1;
+    static char cached_time[16], cached_date[32];
+    time_t t = (time_t) (ms / 1000);
+    if (t != cached) {
+        struct tm lt;
+        localtime_r(&t, &lt);
+        cached_time[strftime(cached_time, sizeof(cached_time), "%H:%M:%S", &lt)] = '\0';
+        cached_date[strftime(cached_date, sizeof(cached_date), "%Y-%m-%d %H:%M:%S", &lt)] = '\0';
+        cached = t;
+    }
+    *time_string = cached_time;
+    *date_string = cached_date;
+}
+
+
+static void write_record(const log_record *record) {
+    const char *time_buf, *date_buf;
+    format_time(record->time, &time_buf, &date_buf);
+    const char *slash = strrchr(record->file, '/');
+    const char *file = slash ? slash + 1 : record->file;
+    int level = record->level;
+
+    char formatted[LOG_MAX_MESSAGE];
+    const char *text = (const char *) record->payload;
+    size_t length = record->length;
+    if (record->fmt) {
+        length = replay(formatted, sizeof(formatted), record->fmt, record->payload);
+        text = formatted;
+    }
 
     /* Log to stderr */
     if (!L.quiet) {
-        va_list args;
-        char buf[16];
-        buf[strftime(buf, sizeof(buf), "%H:%M:%S", lt)] = '\0';
+        batch_stderr.fp = stderr;
 #ifdef LOG_USE_COLOR
         if (level == LOG_TRACE) {
-            fprintf(
-                    stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
-                    buf, level_colors[level], level_names[level], file, f, line);
+            batch_printf(
+                    &batch_stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%s:%d:\x1b[0m ",
+                    time_buf, level_colors[level], level_names[level], file, record->func, record->line);
         } else {
-            fprintf(
-                    stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
-                    buf, level_colors[level], level_names[level], file, line);
+            batch_printf(
+                    &batch_stderr, "%s %s%-5s\x1b[0m \x1b[90m%s:%d:\x1b[0m ",
+                    time_buf, level_colors[level], level_names[level], file, record->line);
         }
 #else
         if (level == LOG_TRACE) {
-            fprintf(stderr, "%s %-5s %s:%s:%d: ", buf, level_names[level], file, f, line);
+            batch_printf(&batch_stderr, "%s %-5s %s:%s:%d: ", time_buf, level_names[level], file, record->func, record->line);
         } else {
-            fprintf(stderr, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
+            batch_printf(&batch_stderr, "%s %-5s %s:%d: ", time_buf, level_names[level], file, record->line);
         }
 #endif
-        va_start(args, fmt);
-        vfprintf(stderr, fmt, args);
-        va_end(args);
-        //fprintf(stderr, "\n");
+        batch_append(&batch_stderr, text, length);
     }
 
     /* Log to file */
     if (L.fp) {
-        va_list args;
-        char buf[32];
-        buf[strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", lt)] = '\0';
-        fprintf(L.fp, "%s %-5s %s:%d: ", buf, level_names[level], file, line);
+        if (batch_fp.fp != L.fp)
+            batch_flush(&batch_fp);
+        batch_fp.fp = L.fp;
+        batch_printf(&batch_fp, "%s %-5s %s:%d: ", date_buf, level_names[level], file, record->line);
+        batch_append(&batch_fp, text, length);
+        batch_append(&batch_fp, "\n", 1);
+    }
+}
+
+
+// Writes out what every ring holds, returns how many records that was.
+// Called with `drain_mutex` held, which makes its caller the only reader.
+static unsigned long drain(void) {
+    unsigned long written = 0;
+    log_ring *previous = NULL;
+    log_ring *ring = atomic_load_explicit(&rings, memory_order_acquire);
+
+    lock();
+    while (ring) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        while (head != tail) {
+            const log_record *record = (const log_record *) (ring->bytes + (head & (LOG_RING_SIZE - 1)));
+            if (!(record->size & LOG_PADDING)) {
+                write_record(record);
+                written++;
+            }
+            head += record->size & ~LOG_PADDING;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported) {
+            if (!L.quiet) {
+                batch_stderr.fp = stderr;
+                batch_printf(&batch_stderr, "log: %lu messages dropped, the ring was full\n", dropped - ring->reported);
+            }
+            ring->reported = dropped;
+        }
+
+        // The thread is gone and all it logged is out. Only the writer
+        // unlinks, and new rings only go in front of the first one.
+        log_ring *next = ring->next;
+        if (previous && atomic_load_explicit(&ring->closed, memory_order_acquire) &&
+            atomic_load_explicit(&ring->tail, memory_order_acquire) == head) {
+            previous->next = next;
+            free(ring);
+        } else {
+            previous = ring;
+        }
+        ring = next;
+    }
+    batch_flush(&batch_stderr);
+    batch_flush(&batch_fp);
+    unlock();
+    return written;
+}
+
+
+static void *writer(void *info) {
+    (void) info;
+    struct timespec nap = { 0, LOG_IDLE_SLEEP_NS };
+    for (;;) {
+        atomic_store_explicit(&log_now, clock_ms(), memory_order_relaxed);
+        pthread_mutex_lock(&drain_mutex);
+        unsigned long written = drain();
+        pthread_mutex_unlock(&drain_mutex);
+        if (written == 0)
+            nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+
+void log_flush(void) {
+    pthread_mutex_lock(&drain_mutex);
+    drain();
+    pthread_mutex_unlock(&drain_mutex);
+}
+
+
+// Runs on the exiting thread. Should it log again, from another key's
+// destructor, it gets a new ring rather than one the writer may free.
+static void ring_closed(void *info) {
+    thread_ring = NULL;
+    atomic_store_explicit(&((log_ring *) info)->closed, 1, memory_order_release);
+}
+
+
+// The writer takes no signals, they're meant for the threads doing the work
+static void start(void) {
+    atomic_store_explicit(&log_now, clock_ms(), memory_order_relaxed);
+    pthread_key_create(&ring_key, ring_closed);
+    atexit(log_flush);
+
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &previous);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer, NULL) == 0)
+        pthread_detach(thread);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+}
+
+
+static log_ring *ring_create(void) {
+    pthread_once(&once, start);
+    log_ring *ring = calloc(1, sizeof(log_ring));
+    if (!ring)
+        return NULL;
+    ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&rings, &ring->next, ring, memory_order_release, memory_order_relaxed))
+        ;
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+
+/* Logging */
+
+void log_log(int level, const char *file, const char *f, int line, const char *fmt, ...) {
+    if (level < L.level) {
+        return;
+    }
+
+    log_ring *ring = thread_ring;
+    if (!ring && !(ring = thread_ring = ring_create()))
+        return;
+
+    // Format strings are literals, their address is as good as their text
+    log_format *format = &ring->formats[((uint64_t) (uintptr_t) fmt * 0x9E3779B97F4A7C15ull >> 32) & (LOG_FORMAT_CACHE - 1)];
+    if (format->fmt != fmt)
+        compile(format, fmt);
+
+    _Alignas(8) unsigned char payload[LOG_MAX_MESSAGE];
+    va_list args;
+    size_t length = 0;
+    if (format->count >= 0) {
         va_start(args, fmt);
-        vfprintf(L.fp, fmt, args);
+        length = capture(payload, sizeof(payload), format, args);
         va_end(args);
-        fprintf(L.fp, "\n");
+    }
+    const char *deferred = fmt;
+    if (length == 0) {
+        va_start(args, fmt);
+        int formatted = vsnprintf((char *) payload, sizeof(payload), fmt, args);
+        va_end(args);
+        length = formatted < 0 ? 0 : (size_t) formatted < sizeof(payload) ? (size_t) formatted : sizeof(payload) - 1;
+        deferred = NULL;
     }
 
-    /* Release lock */
-    unlock();
+    uint32_t size = (uint32_t) ((sizeof(log_record) + length + 7) & ~(size_t) 7);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t offset = tail & (LOG_RING_SIZE - 1);
+    // Records don't wrap, the rest of the ring is skipped when one doesn't fit
+    size_t padding = LOG_RING_SIZE - offset < size ? LOG_RING_SIZE - offset : 0;
+    // The writer's cache line is only touched when the ring looks full
+    if (LOG_RING_SIZE - (tail - ring->head_seen) < padding + size) {
+        ring->head_seen = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (LOG_RING_SIZE - (tail - ring->head_seen) < padding + size) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+    if (padding) {
+        ((log_record *) (ring->bytes + offset))->size = (uint32_t) padding | LOG_PADDING;
+        tail += padding;
+        offset = 0;
+    }
+
+    log_record *record = (log_record *) (ring->bytes + offset);
+    record->size = size;
+    record->length = (uint32_t) length;
+    record->level = level;
+    record->line = line;
+    record->time = atomic_load_explicit(&log_now, memory_order_relaxed);
+    record->file = file;
+    record->func = f;
+    record->fmt = deferred;
+    memcpy(record->payload, payload, length);
+    atomic_store_explicit(&ring->tail, tail + size, memory_order_release);
+    // The writer has read the lines ahead, get them back before they're needed
+    __builtin_prefetch(ring->bytes + ((tail + size + 256) & (LOG_RING_SIZE - 1)), 1);
+
+    if (level >= LOG_FATAL) {
+        log_flush();
+    }
 }
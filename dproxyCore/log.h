@@ -11,7 +11,6 @@
 
 #include <stdio.h>
 #include <stdarg.h>
-#include <libgen.h>
 
 #define LOG_VERSION "0.1.0"
 
@@ -19,14 +18,27 @@ typedef void (*log_LockFn)(void *udata, int lock);
 
 enum { LOG_TRACE, LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_FATAL };
 
-// #define TRACE log_log(LOG_TRACE, basename(__FILE__), __func__, __LINE__, "%s", "TRACE\n")
+/*
+ * Calls below LOG_MIN_LEVEL are compiled out, arguments and all; build with
+ * e.g. -DLOG_MIN_LEVEL=LOG_INFO. Below the level set at runtime they cost a
+ * load and a compare, the arguments aren't evaluated.
+ */
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_TRACE
+#endif
+
+extern int log_threshold;
 
-#define log_trace(...) log_log(LOG_TRACE, basename(__FILE__), __func__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOG_DEBUG, basename(__FILE__), __func__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOG_INFO,  basename(__FILE__), __func__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOG_WARN,  basename(__FILE__), __func__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOG_ERROR, basename(__FILE__), __func__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOG_FATAL, basename(__FILE__), __func__, __LINE__, __VA_ARGS__)
+#define log_enabled(level) ((level) >= LOG_MIN_LEVEL && (level) >= log_threshold)
+
+#define log_at(level, ...) (log_enabled(level) ? log_log(level, __FILE__, __func__, __LINE__, __VA_ARGS__) : (void) 0)
+
+#define log_trace(...) log_at(LOG_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(LOG_FATAL, __VA_ARGS__)
 
 void log_set_udata(void *udata);
 void log_set_lock(log_LockFn fn);
@@ -35,6 +47,14 @@ void log_set_level(int level);
 int log_get_level(void);
 void log_set_quiet(int enable);
 
-void log_log(int level, const char *file, const char *f, int line, const char *fmt, ...);
+/*
+ * Formats the message into the calling thread's ring and returns, a writer
+ * thread adds the time and location and writes it out. Nothing blocks: when
+ * the ring is full the message is dropped and counted. `log_flush` writes
+ * out everything logged so far, and runs at exit and after a fatal message.
+ */
+void log_log(int level, const char *file, const char *f, int line, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+void log_flush(void);
 
 #endif
@@ -7,53 +7,40 @@
 //
 
 #include "utils.h"
+#include "log.h"
 
+#include <string.h>
+
+// One log record per 16 bytes, hex then the printable ones
 void dump_hex(char *desc, void *addr, int len) {
-    int i;
-    unsigned char buff[17];
+    static const char digits[] = "0123456789abcdef";
     unsigned char *pc = (unsigned char*)addr;
 
     if (len == 0) {
-        printf ("%s (zero bytes):\n", desc);
+        log_trace("%s (zero bytes):\n", desc);
         return;
     }
 
     // Output description if given.
     if (desc != NULL)
-        printf ("%s (%d bytes):\n", desc, len);
-
-    // Process every byte in the data.
-    for (i = 0; i < len; i++) {
-        // Multiple of 16 means new line (with line offset).
-
-        if ((i % 16) == 0) {
-            // Just don't print ASCII for the zeroth line.
-            if (i != 0)
-                printf("  %s\n", buff);
-
-            // Output the offset.
-            printf("  %04x ", i);
-        }
-
-        // Now the hex code for the specific character.
-        printf(" %02x", pc[i]);
-
-        // And store a printable ASCII character for later.
-        if ((pc[i] < 0x20) || (pc[i] > 0x7e)) {
-            buff[i % 16] = '.';
-        } else {
-            buff[i % 16] = pc[i];
+        log_trace("%s (%d bytes):\n", desc, len);
+
+    for (int offset = 0; offset < len; offset += 16) {
+        char hex[16 * 3 + 1];
+        char ascii[16 + 1];
+        int count = len - offset < 16 ? len - offset : 16;
+
+        // Pad out the last line if not exactly 16 characters.
+        memset(hex, ' ', sizeof(hex) - 1);
+        hex[sizeof(hex) - 1] = '\0';
+        for (int i = 0; i < count; i++) {
+            unsigned char c = pc[offset + i];
+            hex[i * 3 + 1] = digits[c >> 4];
+            hex[i * 3 + 2] = digits[c & 0xf];
+            ascii[i] = (c < 0x20 || c > 0x7e) ? '.' : (char) c;
         }
+        ascii[count] = '\0';
 
-        buff[(i % 16) + 1] = '\0';
+        log_trace("  %04x %s  %s\n", offset, hex, ascii);
     }
-
-    // Pad out last line if not exactly 16 characters.
-    while ((i % 16) != 0) {
-        printf("   ");
-        i++;
-    }
-
-    // And print the final ASCII bit.
-    printf("  %s\n", buff);
 }
@@ -9,9 +9,7 @@
 #ifndef utils_h
 #define utils_h
 
-#include <CoreFoundation/CoreFoundation.h>
-
-char* CFStreamEventTypeString(CFStreamEventType);
+#include <stdio.h>
 
 void dump_hex(char *desc, void *addr, int len);
 
@@ -26,13 +26,32 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "CUnit/Basic.h"
 
 #include <dproxyCore/DCProxy.h>
+#include <dproxyCore/DCBufferPool.h>
 #include <dproxyCore/DCConnection.h>
+#include <dproxyCore/DCEventLoop.h>
+#include <dproxyCore/DCHTTPParser.h>
+#include <dproxyCore/DCHTTPMessage.h>
+#include <dproxyCore/DCHTTPScan.h>
+#include <dproxyCore/DCMessageQueue.h>
+#include <dproxyCore/DCResolver.h>
+#include <dproxyCore/DCSlab.h>
+#include <dproxyCore/DCTimerWheel.h>
+#include <dproxyCore/DCWorker.h>
+#include <dproxyCore/log.h>
 
-#include <CoreFoundation/CoreFoundation.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
 /* Pointer to the file used by the tests. */
 static FILE* temp_file = NULL;
@@ -75,7 +94,7 @@ void testFPRINTF(void)
     int i1 = 10;
 
     if (NULL != temp_file) {
-        CU_ASSERT(0 == fprintf(temp_file, ""));
+        CU_ASSERT(0 == fprintf(temp_file, "%s", ""));
         CU_ASSERT(2 == fprintf(temp_file, "Q\n"));
         CU_ASSERT(7 == fprintf(temp_file, "i1 = %d", i1));
     }
@@ -93,12 +112,1471 @@ void testFREAD(void)
     if (NULL != temp_file) {
         rewind(temp_file);
         CU_ASSERT(9 == fread(buffer, sizeof(unsigned char), 20, temp_file));
-        CU_ASSERT(0 == strncmp(buffer, "Q\ni1 = 10", 9));
+        CU_ASSERT(0 == strncmp((const char *) buffer, "Q\ni1 = 10", 9));
     }
 }
 
-void NotificationCallback(CFNotificationCenterRef center, void *observer, CFNotificationName name, const void *object, CFDictionaryRef userInfo){
-    // Ignore
+/* A stub nameserver on 127.0.0.1 that shares the resolver's event loop.
+ * "a.test" has one A record, "race.test" is both loopbacks, "missing.test"
+ * doesn't exist and "silent.test" is never answered.
+ */
+static int stub_fd = -1;
+static unsigned int stub_queries = 0;
+
+static void StubNameserverCallback(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info)
+{
+    unsigned char packet[512];
+    struct sockaddr_storage from;
+    socklen_t fromLength = sizeof(from);
+    ssize_t length;
+
+    while ((length = recvfrom(fd, packet, sizeof(packet), 0, (struct sockaddr *) &from, &fromLength)) > 12) {
+        stub_queries++;
+
+        /* Question name, as "\1a\4test\0" */
+        char name[256];
+        size_t nameLength = 0;
+        int offset = 12;
+        while (packet[offset] != 0 && offset < length) {
+            if (nameLength) name[nameLength++] = '.';
+            memcpy(name + nameLength, packet + offset + 1, packet[offset]);
+            nameLength += packet[offset];
+            offset += packet[offset] + 1;
+        }
+        name[nameLength] = '\0';
+        offset += 5;
+        unsigned short type = (packet[offset - 4] << 8) | packet[offset - 3];
+
+        if (strcmp(name, "silent.test") == 0)
+            continue;
+
+        packet[2] = 0x81;
+        packet[3] = 0x80;
+        packet[6] = packet[7] = packet[8] = packet[9] = 0;
+
+        if (strcmp(name, "a.test") == 0 && type == 1) {
+            static const unsigned char answer[] = {
+                0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x04, 10, 0, 0, 1
+            };
+            packet[7] = 1;
+            memcpy(packet + offset, answer, sizeof(answer));
+            offset += sizeof(answer);
+        } else if (strcmp(name, "race.test") == 0 && type == 1) {
+            static const unsigned char answer[] = {
+                0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x04, 127, 0, 0, 1
+            };
+            packet[7] = 1;
+            memcpy(packet + offset, answer, sizeof(answer));
+            offset += sizeof(answer);
+        } else if (strcmp(name, "race.test") == 0 && type == 28) {
+            static const unsigned char answer[] = {
+                0xC0, 0x0C, 0x00, 0x1C, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x10,
+                0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1
+            };
+            packet[7] = 1;
+            memcpy(packet + offset, answer, sizeof(answer));
+            offset += sizeof(answer);
+        } else if (strcmp(name, "missing.test") == 0) {
+            /* NXDOMAIN with an SOA, MINIMUM 5 */
+            static const unsigned char authority[] = {
+                0xC0, 0x0C, 0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x0E, 0x10, 0x00, 0x16,
+                0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01,
+                0x00, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x05
+            };
+            packet[3] = 0x83;
+            packet[9] = 1;
+            memcpy(packet + offset, authority, sizeof(authority));
+            offset += sizeof(authority);
+        }
+
+        sendto(fd, packet, offset, 0, (struct sockaddr *) &from, fromLength);
+    }
+}
+
+static DCEventLoopRef resolver_loop = NULL;
+static DCResolverRef resolver = NULL;
+static unsigned int resolver_callbacks = 0;
+static unsigned int resolver_expected = 0;
+static DCResolverStatus resolver_status;
+static struct sockaddr_storage resolver_address;
+
+int init_resolver_suite(void)
+{
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    resolver_loop = DCEventLoopCreate(kDCEventLoopBackendDefault);
+    stub_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!resolver_loop || stub_fd == -1 ||
+        bind(stub_fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        getsockname(stub_fd, (struct sockaddr *) &address, &addressLength) != 0) {
+        return -1;
+    }
+    fcntl(stub_fd, F_SETFL, fcntl(stub_fd, F_GETFL) | O_NONBLOCK);
+    DCEventLoopAddFD(resolver_loop, stub_fd, StubNameserverCallback, NULL);
+
+    resolver = DCResolverCreate(resolver_loop);
+    DCResolverSetTimeout(resolver, 200, 1);
+    return DCResolverSetNameserver(resolver, "127.0.0.1", ntohs(address.sin_port)) ? 0 : -1;
+}
+
+int clean_resolver_suite(void)
+{
+    DCResolverRelease(resolver);
+    DCEventLoopRemoveFD(resolver_loop, stub_fd);
+    close(stub_fd);
+    DCEventLoopRelease(resolver_loop);
+    return 0;
+}
+
+static void ResolverCallback(DCResolverRef r, DCResolverStatus status, const struct sockaddr_storage *addresses, unsigned int nbrAddresses, void *info)
+{
+    resolver_status = status;
+    if (nbrAddresses > 0)
+        resolver_address = addresses[0];
+    if (++resolver_callbacks == resolver_expected)
+        DCEventLoopStop(resolver_loop);
+}
+
+static void ResolverDeadline(DCEventLoopRef loop, void *info)
+{
+    DCEventLoopStop(loop);
+}
+
+/* Resolves `name` `times` times at once and runs the loop until all are answered. */
+static void resolve(const char *name, unsigned int times)
+{
+    static bool hasDeadline = false;
+    if (!hasDeadline) {
+        DCEventLoopAddTimer(resolver_loop, 2000, ResolverDeadline, NULL);
+        hasDeadline = true;
+    }
+
+    resolver_callbacks = 0;
+    resolver_expected = times;
+    memset(&resolver_address, 0, sizeof(resolver_address));
+    for (unsigned int i = 0; i < times; i++)
+        DCResolverResolve(resolver, name, ResolverCallback, NULL);
+    if (resolver_callbacks < resolver_expected)
+        DCEventLoopRun(resolver_loop);
+}
+
+/* Concurrent lookups share one A and one AAAA query, later ones come from the cache. */
+void testResolverCoalescesAndCaches(void)
+{
+    resolve("a.test", 3);
+    CU_ASSERT(3 == resolver_callbacks);
+    CU_ASSERT(kDCResolverStatusResolved == resolver_status);
+    CU_ASSERT(AF_INET == resolver_address.ss_family);
+    CU_ASSERT(htonl(0x0A000001) == ((struct sockaddr_in *) &resolver_address)->sin_addr.s_addr);
+    CU_ASSERT(2 == stub_queries);
+
+    resolve("A.TEST.", 1);
+    CU_ASSERT(1 == resolver_callbacks);
+    CU_ASSERT(kDCResolverStatusResolved == resolver_status);
+    CU_ASSERT(2 == stub_queries);
+    CU_ASSERT(1 == DCResolverGetCacheHits(resolver));
+}
+
+/* NXDOMAIN is cached as well. */
+void testResolverNegativeCache(void)
+{
+    unsigned int queries = stub_queries;
+    resolve("missing.test", 1);
+    CU_ASSERT(kDCResolverStatusNotFound == resolver_status);
+    CU_ASSERT(queries + 2 == stub_queries);
+
+    resolve("missing.test", 1);
+    CU_ASSERT(kDCResolverStatusNotFound == resolver_status);
+    CU_ASSERT(queries + 2 == stub_queries);
+}
+
+/* Unanswered queries fail after the timeout, literals never hit the network. */
+void testResolverTimeoutAndLiterals(void)
+{
+    resolve("silent.test", 1);
+    CU_ASSERT(1 == resolver_callbacks);
+    CU_ASSERT(kDCResolverStatusFailed == resolver_status);
+
+    unsigned int queries = stub_queries;
+    resolve("::1", 1);
+    CU_ASSERT(kDCResolverStatusResolved == resolver_status);
+    CU_ASSERT(AF_INET6 == resolver_address.ss_family);
+    CU_ASSERT(queries == stub_queries);
+}
+
+static const char kParserRequest[] =
+    "POST http://example.com:8080/upload?x=1 HTTP/1.1\r\n"
+    "Host: example.com:8080\r\n"
+    "Content-Length: 5\r\n"
+    "X-Empty:\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "hello";
+
+static int span_equals(const char *buffer, DCHTTPSpan span, const char *string)
+{
+    return span.length == strlen(string) && memcmp(buffer + span.offset, string, span.length) == 0;
+}
+
+static DCHTTPParserResult parse_all(DCHTTPParser *parser, DCHTTPParserType type, const char *buffer)
+{
+    DCHTTPParserInit(parser, type);
+    return DCHTTPParserExecute(parser, buffer, strlen(buffer));
+}
+
+/* A request parses the same however it is split up. */
+void testParserRequestAnySplit(void)
+{
+    size_t headerLength = strstr(kParserRequest, "\r\n\r\n") + 4 - kParserRequest;
+    int failures = 0;
+
+    for (size_t split = 0; split <= headerLength; split++) {
+        DCHTTPParser parser;
+        DCHTTPParserInit(&parser, kDCHTTPParserTypeRequest);
+
+        DCHTTPParserResult result = DCHTTPParserExecute(&parser, kParserRequest, split);
+        if (split < headerLength && result != kDCHTTPParserResultIncomplete)
+            failures++;
+        if (result != kDCHTTPParserResultComplete)
+            result = DCHTTPParserExecute(&parser, kParserRequest, sizeof(kParserRequest) - 1);
+
+        if (result != kDCHTTPParserResultComplete ||
+            parser.idx != headerLength ||
+            !span_equals(kParserRequest, parser.method, "POST") ||
+            !span_equals(kParserRequest, parser.target, "http://example.com:8080/upload?x=1") ||
+            parser.nbrHeaders != 4 ||
+            !span_equals(kParserRequest, parser.headers[2].name, "X-Empty") ||
+            parser.headers[2].value.length != 0 ||
+            parser.contentLength != 5 ||
+            DCHTTPParserIsKeepAlive(&parser))
+            failures++;
+    }
+    CU_ASSERT(0 == failures);
+}
+
+/* Responses, framing headers and the keep-alive defaults. */
+void testParserResponse(void)
+{
+    DCHTTPParser parser;
+    CU_ASSERT(kDCHTTPParserResultComplete == parse_all(&parser, kDCHTTPParserTypeResponse,
+        "HTTP/1.1 404 Not Found\r\nTransfer-Encoding: gzip, chunked\r\n\r\n"));
+    CU_ASSERT(404 == parser.status);
+    CU_ASSERT(span_equals("HTTP/1.1 404 Not Found", parser.reason, "Not Found"));
+    CU_ASSERT(parser.chunked);
+    CU_ASSERT(-1 == parser.contentLength);
+    CU_ASSERT(DCHTTPParserIsKeepAlive(&parser));
+
+    CU_ASSERT(kDCHTTPParserResultComplete == parse_all(&parser, kDCHTTPParserTypeResponse,
+        "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n"));
+    CU_ASSERT(!DCHTTPParserIsKeepAlive(&parser));
+
+    CU_ASSERT(kDCHTTPParserResultComplete == parse_all(&parser, kDCHTTPParserTypeResponse,
+        "HTTP/1.0 200 OK\r\nConnection: Keep-Alive\r\n\r\n"));
+    CU_ASSERT(DCHTTPParserIsKeepAlive(&parser));
+
+    DCHTTPMessageRef message = DCHTTPMessageCreateWithBytes(kDCHTTPParserTypeResponse,
+        "HTTP/1.1 204 No Content\r\nServer: stub\r\n\r\n", 41);
+    CU_ASSERT(NULL != message);
+    if (message) {
+        DCHTTPSlice value;
+        CU_ASSERT(!DCHTTPMessageIsRequest(message));
+        CU_ASSERT(204 == DCHTTPMessageGetStatusCode(message));
+        CU_ASSERT(DCHTTPMessageGetHeader(message, "server", &value));
+        CU_ASSERT(4 == value.length && 0 == memcmp(value.data, "stub", 4));
+        CU_ASSERT(41 == DCHTTPMessageGetHeaderLength(message));
+        DCHTTPMessageRelease(message);
+    }
+}
+
+/* Malformed or ambiguous messages are refused rather than guessed at. */
+void testParserErrors(void)
+{
+    DCHTTPParser parser;
+    CU_ASSERT(kDCHTTPParserResultError == parse_all(&parser, kDCHTTPParserTypeRequest,
+        "GET / HTTP/1.1\r\nContent-Length: 1\r\nContent-Length: 2\r\n\r\n"));
+    CU_ASSERT(kDCHTTPParserErrorInvalidContentLength == parser.error);
+
+    CU_ASSERT(kDCHTTPParserResultComplete == parse_all(&parser, kDCHTTPParserTypeRequest,
+        "GET / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\n"));
+
+    CU_ASSERT(kDCHTTPParserResultError == parse_all(&parser, kDCHTTPParserTypeRequest,
+        "GET / HTTP/1.1\r\nX-Folded: a\r\n b\r\n\r\n"));
+    CU_ASSERT(kDCHTTPParserResultError == parse_all(&parser, kDCHTTPParserTypeRequest,
+        "GET / HTTP/1.1\r\nBad Name: a\r\n\r\n"));
+    CU_ASSERT(kDCHTTPParserResultError == parse_all(&parser, kDCHTTPParserTypeRequest,
+        "G(T / HTTP/1.1\r\n\r\n"));
+    CU_ASSERT(kDCHTTPParserResultError == parse_all(&parser, kDCHTTPParserTypeResponse,
+        "HTTP/1.1 20 OK\r\n\r\n"));
+}
+
+/* Chunked bodies end in the same place however they're split, trailers included. */
+void testChunkDecoder(void)
+{
+    static const char body[] = "5;ext=1\r\nhello\r\n1A\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\nX-Trailer: yes\r\n\r\nGET /next";
+    size_t bodyLength = strstr(body, "GET /next") - body;
+    int failures = 0;
+
+    for (size_t split = 0; split <= bodyLength; split++) {
+        DCHTTPChunkDecoder decoder;
+        DCHTTPChunkDecoderInit(&decoder);
+
+        size_t first = 0, second = 0;
+        DCHTTPParserResult result = DCHTTPChunkDecoderExecute(&decoder, body, split, &first);
+        if (result == kDCHTTPParserResultIncomplete) {
+            if (first != split)
+                failures++;
+            result = DCHTTPChunkDecoderExecute(&decoder, body + split, sizeof(body) - 1 - split, &second);
+        }
+        if (result != kDCHTTPParserResultComplete || first + second != bodyLength)
+            failures++;
+    }
+    CU_ASSERT(0 == failures);
+
+    const char *invalid[] = { "x\r\n", "5\r\nhelloXX", "5 junk\r\n", "1234567890123456\r\n", "0\r\n bad\r\n\r\n" };
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        DCHTTPChunkDecoder decoder;
+        size_t consumed;
+        DCHTTPChunkDecoderInit(&decoder);
+        CU_ASSERT(kDCHTTPParserResultError == DCHTTPChunkDecoderExecute(&decoder, invalid[i], strlen(invalid[i]), &consumed));
+        CU_ASSERT(kDCHTTPParserErrorInvalidChunk == decoder.error);
+    }
+}
+
+/* Every SIMD level stops on exactly the byte the scalar scanner stops on. */
+void testScanLevelsAgree(void)
+{
+    const DCHTTPScanner *scalar = DCHTTPScanGetLevel(kDCHTTPScanLevelScalar);
+    uint8_t buffer[80];
+    int failures = 0;
+
+    for (int level = kDCHTTPScanLevelSSE42; level <= kDCHTTPScanLevelAVX2; level++) {
+        const DCHTTPScanner *scanner = DCHTTPScanGetLevel((DCHTTPScanLevel) level);
+        if (!scanner)
+            continue;
+
+        for (unsigned int c = 0; c < 256; c++) {
+            for (size_t position = 0; position < sizeof(buffer); position++) {
+                memset(buffer, 'a', sizeof(buffer));
+                buffer[position] = (uint8_t) c;
+                for (size_t start = 0; start < 3; start++) {
+                    if (scanner->token(buffer, start, sizeof(buffer)) != scalar->token(buffer, start, sizeof(buffer)) ||
+                        scanner->target(buffer, start, sizeof(buffer)) != scalar->target(buffer, start, sizeof(buffer)) ||
+                        scanner->value(buffer, start, sizeof(buffer)) != scalar->value(buffer, start, sizeof(buffer)))
+                        failures++;
+                }
+            }
+        }
+    }
+    CU_ASSERT(0 == failures);
+    CU_ASSERT(NULL != DCHTTPScanGetDefault());
+}
+
+/* Freed objects are handed out again, most recently freed first, zeroed. */
+void testSlabRecycles(void)
+{
+    DCSlabRef slab = DCSlabCreate("test", 40, 4);
+    void *objects[6];
+
+    for (int i = 0; i < 6; i++) {
+        objects[i] = DCSlabAlloc(slab);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(objects[i]);
+        CU_ASSERT(0 == ((uintptr_t) objects[i]) % 16);
+        memset(objects[i], 0xAB, 40);
+    }
+    CU_ASSERT(6 == DCSlabGetCount(slab));
+
+    DCSlabFree(slab, objects[2]);
+    unsigned char *again = (unsigned char *) DCSlabAlloc(slab);
+#if !defined(DC_DISABLE_POOLING)
+    CU_ASSERT(again == objects[2]);
+    CU_ASSERT(8 == DCSlabGetCapacity(slab));
+#endif
+    CU_ASSERT(0 == again[0] && 0 == again[39]);
+    objects[2] = again;
+
+    for (int i = 0; i < 6; i++)
+        DCSlabFree(slab, objects[i]);
+    CU_ASSERT(0 == DCSlabGetCount(slab));
+    DCSlabRelease(slab);
+}
+
+/* Sizes round up to their class, buffers are reused up to the cache limit. */
+void testBufferPoolClasses(void)
+{
+    CU_ASSERT(64 == DCBufferPoolGoodSize(1));
+    CU_ASSERT(128 == DCBufferPoolGoodSize(65));
+    CU_ASSERT(16384 == DCBufferPoolGoodSize(16384));
+    CU_ASSERT(70000 == DCBufferPoolGoodSize(70000));
+
+    DCBufferPoolRef pool = DCBufferPoolCreate(2 * 4096);
+    DCBufferPoolStats stats;
+    size_t capacity;
+    void *buffers[3];
+
+    for (int i = 0; i < 3; i++) {
+        buffers[i] = DCBufferPoolAlloc(pool, 3000, &capacity);
+        CU_ASSERT(4096 == capacity);
+    }
+    for (int i = 0; i < 3; i++)
+        DCBufferPoolFree(pool, buffers[i], capacity);
+
+    // Only two fit in the cache, the third went back to malloc
+    DCBufferPoolGetStats(pool, &stats);
+    CU_ASSERT(3 == stats.misses);
+    CU_ASSERT(0 == stats.usedBytes);
+#if !defined(DC_DISABLE_POOLING)
+    CU_ASSERT(2 * 4096 == stats.cachedBytes);
+
+    void *reused = DCBufferPoolAlloc(pool, 4096, &capacity);
+    CU_ASSERT(reused == buffers[1]);
+    DCBufferPoolGetStats(pool, &stats);
+    CU_ASSERT(1 == stats.hits);
+    DCBufferPoolFree(pool, reused, capacity);
+#endif
+
+    void *large = DCBufferPoolAlloc(pool, 100000, &capacity);
+    CU_ASSERT(100000 == capacity);
+    DCBufferPoolFree(pool, large, capacity);
+    DCBufferPoolRelease(pool);
+}
+
+/* First in first out across the wrap, a full queue refuses more. */
+void testMessageQueueRing(void)
+{
+    DCHTTPMessageRef messages[3];
+    for (int i = 0; i < 3; i++) {
+        messages[i] = DCHTTPMessageCreateWithBytes(kDCHTTPParserTypeResponse,
+            "HTTP/1.1 204 No Content\r\n\r\n", 27);
+        CU_ASSERT_PTR_NOT_NULL_FATAL(messages[i]);
+    }
+
+    DCMessageQueue queue;
+    memset(&queue, 0, sizeof(queue));
+    CU_ASSERT(NULL == DCMessageQueuePop(&queue));
+
+    for (unsigned int round = 0; round < 3; round++) {
+        for (unsigned int i = 0; i < kDCMessageQueueCapacity; i++)
+            CU_ASSERT(DCMessageQueuePush(&queue, messages[i % 3]));
+        CU_ASSERT(DCMessageQueueIsFull(&queue));
+        CU_ASSERT(!DCMessageQueuePush(&queue, messages[0]));
+
+        // Leave a few behind so the next round wraps
+        for (unsigned int i = 0; i < kDCMessageQueueCapacity - round; i++) {
+            DCHTTPMessageRef message = DCMessageQueuePop(&queue);
+            CU_ASSERT(message == messages[i % 3]);
+            DCHTTPMessageRelease(message);
+        }
+        CU_ASSERT(round == DCMessageQueueGetCount(&queue));
+        DCMessageQueueClear(&queue);
+        CU_ASSERT(DCMessageQueueIsEmpty(&queue));
+    }
+
+    for (int i = 0; i < 3; i++)
+        DCHTTPMessageRelease(messages[i]);
+}
+
+static void* LogThread(void *info)
+{
+    int thread = (int) (intptr_t) info;
+    for (int i = 0; i < 1000; i++)
+        log_info("thread %d message %d\n", thread, i);
+    return NULL;
+}
+
+/* Arguments are captured and formatted later, each thread's records in order. */
+void testLogDeferredFormatting(void)
+{
+    FILE *file = tmpfile();
+    CU_ASSERT_PTR_NOT_NULL_FATAL(file);
+    log_flush();
+    int level = log_get_level();
+    log_set_fp(file);
+    log_set_quiet(1);
+    log_set_level(LOG_INFO);
+
+    char slice[] = "GETXXX";
+    log_info("%s=%d [%.*s] %5.1f %x %%\n", "answer", 42, 3, slice, 2.5, 255u);
+    strcpy(slice, "later");
+    log_trace("below the level %d\n", 1);
+
+    pthread_t threads[2];
+    for (int i = 0; i < 2; i++)
+        pthread_create(&threads[i], NULL, LogThread, (void *) (intptr_t) i);
+    for (int i = 0; i < 2; i++)
+        pthread_join(threads[i], NULL);
+    log_flush();
+
+    log_set_fp(NULL);
+    log_set_quiet(0);
+    log_set_level(level);
+
+    rewind(file);
+    char line[512];
+    int next[2] = { 0, 0 };
+    bool formatted = false, ordered = true, filtered = true;
+    while (fgets(line, sizeof(line), file)) {
+        int thread, message;
+        char *text = strstr(line, ": ");
+        if (!text)
+            continue;
+        text += 2;
+        if (strcmp(text, "answer=42 [GET]   2.5 ff %\n") == 0)
+            formatted = true;
+        if (strstr(text, "below the level"))
+            filtered = false;
+        if (sscanf(text, "thread %d message %d", &thread, &message) == 2 && thread >= 0 && thread < 2)
+            ordered = ordered && message == next[thread]++;
+    }
+    CU_ASSERT(formatted);
+    CU_ASSERT(filtered);
+    CU_ASSERT(ordered);
+    CU_ASSERT(1000 == next[0] && 1000 == next[1]);
+    fclose(file);
+}
+
+/* State of the echo server in `testEventLoopListenerEcho`. */
+static int echo_fd = -1;
+static char echo_bytes[16];
+static size_t echo_length = 0;
+static int echo_sent_error = -1;
+
+static void EchoSent(DCEventLoopRef loop, size_t written, int error, void *info)
+{
+    echo_sent_error = error;
+    DCEventLoopStop(loop);
+}
+
+static void EchoReceived(DCEventLoopRef loop, int fd, const void *bytes, ssize_t result, void *info)
+{
+    if (result <= 0) {
+        DCEventLoopStop(loop);
+        return;
+    }
+    memcpy(echo_bytes, bytes, result);
+    echo_length = result;
+    struct iovec vector[2] = { { echo_bytes, 2 }, { echo_bytes + 2, echo_length - 2 } };
+    DCEventLoopSend(loop, fd, vector, 2, EchoSent, NULL);
+}
+
+static void EchoReadable(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info)
+{
+    ssize_t bytes = read(fd, echo_bytes, sizeof(echo_bytes));
+    if (bytes > 0) {
+        echo_length = bytes;
+        echo_sent_error = write(fd, echo_bytes, bytes) == bytes ? 0 : errno;
+        DCEventLoopStop(loop);
+    }
+}
+
+static void EchoAccepted(DCEventLoopRef loop, int listenFD, int fd, void *info)
+{
+    echo_fd = fd;
+    if (DCEventLoopHasCompletions(loop)) {
+        DCEventLoopAddFDWithEvents(loop, fd, kDCEventLoopEventNone, EchoReadable, NULL);
+        DCEventLoopReceive(loop, fd, sizeof(echo_bytes), EchoReceived);
+    } else {
+        DCEventLoopAddFDWithEvents(loop, fd, kDCEventLoopEventRead, EchoReadable, NULL);
+    }
+}
+
+/* Accepts and echoes one message, by readiness or with completions (io_uring). */
+void testEventLoopListenerEcho(void)
+{
+    DCEventLoopBackend backends[] = { kDCEventLoopBackendDefault, kDCEventLoopBackendIOUring };
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        // io_uring falls back to epoll where the kernel can't, and elsewhere fails
+        DCEventLoopRef loop = DCEventLoopCreate(backends[i]);
+        if (!loop)
+            continue;
+
+        struct sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+        CU_ASSERT_FATAL(listenFD != -1);
+        CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+        CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+        getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+        fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+        CU_ASSERT(DCEventLoopAddListener(loop, listenFD, EchoAccepted, NULL));
+
+        int clientFD = socket(AF_INET, SOCK_STREAM, 0);
+        CU_ASSERT_FATAL(connect(clientFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+        CU_ASSERT(write(clientFD, "hello", 5) == 5);
+
+        echo_fd = -1;
+        echo_length = 0;
+        echo_sent_error = -1;
+        DCEventLoopAddTimer(loop, 2000, ResolverDeadline, NULL);
+        DCEventLoopRun(loop);
+
+        char reply[16];
+        CU_ASSERT(echo_fd != -1);
+        CU_ASSERT(0 == echo_sent_error);
+        CU_ASSERT(5 == echo_length);
+        CU_ASSERT(read(clientFD, reply, sizeof(reply)) == 5 && memcmp(reply, "hello", 5) == 0);
+
+        if (echo_fd != -1) {
+            DCEventLoopRemoveFD(loop, echo_fd);
+            close(echo_fd);
+        }
+        DCEventLoopRemoveFD(loop, listenFD);
+        close(listenFD);
+        close(clientFD);
+        DCEventLoopRelease(loop);
+    }
+}
+
+/* Channels are released once their client is closed, whichever side closed it,
+ * along with their connections. What's still open goes with the worker. */
+void testWorkerReleasesClosedChannels(void)
+{
+    DCWorkerRef worker = DCWorkerCreate(0, kDCEventLoopBackendDefault);
+    CU_ASSERT_FATAL(worker != NULL);
+
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(listenFD != -1);
+    CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+    getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    CU_ASSERT_FATAL(DCWorkerAddListener(worker, listenFD, true));
+
+    // Closed by the client, by the proxy for a request it can't route, after
+    // an upstream refused, and one left open
+    const char *requests[] = {
+        NULL,
+        "GET / HTTP/1.1\r\n\r\n",
+        "GET http://127.0.0.1:1/ HTTP/1.1\r\nHost: 127.0.0.1:1\r\n\r\n",
+        "",
+    };
+    int clientFDs[4];
+    for (int i = 0; i < 4; i++) {
+        clientFDs[i] = socket(AF_INET, SOCK_STREAM, 0);
+        CU_ASSERT_FATAL(connect(clientFDs[i], (struct sockaddr *) &address, sizeof(address)) == 0);
+        if (!requests[i])
+            close(clientFDs[i]);
+        else if (requests[i][0])
+            CU_ASSERT(write(clientFDs[i], requests[i], strlen(requests[i])) == (ssize_t) strlen(requests[i]));
+    }
+
+    DCEventLoopAddTimer(DCWorkerGetEventLoop(worker), 500, ResolverDeadline, NULL);
+    DCWorkerRun(worker);
+
+    CU_ASSERT(1 == DCSlabGetCount(DCWorkerGetChannelSlab(worker)));
+    CU_ASSERT(1 == DCSlabGetCount(DCWorkerGetConnectionSlab(worker)));
+    CU_ASSERT(*DCWorkerGetChannelList(worker) != NULL);
+
+    DCWorkerRelease(worker);
+    for (int i = 1; i < 4; i++)
+        close(clientFDs[i]);
+}
+
+static unsigned long long wheel_fired[16];
+static unsigned int wheel_nbr_fired;
+static DCTimerWheelRef wheel_under_test;
+
+static void WheelFired(DCTimerWheelEntry *entry, void *info)
+{
+    wheel_fired[wheel_nbr_fired++ % 16] = entry->deadline;
+    // Re-arms itself once from the callback
+    if (info && entry->deadline < 100000)
+        DCTimerWheelSchedule(wheel_under_test, entry, entry->deadline + 100000);
+}
+
+/* Entries fire in deadline order, on time, from whichever level they were
+ * placed in, through cancels and re-arms from callbacks. */
+void testTimerWheelOrderAndCascade(void)
+{
+    unsigned long long start = 1000;
+    // Level 0 to 3 and the overflow, relative to the start
+    unsigned long long offsets[] = { 5, 70, 63, 64, 4095, 4096, 262143, 262145, 300000, 20000000, 1, 4200 };
+    size_t count = sizeof(offsets) / sizeof(offsets[0]);
+    DCTimerWheelEntry entries[12];
+
+    wheel_under_test = DCTimerWheelCreate(start);
+    wheel_nbr_fired = 0;
+    CU_ASSERT(-1 == DCTimerWheelGetTimeout(wheel_under_test, start));
+    for (size_t i = 0; i < count; i++) {
+        DCTimerWheelEntryInit(&entries[i], WheelFired, i == 2 ? &entries[i] : NULL);
+        DCTimerWheelSchedule(wheel_under_test, &entries[i], start + offsets[i]);
+    }
+    CU_ASSERT(1 == DCTimerWheelGetTimeout(wheel_under_test, start));
+
+    // Cancelled, and moved from level 1 to level 0
+    DCTimerWheelCancel(&entries[5]);
+    CU_ASSERT(!DCTimerWheelEntryIsScheduled(&entries[5]));
+    DCTimerWheelSchedule(wheel_under_test, &entries[11], start + 2);
+
+    // The re-armed one comes back 100000 later
+    unsigned long long expected[] = { 1, 2, 5, 63, 64, 70, 4095, 100063, 262143, 262145, 300000, 20000000 };
+    size_t nbrExpected = sizeof(expected) / sizeof(expected[0]);
+    unsigned long long now = start;
+    size_t nbrChecked = 0;
+    while (wheel_nbr_fired < nbrExpected && now < start + 30000000) {
+        int timeout = DCTimerWheelGetTimeout(wheel_under_test, now);
+        CU_ASSERT_FATAL(timeout >= 0);
+        // Jumping past the next thing to do is fine too, just less often
+        now += timeout > 0 ? (unsigned long long) timeout : 1;
+        if (now % 3 == 0) now += 7;
+        DCTimerWheelAdvance(wheel_under_test, now);
+        for (; nbrChecked < wheel_nbr_fired; nbrChecked++)
+            CU_ASSERT(wheel_fired[nbrChecked] <= now);
+    }
+    CU_ASSERT(nbrExpected == wheel_nbr_fired);
+    for (size_t i = 0; i < nbrExpected && i < wheel_nbr_fired; i++)
+        CU_ASSERT(start + expected[i] == wheel_fired[i]);
+    CU_ASSERT(-1 == DCTimerWheelGetTimeout(wheel_under_test, now));
+
+    // Still scheduled when released, cancelling it afterwards does nothing
+    DCTimerWheelSchedule(wheel_under_test, &entries[0], now + 10);
+    DCTimerWheelRelease(wheel_under_test);
+    CU_ASSERT(!DCTimerWheelEntryIsScheduled(&entries[0]));
+    DCTimerWheelCancel(&entries[0]);
+}
+
+static int clock_pipe[2];
+static long long clock_lag;
+
+static unsigned long long MonotonicMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + (unsigned long long) ts.tv_nsec / 1000000;
+}
+
+static void* ClockWriterThread(void *info)
+{
+    usleep(200000);
+    ssize_t ignored = write(clock_pipe[1], "x", 1);
+    (void) ignored;
+    return NULL;
+}
+
+static void ClockReadable(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info)
+{
+    char byte;
+    ssize_t ignored = read(fd, &byte, 1);
+    (void) ignored;
+    clock_lag = (long long) MonotonicMs() - (long long) DCEventLoopGetTime(loop);
+    DCEventLoopStop(loop);
+}
+
+/* Handlers see the time they were woken at, not when the loop went to
+ * sleep, so deadlines they arm aren't early by however long it waited. */
+void testEventLoopTimeInHandlers(void)
+{
+    DCEventLoopBackend backends[] = { kDCEventLoopBackendDefault, kDCEventLoopBackendIOUring };
+    for (int i = 0; i < 2; i++) {
+        DCEventLoopRef loop = DCEventLoopCreate(backends[i]);
+        if (!loop)
+            continue;
+        CU_ASSERT_FATAL(pipe(clock_pipe) == 0);
+        fcntl(clock_pipe[0], F_SETFL, fcntl(clock_pipe[0], F_GETFL) | O_NONBLOCK);
+        DCEventLoopAddFD(loop, clock_pipe[0], ClockReadable, NULL);
+
+        pthread_t writer;
+        clock_lag = -1;
+        pthread_create(&writer, NULL, ClockWriterThread, NULL);
+        DCEventLoopRun(loop);
+        pthread_join(writer, NULL);
+        CU_ASSERT(clock_lag >= 0 && clock_lag < 50);
+
+        DCEventLoopRemoveFD(loop, clock_pipe[0]);
+        DCEventLoopRelease(loop);
+        close(clock_pipe[0]);
+        close(clock_pipe[1]);
+    }
+}
+
+static void TimeoutsCheck(DCEventLoopRef loop, void *info)
+{
+    unsigned int *checks = (unsigned int *) info;
+    // Nothing timed out early
+    if (++checks[0] == 1)
+        checks[1] = DCSlabGetCount(DCWorkerGetChannelSlab(DCWorkerGetCurrent()));
+    if (checks[0] == 8)
+        DCEventLoopStop(loop);
+}
+
+/* Clients that never send a request or never finish its header, and one
+ * whose upstream never answers, are closed once their timeouts run out. */
+void testWorkerTimesOutConnections(void)
+{
+    DCWorkerRef worker = DCWorkerCreate(0, kDCEventLoopBackendDefault);
+    CU_ASSERT_FATAL(worker != NULL);
+    DCConnectionTimeouts timeouts = { 300, 300, 300, 300 };
+    DCWorkerSetConnectionTimeouts(worker, &timeouts);
+
+    struct sockaddr_in address, upstreamAddress;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    upstreamAddress = address;
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(listenFD != -1);
+    CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+    getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    CU_ASSERT_FATAL(DCWorkerAddListener(worker, listenFD, true));
+
+    // Connections to it are completed by the kernel, and never answered
+    int upstreamFD = socket(AF_INET, SOCK_STREAM, 0);
+    addressLength = sizeof(upstreamAddress);
+    CU_ASSERT_FATAL(bind(upstreamFD, (struct sockaddr *) &upstreamAddress, sizeof(upstreamAddress)) == 0);
+    CU_ASSERT_FATAL(listen(upstreamFD, 8) == 0);
+    getsockname(upstreamFD, (struct sockaddr *) &upstreamAddress, &addressLength);
+
+    char request[128];
+    unsigned int upstreamPort = ntohs(upstreamAddress.sin_port);
+    snprintf(request, sizeof(request), "GET http://127.0.0.1:%u/ HTTP/1.1\r\nHost: 127.0.0.1:%u\r\n\r\n", upstreamPort, upstreamPort);
+    const char *requests[] = { "", "GET / HTTP/1.1\r\nHost: exa", request };
+    int clientFDs[3];
+    for (int i = 0; i < 3; i++) {
+        clientFDs[i] = socket(AF_INET, SOCK_STREAM, 0);
+        // Fails rather than hangs below when the proxy never closes
+        struct timeval receiveTimeout = { 2, 0 };
+        setsockopt(clientFDs[i], SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+        CU_ASSERT_FATAL(connect(clientFDs[i], (struct sockaddr *) &address, sizeof(address)) == 0);
+        CU_ASSERT(write(clientFDs[i], requests[i], strlen(requests[i])) == (ssize_t) strlen(requests[i]));
+    }
+
+    unsigned int checks[2] = { 0, 0 };
+    DCEventLoopAddTimer(DCWorkerGetEventLoop(worker), 100, TimeoutsCheck, checks);
+    DCWorkerRun(worker);
+
+    CU_ASSERT(3 == checks[1]);
+    CU_ASSERT(0 == DCSlabGetCount(DCWorkerGetChannelSlab(worker)));
+    CU_ASSERT(0 == DCSlabGetCount(DCWorkerGetConnectionSlab(worker)));
+    // The one whose upstream never answered is told so before it's closed
+    for (int i = 0; i < 3; i++) {
+        char reply[128];
+        ssize_t nbrRead = read(clientFDs[i], reply, sizeof(reply));
+        if (i == 2) {
+            CU_ASSERT(nbrRead > 12 && memcmp(reply, "HTTP/1.1 504", 12) == 0);
+            nbrRead = read(clientFDs[i], reply, sizeof(reply));
+        }
+        CU_ASSERT(nbrRead == 0 || (nbrRead < 0 && errno == ECONNRESET));
+        close(clientFDs[i]);
+    }
+
+    DCWorkerRelease(worker);
+    close(upstreamFD);
+}
+
+#define kTunnelBytes (16 * 1024 * 1024)
+
+static int tunnel_echo_fd;
+static int tunnel_client_fd;
+static size_t tunnel_received;
+static bool tunnel_intact;
+static bool tunnel_eof;
+static atomic_bool tunnel_done;
+static unsigned int tunnel_upstream_throttles;
+
+static void* TunnelEchoThread(void *info)
+{
+    int fd = accept(tunnel_echo_fd, NULL, NULL);
+    if (fd == -1)
+        return NULL;
+    struct timeval timeout = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    char buffer[64 * 1024];
+    ssize_t nbrRead;
+    while ((nbrRead = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t written = 0, n; written < nbrRead; written += n)
+            if ((n = write(fd, buffer + written, nbrRead - written)) <= 0)
+                goto done;
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static void* TunnelWriterThread(void *info)
+{
+    unsigned char buffer[64 * 1024];
+    for (size_t sent = 0; sent < kTunnelBytes; sent += sizeof(buffer)) {
+        for (size_t i = 0; i < sizeof(buffer); i++)
+            buffer[i] = (unsigned char) ((sent + i) % 251);
+        for (size_t written = 0; written < sizeof(buffer);) {
+            ssize_t n = write(tunnel_client_fd, buffer + written, sizeof(buffer) - written);
+            if (n <= 0)
+                return NULL;
+            written += (size_t) n;
+        }
+    }
+    shutdown(tunnel_client_fd, SHUT_WR);
+    return NULL;
+}
+
+// Starts reading late, so everything echoed piles up in the proxy meanwhile
+static void* TunnelReaderThread(void *info)
+{
+    unsigned char buffer[64 * 1024];
+    ssize_t nbrRead;
+    usleep(300000);
+    tunnel_intact = true;
+    while ((nbrRead = read(tunnel_client_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < nbrRead; i++)
+            tunnel_intact = tunnel_intact && buffer[i] == (unsigned char) ((tunnel_received + i) % 251);
+        tunnel_received += (size_t) nbrRead;
+    }
+    tunnel_eof = nbrRead == 0;
+    atomic_store(&tunnel_done, true);
+    return NULL;
+}
+
+static void TunnelCheck(DCEventLoopRef loop, void *info)
+{
+    unsigned int *checks = (unsigned int *) info;
+    DCChannelRef channel = *DCWorkerGetChannelList(DCWorkerGetCurrent());
+    if (channel) {
+        DCChannelStats stats;
+        DCChannelGetStats(channel, &stats);
+        if (stats.upstreamThrottles > tunnel_upstream_throttles)
+            tunnel_upstream_throttles = stats.upstreamThrottles;
+    }
+    // First until the reply is surely sent, then until the relay is over
+    checks[0]++;
+    if (checks[1] == 0 ? checks[0] == 10 : atomic_load(&tunnel_done) || checks[0] == 500)
+        DCEventLoopStop(loop);
+}
+
+/* CONNECT is answered once the upstream is connected, then bytes go both
+ * ways until both sides are done. An upstream that's faster than the
+ * client reads waits for it rather than piling up in the proxy. */
+void testWorkerTunnelsConnect(void)
+{
+    DCWorkerRef worker = DCWorkerCreate(0, kDCEventLoopBackendDefault);
+    CU_ASSERT_FATAL(worker != NULL);
+
+    struct sockaddr_in address, echoAddress;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    echoAddress = address;
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(listenFD != -1);
+    CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+    getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    CU_ASSERT_FATAL(DCWorkerAddListener(worker, listenFD, true));
+
+    tunnel_echo_fd = socket(AF_INET, SOCK_STREAM, 0);
+    addressLength = sizeof(echoAddress);
+    CU_ASSERT_FATAL(bind(tunnel_echo_fd, (struct sockaddr *) &echoAddress, sizeof(echoAddress)) == 0);
+    CU_ASSERT_FATAL(listen(tunnel_echo_fd, 8) == 0);
+    getsockname(tunnel_echo_fd, (struct sockaddr *) &echoAddress, &addressLength);
+
+    // A small receive buffer, the kernel doesn't hide the backpressure
+    int receiveBuffer = 64 * 1024;
+    struct timeval timeout = { 2, 0 };
+    tunnel_client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(tunnel_client_fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+    setsockopt(tunnel_client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(tunnel_client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    CU_ASSERT_FATAL(connect(tunnel_client_fd, (struct sockaddr *) &address, sizeof(address)) == 0);
+
+    char request[128];
+    unsigned int echoPort = ntohs(echoAddress.sin_port);
+    snprintf(request, sizeof(request), "CONNECT 127.0.0.1:%u HTTP/1.1\r\nHost: 127.0.0.1:%u\r\n\r\n", echoPort, echoPort);
+    CU_ASSERT(write(tunnel_client_fd, request, strlen(request)) == (ssize_t) strlen(request));
+
+    pthread_t echoThread, writerThread, readerThread;
+    atomic_store(&tunnel_done, false);
+    pthread_create(&echoThread, NULL, TunnelEchoThread, NULL);
+
+    // The reply comes before anything is relayed
+    unsigned int checks[2] = { 0, 0 };
+    DCEventLoopAddTimer(DCWorkerGetEventLoop(worker), 10, TunnelCheck, checks);
+    DCWorkerRun(worker);
+    const char *established = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    char reply[64];
+    memset(reply, 0, sizeof(reply));
+    CU_ASSERT(read(tunnel_client_fd, reply, strlen(established)) == (ssize_t) strlen(established));
+    CU_ASSERT(strcmp(reply, established) == 0);
+
+    pthread_create(&writerThread, NULL, TunnelWriterThread, NULL);
+    pthread_create(&readerThread, NULL, TunnelReaderThread, NULL);
+    checks[0] = 0;
+    checks[1] = 1;
+    DCWorkerRun(worker);
+    pthread_join(writerThread, NULL);
+    pthread_join(readerThread, NULL);
+    pthread_join(echoThread, NULL);
+
+    CU_ASSERT(kTunnelBytes == tunnel_received);
+    CU_ASSERT(tunnel_intact);
+    CU_ASSERT(tunnel_eof);
+    CU_ASSERT(tunnel_upstream_throttles > 0);
+
+    DCWorkerRelease(worker);
+    close(tunnel_client_fd);
+    close(tunnel_echo_fd);
+}
+
+static void StopLoop(DCEventLoopRef loop, void *info)
+{
+    DCEventLoopStop(loop);
+}
+
+/* Requests that can't be routed, or whose upstream refuses to connect, are
+ * answered with an error before the client is closed. */
+void testWorkerAnswersErrors(void)
+{
+    DCWorkerRef worker = DCWorkerCreate(0, kDCEventLoopBackendDefault);
+    CU_ASSERT_FATAL(worker != NULL);
+
+    struct sockaddr_in address, refusingAddress;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    refusingAddress = address;
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(listenFD != -1);
+    CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+    getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    CU_ASSERT_FATAL(DCWorkerAddListener(worker, listenFD, true));
+
+    // Bound and closed again, nothing listens there
+    int refusingFD = socket(AF_INET, SOCK_STREAM, 0);
+    addressLength = sizeof(refusingAddress);
+    CU_ASSERT_FATAL(bind(refusingFD, (struct sockaddr *) &refusingAddress, sizeof(refusingAddress)) == 0);
+    getsockname(refusingFD, (struct sockaddr *) &refusingAddress, &addressLength);
+    close(refusingFD);
+
+    char request[128];
+    unsigned int refusingPort = ntohs(refusingAddress.sin_port);
+    snprintf(request, sizeof(request), "GET http://127.0.0.1:%u/ HTTP/1.1\r\nHost: 127.0.0.1:%u\r\n\r\n", refusingPort, refusingPort);
+    // Ports that don't fit in 16 bits or aren't numbers are refused, not truncated
+    const char *requests[] = {
+        "GET / HTTP/1.1\r\n\r\n",
+        request,
+        "GET / HTTP/1.1\r\nHost: 127.0.0.1:83953\r\n\r\n",
+        "GET http://127.0.0.1:80abc/ HTTP/1.1\r\n\r\n",
+        "CONNECT 127.0.0.1: HTTP/1.1\r\n\r\n"
+    };
+    const char *statuses[] = { "HTTP/1.1 400", "HTTP/1.1 502", "HTTP/1.1 400", "HTTP/1.1 400", "HTTP/1.1 400" };
+    int clientFDs[5];
+    for (int i = 0; i < 5; i++) {
+        clientFDs[i] = socket(AF_INET, SOCK_STREAM, 0);
+        struct timeval receiveTimeout = { 2, 0 };
+        setsockopt(clientFDs[i], SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+        CU_ASSERT_FATAL(connect(clientFDs[i], (struct sockaddr *) &address, sizeof(address)) == 0);
+        CU_ASSERT(write(clientFDs[i], requests[i], strlen(requests[i])) == (ssize_t) strlen(requests[i]));
+    }
+
+    DCEventLoopAddTimer(DCWorkerGetEventLoop(worker), 200, StopLoop, NULL);
+    DCWorkerRun(worker);
+
+    for (int i = 0; i < 5; i++) {
+        char reply[128];
+        CU_ASSERT(read(clientFDs[i], reply, sizeof(reply)) > 12 && memcmp(reply, statuses[i], 12) == 0);
+        CU_ASSERT(read(clientFDs[i], reply, sizeof(reply)) == 0);
+        close(clientFDs[i]);
+    }
+    CU_ASSERT(0 == DCSlabGetCount(DCWorkerGetChannelSlab(worker)));
+
+    DCWorkerRelease(worker);
+}
+
+static int early_upstream_fd;
+static int early_client_fd;
+static int early_fds[2] = { -1, -1 };
+static char early_first[256];
+static char early_second[256];
+
+static void EarlyResponseCheck(DCEventLoopRef loop, void *info)
+{
+    unsigned int *checks = (unsigned int *) info;
+    unsigned int i = checks[0]++;
+    if (i == 0) {
+        // Answered once the header and half of the body are in
+        early_fds[0] = accept(early_upstream_fd, NULL, NULL);
+        if (early_fds[0] == -1) {
+            DCEventLoopStop(loop);
+            return;
+        }
+        recv(early_fds[0], early_first, sizeof(early_first) - 1, 0);
+        const char *response = "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\n\r\n";
+        write(early_fds[0], response, strlen(response));
+    } else if (i == 1) {
+        char rest[128];
+        snprintf(rest, sizeof(rest), "0123456789GET http://127.0.0.1:%u/second HTTP/1.1\r\nHost: 127.0.0.1:%u\r\n\r\n", checks[1], checks[1]);
+        write(early_client_fd, rest, strlen(rest));
+    } else if (i == 3) {
+        size_t length = strlen(early_first);
+        recv(early_fds[0], early_first + length, sizeof(early_first) - 1 - length, MSG_DONTWAIT);
+        early_fds[1] = accept(early_upstream_fd, NULL, NULL);
+        if (early_fds[1] != -1)
+            recv(early_fds[1], early_second, sizeof(early_second) - 1, MSG_DONTWAIT);
+        DCEventLoopStop(loop);
+    }
+}
+
+/* An upstream that answers before the request body is all there isn't
+ * reused, the next request must not end up as the rest of that body. */
+void testWorkerEarlyResponseNotReused(void)
+{
+    DCWorkerRef worker = DCWorkerCreate(0, kDCEventLoopBackendDefault);
+    CU_ASSERT_FATAL(worker != NULL);
+
+    struct sockaddr_in address, upstreamAddress;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    upstreamAddress = address;
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(listenFD != -1);
+    CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+    getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    CU_ASSERT_FATAL(DCWorkerAddListener(worker, listenFD, true));
+
+    early_upstream_fd = socket(AF_INET, SOCK_STREAM, 0);
+    addressLength = sizeof(upstreamAddress);
+    CU_ASSERT_FATAL(bind(early_upstream_fd, (struct sockaddr *) &upstreamAddress, sizeof(upstreamAddress)) == 0);
+    CU_ASSERT_FATAL(listen(early_upstream_fd, 8) == 0);
+    getsockname(early_upstream_fd, (struct sockaddr *) &upstreamAddress, &addressLength);
+    fcntl(early_upstream_fd, F_SETFL, fcntl(early_upstream_fd, F_GETFL) | O_NONBLOCK);
+
+    char request[128];
+    unsigned int upstreamPort = ntohs(upstreamAddress.sin_port);
+    snprintf(request, sizeof(request), "POST http://127.0.0.1:%u/first HTTP/1.1\r\nHost: 127.0.0.1:%u\r\nContent-Length: 20\r\n\r\n0123456789", upstreamPort, upstreamPort);
+    early_client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(connect(early_client_fd, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT(write(early_client_fd, request, strlen(request)) == (ssize_t) strlen(request));
+
+    unsigned int checks[2] = { 0, upstreamPort };
+    DCEventLoopAddTimer(DCWorkerGetEventLoop(worker), 50, EarlyResponseCheck, checks);
+    DCWorkerRun(worker);
+
+    CU_ASSERT(strstr(early_first, "POST") == early_first);
+    CU_ASSERT(strstr(early_first, "GET") == NULL);
+    CU_ASSERT(strstr(early_second, "GET http://127.0.0.1") == early_second);
+    CU_ASSERT(strstr(early_second, "/second") != NULL);
+
+    DCWorkerRelease(worker);
+    close(early_client_fd);
+    for (int i = 0; i < 2; i++)
+        if (early_fds[i] != -1)
+            close(early_fds[i]);
+    close(early_upstream_fd);
+}
+
+static DCWorkerChannelBudget admission_budget;
+static unsigned int admission_accepting[2];
+static unsigned int admission_channels[2];
+static int admission_waiting[2];
+static int admission_client_fd;
+
+static void AdmissionCheck(DCEventLoopRef loop, void *info)
+{
+    unsigned int *checks = (unsigned int *) info;
+    DCWorkerRef worker = DCWorkerGetCurrent();
+    char reply[64];
+    unsigned int i = checks[0]++;
+    if (i < 2) {
+        admission_accepting[i] = DCWorkerIsAccepting(worker);
+        admission_channels[i] = DCWorkerGetChannelCount(worker);
+        admission_waiting[i] = recv(admission_client_fd, reply, sizeof(reply), MSG_DONTWAIT) < 0 && errno == EAGAIN;
+    }
+    // Another worker's channel closes
+    if (i == 0)
+        atomic_fetch_sub(&admission_budget.nbrOpen, 1);
+    if (i == 1)
+        DCEventLoopStop(loop);
+}
+
+/* A worker stops accepting once its budget is used up, leaving connections in
+ * the backlog, and takes them once channels close elsewhere. */
+void testWorkerAdmissionLimits(void)
+{
+    DCWorkerRef worker = DCWorkerCreate(0, kDCEventLoopBackendDefault);
+    CU_ASSERT_FATAL(worker != NULL);
+    atomic_store(&admission_budget.nbrOpen, 1);
+    admission_budget.maxOpen = 3;
+    DCWorkerSetChannelLimits(worker, 0, &admission_budget);
+
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(listenFD != -1);
+    CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+    getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    CU_ASSERT_FATAL(DCWorkerAddListener(worker, listenFD, true));
+
+    // Two idle clients fill the budget, the third one's request can't be
+    // routed and is refused once it's accepted
+    const char *request = "GET / HTTP/1.1\r\n\r\n";
+    int clientFDs[3];
+    for (int i = 0; i < 3; i++) {
+        clientFDs[i] = socket(AF_INET, SOCK_STREAM, 0);
+        CU_ASSERT_FATAL(connect(clientFDs[i], (struct sockaddr *) &address, sizeof(address)) == 0);
+    }
+    admission_client_fd = clientFDs[2];
+    CU_ASSERT(write(clientFDs[2], request, strlen(request)) == (ssize_t) strlen(request));
+
+    unsigned int checks[1] = { 0 };
+    DCEventLoopAddTimer(DCWorkerGetEventLoop(worker), 150, AdmissionCheck, checks);
+    DCWorkerRun(worker);
+
+    CU_ASSERT(!admission_accepting[0]);
+    CU_ASSERT(2 == admission_channels[0]);
+    CU_ASSERT(admission_waiting[0]);
+    // Taken, answered and released
+    CU_ASSERT(admission_accepting[1]);
+    CU_ASSERT(2 == admission_channels[1]);
+    CU_ASSERT(!admission_waiting[1]);
+    CU_ASSERT(2 == atomic_load(&admission_budget.nbrOpen));
+
+    DCWorkerRelease(worker);
+    CU_ASSERT(0 == atomic_load(&admission_budget.nbrOpen));
+    for (int i = 0; i < 3; i++)
+        close(clientFDs[i]);
+}
+
+// A port that's free on both loopbacks, as far as binding tells
+static UInt16 FreeLoopbackPort(void)
+{
+    for (int attempt = 0; attempt < 16; attempt++) {
+        struct sockaddr_in address;
+        socklen_t addressLength = sizeof(address);
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        bind(fd, (struct sockaddr *) &address, sizeof(address));
+        getsockname(fd, (struct sockaddr *) &address, &addressLength);
+        close(fd);
+
+        struct sockaddr_in6 address6;
+        memset(&address6, 0, sizeof(address6));
+        address6.sin6_family = AF_INET6;
+        address6.sin6_addr = in6addr_loopback;
+        address6.sin6_port = address.sin_port;
+        fd = socket(AF_INET6, SOCK_STREAM, 0);
+        int bound = bind(fd, (struct sockaddr *) &address6, sizeof(address6));
+        close(fd);
+        if (bound == 0)
+            return ntohs(address.sin_port);
+    }
+    return 0;
+}
+
+// True once the proxy has closed a request it can't route
+static int race_upstream_fd;
+static int race_client_fd;
+static char race_request[128];
+static int race_connected[3];
+static unsigned int race_failures[2];
+
+static void RaceCheck(DCEventLoopRef loop, void *info)
+{
+    unsigned int *checks = (unsigned int *) info;
+    unsigned int i = checks[0]++;
+    if (i != 0 && i != 5 && i != 6)
+        return;
+    int fd = accept(race_upstream_fd, NULL, NULL);
+    race_connected[i == 0 ? 0 : i - 4] = fd != -1;
+    if (fd != -1)
+        close(fd);
+    if (i == 0)
+        return;
+
+    if (i == 5) {
+        DCAddressStatsRef stats = DCWorkerGetAddressStats(DCWorkerGetCurrent());
+        struct sockaddr_storage addresses[2];
+        struct sockaddr_in6 *address6 = (struct sockaddr_in6 *) &addresses[0];
+        struct sockaddr_in *address = (struct sockaddr_in *) &addresses[1];
+        memset(addresses, 0, sizeof(addresses));
+        address6->sin6_family = AF_INET6;
+        address6->sin6_addr = in6addr_loopback;
+        address6->sin6_port = htons(checks[1]);
+        address->sin_family = AF_INET;
+        address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address->sin_port = htons(checks[1]);
+        race_failures[0] = DCAddressStatsGetFailures(stats, &addresses[0], DCEventLoopGetTime(loop));
+        race_failures[1] = DCAddressStatsGetFailures(stats, &addresses[1], DCEventLoopGetTime(loop));
+
+        // The next connect to the name goes to the address that answered
+        // first, well within the attempt delay
+        write(race_client_fd, race_request, strlen(race_request));
+        return;
+    }
+    DCEventLoopStop(loop);
+}
+
+/* An upstream name with an IPv6 address that never answers and an IPv4 one
+ * that does is connected over IPv4 once the attempt delay is up, and the
+ * next connect to it tries IPv4 first. */
+void testWorkerRacesUpstreamAddresses(void)
+{
+    DCWorkerRef worker = DCWorkerCreate(0, kDCEventLoopBackendDefault);
+    CU_ASSERT_FATAL(worker != NULL);
+    DCEventLoopRef loop = DCWorkerGetEventLoop(worker);
+    UInt16 port = FreeLoopbackPort();
+    CU_ASSERT_FATAL(port != 0);
+
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int nameserverFD = socket(AF_INET, SOCK_DGRAM, 0);
+    CU_ASSERT_FATAL(bind(nameserverFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    getsockname(nameserverFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(nameserverFD, F_SETFL, fcntl(nameserverFD, F_GETFL) | O_NONBLOCK);
+    DCEventLoopAddFD(loop, nameserverFD, StubNameserverCallback, NULL);
+    CU_ASSERT_FATAL(DCResolverSetNameserver(DCWorkerGetResolver(worker), "127.0.0.1", ntohs(address.sin_port)));
+
+    address.sin_port = 0;
+    int listenFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(bind(listenFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT_FATAL(listen(listenFD, 8) == 0);
+    addressLength = sizeof(address);
+    getsockname(listenFD, (struct sockaddr *) &address, &addressLength);
+    fcntl(listenFD, F_SETFL, fcntl(listenFD, F_GETFL) | O_NONBLOCK);
+    CU_ASSERT_FATAL(DCWorkerAddListener(worker, listenFD, true));
+
+    struct sockaddr_in upstreamAddress = address;
+    upstreamAddress.sin_port = htons(port);
+    race_upstream_fd = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(bind(race_upstream_fd, (struct sockaddr *) &upstreamAddress, sizeof(upstreamAddress)) == 0);
+    CU_ASSERT_FATAL(listen(race_upstream_fd, 8) == 0);
+    fcntl(race_upstream_fd, F_SETFL, fcntl(race_upstream_fd, F_GETFL) | O_NONBLOCK);
+
+    // A full backlog on ::1, further handshakes are dropped rather than refused
+    struct sockaddr_in6 silentAddress;
+    memset(&silentAddress, 0, sizeof(silentAddress));
+    silentAddress.sin6_family = AF_INET6;
+    silentAddress.sin6_addr = in6addr_loopback;
+    silentAddress.sin6_port = htons(port);
+    int silentFD = socket(AF_INET6, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(silentFD, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+    CU_ASSERT_FATAL(bind(silentFD, (struct sockaddr *) &silentAddress, sizeof(silentAddress)) == 0);
+    CU_ASSERT_FATAL(listen(silentFD, 0) == 0);
+    int fillerFDs[2];
+    for (int i = 0; i < 2; i++) {
+        fillerFDs[i] = socket(AF_INET6, SOCK_STREAM, 0);
+        fcntl(fillerFDs[i], F_SETFL, fcntl(fillerFDs[i], F_GETFL) | O_NONBLOCK);
+        connect(fillerFDs[i], (struct sockaddr *) &silentAddress, sizeof(silentAddress));
+    }
+    usleep(50000);
+
+    snprintf(race_request, sizeof(race_request), "GET http://race.test:%u/ HTTP/1.1\r\nHost: race.test:%u\r\n\r\n", port, port);
+    int clientFD = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(connect(clientFD, (struct sockaddr *) &address, sizeof(address)) == 0);
+    CU_ASSERT(write(clientFD, race_request, strlen(race_request)) == (ssize_t) strlen(race_request));
+    // Sends the same request once the first race is over
+    race_client_fd = socket(AF_INET, SOCK_STREAM, 0);
+    CU_ASSERT_FATAL(connect(race_client_fd, (struct sockaddr *) &address, sizeof(address)) == 0);
+
+    unsigned int checks[2] = { 0, port };
+    DCEventLoopAddTimer(loop, 100, RaceCheck, checks);
+    DCWorkerRun(worker);
+
+    // Not before the delay, then over IPv4
+    CU_ASSERT(!race_connected[0]);
+    CU_ASSERT(race_connected[1]);
+    CU_ASSERT(1 == race_failures[0]);
+    CU_ASSERT(0 == race_failures[1]);
+    CU_ASSERT(race_connected[2]);
+
+    close(clientFD);
+    close(race_client_fd);
+    DCEventLoopRemoveFD(loop, nameserverFD);
+    DCWorkerRelease(worker);
+    for (int i = 0; i < 2; i++)
+        close(fillerFDs[i]);
+    close(silentFD);
+    close(race_upstream_fd);
+    close(nameserverFD);
+}
+
+static bool ProxyAnswers(const char *host, UInt16 port)
+{
+    struct sockaddr_storage address;
+    if (!DCResolverParseLiteral(host, &address))
+        return false;
+    socklen_t addressLength = sizeof(struct sockaddr_in);
+    if (address.ss_family == AF_INET6) {
+        ((struct sockaddr_in6 *) &address)->sin6_port = htons(port);
+        addressLength = sizeof(struct sockaddr_in6);
+    } else {
+        ((struct sockaddr_in *) &address)->sin_port = htons(port);
+    }
+
+    int fd = socket(address.ss_family, SOCK_STREAM, 0);
+    struct timeval receiveTimeout = { 2, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receiveTimeout, sizeof(receiveTimeout));
+    // Without a target it's refused, by the proxy itself
+    const char *request = "GET / HTTP/1.1\r\n\r\n";
+    char reply[128];
+    bool answered = connect(fd, (struct sockaddr *) &address, addressLength) == 0 &&
+        write(fd, request, strlen(request)) == (ssize_t) strlen(request) &&
+        read(fd, reply, sizeof(reply)) > 12 && memcmp(reply, "HTTP/1.1 400", 12) == 0 &&
+        read(fd, reply, sizeof(reply)) == 0;
+    close(fd);
+    return answered;
+}
+
+/* Every address added gets listened on, in every worker, and without any
+ * the proxy takes IPv4 and IPv6 on one dual-stack listener. */
+void testProxyListenAddresses(void)
+{
+    int level = log_get_level();
+    UInt16 port = FreeLoopbackPort();
+    CU_ASSERT_FATAL(port != 0);
+
+    DCProxyRef proxy = DCProxyCreate(port);
+    DCProxySetWorkerCount(proxy, 2);
+    CU_ASSERT(!DCProxyAddListenAddress(proxy, "localhost", 0, NULL));
+    CU_ASSERT(DCProxyAddListenAddress(proxy, "127.0.0.1", 0, NULL));
+    CU_ASSERT(DCProxyAddListenAddress(proxy, "::1", 0, NULL));
+    CU_ASSERT_FATAL(DCProxyRunServer(proxy, false));
+    for (int i = 0; i < 4; i++) {
+        CU_ASSERT(ProxyAnswers("127.0.0.1", port));
+        CU_ASSERT(ProxyAnswers("::1", port));
+    }
+    DCProxyRelease(proxy);
+
+    port = FreeLoopbackPort();
+    proxy = DCProxyCreate(port);
+    DCProxySetWorkerCount(proxy, 1);
+    CU_ASSERT_FATAL(DCProxyRunServer(proxy, false));
+    CU_ASSERT(ProxyAnswers("127.0.0.1", port));
+    CU_ASSERT(ProxyAnswers("::1", port));
+    DCProxyRelease(proxy);
+    log_set_level(level);
 }
 
 /* The main() function for setting up and running the tests.
@@ -109,20 +1587,16 @@ int main()
 {
     CU_pSuite pSuite = NULL;
 
-    // $ echo -en "GET httpbin.org/ip HTTP/1.1\r\nHost: httpbin.org\r\nUser-Agent: cmdline\r\nAccept: */*\r\n\r\n" | nc 127.0.0.1 1080
+    // With DPROXY_TEST_SERVE=<seconds> a proxy is served on 1080 for that long before the tests run
+    // $ echo -en "GET http://127.0.0.1:18080/bytes/10 HTTP/1.1\r\nHost: 127.0.0.1:18080\r\nUser-Agent: cmdline\r\nAccept: */*\r\n\r\n" | nc 127.0.0.1 1080
 
-    CFNotificationCenterAddObserver(CFNotificationCenterGetLocalCenter(),
-                                    NULL,
-                                    NotificationCallback,
-                                    kDCConnectionReceivedHTTPRequest,
-                                    NULL,
-                                    CFNotificationSuspensionBehaviorHold);
-
-    DCProxyRef proxy = DCProxyCreate(1080);
-    DCProxyRunServer(proxy, false);
-
-    CFRunLoopRunInMode(kCFRunLoopDefaultMode, 300, true);
-    printf("HAS HANDLED\n");
+    const char *serve = getenv("DPROXY_TEST_SERVE");
+    if (serve) {
+        DCProxyRef proxy = DCProxyCreate(1080);
+        DCProxyRunServer(proxy, false);
+        sleep((unsigned int) atoi(serve));
+        printf("HAS HANDLED\n");
+    }
 
     /* initialize the CUnit test registry */
     if (CUE_SUCCESS != CU_initialize_registry())
@@ -144,10 +1618,90 @@ int main()
         return CU_get_error();
     }
 
+    pSuite = CU_add_suite("DCResolver", init_resolver_suite, clean_resolver_suite);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "coalescing and cache", testResolverCoalescesAndCaches)) ||
+        (NULL == CU_add_test(pSuite, "negative cache", testResolverNegativeCache)) ||
+        (NULL == CU_add_test(pSuite, "timeout and literals", testResolverTimeoutAndLiterals)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    pSuite = CU_add_suite("DCHTTPParser", NULL, NULL);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "request at any split", testParserRequestAnySplit)) ||
+        (NULL == CU_add_test(pSuite, "response and framing", testParserResponse)) ||
+        (NULL == CU_add_test(pSuite, "errors", testParserErrors)) ||
+        (NULL == CU_add_test(pSuite, "chunked bodies", testChunkDecoder)) ||
+        (NULL == CU_add_test(pSuite, "scan levels agree", testScanLevelsAgree)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    pSuite = CU_add_suite("Allocators", NULL, NULL);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "slab recycles", testSlabRecycles)) ||
+        (NULL == CU_add_test(pSuite, "buffer pool classes", testBufferPoolClasses)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    pSuite = CU_add_suite("DCMessageQueue", NULL, NULL);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "ring", testMessageQueueRing)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    pSuite = CU_add_suite("log", NULL, NULL);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "deferred formatting", testLogDeferredFormatting)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    pSuite = CU_add_suite("DCEventLoop", NULL, NULL);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "listener and echo", testEventLoopListenerEcho)) ||
+        (NULL == CU_add_test(pSuite, "timer wheel order and cascade", testTimerWheelOrderAndCascade)) ||
+        (NULL == CU_add_test(pSuite, "time in handlers", testEventLoopTimeInHandlers)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    pSuite = CU_add_suite("DCWorker", NULL, NULL);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "releases closed channels", testWorkerReleasesClosedChannels)) ||
+        (NULL == CU_add_test(pSuite, "times out connections", testWorkerTimesOutConnections)) ||
+        (NULL == CU_add_test(pSuite, "tunnels CONNECT", testWorkerTunnelsConnect)) ||
+        (NULL == CU_add_test(pSuite, "early response isn't reused", testWorkerEarlyResponseNotReused)) ||
+        (NULL == CU_add_test(pSuite, "answers errors", testWorkerAnswersErrors)) ||
+        (NULL == CU_add_test(pSuite, "admission limits", testWorkerAdmissionLimits)) ||
+        (NULL == CU_add_test(pSuite, "races upstream addresses", testWorkerRacesUpstreamAddresses)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
+    pSuite = CU_add_suite("DCProxy", NULL, NULL);
+    if ((NULL == pSuite) ||
+        (NULL == CU_add_test(pSuite, "listen addresses", testProxyListenAddresses)))
+    {
+        CU_cleanup_registry();
+        return CU_get_error();
+    }
+
     /* Run all tests using the CUnit Basic interface */
     CU_basic_set_mode(CU_BRM_VERBOSE);
     CU_basic_run_tests();
+    unsigned int failures = CU_get_number_of_failures();
     CU_cleanup_registry();
-    return CU_get_error();
+    return failures > 0 ? 1 : CU_get_error();
 }
 
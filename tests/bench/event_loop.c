@@ -0,0 +1,186 @@
+/*
+ * Ping-pong over socket pairs through each event loop backend, epoll
+ * reading and writing on readiness, io_uring with its receives and sends.
+ *
+ *   $ cc -O2 -I../../dproxyCore event_loop.c ../../dproxyCore/DCEventLoop*.c \
+ *       ../../dproxyCore/DCSlab.c ../../dproxyCore/log.c -lpthread -o event_loop
+ *   $ ./event_loop [pairs] [round trips] [message size]
+ */
+
+#include "DCEventLoop.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kMaxMessageSize 16384
+
+typedef struct Bench Bench;
+
+// One end of a pair, the client end counts round trips
+typedef struct End {
+    Bench *bench;
+    int fd;
+    bool client;
+    size_t received;
+} End;
+
+struct Bench {
+    DCEventLoopRef loop;
+    bool completions;
+    size_t messageSize;
+    unsigned long roundTrips;
+    unsigned long target;
+    char message[kMaxMessageSize];
+};
+
+static double __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void __sent(DCEventLoopRef loop, size_t written, int error, void *info) {
+    if (error) {
+        fprintf(stderr, "send failed: %s\n", strerror(error));
+        exit(1);
+    }
+}
+
+static void __send(End *end) {
+    Bench *bench = end->bench;
+    if (bench->completions) {
+        struct iovec vector = { bench->message, bench->messageSize };
+        if (!DCEventLoopSend(bench->loop, end->fd, &vector, 1, __sent, end)) {
+            fprintf(stderr, "couldn't submit a send\n");
+            exit(1);
+        }
+    } else if (write(end->fd, bench->message, bench->messageSize) != (ssize_t) bench->messageSize) {
+        fprintf(stderr, "short write: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+// A whole message is in, answer it or count the round trip
+static void __messageReceived(End *end) {
+    Bench *bench = end->bench;
+    end->received -= bench->messageSize;
+    if (end->client && ++bench->roundTrips == bench->target) {
+        DCEventLoopStop(bench->loop);
+        return;
+    }
+    __send(end);
+}
+
+static void __received(DCEventLoopRef loop, int fd, const void *bytes, ssize_t result, void *info) {
+    End *end = (End *) info;
+    if (result <= 0) {
+        fprintf(stderr, "receive failed: %s\n", result ? strerror((int) -result) : "EOF");
+        exit(1);
+    }
+    end->received += result;
+    if (end->received >= end->bench->messageSize)
+        __messageReceived(end);
+    DCEventLoopReceive(loop, fd, kMaxMessageSize, __received);
+}
+
+static void __readable(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    End *end = (End *) info;
+    char buffer[kMaxMessageSize];
+    ssize_t bytes;
+    while ((bytes = read(fd, buffer, sizeof(buffer))) > 0) {
+        end->received += bytes;
+        if (end->received >= end->bench->messageSize)
+            __messageReceived(end);
+    }
+}
+
+// Round trips per second
+static double __bench(DCEventLoopBackend backend, unsigned int nbrPairs, unsigned long roundTrips, size_t messageSize) {
+    Bench *bench = (Bench *) calloc(1, sizeof(Bench));
+    bench->loop = DCEventLoopCreate(backend);
+    if (!bench->loop || DCEventLoopGetBackend(bench->loop) != backend) {
+        if (bench->loop)
+            DCEventLoopRelease(bench->loop);
+        free(bench);
+        return 0;
+    }
+    bench->completions = DCEventLoopHasCompletions(bench->loop);
+    bench->messageSize = messageSize;
+    bench->target = roundTrips;
+    memset(bench->message, 'x', messageSize);
+
+    End *ends = (End *) calloc(nbrPairs * 2, sizeof(End));
+    for (unsigned int i = 0; i < nbrPairs; i++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            perror("socketpair");
+            exit(1);
+        }
+        for (int j = 0; j < 2; j++) {
+            End *end = &ends[i * 2 + j];
+            end->bench = bench;
+            end->fd = fds[j];
+            end->client = j == 0;
+            fcntl(end->fd, F_SETFL, fcntl(end->fd, F_GETFL) | O_NONBLOCK);
+            if (bench->completions) {
+                DCEventLoopAddFDWithEvents(bench->loop, end->fd, kDCEventLoopEventNone, __readable, end);
+                DCEventLoopReceive(bench->loop, end->fd, kMaxMessageSize, __received);
+            } else {
+                DCEventLoopAddFDWithEvents(bench->loop, end->fd, kDCEventLoopEventRead, __readable, end);
+            }
+        }
+    }
+
+    double start = __now();
+    for (unsigned int i = 0; i < nbrPairs; i++)
+        __send(&ends[i * 2]);
+    DCEventLoopRun(bench->loop);
+    double elapsed = __now() - start;
+
+    for (unsigned int i = 0; i < nbrPairs * 2; i++) {
+        DCEventLoopRemoveFD(bench->loop, ends[i].fd);
+        close(ends[i].fd);
+    }
+    DCEventLoopRelease(bench->loop);
+    free(ends);
+    free(bench);
+    return roundTrips / elapsed;
+}
+
+int main(int argc, const char * argv[]) {
+    unsigned int nbrPairs = argc > 1 ? (unsigned int) strtoul(argv[1], NULL, 10) : 64;
+    unsigned long roundTrips = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    size_t messageSize = argc > 3 ? strtoul(argv[3], NULL, 10) : 512;
+    if (messageSize == 0 || messageSize > kMaxMessageSize) {
+        fprintf(stderr, "message size must be 1-%d bytes\n", kMaxMessageSize);
+        return 1;
+    }
+    log_set_level(LOG_WARN);
+
+    printf("%u pairs, %lu round trips of %zu bytes\n", nbrPairs, roundTrips, messageSize);
+#if defined(__linux__)
+    DCEventLoopBackend backends[] = { kDCEventLoopBackendEpoll, kDCEventLoopBackendIOUring };
+#else
+    DCEventLoopBackend backends[] = { kDCEventLoopBackendKqueue };
+#endif
+    double baseline = 0;
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        double rate = __bench(backends[i], nbrPairs, roundTrips, messageSize);
+        if (rate == 0) {
+            printf("  %-28s unsupported\n", DCEventLoopBackendString(backends[i]));
+            continue;
+        }
+        if (baseline == 0)
+            baseline = rate;
+        printf("  %-28s %10.0f round trips/s %6.2fx\n", DCEventLoopBackendString(backends[i]), rate, rate / baseline);
+    }
+
+    return 0;
+}
@@ -0,0 +1,580 @@
+/*
+ * Open-loop load generator. Requests go out on a fixed schedule whether or
+ * not earlier ones were answered, and latency is counted from when a
+ * request was due rather than when it was sent, so a stalled proxy shows
+ * up in the tail instead of just slowing the test down.
+ *
+ *   $ cc -O2 -I../../dproxyCore loadgen.c ../../dproxyCore/DCEventLoop*.c \
+ *       ../../dproxyCore/DCSlab.c ../../dproxyCore/DCHTTPParser.c \
+ *       ../../dproxyCore/DCHTTPScan.c ../../dproxyCore/log.c -lpthread -o loadgen
+ *   $ ./loadgen -x 127.0.0.1:1080 -u http://127.0.0.1:18080/bytes/512 \
+ *       -t 2 -c 64 -R 20000 -d 10 [-p depth] [-C] [-n name]
+ *
+ * -x is the proxy, without it requests go straight to the origin. -p sends
+ * up to that many requests on a connection before the first is answered.
+ * -C closes the connection after every response.
+ */
+
+#include "DCEventLoop.h"
+#include "DCHTTPParser.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kMaxThreads 64
+#define kMaxDepth 64
+#define kInputSize 65536
+#define kRequestSize 512
+#define kTickMs 1
+
+// MARK: - Histogram
+
+/*
+ * Log-linear buckets like HdrHistogram: values below 2048 are exact, above
+ * that each power of two is split in 1024, so every recorded value is kept
+ * to within 0.1%. Microseconds up to about 2^40 fit in 32K counters.
+ */
+#define kHistogramSubBits 10
+#define kHistogramSubCount (1 << kHistogramSubBits)
+#define kHistogramCounts (40 * kHistogramSubCount)
+
+typedef struct Histogram {
+    uint64_t counts[kHistogramCounts];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+static unsigned int __histogramIndex(uint64_t value) {
+    if (value < 2 * kHistogramSubCount)
+        return (unsigned int) value;
+    unsigned int msb = 63 - __builtin_clzll(value);
+    unsigned int shift = msb - kHistogramSubBits;
+    unsigned int index = (shift + 1) * kHistogramSubCount + (unsigned int) (value >> shift) - kHistogramSubCount;
+    return index < kHistogramCounts ? index : kHistogramCounts - 1;
+}
+
+// The highest value that lands in `index`
+static uint64_t __histogramValue(unsigned int index) {
+    if (index < 2 * kHistogramSubCount)
+        return index;
+    unsigned int shift = index / kHistogramSubCount - 1;
+    uint64_t sub = index % kHistogramSubCount + kHistogramSubCount;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void __histogramRecord(Histogram *histogram, uint64_t value) {
+    histogram->counts[__histogramIndex(value)]++;
+    if (histogram->total == 0 || value < histogram->min)
+        histogram->min = value;
+    if (value > histogram->max)
+        histogram->max = value;
+    histogram->total++;
+    histogram->sum += value;
+}
+
+static void __histogramMerge(Histogram *into, const Histogram *from) {
+    if (from->total == 0)
+        return;
+    for (unsigned int i = 0; i < kHistogramCounts; i++)
+        into->counts[i] += from->counts[i];
+    if (into->total == 0 || from->min < into->min)
+        into->min = from->min;
+    if (from->max > into->max)
+        into->max = from->max;
+    into->total += from->total;
+    into->sum += from->sum;
+}
+
+static uint64_t __histogramPercentile(const Histogram *histogram, double percentile) {
+    if (histogram->total == 0)
+        return 0;
+    uint64_t rank = (uint64_t) (percentile / 100.0 * histogram->total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < kHistogramCounts; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = __histogramValue(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// MARK: - Configuration
+
+typedef struct Config {
+    struct sockaddr_in address; // The proxy, or the origin when going direct
+    bool proxied;
+    char host[256];
+    char request[kRequestSize];
+    size_t requestLength;
+    unsigned int nbrThreads;
+    unsigned int nbrConnections;
+    double rate;
+    double duration;
+    unsigned int depth;
+    bool churn;
+    const char *name;
+} Config;
+
+static Config config;
+
+static uint64_t __nowUs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + (uint64_t) ts.tv_nsec / 1000;
+}
+
+// MARK: - Connections
+
+typedef struct Worker Worker;
+
+typedef struct Connection {
+    Worker *worker;
+    int fd;
+    bool connected;
+
+    uint64_t interval;   // Between this connection's requests, in microseconds
+    uint64_t nextDue;
+    uint64_t due[kMaxDepth]; // When each request in flight was due, oldest first
+    unsigned int dueHead;
+    unsigned int inFlight;
+
+    char input[kInputSize];
+    size_t inputLength;
+    DCHTTPParser parser;
+    bool inBody;
+    bool chunked;
+    bool untilClose;
+    long long bodyLeft;
+    DCHTTPChunkDecoder chunks;
+} Connection;
+
+struct Worker {
+    pthread_t thread;
+    DCEventLoopRef loop;
+    Connection *connections;
+    unsigned int nbrConnections;
+    uint64_t start;
+    uint64_t end;
+
+    Histogram histogram;
+    uint64_t completed;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t connects;
+    uint64_t late; // Still in flight when time ran out
+};
+
+static void __connectionEvent(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info);
+
+static void __connectionClose(Connection *connection) {
+    if (connection->fd == -1)
+        return;
+    DCEventLoopRemoveFD(connection->worker->loop, connection->fd);
+    close(connection->fd);
+    connection->fd = -1;
+    connection->connected = false;
+    connection->inputLength = 0;
+    connection->inBody = false;
+    DCHTTPParserInit(&connection->parser, kDCHTTPParserTypeResponse);
+}
+
+// What was in flight on a broken connection counts as failed
+static void __connectionFailed(Connection *connection) {
+    connection->worker->errors += connection->inFlight;
+    connection->inFlight = 0;
+    __connectionClose(connection);
+}
+
+static bool __connectionOpen(Connection *connection) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return false;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    if (connect(fd, (struct sockaddr *) &config.address, sizeof(config.address)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return false;
+    }
+    connection->fd = fd;
+    connection->connected = false;
+    connection->worker->connects++;
+    if (!DCEventLoopAddFD(connection->worker->loop, fd, __connectionEvent, connection)) {
+        close(fd);
+        connection->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+static void __connectionSend(Connection *connection, uint64_t now) {
+    unsigned int depth = config.churn ? 1 : config.depth;
+    while (connection->nextDue <= now && connection->nextDue < connection->worker->end && connection->inFlight < depth) {
+        ssize_t written = send(connection->fd, config.request, config.requestLength, 0);
+        if (written != (ssize_t) config.requestLength) {
+            // Requests are tiny, a full socket buffer means the other end is stuck
+            __connectionFailed(connection);
+            return;
+        }
+        connection->due[(connection->dueHead + connection->inFlight) % kMaxDepth] = connection->nextDue;
+        connection->inFlight++;
+        connection->nextDue += connection->interval;
+    }
+}
+
+static void __responseCompleted(Connection *connection) {
+    Worker *worker = connection->worker;
+    uint64_t due = connection->due[connection->dueHead];
+    connection->dueHead = (connection->dueHead + 1) % kMaxDepth;
+    connection->inFlight--;
+    uint64_t now = __nowUs();
+    __histogramRecord(&worker->histogram, now > due ? now - due : 0);
+    worker->completed++;
+    connection->inBody = false;
+    DCHTTPParserInit(&connection->parser, kDCHTTPParserTypeResponse);
+}
+
+// Goes through what was read, false when the connection is done with
+static bool __connectionConsume(Connection *connection) {
+    size_t offset = 0;
+    while (offset < connection->inputLength) {
+        const char *bytes = connection->input + offset;
+        size_t length = connection->inputLength - offset;
+
+        if (!connection->inBody) {
+            if (connection->inFlight == 0)
+                return false;
+            DCHTTPParserResult result = DCHTTPParserExecute(&connection->parser, bytes, length);
+            if (result == kDCHTTPParserResultIncomplete)
+                break;
+            if (result == kDCHTTPParserResultError)
+                return false;
+
+            offset += connection->parser.idx;
+            connection->inBody = true;
+            connection->chunked = connection->parser.chunked;
+            connection->untilClose = !connection->chunked && connection->parser.contentLength < 0 &&
+                connection->parser.status != 204 && connection->parser.status != 304;
+            connection->bodyLeft = connection->parser.contentLength > 0 ? connection->parser.contentLength : 0;
+            if (connection->chunked)
+                DCHTTPChunkDecoderInit(&connection->chunks);
+            if (!connection->chunked && !connection->untilClose && connection->bodyLeft == 0) {
+                bool keepAlive = DCHTTPParserIsKeepAlive(&connection->parser);
+                __responseCompleted(connection);
+                if (!keepAlive)
+                    return false;
+            }
+            continue;
+        }
+
+        if (connection->untilClose) {
+            offset = connection->inputLength;
+        } else if (connection->chunked) {
+            size_t consumed = 0;
+            DCHTTPParserResult result = DCHTTPChunkDecoderExecute(&connection->chunks, bytes, length, &consumed);
+            if (result == kDCHTTPParserResultError)
+                return false;
+            offset += consumed;
+            if (result == kDCHTTPParserResultComplete) {
+                bool keepAlive = DCHTTPParserIsKeepAlive(&connection->parser);
+                __responseCompleted(connection);
+                if (!keepAlive)
+                    return false;
+            }
+        } else {
+            size_t take = (long long) length < connection->bodyLeft ? length : (size_t) connection->bodyLeft;
+            offset += take;
+            connection->bodyLeft -= take;
+            if (connection->bodyLeft == 0) {
+                bool keepAlive = DCHTTPParserIsKeepAlive(&connection->parser);
+                __responseCompleted(connection);
+                if (!keepAlive)
+                    return false;
+            }
+        }
+    }
+
+    // Only an unfinished header is kept, the parser needs it from its start
+    memmove(connection->input, connection->input + offset, connection->inputLength - offset);
+    connection->inputLength -= offset;
+    return true;
+}
+
+static void __connectionEvent(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    Connection *connection = (Connection *) info;
+
+    if ((events & kDCEventLoopEventWrite) && !connection->connected) {
+        int error = 0;
+        socklen_t errorLength = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength);
+        if (error != 0) {
+            connection->worker->errors++;
+            __connectionClose(connection);
+            return;
+        }
+        connection->connected = true;
+        __connectionSend(connection, __nowUs());
+        if (connection->fd == -1)
+            return;
+    }
+
+    if (!(events & (kDCEventLoopEventRead | kDCEventLoopEventHangUp | kDCEventLoopEventError)))
+        return;
+
+    for (;;) {
+        ssize_t bytes = read(fd, connection->input + connection->inputLength, kInputSize - connection->inputLength);
+        if (bytes > 0) {
+            connection->worker->bytes += bytes;
+            connection->inputLength += bytes;
+            if (!__connectionConsume(connection)) {
+                if (connection->inFlight > 0)
+                    __connectionFailed(connection);
+                else
+                    __connectionClose(connection);
+                return;
+            }
+            if (connection->inputLength == kInputSize) {
+                __connectionFailed(connection);
+                return;
+            }
+        } else if (bytes == 0) {
+            // A body that runs until the connection closes is done now
+            if (connection->inBody && connection->untilClose)
+                __responseCompleted(connection);
+            if (connection->inFlight > 0)
+                __connectionFailed(connection);
+            else
+                __connectionClose(connection);
+            return;
+        } else if (errno == EINTR) {
+            continue;
+        } else {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                __connectionFailed(connection);
+            break;
+        }
+    }
+
+    // Room in the pipeline again
+    if (connection->fd != -1 && connection->connected)
+        __connectionSend(connection, __nowUs());
+}
+
+// MARK: - Workers
+
+static void __tick(DCEventLoopRef loop, void *info) {
+    Worker *worker = (Worker *) info;
+    uint64_t now = __nowUs();
+
+    if (now >= worker->end) {
+        // Give stragglers a moment, whatever is left after that is late
+        bool idle = true;
+        for (unsigned int i = 0; i < worker->nbrConnections; i++)
+            idle = idle && worker->connections[i].inFlight == 0;
+        if (idle || now >= worker->end + 2000000)
+            DCEventLoopStop(loop);
+        return;
+    }
+
+    for (unsigned int i = 0; i < worker->nbrConnections; i++) {
+        Connection *connection = &worker->connections[i];
+        if (connection->nextDue > now)
+            continue;
+        if (connection->fd == -1) {
+            if (!__connectionOpen(connection)) {
+                // Counted once per missed request, like any other failure
+                worker->errors++;
+                connection->nextDue += connection->interval;
+            }
+            continue;
+        }
+        if (connection->connected)
+            __connectionSend(connection, now);
+    }
+}
+
+static void* __worker(void *info) {
+    Worker *worker = (Worker *) info;
+    worker->loop = DCEventLoopCreate(kDCEventLoopBackendDefault);
+    DCEventLoopAddTimer(worker->loop, kTickMs, __tick, worker);
+    DCEventLoopRun(worker->loop);
+
+    for (unsigned int i = 0; i < worker->nbrConnections; i++) {
+        worker->late += worker->connections[i].inFlight;
+        __connectionClose(&worker->connections[i]);
+    }
+    DCEventLoopRelease(worker->loop);
+    return NULL;
+}
+
+// MARK: - Main
+
+static bool __parseURL(const char *url) {
+    unsigned int port = 80;
+    char host[256];
+    const char *rest = strncmp(url, "http://", 7) == 0 ? url + 7 : url;
+    const char *path = strchr(rest, '/');
+    size_t authorityLength = path ? (size_t) (path - rest) : strlen(rest);
+    if (authorityLength == 0 || authorityLength >= sizeof(host))
+        return false;
+    memcpy(host, rest, authorityLength);
+    host[authorityLength] = '\0';
+    snprintf(config.host, sizeof(config.host), "%s", host);
+
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        port = (unsigned int) atoi(colon + 1);
+    }
+    if (!config.proxied) {
+        config.address.sin_family = AF_INET;
+        config.address.sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &config.address.sin_addr) != 1)
+            return false;
+    }
+
+    const char *target = config.proxied ? url : (path ? path : "/");
+    config.requestLength = snprintf(config.request, sizeof(config.request),
+                                    "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n",
+                                    target, config.host, config.churn ? "Connection: close\r\n" : "");
+    return config.requestLength < sizeof(config.request);
+}
+
+static bool __parseProxy(const char *proxy) {
+    char host[64];
+    const char *colon = strrchr(proxy, ':');
+    if (!colon || (size_t) (colon - proxy) >= sizeof(host))
+        return false;
+    memcpy(host, proxy, colon - proxy);
+    host[colon - proxy] = '\0';
+    config.address.sin_family = AF_INET;
+    config.address.sin_port = htons((unsigned short) atoi(colon + 1));
+    config.proxied = true;
+    return inet_pton(AF_INET, host, &config.address.sin_addr) == 1;
+}
+
+static void __usage(const char *name) {
+    fprintf(stderr, "usage: %s -u url [-x proxy host:port] [-t threads] [-c connections] [-R requests/s]\n"
+                    "          [-d seconds] [-p pipeline depth] [-C] [-n scenario name]\n", name);
+    exit(2);
+}
+
+int main(int argc, char * argv[]) {
+    const char *url = NULL;
+    const char *proxy = NULL;
+    config.nbrThreads = 2;
+    config.nbrConnections = 64;
+    config.rate = 1000;
+    config.duration = 10;
+    config.depth = 1;
+    config.name = "load";
+
+    int option;
+    while ((option = getopt(argc, argv, "u:x:t:c:R:d:p:Cn:")) != -1) {
+        switch (option) {
+            case 'u': url = optarg; break;
+            case 'x': proxy = optarg; break;
+            case 't': config.nbrThreads = (unsigned int) atoi(optarg); break;
+            case 'c': config.nbrConnections = (unsigned int) atoi(optarg); break;
+            case 'R': config.rate = atof(optarg); break;
+            case 'd': config.duration = atof(optarg); break;
+            case 'p': config.depth = (unsigned int) atoi(optarg); break;
+            case 'C': config.churn = true; break;
+            case 'n': config.name = optarg; break;
+            default: __usage(argv[0]);
+        }
+    }
+    if (!url || (proxy && !__parseProxy(proxy)) || !__parseURL(url))
+        __usage(argv[0]);
+    if (config.nbrThreads == 0 || config.nbrThreads > kMaxThreads)
+        config.nbrThreads = 1;
+    if (config.nbrConnections < config.nbrThreads)
+        config.nbrConnections = config.nbrThreads;
+    if (config.depth == 0 || config.depth > kMaxDepth)
+        config.depth = 1;
+    if (config.rate <= 0 || config.duration <= 0)
+        __usage(argv[0]);
+
+    log_set_level(LOG_WARN);
+    signal(SIGPIPE, SIG_IGN);
+
+    // Every connection runs at the same rate, their schedules spread evenly
+    uint64_t interval = (uint64_t) (1e6 * config.nbrConnections / config.rate);
+    if (interval == 0)
+        interval = 1;
+    uint64_t start = __nowUs() + 10000;
+    uint64_t end = start + (uint64_t) (config.duration * 1e6);
+
+    Worker *workers = (Worker *) calloc(config.nbrThreads, sizeof(Worker));
+    Connection *connections = (Connection *) calloc(config.nbrConnections, sizeof(Connection));
+    for (unsigned int i = 0; i < config.nbrConnections; i++)
+        workers[i % config.nbrThreads].nbrConnections++;
+    // Connections of a worker are contiguous, hand them out in order
+    unsigned int next = 0;
+    for (unsigned int w = 0; w < config.nbrThreads; w++) {
+        Worker *worker = &workers[w];
+        worker->connections = &connections[next];
+        worker->start = start;
+        worker->end = end;
+        for (unsigned int i = 0; i < worker->nbrConnections; i++) {
+            Connection *connection = &connections[next + i];
+            connection->worker = worker;
+            connection->fd = -1;
+            connection->interval = interval;
+            connection->nextDue = start + interval * (next + i) / config.nbrConnections;
+            DCHTTPParserInit(&connection->parser, kDCHTTPParserTypeResponse);
+        }
+        next += worker->nbrConnections;
+    }
+
+    for (unsigned int w = 0; w < config.nbrThreads; w++)
+        pthread_create(&workers[w].thread, NULL, __worker, &workers[w]);
+
+    Histogram *histogram = (Histogram *) calloc(1, sizeof(Histogram));
+    uint64_t completed = 0, bytes = 0, errors = 0, connects = 0, late = 0;
+    for (unsigned int w = 0; w < config.nbrThreads; w++) {
+        pthread_join(workers[w].thread, NULL);
+        __histogramMerge(histogram, &workers[w].histogram);
+        completed += workers[w].completed;
+        bytes += workers[w].bytes;
+        errors += workers[w].errors;
+        connects += workers[w].connects;
+        late += workers[w].late;
+    }
+
+    printf("%s: %u connections, %u threads, depth %u%s, %.0f req/s for %.0f s through %s\n",
+           config.name, config.nbrConnections, config.nbrThreads, config.churn ? 1 : config.depth,
+           config.churn ? ", new connection per request" : "", config.rate, config.duration,
+           config.proxied ? proxy : "nothing (direct)");
+    printf("  requests %10llu %10.1f/s %8.2f MB/s   errors %llu   late %llu   connects %llu\n",
+           (unsigned long long) completed, completed / config.duration, bytes / config.duration / 1e6,
+           (unsigned long long) errors, (unsigned long long) late, (unsigned long long) connects);
+    printf("  latency  p50 %8.3f ms   p99 %8.3f ms   p99.9 %8.3f ms   max %8.3f ms   mean %8.3f ms\n",
+           __histogramPercentile(histogram, 50) / 1e3, __histogramPercentile(histogram, 99) / 1e3,
+           __histogramPercentile(histogram, 99.9) / 1e3, histogram->max / 1e3,
+           histogram->total ? histogram->sum / histogram->total / 1e3 : 0);
+
+    free(histogram);
+    free(connections);
+    free(workers);
+    return errors > 0 || late > 0 ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * Cost of a log call on the calling thread, with several threads logging at
+ * once, for a message that's written and one below the runtime level.
+ *
+ *   $ cc -O2 -I../../dproxyCore log.c ../../dproxyCore/log.c -lpthread -o log
+ *   $ ./log [threads] [messages per thread] 2> /dev/null
+ */
+
+#include "log.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static unsigned long __messages;
+static pthread_barrier_t __barrier;
+
+static double __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Spaced out so the writer keeps up and nothing is dropped
+static void* __logging(void *info) {
+    double *elapsed = (double *) info;
+    pthread_barrier_wait(&__barrier);
+    double busy = 0;
+    for (unsigned long i = 0; i < __messages; i += 64) {
+        double start = __now();
+        for (unsigned long j = i; j < i + 64 && j < __messages; j++)
+            log_info("connection=%p (%s) read %lu bytes\n", (void *) info, "CLIENT", j);
+        busy += __now() - start;
+        struct timespec nap = { 0, 200000 };
+        nanosleep(&nap, NULL);
+    }
+    *elapsed = busy;
+    return NULL;
+}
+
+static void* __filtered(void *info) {
+    double *elapsed = (double *) info;
+    pthread_barrier_wait(&__barrier);
+    double start = __now();
+    for (unsigned long i = 0; i < __messages; i++)
+        log_trace("connection=%p (%s) read %lu bytes\n", (void *) info, "CLIENT", i);
+    *elapsed = __now() - start;
+    return NULL;
+}
+
+static double __run(void *(*body)(void *), unsigned int nbrThreads) {
+    pthread_t threads[64];
+    double elapsed[64];
+    pthread_barrier_init(&__barrier, NULL, nbrThreads);
+    for (unsigned int i = 0; i < nbrThreads; i++)
+        pthread_create(&threads[i], NULL, body, &elapsed[i]);
+    double total = 0;
+    for (unsigned int i = 0; i < nbrThreads; i++) {
+        pthread_join(threads[i], NULL);
+        total += elapsed[i];
+    }
+    pthread_barrier_destroy(&__barrier);
+    log_flush();
+    return total / nbrThreads / __messages * 1e9;
+}
+
+int main(int argc, const char * argv[]) {
+    unsigned int nbrThreads = argc > 1 ? (unsigned int) strtoul(argv[1], NULL, 10) : 4;
+    __messages = argc > 2 ? strtoul(argv[2], NULL, 10) : 200000;
+    if (nbrThreads == 0 || nbrThreads > 64)
+        nbrThreads = 4;
+
+    log_set_level(LOG_INFO);
+    double written = __run(__logging, nbrThreads);
+    double filtered = __run(__filtered, nbrThreads);
+
+    printf("%u threads, %lu messages each\n", nbrThreads, __messages);
+    printf("  %-28s %8.1f ns/call\n", "written", written);
+    printf("  %-28s %8.1f ns/call\n", "below the level", filtered);
+    return 0;
+}
@@ -0,0 +1,325 @@
+/*
+ * Origin stub for the load tests, so nothing has to leave the machine.
+ * Keep-alive and pipelining by default, the path picks the response:
+ *
+ *   /bytes/<n>     <n> bytes with a Content-Length
+ *   /chunked/<n>   <n> bytes in chunks of up to 16 KB
+ *   /close/<n>     <n> bytes ended by closing the connection
+ *
+ *   $ cc -O2 -I../../dproxyCore origin.c ../../dproxyCore/DCEventLoop*.c \
+ *       ../../dproxyCore/DCSlab.c ../../dproxyCore/DCHTTPParser.c \
+ *       ../../dproxyCore/DCHTTPScan.c ../../dproxyCore/log.c -lpthread -o origin
+ *   $ ./origin [port] [threads]
+ */
+
+#include "DCEventLoop.h"
+#include "DCHTTPParser.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define kInputSize 16384
+#define kChunkSize 16384
+#define kBodyBlockSize 65536
+
+static char __body[kBodyBlockSize];
+
+typedef enum Body {
+    kBodyLength = 0,
+    kBodyChunked,
+    kBodyUntilClose
+} Body;
+
+typedef struct Client {
+    int fd;
+    DCHTTPParser parser;
+    char input[kInputSize];
+    size_t inputLength;
+    unsigned long long discard; // Request body bytes still to skip
+
+    // The response being written: `head`, then `rawLeft` body bytes. For
+    // chunked bodies `head` is then the next chunk's framing, and so on.
+    bool responding;
+    Body body;
+    char head[256];
+    size_t headLength;
+    size_t headIdx;
+    unsigned long long rawLeft;
+    unsigned long long chunkedLeft;
+    bool chunksSent;
+    bool lastChunkSent;
+    bool closeAfter;
+} Client;
+
+static void __clientClose(DCEventLoopRef loop, Client *client) {
+    DCEventLoopRemoveFD(loop, client->fd);
+    close(client->fd);
+    free(client);
+}
+
+static void __startResponse(Client *client, const char *target, size_t targetLength, bool keepAlive) {
+    char path[128];
+    if (targetLength >= sizeof(path))
+        targetLength = sizeof(path) - 1;
+    memcpy(path, target, targetLength);
+    path[targetLength] = '\0';
+
+    // Through a proxy it's the absolute form
+    const char *start = strstr(path, "://");
+    start = start ? strchr(start + 3, '/') : path;
+    if (!start)
+        start = "/";
+
+    unsigned long long size = 0;
+    Body body = kBodyLength;
+    bool found = true;
+    if (sscanf(start, "/bytes/%llu", &size) == 1)
+        body = kBodyLength;
+    else if (sscanf(start, "/chunked/%llu", &size) == 1)
+        body = kBodyChunked;
+    else if (sscanf(start, "/close/%llu", &size) == 1)
+        body = kBodyUntilClose;
+    else
+        found = false;
+
+    client->responding = true;
+    client->headIdx = 0;
+    client->chunksSent = false;
+    client->lastChunkSent = false;
+    client->closeAfter = !keepAlive || body == kBodyUntilClose;
+    if (!found) {
+        client->body = kBodyLength;
+        client->rawLeft = 0;
+        client->headLength = snprintf(client->head, sizeof(client->head),
+                                      "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n%s\r\n",
+                                      client->closeAfter ? "Connection: close\r\n" : "");
+        return;
+    }
+
+    client->body = body;
+    if (body == kBodyChunked) {
+        client->rawLeft = 0;
+        client->chunkedLeft = size;
+        client->headLength = snprintf(client->head, sizeof(client->head),
+                                      "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n%s\r\n",
+                                      client->closeAfter ? "Connection: close\r\n" : "");
+    } else if (body == kBodyUntilClose) {
+        client->rawLeft = size;
+        client->headLength = snprintf(client->head, sizeof(client->head),
+                                      "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n");
+    } else {
+        client->rawLeft = size;
+        client->headLength = snprintf(client->head, sizeof(client->head),
+                                      "HTTP/1.1 200 OK\r\nContent-Length: %llu\r\n%s\r\n",
+                                      size, client->closeAfter ? "Connection: close\r\n" : "");
+    }
+}
+
+// Framing of the next chunk once the previous one is out, the CRLF that
+// ends the previous one included. False when the body is done.
+static bool __nextChunk(Client *client) {
+    if (client->body != kBodyChunked || client->lastChunkSent)
+        return false;
+
+    const char *separator = client->chunksSent ? "\r\n" : "";
+    size_t length = client->chunkedLeft < kChunkSize ? (size_t) client->chunkedLeft : kChunkSize;
+    if (length == 0) {
+        client->headLength = snprintf(client->head, sizeof(client->head), "%s0\r\n\r\n", separator);
+        client->lastChunkSent = true;
+    } else {
+        client->headLength = snprintf(client->head, sizeof(client->head), "%s%zx\r\n", separator, length);
+        client->rawLeft = length;
+        client->chunkedLeft -= length;
+        client->chunksSent = true;
+    }
+    client->headIdx = 0;
+    return true;
+}
+
+// Writes until the socket is full, returns false when the client is gone
+static bool __write(Client *client) {
+    while (client->responding) {
+        struct iovec vector[2];
+        int count = 0;
+        size_t head = client->headLength - client->headIdx;
+        if (head > 0) {
+            vector[count].iov_base = client->head + client->headIdx;
+            vector[count].iov_len = head;
+            count++;
+        }
+        if (client->rawLeft > 0) {
+            vector[count].iov_base = __body;
+            vector[count].iov_len = client->rawLeft < kBodyBlockSize ? (size_t) client->rawLeft : kBodyBlockSize;
+            count++;
+        }
+
+        if (count == 0) {
+            if (__nextChunk(client))
+                continue;
+            client->responding = false;
+            return !client->closeAfter;
+        }
+
+        ssize_t written = writev(client->fd, vector, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        if ((size_t) written < head) {
+            client->headIdx += written;
+            continue;
+        }
+        client->headIdx = client->headLength;
+        client->rawLeft -= written - head;
+    }
+    return true;
+}
+
+// Parses requests in order, one response at a time. False when it's closed.
+static bool __serve(Client *client) {
+    while (!client->responding) {
+        if (client->discard > 0) {
+            size_t skip = client->inputLength < client->discard ? client->inputLength : (size_t) client->discard;
+            memmove(client->input, client->input + skip, client->inputLength - skip);
+            client->inputLength -= skip;
+            client->discard -= skip;
+            if (client->discard > 0)
+                return true;
+        }
+        if (client->inputLength == 0)
+            return true;
+
+        DCHTTPParserResult result = DCHTTPParserExecute(&client->parser, client->input, client->inputLength);
+        if (result == kDCHTTPParserResultIncomplete)
+            return client->inputLength < kInputSize;
+        if (result == kDCHTTPParserResultError)
+            return false;
+
+        __startResponse(client, client->input + client->parser.target.offset, client->parser.target.length,
+                        DCHTTPParserIsKeepAlive(&client->parser));
+        size_t headerLength = client->parser.idx;
+        client->discard = client->parser.contentLength > 0 ? (unsigned long long) client->parser.contentLength : 0;
+        memmove(client->input, client->input + headerLength, client->inputLength - headerLength);
+        client->inputLength -= headerLength;
+        DCHTTPParserInit(&client->parser, kDCHTTPParserTypeRequest);
+
+        if (!__write(client))
+            return false;
+    }
+    return true;
+}
+
+static void __clientEvent(DCEventLoopRef loop, int fd, DCEventLoopEvents events, void *info) {
+    Client *client = (Client *) info;
+
+    if ((events & kDCEventLoopEventWrite) && client->responding) {
+        if (!__write(client)) {
+            __clientClose(loop, client);
+            return;
+        }
+    }
+
+    for (;;) {
+        if (!__serve(client)) {
+            __clientClose(loop, client);
+            return;
+        }
+        // Nothing more is read while a response waits for room
+        if (client->responding || client->inputLength == kInputSize)
+            return;
+
+        ssize_t bytes = read(fd, client->input + client->inputLength, kInputSize - client->inputLength);
+        if (bytes > 0) {
+            client->inputLength += bytes;
+        } else if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                __clientClose(loop, client);
+            return;
+        }
+    }
+}
+
+static void __accepted(DCEventLoopRef loop, int listenFD, int fd, void *info) {
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    Client *client = (Client *) calloc(1, sizeof(Client));
+    client->fd = fd;
+    DCHTTPParserInit(&client->parser, kDCHTTPParserTypeRequest);
+    if (!DCEventLoopAddFD(loop, fd, __clientEvent, client)) {
+        close(fd);
+        free(client);
+    }
+}
+
+static int __listen(unsigned int port) {
+    int on = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#if defined(SO_REUSEPORT)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void* __worker(void *info) {
+    unsigned int port = (unsigned int) (uintptr_t) info;
+    DCEventLoopRef loop = DCEventLoopCreate(kDCEventLoopBackendDefault);
+    int fd = __listen(port);
+    if (!loop || fd == -1 || !DCEventLoopAddListener(loop, fd, __accepted, NULL)) {
+        fprintf(stderr, "couldn't listen on port %u: %s\n", port, strerror(errno));
+        exit(1);
+    }
+    DCEventLoopRun(loop);
+    return NULL;
+}
+
+int main(int argc, const char * argv[]) {
+    unsigned int port = argc > 1 ? (unsigned int) atoi(argv[1]) : 18080;
+    unsigned int nbrThreads = argc > 2 ? (unsigned int) atoi(argv[2]) : 1;
+    log_set_level(LOG_WARN);
+    signal(SIGPIPE, SIG_IGN);
+    memset(__body, 'x', sizeof(__body));
+
+#if !defined(SO_REUSEPORT)
+    nbrThreads = 1;
+#endif
+    printf("origin listening on 127.0.0.1:%u with %u thread(s)\n", port, nbrThreads);
+    fflush(stdout);
+
+    pthread_t threads[64];
+    if (nbrThreads == 0 || nbrThreads > 64)
+        nbrThreads = 1;
+    for (unsigned int i = 1; i < nbrThreads; i++)
+        pthread_create(&threads[i], NULL, __worker, (void *) (uintptr_t) port);
+    __worker((void *) (uintptr_t) port);
+    return 0;
+}
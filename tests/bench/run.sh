@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# Load test scenarios through dproxy against the local origin stub.
+#
+#   $ DPROXY=/path/to/dproxy tests/bench/run.sh     # starts the proxy itself
+#   $ PROXY=127.0.0.1:1080 tests/bench/run.sh       # an already running proxy
+#
+# Optional: WORKERS (proxy workers, default 2), BACKEND (default, epoll,
+# kqueue, io_uring), THREADS (client threads, default 2), DURATION (seconds
+# per scenario, default 10), SCENARIOS (names from below, default all).
+
+set -u
+
+HERE="$(cd "$(dirname "$0")" && pwd)"
+CORE="$HERE/../../dproxyCore"
+OUT="${OUT:-${TMPDIR:-/tmp}/dproxy-bench}"
+ORIGIN_PORT="${ORIGIN_PORT:-18080}"
+PROXY_PORT="${PROXY_PORT:-1080}"
+WORKERS="${WORKERS:-2}"
+BACKEND="${BACKEND:-default}"
+THREADS="${THREADS:-2}"
+DURATION="${DURATION:-10}"
+SCENARIOS="${SCENARIOS:-small large chunked pipeline churn}"
+
+SOURCES="$CORE/DCEventLoop.c $CORE/DCEventLoopEpoll.c $CORE/DCEventLoopIOUring.c $CORE/DCEventLoopKqueue.c
+         $CORE/DCSlab.c $CORE/DCTimerWheel.c $CORE/DCHTTPParser.c $CORE/DCHTTPScan.c $CORE/log.c"
+
+mkdir -p "$OUT"
+for tool in origin loadgen ; do
+    if [ ! -x "$OUT/$tool" ] || [ "$HERE/$tool.c" -nt "$OUT/$tool" ] ; then
+        ${CC:-cc} -O2 -std=gnu11 -I"$CORE" "$HERE/$tool.c" $SOURCES -lpthread -o "$OUT/$tool" || exit 1
+    fi
+done
+
+PIDS=()
+cleanup() {
+    for pid in "${PIDS[@]}" ; do
+        kill "$pid" 2> /dev/null
+    done
+}
+trap cleanup EXIT
+
+"$OUT/origin" "$ORIGIN_PORT" "$THREADS" > "$OUT/origin.log" 2>&1 &
+PIDS+=($!)
+
+if [ -z "${PROXY:-}" ] ; then
+    if [ -z "${DPROXY:-}" ] ; then
+        echo "Set DPROXY to a dproxy binary, or PROXY to the address of a running one"
+        exit 2
+    fi
+    "$DPROXY" "$PROXY_PORT" "$WORKERS" "$BACKEND" > "$OUT/dproxy.log" 2>&1 &
+    PIDS+=($!)
+    PROXY="127.0.0.1:$PROXY_PORT"
+fi
+sleep 1
+
+ORIGIN="http://127.0.0.1:$ORIGIN_PORT"
+failed=0
+run() {
+    "$OUT/loadgen" -x "$PROXY" -t "$THREADS" -d "$DURATION" "$@" || failed=1
+    echo
+}
+
+for scenario in $SCENARIOS ; do
+    case "$scenario" in
+        small)    run -n "small GETs"      -u "$ORIGIN/bytes/512"     -c 64 -R 10000 ;;
+        large)    run -n "large downloads" -u "$ORIGIN/bytes/1048576" -c 8  -R 200 ;;
+        chunked)  run -n "chunked"         -u "$ORIGIN/chunked/65536" -c 32 -R 2000 ;;
+        pipeline) run -n "pipelining"      -u "$ORIGIN/bytes/128"     -c 16 -R 20000 -p 8 ;;
+        churn)    run -n "connection churn" -u "$ORIGIN/bytes/512"    -c 32 -R 2000 -C ;;
+        *)        echo "Unknown scenario '$scenario'" ; failed=1 ;;
+    esac
+done
+
+exit $failed
@@ -0,0 +1,312 @@
+/*
+ * Soak test: runs dproxy in this process and pushes a large number of short
+ * connections through it, checking that resident memory stays flat once
+ * the slabs and buffer pools have warmed up. A channel or connection left
+ * behind per client shows up as steady growth.
+ *
+ * Clients end their connections in turn after a full response, with a reset
+ * after a full response, right after sending the request, and by shutting
+ * down their side and reading until the proxy closes.
+ *
+ *   $ ./soak -u http://127.0.0.1:18080/bytes/512 [-n connections] [-t threads]
+ *       [-w workers] [-b backend] [-p port] [-g growth MB]
+ *
+ * Exits with 1 when memory grew by more than -g after the first tenth of
+ * the connections, or when a connection failed or hung.
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "DCProxy.h"
+#include "log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define kMaxThreads 256
+#define kInputSize 65536
+#define kReceiveTimeoutSeconds 5
+
+enum {
+    kEndAfterResponse,
+    kEndWithReset,
+    kEndBeforeResponse,
+    kEndWithShutdown,
+    kEndCount
+};
+
+static struct sockaddr_in __proxyAddress;
+static char __request[1024];
+static size_t __requestLength;
+static unsigned long __total;
+
+static atomic_ulong __next;
+static atomic_ulong __done;
+static atomic_ulong __errors;
+static atomic_ulong __hung;
+
+static double __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long __residentBytes(void) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (!statm)
+        return -1;
+    long size = 0, resident = 0;
+    int matched = fscanf(statm, "%ld %ld", &size, &resident);
+    fclose(statm);
+    return matched == 2 ? resident * sysconf(_SC_PAGESIZE) : -1;
+}
+
+// MARK: - Clients
+
+static int __connect(void) {
+    for (;;) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1)
+            return -1;
+        struct timeval timeout = { kReceiveTimeoutSeconds, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(fd, (struct sockaddr *) &__proxyAddress, sizeof(__proxyAddress)) == 0)
+            return fd;
+        int error = errno;
+        close(fd);
+        // Out of local ports for a moment, they come back as TIME_WAITs expire
+        if (error != EADDRNOTAVAIL && error != EAGAIN)
+            return -1;
+        usleep(1000);
+    }
+}
+
+static bool __sendRequest(int fd) {
+    size_t sent = 0;
+    while (sent < __requestLength) {
+        ssize_t written = send(fd, __request + sent, __requestLength - sent, MSG_NOSIGNAL);
+        if (written <= 0)
+            return false;
+        sent += (size_t) written;
+    }
+    return true;
+}
+
+// Reads one response with a Content-Length, false when it didn't arrive whole
+static bool __readResponse(int fd, char *input, bool *hung) {
+    size_t length = 0;
+    size_t expected = 0;
+    for (;;) {
+        ssize_t nbrRead = recv(fd, input + length, kInputSize - 1 - length, 0);
+        if (nbrRead <= 0) {
+            *hung = nbrRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            return false;
+        }
+        length += (size_t) nbrRead;
+        input[length] = '\0';
+
+        if (expected == 0) {
+            char *end = strstr(input, "\r\n\r\n");
+            if (!end)
+                continue;
+            char *header = strcasestr(input, "\r\nContent-Length:");
+            if (!header || header > end)
+                return false;
+            expected = (size_t) (end + 4 - input) + strtoul(header + 17, NULL, 10);
+        }
+        if (length >= expected)
+            return length == expected;
+    }
+}
+
+// Until the proxy closes, false when it never did
+static bool __readUntilClosed(int fd, char *input) {
+    for (;;) {
+        ssize_t nbrRead = recv(fd, input, kInputSize, 0);
+        if (nbrRead == 0 || (nbrRead < 0 && errno == ECONNRESET))
+            return true;
+        if (nbrRead < 0)
+            return false;
+    }
+}
+
+static void __abort(int fd) {
+    struct linger linger = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+}
+
+static void* __client(void *info) {
+    char *input = malloc(kInputSize);
+    for (;;) {
+        unsigned long i = atomic_fetch_add(&__next, 1);
+        if (i >= __total)
+            break;
+
+        int fd = __connect();
+        if (fd == -1 || !__sendRequest(fd)) {
+            atomic_fetch_add(&__errors, 1);
+            if (fd != -1)
+                close(fd);
+            atomic_fetch_add(&__done, 1);
+            continue;
+        }
+
+        bool hung = false;
+        switch (i % kEndCount) {
+            case kEndAfterResponse:
+                if (!__readResponse(fd, input, &hung))
+                    atomic_fetch_add(hung ? &__hung : &__errors, 1);
+                close(fd);
+                break;
+            case kEndWithReset:
+                if (!__readResponse(fd, input, &hung))
+                    atomic_fetch_add(hung ? &__hung : &__errors, 1);
+                __abort(fd);
+                break;
+            case kEndBeforeResponse:
+                close(fd);
+                break;
+            case kEndWithShutdown:
+                shutdown(fd, SHUT_WR);
+                if (!__readUntilClosed(fd, input))
+                    atomic_fetch_add(&__hung, 1);
+                close(fd);
+                break;
+        }
+        atomic_fetch_add(&__done, 1);
+    }
+    free(input);
+    return NULL;
+}
+
+// MARK: - Main
+
+static bool __prepareRequest(const char *url) {
+    const char *authority = strstr(url, "://");
+    if (!authority)
+        return false;
+    authority += 3;
+    const char *path = strchr(authority, '/');
+    int authorityLength = path ? (int) (path - authority) : (int) strlen(authority);
+    int length = snprintf(__request, sizeof(__request), "GET %s HTTP/1.1\r\nHost: %.*s\r\n\r\n", url, authorityLength, authority);
+    __requestLength = (size_t) length;
+    return length > 0 && (size_t) length < sizeof(__request);
+}
+
+static DCEventLoopBackend __backendNamed(const char *name) {
+    if (strcmp(name, "epoll") == 0) return kDCEventLoopBackendEpoll;
+    if (strcmp(name, "kqueue") == 0) return kDCEventLoopBackendKqueue;
+    if (strcmp(name, "io_uring") == 0) return kDCEventLoopBackendIOUring;
+    return kDCEventLoopBackendDefault;
+}
+
+int main(int argc, char * const argv[]) {
+    const char *url = "http://127.0.0.1:18080/bytes/512";
+    unsigned int nbrThreads = 8;
+    unsigned int nbrWorkers = 2;
+    unsigned int port = 18090;
+    double growthLimit = 16;
+    DCEventLoopBackend backend = kDCEventLoopBackendDefault;
+    __total = 1000000;
+
+    int option;
+    while ((option = getopt(argc, argv, "u:n:t:w:b:p:g:")) != -1) {
+        switch (option) {
+            case 'u': url = optarg; break;
+            case 'n': __total = strtoul(optarg, NULL, 10); break;
+            case 't': nbrThreads = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'w': nbrWorkers = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'b': backend = __backendNamed(optarg); break;
+            case 'p': port = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'g': growthLimit = strtod(optarg, NULL); break;
+            default:
+                fprintf(stderr, "usage: %s -u url [-n connections] [-t threads] [-w workers] [-b backend] [-p port] [-g growth MB]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (nbrThreads == 0 || nbrThreads > kMaxThreads)
+        nbrThreads = 8;
+    if (!__prepareRequest(url) || __residentBytes() < 0) {
+        fprintf(stderr, "Needs an http:// URL and /proc/self/statm\n");
+        return 2;
+    }
+
+    DCProxyRef proxy = DCProxyCreate(port);
+    DCProxySetWorkerCount(proxy, nbrWorkers);
+    DCProxySetEventLoopBackend(proxy, backend);
+    if (!DCProxyRunServer(proxy, false)) {
+        DCProxyRelease(proxy);
+        return 1;
+    }
+    // The workers are running, the level isn't ours to change anymore
+    log_set_quiet(1);
+
+    memset(&__proxyAddress, 0, sizeof(__proxyAddress));
+    __proxyAddress.sin_family = AF_INET;
+    __proxyAddress.sin_port = htons(port);
+    __proxyAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    printf("%lu connections through 127.0.0.1:%u (%u workers) with %u threads to %s\n", __total, port, nbrWorkers, nbrThreads, url);
+
+    pthread_t threads[kMaxThreads];
+    for (unsigned int i = 0; i < nbrThreads; i++)
+        pthread_create(&threads[i], NULL, __client, NULL);
+
+    // Memory after the first tenth is the baseline, everything until then
+    // is the slabs and pools filling up
+    double start = __now();
+    long baseline = -1;
+    long peak = 0;
+    unsigned long lastDone = 0;
+    while (atomic_load(&__done) < __total) {
+        sleep(1);
+        unsigned long done = atomic_load(&__done);
+        long resident = __residentBytes();
+        if (baseline < 0 && done >= __total / 10)
+            baseline = resident;
+        if (baseline >= 0 && resident > peak)
+            peak = resident;
+        printf("  %10lu connections  %8lu/s  rss %7.1f MB  errors %lu  hung %lu\n", done, done - lastDone,
+               resident / 1048576.0, atomic_load(&__errors), atomic_load(&__hung));
+        fflush(stdout);
+        lastDone = done;
+    }
+    for (unsigned int i = 0; i < nbrThreads; i++)
+        pthread_join(threads[i], NULL);
+
+    // Let the proxy finish with the last connections
+    sleep(1);
+    long resident = __residentBytes();
+    if (baseline < 0)
+        baseline = resident;
+    double growth = (resident - baseline) / 1048576.0;
+    double elapsed = __now() - start;
+
+    printf("%lu connections in %.1f s (%.0f/s), errors %lu, hung %lu\n", __total, elapsed, __total / elapsed,
+           atomic_load(&__errors), atomic_load(&__hung));
+    printf("rss baseline %.1f MB, peak %.1f MB, end %.1f MB, growth %.1f MB (%.1f bytes per connection)\n",
+           baseline / 1048576.0, peak / 1048576.0, resident / 1048576.0, growth, (resident - baseline) / (double) __total);
+
+    DCProxyRelease(proxy);
+
+    bool failed = growth > growthLimit || atomic_load(&__errors) > 0 || atomic_load(&__hung) > 0;
+    if (growth > growthLimit)
+        printf("FAILED: resident memory grew by more than %.1f MB\n", growthLimit);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,21 @@
+#!/bin/bash
+
+# Starts the origin stub and runs the soak test against it, see soak.c.
+#
+#   $ tests/bench/soak.sh path/to/origin path/to/soak [soak options]
+#
+# Optional: ORIGIN_PORT (default 18081).
+
+set -u
+
+ORIGIN="$1"
+SOAK="$2"
+shift 2
+ORIGIN_PORT="${ORIGIN_PORT:-18081}"
+
+"$ORIGIN" "$ORIGIN_PORT" 2 > /dev/null 2>&1 &
+ORIGIN_PID=$!
+trap 'kill $ORIGIN_PID 2> /dev/null' EXIT
+sleep 1
+
+"$SOAK" -u "http://127.0.0.1:$ORIGIN_PORT/bytes/512" "$@"
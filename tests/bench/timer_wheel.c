@@ -0,0 +1,89 @@
+/*
+ * Cost of the timer wheel with a lot of armed timeouts, the way connections
+ * use it: armed once, pushed back on every read, almost always cancelled
+ * before they fire. Time is simulated, a tick is a millisecond.
+ *
+ *   $ cc -O2 -I../../dproxyCore timer_wheel.c ../../dproxyCore/DCTimerWheel.c ../../dproxyCore/log.c -lpthread -o timer_wheel
+ *   $ ./timer_wheel [timers] [seconds]
+ */
+
+#include "DCTimerWheel.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static unsigned long __fired;
+
+static double __now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void __timedOut(DCTimerWheelEntry *entry, void *info) {
+    __fired++;
+}
+
+// Between 1 and 120 seconds, like the connection timeouts
+static unsigned long long __timeout(unsigned int *seed) {
+    return 1000 + (unsigned long long) (rand_r(seed) % 119000);
+}
+
+int main(int argc, const char * argv[]) {
+    unsigned long nbrTimers = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    unsigned long nbrSeconds = argc > 2 ? strtoul(argv[2], NULL, 10) : 60;
+    if (nbrTimers == 0)
+        nbrTimers = 1000000;
+    log_set_level(LOG_INFO);
+
+    DCTimerWheelEntry *entries = (DCTimerWheelEntry *) calloc(nbrTimers, sizeof(DCTimerWheelEntry));
+    unsigned int seed = 1;
+    unsigned long long now = 0;
+    DCTimerWheelRef wheel = DCTimerWheelCreate(now);
+
+    double start = __now();
+    for (unsigned long i = 0; i < nbrTimers; i++) {
+        DCTimerWheelEntryInit(&entries[i], __timedOut, NULL);
+        DCTimerWheelSchedule(wheel, &entries[i], now + __timeout(&seed));
+    }
+    double scheduled = (__now() - start) / nbrTimers * 1e9;
+
+    // A second of traffic per tick: each tick a share of the timers is pushed
+    // back, as connections read, and a few are cancelled and armed again
+    unsigned long perTick = nbrTimers / 1000 ? nbrTimers / 1000 : 1;
+    unsigned long nbrMoved = 0;
+    double moving = 0, ticking = 0;
+    for (unsigned long tick = 0; tick < nbrSeconds * 1000; tick++) {
+        double moveStart = __now();
+        for (unsigned long j = 0; j < perTick; j++) {
+            DCTimerWheelEntry *entry = &entries[(unsigned long) rand_r(&seed) % nbrTimers];
+            if (j % 16 == 0)
+                DCTimerWheelCancel(entry);
+            DCTimerWheelSchedule(wheel, entry, now + __timeout(&seed));
+        }
+        nbrMoved += perTick;
+        double tickStart = __now();
+        moving += tickStart - moveStart;
+
+        now++;
+        DCTimerWheelAdvance(wheel, now);
+        ticking += __now() - tickStart;
+    }
+
+    start = __now();
+    for (unsigned long i = 0; i < nbrTimers; i++)
+        DCTimerWheelCancel(&entries[i]);
+    double cancelled = (__now() - start) / nbrTimers * 1e9;
+
+    printf("%lu timers armed, %lu s simulated, %lu pushed back, %lu fired\n", nbrTimers, nbrSeconds, nbrMoved, __fired);
+    printf("  %-28s %8.1f ns/timer\n", "schedule", scheduled);
+    printf("  %-28s %8.1f ns/timer\n", "push back", moving / nbrMoved * 1e9);
+    printf("  %-28s %8.1f ns/tick\n", "advance a tick", ticking / (nbrSeconds * 1000) * 1e9);
+    printf("  %-28s %8.1f ns/timer\n", "cancel", cancelled);
+
+    DCTimerWheelRelease(wheel);
+    free(entries);
+    return 0;
+}
@@ -1,16 +1,22 @@
 #!/bin/bash
 
-# http://httpbin.org/ip
+# Compares a response fetched directly from the origin stub with the same
+# one through the proxy on 127.0.0.1:1080. Start the stub first:
+#
+#   $ tests/bench/origin 18080
 
-direct_output=`curl -s http://httpbin.org/ip`
-proxy_output=`curl -s --proxy1.0 127.0.0.1:1080 http://httpbin.org/ip`
+ORIGIN="http://127.0.0.1:${ORIGIN_PORT:-18080}"
+result=0
 
-diff <(echo -e "$direct_output") <(echo -e "$proxy_output")
-result=$?
+for path in /bytes/100 /chunked/100000 /close/5000 ; do
+    direct_output=`curl -s -D - $ORIGIN$path | md5sum`
+    proxy_output=`curl -s -D - --proxy1.0 127.0.0.1:1080 $ORIGIN$path | md5sum`
 
-if [ $result -ne 0 ] ; then
-    echo -e "NON-PROXY OUTPUT: \n>>>\n${direct_output}\n<<<\n"
-    echo -e "    PROXY OUTPUT: \n>>>\n${proxy_output}\n<<<\n"
-fi
+    if [ "$direct_output" != "$proxy_output" ] ; then
+        echo -e "$path: NON-PROXY ${direct_output}, PROXY ${proxy_output}"
+        result=1
+    fi
+done
 
-echo "DIFF => $?"
+echo "DIFF => $result"
+exit $result